@@ -0,0 +1,106 @@
+// Compact binary copy of the MatchCatalogs of a WCSFoF output, in a
+// compressed-sparse-row layout that the fitting programs read through a
+// memory mapping instead of parsing the FITS tables.  The members of match
+// m are members()[matchStart()[m]] through members()[matchStart()[m+1]-1],
+// in the order of their SequenceNumber.  The matches of each MatchCatalog
+// HDU are contiguous and in the order of its rows.  For each extension the
+// indices of its members, ordered by object number, are given too, so that
+// the objects wanted from each catalog can be listed without sorting.
+//
+// File layout (native byte order, all items 8 bytes):
+//   "GBMATCH1", nCatalogs, nMatches, nMembers, nExtensions
+//   catalogHdu[nCatalogs]	HDU number of each MatchCatalog
+//   catalogStart[nCatalogs+1]	first match of each catalog
+//   matchStart[nMatches+1]	first member of each match
+//   members[nMembers]		(extension, object) pairs
+//   extensionStart[nExtensions+1]	first keeperOrder entry of each extension
+//   keeperOrder[nMembers]	member indices by extension, then object
+//   "GBMATCH1"
+#ifndef BINARYMATCHES_H
+#define BINARYMATCHES_H
+
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include "Std.h"
+#include "MappedFile.h"
+
+class BinaryMatches {
+public:
+  struct Member {
+    int64_t extension;
+    int64_t object;
+  };
+
+  // Map a binary match file.  Throws std::runtime_error on failure.
+  explicit BinaryMatches(const string& filename);
+
+  long nCatalogs() const {return nCat;}
+  long nMatches() const {return nMatch;}
+  long nMembers() const {return nMember;}
+  long nExtensions() const {return nExt;}
+
+  const int64_t* catalogHdu() const {return hdus;}
+  const int64_t* catalogStart() const {return catStarts;}
+  const int64_t* matchStart() const {return matchStarts;}
+  const Member* members() const {return mem;}
+  const int64_t* extensionStart() const {return extStarts;}
+  const int64_t* keeperOrder() const {return order;}
+
+  // Members of one MatchCatalog HDU
+  long catalogMembers(long icat) const {
+    return matchStarts[catStarts[icat+1]] - matchStarts[catStarts[icat]];
+  }
+
+  // Collects MatchCatalog rows as they are written and writes the file
+  // when closed.  The members are streamed to a temporary file beside it
+  // as they come, so that only the match offsets are held until the end.
+  class Writer {
+  public:
+    explicit Writer(const string& filename_);
+    // Removes the temporary file if the Writer was not closed
+    ~Writer();
+    // Append rows in MatchCatalog form to the catalog in the given HDU
+    void add(int hdu, const vector<int>& sequence,
+	     const vector<long>& extn, const vector<long>& obj);
+    // Write the file, for a match file having nExtensions extensions
+    void close(long nExtensions);
+  private:
+    string filename;
+    string bodyName;
+    std::fstream body;	// Members in the order they were added
+    int64_t bodyMembers;
+    bool closed;
+    // A run of members of one catalog that are contiguous in the body
+    struct Chunk {
+      int64_t first;
+      int64_t size;
+    };
+    struct Catalog {
+      Catalog(): nMembers(0) {}
+      vector<int64_t> matchStart;	// First member of each match, within the catalog
+      int64_t nMembers;
+      vector<Chunk> chunks;
+    };
+    std::map<int, Catalog> catalogs;
+
+    // Hide copying
+    Writer(const Writer& rhs) =delete;
+    void operator=(const Writer& rhs) =delete;
+  };
+
+private:
+  MappedFile file;
+  long nCat;
+  long nMatch;
+  long nMember;
+  long nExt;
+  const int64_t* hdus;
+  const int64_t* catStarts;
+  const int64_t* matchStarts;
+  const Member* mem;
+  const int64_t* extStarts;
+  const int64_t* order;
+};
+
+#endif
@@ -0,0 +1,220 @@
+// Block-sparse symmetric matrix for the normal equations of the fits.
+// Parameters are grouped into blocks, one per free map, numbered by the
+// map numbers that the updaters are given.  Only the lower triangle (by
+// block number) of the blocks that are actually updated is stored, so
+// memory grows with the number of map pairs that co-occur in a match
+// rather than with nParams^2.
+//
+// A block's parameter range is learned from the updates made to it, so
+// every map must have its diagonal block updated at least once.  After
+// accumulation, completeLayout() gives every parameter not in any map's
+// block a block of its own so that the matrix covers all of them.
+//
+// BlockUpdater has the rankOneUpdate calls of linalg::SymmetricUpdater and
+// can be used by many threads at once.
+//
+// BlockSolver is the interface of the solvers for these matrices.
+
+#ifndef BLOCKSYMMETRIC_H
+#define BLOCKSYMMETRIC_H
+
+#include <map>
+#include <ostream>
+#include "Std.h"
+#include "LinearAlgebra.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+class BlockSymmetric {
+public:
+  // One stored block.  Row-major, nRows x nCols.  The diagonal blocks hold
+  // only their lower triangle (the rest is left zero).
+  struct Block {
+    Block(int rowStart_=0, int colStart_=0, int nRows_=0, int nCols_=0):
+      rowStart(rowStart_), colStart(colStart_), nRows(nRows_), nCols(nCols_),
+      v(nRows_*nCols_, 0.) {}
+    int rowStart;	// Parameter index of first row
+    int colStart;	// and of first column
+    int nRows;
+    int nCols;
+    vector<double> v;
+    double& operator()(int r, int c) {return v[r*nCols+c];}
+    double operator()(int r, int c) const {return v[r*nCols+c];}
+  };
+  // Blocks of one block row, keyed by block column (<= the row)
+  typedef std::map<int, Block> Row;
+
+  BlockSymmetric(int nParams_, int nMaps_);
+
+  int nParams() const {return nP;}
+  int nMaps() const {return nM;}
+  // Zero all elements but keep the blocks, as alpha.setZero() does.  Blocks
+  // added by completeLayout() are dropped.
+  void setZero();
+
+  // Give every parameter a block, making blocks of the ranges of parameters
+  // that no map's diagonal block covers.  Throws std::runtime_error if the
+  // blocks overlap.
+  void completeLayout();
+  // Block layout, valid after completeLayout().  Maps that were never
+  // updated have empty blocks.
+  int nBlocks() const {return rows.size();}
+  int blockStart(int b) const {
+    const Block* d = find(b,b);
+    return d ? d->rowStart : 0;
+  }
+  int blockSize(int b) const {
+    const Block* d = find(b,b);
+    return d ? d->nRows : 0;
+  }
+  int blockOf(int iParam) const {return blockOfParam[iParam];}
+
+  const Row& row(int b) const {return rows[b];}
+  Row& row(int b) {return rows[b];}
+  // The stored block at (row,col) with row >= col, or nullptr if none
+  const Block* find(int rowBlock, int colBlock) const;
+  Block* find(int rowBlock, int colBlock);
+
+  // Element access by parameter index, valid after completeLayout()
+  double diagonal(int iParam) const;
+  void setDiagonal(int iParam, double value);
+  // Flags the parameters whose row and column are entirely zero
+  vector<bool> emptyParameters() const;
+
+  // Replace the matrix with S * this * S for S=diag(s)
+  void scale(const DVector& s);
+  // y = this * x
+  void multiply(const DVector& x, DVector& y) const;
+  // Fill a dense nParams x nParams matrix with both triangles
+  void toDense(DMatrix& m) const;
+
+private:
+  friend class BlockUpdater;
+  int nP;
+  int nM;
+  vector<Row> rows;	// One per block; those past nM are from completeLayout()
+  vector<int> blockOfParam;
+  // The block at (row,col) with row >= col, made if needed.
+  Block& blockAt(int rowBlock, int rowStart, int nRows,
+		 int colBlock, int colStart, int nCols);
+};
+
+class BlockUpdater {
+public:
+  BlockUpdater(BlockSymmetric& alpha_, int nLocks_);
+  ~BlockUpdater();
+  // alpha += w * v v^T for the block of map m starting at parameter i
+  template <class V>
+  void rankOneUpdate(int m, int i, const V& v, double w=1.);
+  // alpha += w * v2 v1^T (and its transpose) for the blocks of maps m2, m1
+  template <class V2, class V1>
+  void rankOneUpdate(int m2, int i2, const V2& v2,
+		     int m1, int i1, const V1& v1,
+		     double w=1.);
+  // alpha += w * C (and its transpose) for the n2 x n1 row-major matrix C
+  // whose rows are the parameters of map m2 and columns those of map m1.
+  // Only the lower triangle of C is used if m2==m1.
+  void blockUpdate(int m2, int i2, int n2,
+		   int m1, int i1, int n1,
+		   const double* c, double w=1.);
+private:
+  BlockSymmetric& alpha;
+  int nLocks;
+#ifdef _OPENMP
+  vector<omp_lock_t> locks;
+#endif
+  void lock(int rowBlock) {
+#ifdef _OPENMP
+    omp_set_lock(&locks[rowBlock % nLocks]);
+#endif
+  }
+  void unlock(int rowBlock) {
+#ifdef _OPENMP
+    omp_unset_lock(&locks[rowBlock % nLocks]);
+#endif
+  }
+  // Hide copying
+  BlockUpdater(const BlockUpdater& rhs) =delete;
+  void operator=(const BlockUpdater& rhs) =delete;
+};
+
+// Solution of alpha * x = b for a BlockSymmetric alpha, in the steps of
+// analysis of alpha's pattern (which may be kept for later matrices that
+// it covers) and numerical factorization.
+class BlockSolver {
+public:
+  virtual ~BlockSolver() {}
+  // Analyze the pattern of alpha, which must have had completeLayout()
+  virtual void analyze(const BlockSymmetric& alpha) =0;
+  // True if the last analysis can be used for alpha
+  virtual bool covers(const BlockSymmetric& alpha) const =0;
+  // Factor alpha + shift*I, returning false if it is not positive definite.
+  // alpha must be kept unchanged until the last solve().
+  virtual bool factorize(const BlockSymmetric& alpha, double shift=0.) =0;
+  // The parameter at which a failed factorization stopped
+  virtual int failedParameter() const =0;
+  // Replace b with the solution x of alpha * x = b
+  virtual void solve(DVector& b) const =0;
+  // Describe the result of the analysis
+  virtual void report(std::ostream& os) const =0;
+};
+
+template <class V>
+void
+BlockUpdater::rankOneUpdate(int m, int i, const V& v, double w) {
+  int n = v.size();
+  lock(m);
+  BlockSymmetric::Block& b = alpha.blockAt(m, i, n, m, i, n);
+  for (int r=0; r<n; r++) {
+    double wr = w*v[r];
+    double* out = &b.v[r*n];
+    for (int c=0; c<=r; c++)
+      out[c] += wr*v[c];
+  }
+  unlock(m);
+}
+
+template <class V2, class V1>
+void
+BlockUpdater::rankOneUpdate(int m2, int i2, const V2& v2,
+			    int m1, int i1, const V1& v1,
+			    double w) {
+  int n2 = v2.size();
+  int n1 = v1.size();
+  if (m2==m1) {
+    // Both vectors on the same map: symmetric sum into its lower triangle
+    lock(m2);
+    BlockSymmetric::Block& b = alpha.blockAt(m2, i2, n2, m2, i2, n2);
+    for (int r=0; r<n2; r++) {
+      double* out = &b.v[r*n2];
+      for (int c=0; c<=r; c++)
+	out[c] += w*(v2[r]*v1[c] + v1[r]*v2[c]);
+    }
+    unlock(m2);
+  } else if (m2 > m1) {
+    lock(m2);
+    BlockSymmetric::Block& b = alpha.blockAt(m2, i2, n2, m1, i1, n1);
+    for (int r=0; r<n2; r++) {
+      double wr = w*v2[r];
+      double* out = &b.v[r*n1];
+      for (int c=0; c<n1; c++)
+	out[c] += wr*v1[c];
+    }
+    unlock(m2);
+  } else {
+    // Store as the transpose, in the row of the higher map number
+    lock(m1);
+    BlockSymmetric::Block& b = alpha.blockAt(m1, i1, n1, m2, i2, n2);
+    for (int r=0; r<n1; r++) {
+      double wr = w*v1[r];
+      double* out = &b.v[r*n2];
+      for (int c=0; c<n2; c++)
+	out[c] += wr*v2[c];
+    }
+    unlock(m1);
+  }
+}
+
+#endif
@@ -0,0 +1,74 @@
+// Service that reads the input catalogs of the fitting programs ahead of
+// their use.  A fixed set of I/O threads opens the catalogs in order and
+// extracts the needed rows and columns, staying a limited number of
+// catalogs ahead of the consumers, which may be any number of (OpenMP)
+// threads taking the catalogs in any order.
+//
+// Distinct files are read at once when CFITSIO allows it (see FitsLocks.h);
+// if not, reading still overlaps with the consumers' processing of the
+// catalogs already read.
+#ifndef CATALOGREADER_H
+#define CATALOGREADER_H
+
+#include <map>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include "Std.h"
+#include "FTable.h"
+#include "FitsLocks.h"
+
+class CatalogReader {
+public:
+  struct Request {
+    string filename;
+    int hduNumber;
+    // Columns to read, all of them if empty and there are no expressions
+    vector<string> columns;
+    // If not empty, the columns named above that exist are read, plus
+    // those used by these expressions, once the catalog is opened
+    list<string> expressions;
+    // [start,end) row ranges to read, giving one table each.  If empty,
+    // the whole catalog is read into one table.
+    vector<std::pair<long,long> > ranges;
+  };
+  // Start reading the requests with ioThreads threads, at most readAhead
+  // requests beyond the number taken so far.  If consumers take requests
+  // out of order, as with a dynamic OpenMP schedule, readAhead must be at
+  // least the number of consumer threads.
+  CatalogReader(const vector<Request>& requests_, int ioThreads, int readAhead);
+  // Waits for the I/O threads to finish
+  ~CatalogReader();
+
+  long size() const {return requests.size();}
+  // The tables of request i, one per range, waiting until they are read.
+  // Each request may be taken only once.  Rethrows any error from reading it.
+  vector<img::FTable> take(long i);
+
+  // Can distinct FITS files be read by several threads at once?
+  static bool concurrentFiles() {return FitsLocks::concurrentFiles();}
+
+private:
+  vector<Request> requests;
+  long readAhead;
+  long nextToRead;
+  long nTaken;
+  std::map<long, vector<img::FTable> > ready;
+  std::map<long, std::exception_ptr> failed;
+  std::mutex queueLock;
+  std::condition_variable changed;
+  vector<std::thread> threads;
+
+  FitsLocks fitsLocks;
+
+  void ioLoop();
+  void read(const Request& r, vector<img::FTable>& tables);
+
+  // Hide copying
+  CatalogReader(const CatalogReader& rhs) =delete;
+  void operator=(const CatalogReader& rhs) =delete;
+};
+
+#endif
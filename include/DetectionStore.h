@@ -0,0 +1,79 @@
+// Compact store of the catalog columns that the fitting programs read for
+// each detection, built once from the original catalogs of a WCSFoF output
+// by MakeDetectionStore.  Each extension's detections are kept sorted by
+// object ID, as columns of 8-byte values, so that the store can be used
+// directly from a memory mapping of the file.
+//
+// File layout (native byte order, all items 8 bytes):
+//   "GBDSTOR2"
+//   for each extension, a block of nRows IDs (int64) followed by
+//     nRows each of X, Y, ERR, MAG, MAGERR, COLOR (double)
+//   index: for each extension, the block's byte offset, nRows, a hash
+//     of its catalog file name and HDU number, and 1 if its catalog could
+//     evaluate the color expression, else 0
+//   nExtensions, index offset, "GBDSTOR2"
+// Values of optional columns that a catalog lacks are NaN.
+#ifndef DETECTIONSTORE_H
+#define DETECTIONSTORE_H
+
+#include <cstdint>
+#include <fstream>
+#include "Std.h"
+#include "MappedFile.h"
+
+class DetectionStore {
+public:
+  // The columns held for each detection
+  enum Column {X, Y, ERR, MAG, MAGERR, COLOR, NCOLUMNS};
+
+  // Map a store file into memory.  Throws std::runtime_error on failure.
+  explicit DetectionStore(const string& filename);
+
+  long nExtensions() const {return nExt;}
+
+  // The detections of one extension, in ascending order of ID.  Throws
+  // std::runtime_error if the extension's index entry lies outside the file.
+  struct Rows {
+    long n;
+    const int64_t* id;
+    const double* column[NCOLUMNS];
+    bool hasColor;	// False if the COLOR column is all NaN for lack
+			// of a color expression the catalog could evaluate
+  };
+  Rows extension(long iext) const;
+
+  // Does the store's extension come from this catalog?
+  bool matches(long iext, const string& filename, int hduNumber) const;
+  static uint64_t catalogHash(const string& filename, int hduNumber);
+
+  // Writes a store, one extension at a time in order
+  class Writer {
+  public:
+    explicit Writer(const string& filename);
+    // Append the next extension.  The IDs must be ascending and each
+    // column must have as many entries as there are IDs.
+    void add(const string& catalogFile, int hduNumber,
+	     const vector<int64_t>& id, const vector<double> (&columns)[NCOLUMNS],
+	     bool hasColor);
+    // Write the index; no more extensions may be added.
+    void close();
+    ~Writer();
+  private:
+    string filename;
+    std::ofstream out;
+    vector<int64_t> index;
+    bool closed;
+  };
+
+private:
+  MappedFile file;
+  long nExt;
+  int64_t indexOffset;
+  const int64_t* index;
+
+  // Hide copying
+  DetectionStore(const DetectionStore& rhs) =delete;
+  void operator=(const DetectionStore& rhs) =delete;
+};
+
+#endif
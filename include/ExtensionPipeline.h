@@ -0,0 +1,69 @@
+// Hands out extension numbers to reader threads and passes the items they
+// prepare to one consumer in a given order of extensions.  The order may
+// hold any subset of extension numbers, e.g. those of the fields matched by
+// one shard, or those added since an earlier run.  Readers wait before
+// starting an extension more than maxPending ahead of the consumer, which
+// bounds the memory held in finished but unconsumed items.
+#ifndef EXTENSIONPIPELINE_H
+#define EXTENSIONPIPELINE_H
+
+#include <map>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include "Std.h"
+
+template <class T>
+class ExtensionPipeline {
+public:
+  ExtensionPipeline(const vector<long>& order_, int maxPending_):
+    order(order_), nExtensions(order_.size()), maxPending(maxPending_),
+    nextToRead(0), nextToGet(0) {
+    long largest = -1;
+    for (auto n : order) largest = std::max(largest, n);
+    position.assign(largest+1, -1);
+    for (long i=0; i<nExtensions; i++) position[order[i]] = i;
+  }
+  // Next extension for a reader to prepare, or -1 if there are none left
+  long next() {
+    std::unique_lock<std::mutex> lock(queueLock);
+    changed.wait(lock, [this]() {return nextToRead < nextToGet + maxPending
+				       || nextToRead >= nExtensions;});
+    if (nextToRead >= nExtensions) return -1;
+    return order[nextToRead++];
+  }
+  // Hand over the item prepared for an extension given by next()
+  void put(long extensionNumber, T* item) {
+    if (extensionNumber < 0 || extensionNumber >= static_cast<long>(position.size())
+	|| position[extensionNumber] < 0)
+      throw std::runtime_error("Extension " + std::to_string(extensionNumber)
+			       + " is not in the pipeline's order");
+    std::lock_guard<std::mutex> lock(queueLock);
+    ready[position[extensionNumber]] = item;
+    changed.notify_all();
+  }
+  // Next item in order, or nullptr when all have been consumed.
+  T* get() {
+    std::unique_lock<std::mutex> lock(queueLock);
+    if (nextToGet >= nExtensions) return nullptr;
+    changed.wait(lock, [this]() {return ready.count(nextToGet)>0;});
+    T* item = ready[nextToGet];
+    ready.erase(nextToGet);
+    ++nextToGet;
+    changed.notify_all();
+    return item;
+  }
+private:
+  vector<long> order;	// Extension numbers in the order they are consumed
+  vector<long> position;	// Place of each extension number in the order, or -1
+  long nExtensions;
+  long maxPending;
+  long nextToRead;
+  long nextToGet;
+  std::map<long, T*> ready;
+  std::mutex queueLock;
+  std::condition_variable changed;
+};
+
+#endif
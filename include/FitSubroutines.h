@@ -4,8 +4,11 @@
 #ifndef FITSUBROUTINES_H
 #define FITSUBROUTINES_H
 
-// Number of threads to use for reading catalogs
+// Default number of threads to use for reading catalogs
 #define CATALOG_THREADS 4
+// When catalogs are indexed by row number, wanted rows separated by no more
+// than this many others are read together rather than as separate ranges
+#define ROW_RANGE_GAP 256
 
 #include <list>
 #include <set>
@@ -21,6 +24,8 @@
 #include "FTable.h"
 #include "FitsTable.h"
 #include "Instrument.h"
+#include "DetectionStore.h"
+#include "BinaryMatches.h"
 #include "YAMLCollector.h"
 
 #include "Match.h"
@@ -207,6 +212,27 @@ int elementNumber(string& key);
 bool isDouble(img::FTable f, string key, int elementNumber);
 // Retrieve a double-valued number from either float or double column, element of array or scalar cell
 double getTableDouble(img::FTable f, string key, int elementNumber, bool isDouble, long irow);
+// Find which of a table's columns are needed to read the given keys (which may
+// have [#] element suffixes) and to evaluate the given expressions, so that only
+// those columns need be read from a catalog.  Names are matched without regard to
+// case and returned as spelled in tableColumns.  Names following @ are header keywords.
+vector<string> columnsUsed(const vector<string>& tableColumns,
+			   const list<string>& keys,
+			   const list<string>& expressions);
+// The detections of one extension of a DetectionStore as a table with an
+// integer ID column and double-valued columns X, Y, ERR, MAG, MAGERR, and
+// COLOR, in ID order.
+img::FTable storedDetections(const DetectionStore& store, long iext);
+// Check that a DetectionStore was made from the catalogs of this extension
+// table, quitting if not.
+void checkDetectionStore(const DetectionStore& store,
+			 const img::FTable& extensionTable);
+// Check that a binary match file holds each of the given MatchCatalog HDUs
+// of the input file, with the same numbers of members and matches, quitting
+// if not.
+void checkBinaryMatches(const BinaryMatches& binary,
+			const string& inputTables,
+			const set<int>& catalogHdus);
 
 // Class to produce ordering for vector of points to objects
 // that have a public "name" member.
@@ -339,19 +365,40 @@ readMatches(img::FTable& table,
 	    const ExtensionObjectSet& skipSet,
 	    int minMatches);
 
+// The same for all the catalogs of a binary match file whose HDU numbers
+// are in useHdus.  The Matches are built in one pass over the mapped file,
+// and each Extension's objects are recorded already in order.
+template <class S>
+void
+readMatches(const BinaryMatches& binary,
+	    const set<int>& useHdus,
+	    list<typename S::Match*>& matches,
+	    vector<typename S::Extension*>& extensions,
+	    vector<typename S::ColorExtension*>& colorExtensions,
+	    const ExtensionObjectSet& skipSet,
+	    int minMatches);
+
 // Read each Extension's objects' data from it FITS catalog
-// and place into Detection structures.
+// and place into Detection structures, with catalogThreads threads reading
+// the catalogs ahead of those filling the Detections.  If a DetectionStore
+// is given, the data are taken from it instead of the catalogs.
 template <class S>
 void readObjects(const img::FTable& extensionTable,
 		 const vector<Exposure*>& exposures,
-		 vector<typename S::Extension*>& extensions);
+		 vector<typename S::Extension*>& extensions,
+		 int catalogThreads=CATALOG_THREADS,
+		 const DetectionStore* store=nullptr);
 
 // Read color information from files marked as holding such, insert into
-// relevant Matches.
+// relevant Matches.  Only the ID and the columns used by each color
+// expression are read, by catalogThreads threads, or the colors are taken
+// from the DetectionStore if one is given.
 template <class S>
 void
 readColors(img::FTable extensionTable,
-	   vector<typename S::ColorExtension*> colorExtensions);
+	   vector<typename S::ColorExtension*> colorExtensions,
+	   int catalogThreads=CATALOG_THREADS,
+	   const DetectionStore* store=nullptr);
 
 // Find all matched Detections that exceed allowable error, then
 // delete them from their Match and delete the Detection.
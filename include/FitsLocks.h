@@ -0,0 +1,37 @@
+// Locks for reading and writing FITS files from several threads.
+//
+// The FITS library keeps a shared registry of open files, in which all
+// HDUs of one file share a CFITSIO handle.  So each file is opened, used,
+// and closed under its own lock, and any file is only opened or closed
+// while the lock for all files is also held.  Distinct files can then be
+// read at once if CFITSIO was built reentrant; if not, the lock for all
+// files serves for each of them, and all FITS access is serialized.
+#ifndef FITSLOCKS_H
+#define FITSLOCKS_H
+
+#include <map>
+#include <mutex>
+#include "Std.h"
+
+class FitsLocks {
+public:
+  FitsLocks() {}
+  ~FitsLocks();
+  // Can distinct FITS files be read by several threads at once?
+  static bool concurrentFiles();
+  // Lock to hold while a file is opened, used, and closed
+  std::mutex& lockFor(const string& filename);
+  // Lock to hold in addition while a file is opened or closed.  It is only
+  // locked if lockFor() does not already cover all files.  Always take it
+  // after the file's own lock.
+  std::unique_lock<std::mutex> openClose();
+private:
+  std::mutex fileMapLock;
+  std::map<string, std::mutex*> fileLocks;
+  std::mutex allFilesLock;
+  // Hide copying
+  FitsLocks(const FitsLocks& rhs) =delete;
+  void operator=(const FitsLocks& rhs) =delete;
+};
+
+#endif
@@ -9,7 +9,15 @@
 #include <list>
 #include <set>
 #include <vector>
+#include <array>
 #include <algorithm>
+#include <unordered_map>
+#include <map>
+#include <utility>
+#include <new>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
 
 #include <iostream>
 
@@ -19,24 +27,173 @@ namespace fof {
   using std::set;
   using std::list;
 
+  // The matching classes get the position of a point through PointTraits.
+  // The default asks the point class for getX(), which may return anything
+  // indexable with [] (a vector, array, or pointer).  Returning a reference
+  // to fixed-size storage keeps the matching free of heap allocations.
+  // Specialize this for point classes that store their coordinates otherwise.
+  template <class P, int DIM>
+  struct PointTraits {
+    typedef std::array<double,DIM> Coords;
+    static Coords position(const P& point) {
+      const auto& x = point.getX();
+      Coords c;
+      for (int i=0; i<DIM; i++) c[i] = x[i];
+      return c;
+    }
+  };
+
+  // Arena for objects of class T that are created and destroyed often.
+  // Memory is obtained in blocks and recycled through a free list; it is
+  // only returned when the Pool is destroyed.  The owner must destroy() any
+  // live objects before then.
+  template <class T>
+  class Pool {
+  public:
+    explicit Pool(size_t blockSize_=1024): blockSize(blockSize_), nUsed(blockSize_) {}
+    ~Pool() {
+      for (auto b : blocks) ::operator delete(b);
+    }
+    template <class... Args>
+    T* create(Args&&... args) {
+      void* where;
+      if (!freeList.empty()) {
+	where = freeList.back();
+	freeList.pop_back();
+      } else {
+	if (nUsed==blockSize) {
+	  blocks.push_back(static_cast<T*>(::operator new(blockSize*sizeof(T))));
+	  nUsed = 0;
+	}
+	where = blocks.back() + nUsed++;
+      }
+      return new (where) T(std::forward<Args>(args)...);
+    }
+    void destroy(T* t) {
+      t->~T();
+      freeList.push_back(t);
+    }
+  private:
+    size_t blockSize;
+    size_t nUsed;	// Objects used in the last block
+    vector<T*> blocks;
+    vector<T*> freeList;
+    // Hide
+    Pool(const Pool& rhs);
+    void operator=(const Pool& rhs);
+  };
+
+  // Arena for the nodes of the std::set and std::list containers that index
+  // Matches and Cells, which would otherwise each be a separate trip to the
+  // heap.  Chunks are carved in multiples of Grain bytes from large blocks
+  // and recycled through one free list per size; larger requests go to the
+  // heap.  Memory is only returned when the arena is destroyed, so every
+  // container using it must be destroyed first.
+  class NodeArena {
+  public:
+    static const size_t Grain = 16;
+    explicit NodeArena(size_t blockBytes_=65536):
+      blockBytes(blockBytes_), nUsed(blockBytes_) {
+      for (size_t k=0; k<MaxClass; k++) freeLists[k] = nullptr;
+    }
+    ~NodeArena() {
+      for (auto b : blocks) ::operator delete(b);
+    }
+    void* allocate(size_t bytes) {
+      size_t k = sizeClass(bytes);
+      if (k >= MaxClass) return ::operator new(bytes);
+      if (freeLists[k]) {
+	void* where = freeLists[k];
+	freeLists[k] = *static_cast<void**>(where);
+	return where;
+      }
+      size_t chunk = k*Grain;
+      if (nUsed + chunk > blockBytes) {
+	blocks.push_back(static_cast<char*>(::operator new(blockBytes)));
+	nUsed = 0;
+      }
+      void* where = blocks.back() + nUsed;
+      nUsed += chunk;
+      return where;
+    }
+    void deallocate(void* p, size_t bytes) {
+      size_t k = sizeClass(bytes);
+      if (k >= MaxClass) {
+	::operator delete(p);
+	return;
+      }
+      *static_cast<void**>(p) = freeLists[k];
+      freeLists[k] = p;
+    }
+  private:
+    static const size_t MaxClass = 16;	// Chunks up to 240 bytes
+    size_t blockBytes;
+    size_t nUsed;	// Bytes used in the last block
+    vector<char*> blocks;
+    void* freeLists[MaxClass];
+    static size_t sizeClass(size_t bytes) {
+      return std::max(bytes, sizeof(void*)) / Grain
+	+ (std::max(bytes, sizeof(void*)) % Grain ? 1 : 0);
+    }
+    // Hide
+    NodeArena(const NodeArena& rhs);
+    void operator=(const NodeArena& rhs);
+  };
+
+  // Standard allocator drawing from a NodeArena
+  template <class T>
+  class ArenaAllocator {
+  public:
+    typedef T value_type;
+    explicit ArenaAllocator(NodeArena* arena_): arena(arena_) {
+      static_assert(alignof(T) <= NodeArena::Grain, "ArenaAllocator alignment");
+    }
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& rhs): arena(rhs.arena) {}
+    T* allocate(size_t n) {
+      return static_cast<T*>(arena->allocate(n*sizeof(T)));
+    }
+    void deallocate(T* p, size_t n) {
+      arena->deallocate(p, n*sizeof(T));
+    }
+    NodeArena* arena;
+  };
+  template <class T, class U>
+  inline bool operator==(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs) {
+    return lhs.arena==rhs.arena;
+  }
+  template <class T, class U>
+  inline bool operator!=(const ArenaAllocator<T>& lhs, const ArenaAllocator<U>& rhs) {
+    return lhs.arena!=rhs.arena;
+  }
+
   // Forward references
   template <class P, int DIM=2>
   class Cell;
   template <class P, int DIM=2>
   class Catalog;
 
+  // The Match and Cell containers of one Catalog all draw their nodes from
+  // the Catalog's NodeArena.
   template <class P, int DIM=2>
-  class Match: public list<const P*>  {
+  class Match: public list<const P*, ArenaAllocator<const P*> >  {
     friend class Cell<P,DIM>;
     friend class Catalog<P,DIM>;
   public:
-    Match(const P& point, set<Cell<P,DIM>*> cellsContainingPoint):
-      list<const P*>(1,&point),
-      lower(point.getX()),
-      upper(point.getX()),
-      cells(cellsContainingPoint) {}
-    bool touches(const P& point, double rad) const {
-      vector<double> xp = point.getX();
+    typedef PointTraits<P,DIM> Traits;
+    typedef typename Traits::Coords Coords;
+    typedef list<const P*, ArenaAllocator<const P*> > PointList;
+    typedef set<Cell<P,DIM>*, std::less<Cell<P,DIM>*>,
+		ArenaAllocator<Cell<P,DIM>*> > CellSet;
+    Match(const P& point, const vector<Cell<P,DIM>*>& cellsContainingPoint,
+	  NodeArena* arena):
+      PointList(1, &point, ArenaAllocator<const P*>(arena)),
+      lower(Traits::position(point)),
+      upper(lower),
+      cells(cellsContainingPoint.begin(), cellsContainingPoint.end(),
+	    std::less<Cell<P,DIM>*>(), ArenaAllocator<Cell<P,DIM>*>(arena)),
+      stamp(0) {}
+    bool touches(const Coords& xp, double rad) const {
       // First check whether point's rad-square would
       // touch Match's bounding rectangle:
       bool possible = true;
@@ -45,11 +202,11 @@ namespace fof {
       if (!possible) return false;
       // Now check whether point is within rad of any member point:
       double radsq = rad*rad;
-      for (typename list<const P*>::const_iterator i=list<const P*>::begin();
-	   i != list<const P*>::end();
+      for (typename PointList::const_iterator i=PointList::begin();
+	   i != PointList::end();
 	   ++i) {
 	double dsq=0.;
-	vector<double> x2 = (*i)->getX();
+	Coords x2 = Traits::position(**i);
 	for (int j=0; j<DIM; j++)
 	  dsq += (xp[j]-x2[j])*(xp[j]-x2[j]);
 	if ( dsq <= radsq) return true;
@@ -63,9 +220,9 @@ namespace fof {
 	upper[i] = std::max(upper[i], rhs->upper[i]);
       }
       // Suck points out of rhs:
-      this->splice(list<const P*>::end(), *rhs);
+      this->splice(PointList::end(), *rhs);
       // Remove rhs and add this to Match list of all cells containing rhs
-      for (typename set<Cell<P,DIM>*>::iterator i=rhs->cells.begin();
+      for (typename CellSet::iterator i=rhs->cells.begin();
 	   i != rhs->cells.end();
 	   ++i) {
 	(*i)->erase(rhs);
@@ -74,8 +231,8 @@ namespace fof {
       // And merge in rhs set of cells touched:
       cells.insert(rhs->cells.begin(), rhs->cells.end());
     }
-    void add(const P& point, set<Cell<P,DIM>*> cellsContainingPoint) {
-      vector<double> xp = point.getX();
+    void add(const P& point, const Coords& xp,
+	     const vector<Cell<P,DIM>*>& cellsContainingPoint) {
       // Expand bounds:
       for (int i=0; i<DIM; i++) {
 	lower[i] = std::min(lower[i], xp[i]);
@@ -87,10 +244,12 @@ namespace fof {
     }
   private:
     // Upper and lower coords of bounding rectangle of points
-    vector<double> lower;
-    vector<double> upper;
+    Coords lower;
+    Coords upper;
     // Cells that this match has points inside:
-    std::set<Cell<P>*> cells;
+    CellSet cells;
+    // Marker so each candidate is tested only once per added point:
+    unsigned long stamp;
     // Hide
     Match(const Match& rhs);
     void operator=(const Match& rhs);
@@ -100,18 +259,21 @@ namespace fof {
   class Cell {
     friend class Catalog<P,DIM>;
   public:
-    Cell(vector<double>& _lower, vector<double> _upper, Catalog<P,DIM>* _own):
-      lower(_lower), upper(_upper), 
+    typedef typename PointTraits<P,DIM>::Coords Coords;
+    typedef set<Match<P,DIM>*, std::less<Match<P,DIM>*>,
+		ArenaAllocator<Match<P,DIM>*> > MatchSet;
+    Cell(const Coords& _lower, const Coords& _upper, Catalog<P,DIM>* _own):
       owner(_own),
       parent(nullptr), left(nullptr), right(nullptr),
-      splitIndex(0) {}
+      splitIndex(0), closed(false),
+      lower(_lower), upper(_upper),
+      matches(std::less<Match<P,DIM>*>(), ArenaAllocator<Match<P,DIM>*>(&_own->arena)) {}
     // Destructor kills children so we just destroy root Cell:
     ~Cell() {
-      if (left) delete left;
-      if (right) delete right;
+      if (left) owner->cellPool.destroy(left);
+      if (right) owner->cellPool.destroy(right);
     }
-    bool contains(const P& point) const {
-      vector<double> xp = point.getX();
+    bool contains(const Coords& xp) const {
       for (int i=0; i<DIM; i++) {
 	if ( xp[i] < lower[i] || xp[i] > upper[i]) return false;
       }
@@ -124,18 +286,38 @@ namespace fof {
     void erase(Match<P,DIM>* m) {
       matches.erase(m);
     }
-    void findCellsTouching(const P& point, set<Cell<P,DIM>*>& touching) {
+    void findCellsTouching(const Coords& xp, vector<Cell<P,DIM>*>& touching) {
       // Only reach this routine if touching this cell.  Add self if leaf:
       if (!left) {
-	touching.insert(this);
+	touching.push_back(this);
 	return;
       }
       // Otherwise descend to left and/or right child:
-      double xpt = point.getX()[splitIndex];
-      if (xpt >= splitValue - owner->getRadius()) right->findCellsTouching(point, touching);
-      if (xpt <= splitValue + owner->getRadius()) left->findCellsTouching(point, touching);
+      double xpt = xp[splitIndex];
+      if (xpt >= splitValue - owner->getRadius()) right->findCellsTouching(xp, touching);
+      if (xpt <= splitValue + owner->getRadius()) left->findCellsTouching(xp, touching);
       return;
     }
+    // Gather the Matches lying entirely below limit on the last axis from
+    // the cells that are not closed, then close the leaves lying entirely
+    // below limit, and any cell whose children are both closed.  Nothing
+    // can be added to a closed cell, so it is never visited again.
+    void collectBelow(double limit, unsigned long stamp,
+		      vector<Match<P,DIM>*>& found) {
+      if (closed || lower[DIM-1] >= limit) return;
+      if (left) {
+	left->collectBelow(limit, stamp, found);
+	right->collectBelow(limit, stamp, found);
+	closed = left->closed && right->closed;
+	return;
+      }
+      for (auto m : matches)
+	if (m->upper[DIM-1] < limit && m->stamp != stamp) {
+	  m->stamp = stamp;
+	  found.push_back(m);
+	}
+      closed = upper[DIM-1] < limit;
+    }
     // Split this cell if it has more than maxMatches in it:
     void splitCheck() {
       // Split cell when more than this many matches in it:
@@ -156,12 +338,12 @@ namespace fof {
 	}
       }
       splitValue = 0.5*(upper[splitIndex]+lower[splitIndex]);
-      vector<double> upperLeft = upper;
+      Coords upperLeft = upper;
       upperLeft[splitIndex] = splitValue;
-      vector<double> lowerRight = lower;
+      Coords lowerRight = lower;
       lowerRight[splitIndex] = splitValue;
-      left = new Cell(lower, upperLeft, owner);
-      right = new Cell(lowerRight, upper, owner);
+      left = owner->cellPool.create(lower, upperLeft, owner);
+      right = owner->cellPool.create(lowerRight, upper, owner);
       left->parent = this;
       right->parent = this;
       int childSplit = splitIndex+1;
@@ -170,7 +352,7 @@ namespace fof {
       right->splitIndex = childSplit;
       // Now place each Match into one or both children:
       // and tell it what new Cells it is in instead of this one
-      for (typename set<Match<P,DIM>*>::iterator i=matches.begin();
+      for (typename MatchSet::iterator i=matches.begin();
       i != matches.end();
 	   ++i) {
 	(*i)->cells.erase(this);
@@ -197,86 +379,713 @@ namespace fof {
     Cell<P,DIM>* right;
     int splitIndex;
     double splitValue;
-    vector<double> lower;
-    vector<double> upper;
-    set<Match<P,DIM>*> matches;
+    bool closed;	// Set by collectBelow()
+    Coords lower;
+    Coords upper;
+    MatchSet matches;
+    // Hide
+    Cell(const Cell& rhs);
+    void operator=(const Cell& rhs);
   };
 
 
+  // Holds the NodeArena of a Catalog so that it is constructed before,
+  // and destroyed after, the set of Matches that the Catalog derives from.
+  struct ArenaHolder {
+    NodeArena arena;
+  };
+
   template <class P, int DIM>
-  class Catalog: public set<Match<P,DIM>*> {
+  class Catalog: private ArenaHolder,
+		 public set<Match<P,DIM>*, std::less<Match<P,DIM>*>,
+			    ArenaAllocator<Match<P,DIM>*> > {
+    friend class Cell<P,DIM>;
     public:
-    typename set<Match<P,DIM>*>::iterator iterator;
+    typedef PointTraits<P,DIM> Traits;
+    typedef typename Traits::Coords Coords;
+    typedef Match<P,DIM> MatchType;
+    typedef set<Match<P,DIM>*, std::less<Match<P,DIM>*>,
+		ArenaAllocator<Match<P,DIM>*> > MatchSet;
+    typename MatchSet::iterator iterator;
     Catalog(vector<double> lower, vector<double> upper, double radius_):
-      radius(radius_), root(lower,upper,this) {}
+      MatchSet(std::less<Match<P,DIM>*>(), ArenaAllocator<Match<P,DIM>*>(&this->arena)),
+      radius(radius_), root(toCoords(lower),toCoords(upper),this), stamp(0) {}
     ~Catalog() {
       // Kill all matches: (but note that killing matches does NOT delete points)
-      for (typename set<Match<P,DIM>*>::iterator i= set<Match<P,DIM>*>::begin();
-	   i!=set<Match<P,DIM>*>::end();
-	   i++) {delete *i;}
+      for (typename MatchSet::iterator i= MatchSet::begin();
+	   i!=MatchSet::end();
+	   i++) {matchPool.destroy(*i);}
     }
     double getRadius() const {return radius;}
     void add(const P& point) {
       // Make sure point is in the root domain?
       // I think if we don't do this, they'll be treated as if they are at the edge
       // of the domain, as far as Cell assignment, which is ok.
+      Coords xp = Traits::position(point);
 
       // Find all cells that could touch this point:
-      set<Cell<P,DIM>*> touching;
-      root.findCellsTouching(point, touching);
+      touching.clear();
+      root.findCellsTouching(xp, touching);
 
 
       // Find subset of these Cells that actually contain the point
-      // and make set of all Matches in all the touching Cells
-      set<Cell<P,DIM>*> containing;
-      set<Match<P,DIM>*> candidates;
-      for (typename set<Cell<P,DIM>*>::iterator i=touching.begin();
+      // and make list of all distinct Matches in all the touching Cells
+      containing.clear();
+      candidates.clear();
+      ++stamp;
+      for (typename vector<Cell<P,DIM>*>::iterator i=touching.begin();
 	   i != touching.end();
 	   ++i) {
-	if ((*i)->contains(point)) containing.insert(*i);
-	candidates.insert( (*i)->matches.begin(), (*i)->matches.end());
+	if ((*i)->contains(xp)) containing.push_back(*i);
+	for (typename MatchSet::iterator j=(*i)->matches.begin();
+	     j != (*i)->matches.end();
+	     ++j)
+	  if ((*j)->stamp != stamp) {
+	    (*j)->stamp = stamp;
+	    candidates.push_back(*j);
+	  }
       }
 
       // Find all Matches that touch this point:
       Match<P,DIM>* primary = 0;  // the first Match that touches this point
-      for (typename set<Match<P,DIM>*>::iterator i=candidates.begin();
+      for (typename vector<Match<P,DIM>*>::iterator i=candidates.begin();
 	   i != candidates.end();
 	   ++i) {
-	if ((*i)->touches(point, radius)) {
+	if ((*i)->touches(xp, radius)) {
 	  if (!primary) {
 	    // First Match found:  add Point to this, and all Cells containing it
 	    primary = *i;
-	    primary->add(point, containing);
+	    primary->add(point, xp, containing);
+	    // Cells containing the new point must also index this Match
+	    for (typename vector<Cell<P,DIM>*>::iterator j=containing.begin();
+		 j != containing.end();
+		 ++j)
+	      (*j)->insert(primary);
 	  } else {
 	    // Point touches 2 Matches, which hence match each other, so combine
 	    primary->absorb(*i);
 	    // Get rid of the 2nd one
 	    this->erase(*i);
-	    delete *i;
+	    matchPool.destroy(*i);
 	  }
 	}
       }
       // Create a new Match if Point did not touch any others
       if (!primary) {
-	primary = new Match<P,DIM>(point, containing);
+	primary = matchPool.create(point, containing, &this->arena);
 	// Add to Catalog's index of all Matches
 	this->insert(primary);
 	// And add to every containing Cell's list of Matches:
-	for (typename set<Cell<P,DIM>*>::iterator i=containing.begin();
+	for (typename vector<Cell<P,DIM>*>::iterator i=containing.begin();
 	     i != containing.end();
 	     ++i)
 	  (*i)->insert(primary);
       }
     }
 
+    // Remove every Match whose points all lie below limit on the last axis,
+    // calling out(match) for each before it is destroyed.  No point may be
+    // added below limit + radius afterwards, so these Matches are final.
+    // Only the cells reaching below limit that are not yet closed are
+    // visited.
+    template <class F>
+    void retireBelow(double limit, F out) {
+      retiring.clear();
+      root.collectBelow(limit, ++stamp, retiring);
+      for (auto m : retiring) {
+	out(*m);
+	for (auto c : m->cells) c->erase(m);
+	this->erase(m);
+	matchPool.destroy(m);
+      }
+    }
+
   private:
     double radius; // matching radius
+    // Storage for Matches and Cells; must outlive root.  Their set and list
+    // nodes come from the arena inherited from ArenaHolder.
+    Pool<Match<P,DIM> > matchPool;
+    Pool<Cell<P,DIM> > cellPool;
     Cell<P,DIM> root;	// Root of the cell tree
+    // Scratch space and counter used by add():
+    vector<Cell<P,DIM>*> touching;
+    vector<Cell<P,DIM>*> containing;
+    vector<Match<P,DIM>*> candidates;
+    vector<Match<P,DIM>*> retiring;
+    unsigned long stamp;
+    static Coords toCoords(const vector<double>& v) {
+      Coords c;
+      for (int i=0; i<DIM; i++) c[i] = v[i];
+      return c;
+    }
+  };
+
+
+  //////////////////////////////////////////////////////////////////////
+  // GridCatalog is an alternative to the Cell tree above that indexes the
+  // Matches on a flat uniform grid.  Cell size is a small multiple of the
+  // matching radius, so a new point only needs to inspect the 2^DIM or so cells
+  // within one radius of itself.  Only occupied cells are stored, in a hash
+  // table keyed by the integer cell coordinates, and each cell keeps a
+  // contiguous vector of the Matches having a point inside it.  This avoids
+  // the tree descent and all of the std::set building done by Catalog::add(),
+  // which dominate the time and memory for dense fields.
+  // The public interface is the same as Catalog.
+  //////////////////////////////////////////////////////////////////////
+
+  // Pack the integer coordinates of a grid cell into one hash key
+  template <int DIM>
+  inline long long cellKey(const long* ix) {
+    const int bits = 64/DIM;
+    const unsigned long long mask = (bits>=64) ? ~0ULL : ((1ULL << bits) - 1);
+    unsigned long long key = 0;
+    for (int i=0; i<DIM; i++)
+      key = (key << (bits % 64)) | (static_cast<unsigned long long>(ix[i]) & mask);
+    return static_cast<long long>(key);
+  }
+
+  template <class P, int DIM=2>
+  class GridCatalog;
+
+  template <class P, int DIM=2>
+  class GridMatch: public vector<const P*> {
+    friend class GridCatalog<P,DIM>;
+  public:
+    typedef PointTraits<P,DIM> Traits;
+    typedef typename Traits::Coords Coords;
+    typedef vector<GridMatch*> CellContents;
+    GridMatch(const P& point, const Coords& xp, CellContents* home):
+      vector<const P*>(1,&point),
+      lower(xp),
+      upper(xp),
+      cells(1,home),
+      stamp(0) {
+      home->push_back(this);
+    }
+    bool touches(const Coords& xp, double rad) const {
+      // Check bounding rectangle first:
+      for (int i=0; i<DIM; i++)
+	if ( xp[i] < lower[i]-rad || xp[i] > upper[i]+rad) return false;
+      // Now check whether point is within rad of any member point:
+      double radsq = rad*rad;
+      for (auto member : *this) {
+	double dsq=0.;
+	Coords x2 = Traits::position(*member);
+	for (int j=0; j<DIM; j++)
+	  dsq += (xp[j]-x2[j])*(xp[j]-x2[j]);
+	if ( dsq <= radsq) return true;
+      }
+      return false;
+    }
+    void add(const P& point, const Coords& xp, CellContents* home) {
+      for (int i=0; i<DIM; i++) {
+	lower[i] = std::min(lower[i], xp[i]);
+	upper[i] = std::max(upper[i], xp[i]);
+      }
+      this->push_back(&point);
+      enterCell(home);
+    }
+    void absorb(GridMatch* rhs) {
+      for (int i=0; i<DIM; i++) {
+	lower[i] = std::min(lower[i], rhs->lower[i]);
+	upper[i] = std::max(upper[i], rhs->upper[i]);
+      }
+      this->insert(this->end(), rhs->begin(), rhs->end());
+      // Take over rhs's place in all of its cells
+      for (auto c : rhs->cells) {
+	auto where = std::find(c->begin(), c->end(), rhs);
+	if (std::find(cells.begin(), cells.end(), c)==cells.end()) {
+	  *where = this;
+	  cells.push_back(c);
+	} else {
+	  // Already in this cell, just remove rhs
+	  *where = c->back();
+	  c->pop_back();
+	}
+      }
+      rhs->cells.clear();
+    }
+  private:
+    // Upper and lower coords of bounding rectangle of points
+    Coords lower;
+    Coords upper;
+    // Cells that this match has points inside:
+    vector<CellContents*> cells;
+    // Position of this Match in the GridCatalog's vector:
+    size_t slot;
+    // Marker so each candidate is tested only once per added point:
+    unsigned long stamp;
+    void enterCell(CellContents* c) {
+      if (std::find(cells.begin(), cells.end(), c)!=cells.end()) return;
+      cells.push_back(c);
+      c->push_back(this);
+    }
+    // Hide
+    GridMatch(const GridMatch& rhs);
+    void operator=(const GridMatch& rhs);
+  };
+
+  template <class P, int DIM>
+  class GridCatalog: public vector<GridMatch<P,DIM>*> {
+  public:
+    typedef GridMatch<P,DIM> MatchType;
+    typedef PointTraits<P,DIM> Traits;
+    typedef typename Traits::Coords Coords;
+    // Cell side length is cellFactor times the match radius.
+    GridCatalog(vector<double> lower_, vector<double> upper_, double radius_,
+		double cellFactor=2.):
+      radius(radius_), cellSize(cellFactor*radius_),
+      lower(lower_), upper(upper_), stamp(0) {}
+    ~GridCatalog() {
+      for (auto m : *this) matchPool.destroy(m);
+    }
+    double getRadius() const {return radius;}
+    // Number of occupied grid cells
+    long nCells() const {return cells.size();}
+    void add(const P& point) {
+      Coords xp = Traits::position(point);
+
+      // Range of cells that could hold a friend of this point:
+      long lo[DIM];
+      long hi[DIM];
+      long ix[DIM];
+      for (int i=0; i<DIM; i++) {
+	lo[i] = cellIndex(xp[i]-radius, i);
+	hi[i] = cellIndex(xp[i]+radius, i);
+	ix[i] = lo[i];
+      }
+
+      // Collect each distinct Match found in these cells
+      ++stamp;
+      candidates.clear();
+      while (true) {
+	auto c = cells.find(cellKey<DIM>(ix));
+	if (c!=cells.end())
+	  for (auto m : c->second)
+	    if (m->stamp != stamp) {
+	      m->stamp = stamp;
+	      candidates.push_back(m);
+	    }
+	// Advance to next cell in the range
+	int i=0;
+	for ( ; i<DIM; i++) {
+	  if (++ix[i] <= hi[i]) break;
+	  ix[i] = lo[i];
+	}
+	if (i==DIM) break;
+      }
+
+      // The cell holding the point itself
+      for (int i=0; i<DIM; i++) ix[i] = cellIndex(xp[i], i);
+      long long key = cellKey<DIM>(ix);
+      auto where = cells.emplace(key, typename MatchType::CellContents());
+      if (where.second) rows[ix[DIM-1]].push_back(key);
+      typename MatchType::CellContents* home = &where.first->second;
+
+      MatchType* primary = nullptr;
+      for (auto m : candidates) {
+	if (!m->touches(xp, radius)) continue;
+	if (!primary) {
+	  primary = m;
+	  primary->add(point, xp, home);
+	} else {
+	  // Point joins two Matches - merge them.
+	  primary->absorb(m);
+	  eraseMatch(m);
+	}
+      }
+      if (!primary) {
+	primary = matchPool.create(point, xp, home);
+	primary->slot = this->size();
+	this->push_back(primary);
+      }
+    }
+
+    // Remove every Match whose points all lie below limit on the last axis,
+    // calling out(match) for each before it is destroyed.  No point may be
+    // added below limit + radius afterwards, so these Matches are final.
+    // Only the rows of cells reaching below limit are searched, and the
+    // rows lying entirely below it, which no new point can reach, are
+    // closed: their cells are dropped.
+    template <class F>
+    void retireBelow(double limit, F out) {
+      long lastRow = cellIndex(limit, DIM-1);
+      ++stamp;
+      candidates.clear();
+      for (auto row = rows.begin(); row!=rows.end() && row->first <= lastRow; ++row)
+	for (auto key : row->second)
+	  for (auto m : cells.find(key)->second)
+	    if (m->upper[DIM-1] < limit && m->stamp != stamp) {
+	      m->stamp = stamp;
+	      candidates.push_back(m);
+	    }
+      for (auto m : candidates) {
+	out(*m);
+	for (auto c : m->cells) {
+	  auto where = std::find(c->begin(), c->end(), m);
+	  *where = c->back();
+	  c->pop_back();
+	}
+	eraseMatch(m);
+      }
+      while (!rows.empty()
+	     && lower[DIM-1] + (rows.begin()->first + 1)*cellSize <= limit) {
+	for (auto key : rows.begin()->second) {
+	  auto c = cells.find(key);
+	  for (auto m : c->second)
+	    m->cells.erase(std::find(m->cells.begin(), m->cells.end(), &c->second));
+	  cells.erase(c);
+	}
+	rows.erase(rows.begin());
+      }
+    }
+
+  private:
+    double radius;
+    double cellSize;
     vector<double> lower;
     vector<double> upper;
+    Pool<MatchType> matchPool;
+    std::unordered_map<long long, typename MatchType::CellContents> cells;
+    // Keys of the cells in each row along the last axis
+    std::map<long, vector<long long> > rows;
+    // Scratch space and counter used by add() and retireBelow():
+    vector<MatchType*> candidates;
+    unsigned long stamp;
+
+    long cellIndex(double x, int i) const {
+      return static_cast<long> (std::floor((x - lower[i])/cellSize));
+    }
+    void eraseMatch(MatchType* m) {
+      // Swap last Match into this one's slot
+      MatchType* last = this->back();
+      (*this)[m->slot] = last;
+      last->slot = m->slot;
+      this->pop_back();
+      matchPool.destroy(m);
+    }
+  };
+
+  //////////////////////////////////////////////////////////////////////
+  // FriendLinker does friends-of-friends linking of bare coordinates.  Each
+  // position added gets the next 32-bit index, and is linked to every earlier
+  // position within the radius by path-compressed union-find on a parent
+  // array.  Positions are found on the same kind of hashed grid as
+  // GridCatalog uses.  Linking always attaches the higher root to the lower
+  // one, so the root of each group is its lowest index.
+  //////////////////////////////////////////////////////////////////////
+
+  template <int DIM=2>
+  class FriendLinker {
+  public:
+    typedef std::array<double,DIM> Coords;
+    FriendLinker(const vector<double>& lower_, double radius_, double cellFactor=2.):
+      radius(radius_), cellSize(cellFactor*radius_), lower(lower_), nGroups(0) {}
+    double getRadius() const {return radius;}
+    // Number of positions and of distinct groups
+    uint32_t size() const {return parent.size();}
+    long groupCount() const {return nGroups;}
+    const Coords& position(uint32_t i) const {return coords[i];}
+    void reserve(size_t n) {
+      coords.reserve(n);
+      parent.reserve(n);
+    }
+
+    uint32_t add(const Coords& xp) {
+      if (parent.size() >= UINT32_MAX)
+	throw std::runtime_error("Too many points for fof::FriendLinker");
+      uint32_t index = parent.size();
+      coords.push_back(xp);
+      parent.push_back(index);
+      ++nGroups;
+
+      double radsq = radius*radius;
+      long lo[DIM];
+      long hi[DIM];
+      long ix[DIM];
+      for (int i=0; i<DIM; i++) {
+	lo[i] = cellIndex(xp[i]-radius, i);
+	hi[i] = cellIndex(xp[i]+radius, i);
+	ix[i] = lo[i];
+      }
+      while (true) {
+	auto c = cells.find(cellKey<DIM>(ix));
+	if (c!=cells.end())
+	  for (uint32_t j : c->second) {
+	    uint32_t rootj = find(j);
+	    uint32_t rooti = find(index);
+	    if (rooti==rootj) continue;  // Already friends
+	    const Coords& x2 = coords[j];
+	    double dsq=0.;
+	    for (int k=0; k<DIM; k++)
+	      dsq += (xp[k]-x2[k])*(xp[k]-x2[k]);
+	    if (dsq <= radsq) 
+	      link(rooti, rootj);
+	  }
+	int i=0;
+	for ( ; i<DIM; i++) {
+	  if (++ix[i] <= hi[i]) break;
+	  ix[i] = lo[i];
+	}
+	if (i==DIM) break;
+      }
+
+      // Enter point in its own cell
+      for (int i=0; i<DIM; i++) ix[i] = cellIndex(xp[i], i);
+      cells[cellKey<DIM>(ix)].push_back(index);
+      return index;
+    }
+    // Root (lowest index) of the group containing i
+    uint32_t find(uint32_t i) {
+      while (parent[i]!=i) {
+	// Path halving
+	parent[i] = parent[parent[i]];
+	i = parent[i];
+      }
+      return i;
+    }
+    // Root without compressing paths, for const use
+    uint32_t rootOf(uint32_t i) const {
+      while (parent[i]!=i) i = parent[i];
+      return i;
+    }
+    // Declare two positions to be friends
+    void join(uint32_t i, uint32_t j) {
+      uint32_t rooti = find(i);
+      uint32_t rootj = find(j);
+      if (rooti!=rootj) link(rooti, rootj);
+    }
+    // Add n entries that are only to be linked with join(), having no
+    // positions of their own
+    void addUnplaced(uint32_t n) {
+      if (parent.size() + n >= UINT32_MAX)
+	throw std::runtime_error("Too many points for fof::FriendLinker");
+      for (uint32_t i=0; i<n; i++) parent.push_back(parent.size());
+      nGroups += n;
+    }
+    // Release the spatial index once no more positions will be added
+    void freeCells() {
+      std::unordered_map<long long, vector<uint32_t> > empty;
+      cells.swap(empty);
+    }
+
+  private:
+    double radius;
+    double cellSize;
+    vector<double> lower;
+    std::unordered_map<long long, vector<uint32_t> > cells;
+    vector<Coords> coords;
+    vector<uint32_t> parent;
+    long nGroups;
+
+    long cellIndex(double x, int i) const {
+      return static_cast<long> (std::floor((x - lower[i])/cellSize));
+    }
+    void link(uint32_t rooti, uint32_t rootj) {
+      // Attach the later root to the earlier one
+      if (rooti < rootj) parent[rootj] = rooti;
+      else parent[rooti] = rootj;
+      --nGroups;
+    }
+  };
+
+  // Assemble groups of points from the roots in a linker.  Roots always
+  // precede their members, so one pass suffices, recording each root's
+  // group number in slot[].  Points within each group are in index order.
+  template <class P, int DIM>
+  void
+  collectGroups(const FriendLinker<DIM>& linker,
+		const vector<const P*>& points,
+		vector<vector<const P*>*>& groups) {
+    groups.reserve(linker.groupCount());
+    vector<uint32_t> slot(points.size());
+    for (uint32_t i=0; i<points.size(); i++) {
+      uint32_t root = linker.rootOf(i);
+      if (root==i) {
+	slot[i] = groups.size();
+	groups.push_back(new vector<const P*>);
+      }
+      groups[slot[root]]->push_back(points[i]);
+    }
+  }
+
+  //////////////////////////////////////////////////////////////////////
+  // UnionFindCatalog finds the same friends-of-friends groups as Catalog
+  // without maintaining Match objects while points are added.  Points are
+  // linked by a FriendLinker as they are added, and the groups are assembled
+  // in one pass over the points the first time the catalog is traversed (or
+  // after more points have been added), with each group's points in order of
+  // addition.  Traversal gives pointers to vector<const P*>, as for the other
+  // catalogs.
+  //////////////////////////////////////////////////////////////////////
+
+  template <class P, int DIM=2>
+  class UnionFindCatalog {
+  public:
+    typedef vector<const P*> MatchType;
+    typedef typename vector<MatchType*>::const_iterator const_iterator;
+    typedef PointTraits<P,DIM> Traits;
+    UnionFindCatalog(vector<double> lower_, vector<double> /*upper*/, double radius_,
+		     double cellFactor=2.):
+      linker(lower_, radius_, cellFactor), dirty(false) {}
+    ~UnionFindCatalog() {clearGroups();}
+    double getRadius() const {return linker.getRadius();}
+    // Number of groups
+    long size() const {return linker.groupCount();}
+    bool empty() const {return size()==0;}
+    const_iterator begin() const {buildGroups(); return groups.begin();}
+    const_iterator end() const {buildGroups(); return groups.end();}
+
+    void add(const P& point) {
+      linker.add(Traits::position(point));
+      points.push_back(&point);
+      dirty = true;
+    }
+
+  private:
+    FriendLinker<DIM> linker;
+    vector<const P*> points;
+    // Groups are assembled on demand:
+    mutable vector<MatchType*> groups;
+    mutable bool dirty;
+
+    void clearGroups() const {
+      for (auto g : groups) delete g;
+      groups.clear();
+    }
+    void buildGroups() const {
+      if (!dirty) return;
+      clearGroups();
+      collectGroups(linker, points, groups);
+      dirty = false;
+    }
+    // Hide
+    UnionFindCatalog(const UnionFindCatalog& rhs);
+    void operator=(const UnionFindCatalog& rhs);
   };
 
+  //////////////////////////////////////////////////////////////////////
+  // TiledCatalog does the friends-of-friends linking of one large domain in
+  // parallel.  Points are only stored as they are added.  When the catalog is
+  // first traversed, the domain is cut into tilesPerAxis^DIM tiles (the outer
+  // tiles extending to infinity), and each tile's points plus a halo of the
+  // points within one radius of the tile are linked on their own thread.
+  // Every pair of friends then lies together in the tile (core plus halo) of
+  // one of them, so joining the tile groups in a serial pass over global
+  // point indices gives exactly the groups of a serial FoF, and the same
+  // group and point ordering as UnionFindCatalog.
+  //////////////////////////////////////////////////////////////////////
+
+  template <class P, int DIM=2>
+  class TiledCatalog {
+  public:
+    typedef vector<const P*> MatchType;
+    typedef typename vector<MatchType*>::const_iterator const_iterator;
+    typedef PointTraits<P,DIM> Traits;
+    typedef typename Traits::Coords Coords;
+    TiledCatalog(vector<double> lower_, vector<double> upper_, double radius_,
+		 int tilesPerAxis_=8):
+      lower(lower_), upper(upper_), radius(radius_), 
+      tilesPerAxis(std::max(1,tilesPerAxis_)), dirty(false) {}
+    ~TiledCatalog() {clearGroups();}
+    double getRadius() const {return radius;}
+    // Number of groups - requires matching all points added so far
+    long size() const {buildGroups(); return groups.size();}
+    bool empty() const {return points.empty();}
+    const_iterator begin() const {buildGroups(); return groups.begin();}
+    const_iterator end() const {buildGroups(); return groups.end();}
+
+    void add(const P& point) {
+      if (points.size() >= UINT32_MAX)
+	throw std::runtime_error("Too many points for fof::TiledCatalog");
+      points.push_back(&point);
+      coords.push_back(Traits::position(point));
+      dirty = true;
+    }
+
+  private:
+    vector<double> lower;
+    vector<double> upper;
+    double radius;
+    int tilesPerAxis;
+    vector<const P*> points;
+    vector<Coords> coords;
+    // Groups are assembled on demand:
+    mutable vector<MatchType*> groups;
+    mutable bool dirty;
+
+    long tileIndex(double x, int i) const {
+      double tileSize = (upper[i]-lower[i]) / tilesPerAxis;
+      long t = tileSize > 0. ? static_cast<long> (std::floor((x-lower[i])/tileSize)) : 0;
+      return std::max(0L, std::min(static_cast<long>(tilesPerAxis-1), t));
+    }
+    void clearGroups() const {
+      for (auto g : groups) delete g;
+      groups.clear();
+    }
+    void buildGroups() const {
+      if (!dirty) return;
+      clearGroups();
+
+      // Assign each point to every tile whose core or halo contains it
+      long nTiles = 1;
+      for (int i=0; i<DIM; i++) nTiles *= tilesPerAxis;
+      vector<vector<uint32_t> > members(nTiles);
+      for (uint32_t ipt=0; ipt<coords.size(); ipt++) {
+	const Coords& xp = coords[ipt];
+	long lo[DIM];
+	long hi[DIM];
+	long ix[DIM];
+	for (int i=0; i<DIM; i++) {
+	  lo[i] = tileIndex(xp[i]-radius, i);
+	  hi[i] = tileIndex(xp[i]+radius, i);
+	  ix[i] = lo[i];
+	}
+	while (true) {
+	  long tile = 0;
+	  for (int i=DIM-1; i>=0; i--) tile = tile*tilesPerAxis + ix[i];
+	  members[tile].push_back(ipt);
+	  int i=0;
+	  for ( ; i<DIM; i++) {
+	    if (++ix[i] <= hi[i]) break;
+	    ix[i] = lo[i];
+	  }
+	  if (i==DIM) break;
+	}
+      }
 
+      // Link within each tile; record each member's tile-local root as
+      // the global index of that root.
+      vector<vector<uint32_t> > roots(nTiles);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,1)
+#endif
+      for (long tile=0; tile<nTiles; tile++) {
+	const vector<uint32_t>& m = members[tile];
+	if (m.empty()) continue;
+	FriendLinker<DIM> linker(lower, radius);
+	linker.reserve(m.size());
+	for (auto ipt : m) linker.add(coords[ipt]);
+	linker.freeCells();
+	roots[tile].resize(m.size());
+	for (uint32_t i=0; i<m.size(); i++)
+	  roots[tile][i] = m[linker.find(i)];
+      }
+
+      // Join the tile groups over global point indices
+      FriendLinker<DIM> global(lower, radius);
+      global.addUnplaced(coords.size());
+      for (long tile=0; tile<nTiles; tile++) {
+	for (uint32_t i=0; i<members[tile].size(); i++)
+	  global.join(members[tile][i], roots[tile][i]);
+      }
+      collectGroups(global, points, groups);
+      dirty = false;
+    }
+    // Hide
+    TiledCatalog(const TiledCatalog& rhs);
+    void operator=(const TiledCatalog& rhs);
+  };
 
 }  // end namespace
 #endif // FOF2d_H
@@ -1,6 +1,7 @@
 #ifndef INSTRUMENT_H
 #define INSTRUMENT_H
 #include <map>
+#include <algorithm>
 #include "Std.h"
 #include "Bounds.h"
 #include "Astrometry.h"
@@ -63,6 +64,82 @@ public:
   void operator=(const Exposure& rhs) =delete;
 };
 
+// The objects wanted from one catalog, each an ID and the structure to fill
+// from its row.  Entries are appended as the matches are read, then sorted
+// once by ID so the catalog's ID column can be merge-joined against them.
+template <class T>
+class Keepers {
+public:
+  typedef std::pair<long, T*> Entry;
+  typedef typename vector<Entry>::const_iterator const_iterator;
+  Keepers(): sorted(true) {}
+  void insert(long id, T* p) {
+    if (!entries.empty() && id < entries.back().first) sorted = false;
+    entries.push_back(Entry(id,p));
+  }
+  bool empty() const {return entries.empty();}
+  long size() const {return entries.size();}
+  void reserve(long n) {entries.reserve(n);}
+  // Entries in ID order once sort() is called
+  const_iterator begin() const {return entries.begin();}
+  const_iterator end() const {return entries.end();}
+  void sort() {
+    if (!sorted)
+      std::stable_sort(entries.begin(), entries.end(),
+		       [](const Entry& lhs, const Entry& rhs)
+		       {return lhs.first < rhs.first;});
+    sorted = true;
+  }
+  void clear() {vector<Entry>().swap(entries); sorted = true;}
+
+  // Call f(row, T*) for each entry whose ID appears in the ID column, using
+  // the first row having its ID.  A merge join is done if the column is in
+  // ascending order, as catalogs usually are, else each row is looked up.
+  // Returns the number of entries that were found.  Must be sorted.
+  template <class F>
+  long join(const vector<long>& id, F f) const {
+    long found = 0;
+    bool ascending = std::is_sorted(id.begin(), id.end());
+    if (ascending) {
+      auto k = entries.begin();
+      for (long row=0; row<id.size() && k!=entries.end(); row++) {
+	while (k!=entries.end() && k->first < id[row]) ++k;
+	for ( ; k!=entries.end() && k->first==id[row]; ++k, ++found)
+	  f(row, k->second);
+      }
+    } else {
+      vector<char> used(entries.size(), 0);
+      for (long row=0; row<id.size(); row++) {
+	auto k = std::lower_bound(entries.begin(), entries.end(), id[row],
+				  [](const Entry& e, long value) {return e.first < value;});
+	for ( ; k!=entries.end() && k->first==id[row]; ++k) {
+	  if (used[k - entries.begin()]) break;
+	  used[k - entries.begin()] = 1;
+	  f(row, k->second);
+	  ++found;
+	}
+      }
+    }
+    return found;
+  }
+
+  // The [start,end) row ranges holding all entries when the IDs are row
+  // numbers, joining ranges separated by no more than maxGap rows.
+  // Must be sorted.
+  void rowRanges(long maxGap, vector<std::pair<long,long> >& ranges) const {
+    ranges.clear();
+    for (auto& e : entries) {
+      if (!ranges.empty() && e.first <= ranges.back().second + maxGap)
+	ranges.back().second = std::max(ranges.back().second, e.first+1);
+      else
+	ranges.push_back(std::make_pair(e.first, e.first+1));
+    }
+  }
+private:
+  vector<Entry> entries;
+  bool sorted;
+};
+
 // Class that represents an catalog of objects from a single device on single exposure.
 // Will have originated from a single bintable HDU that we can access.
 // The template argument are SubMap, Detection from either astrometry or photometry.
@@ -85,7 +162,7 @@ public:
   astrometry::Wcs* startWcs;  // Input Wcs for this extension (owned by this class)
   bool needsColor;	// Save info on whether map requires color information.
 
-  std::map<long, T2*> keepers; // The objects from this Extension catalog that we will use
+  Keepers<T2> keepers; // The objects from this Extension catalog that we will use
   ~ExtensionBase() {
     if (startWcs) delete startWcs;
   }
@@ -100,7 +177,7 @@ public:
   ColorExtensionBase() {}
   int priority;	// Rank of this catalog in heirarchy of colors.  Lower value takes priority.
   // The objects from this catalog that we will use, and the matches they give colors for:
-  std::map<long, T*> keepers;  
+  Keepers<T> keepers;
 };
 
 #endif
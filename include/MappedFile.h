@@ -0,0 +1,26 @@
+// Read-only memory mapping of a whole file, for the binary files that the
+// programs read in place rather than parse.
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include "Std.h"
+
+class MappedFile {
+public:
+  // Map the file.  Throws std::runtime_error on failure.
+  explicit MappedFile(const string& filename);
+  ~MappedFile();
+  const string& name() const {return filename;}
+  const char* data() const {return base;}
+  size_t size() const {return length;}
+private:
+  string filename;
+  const char* base;
+  size_t length;
+
+  // Hide copying
+  MappedFile(const MappedFile& rhs) =delete;
+  void operator=(const MappedFile& rhs) =delete;
+};
+
+#endif
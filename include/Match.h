@@ -10,12 +10,19 @@
 using std::list;
 #include <string>
 #include "Std.h"
+#include "ObjectPool.h"
 #include "LinearAlgebra.h"
 #include "Bounds.h"
 #include "Astrometry.h"
 #include "PixelMap.h"
 #include "PixelMapCollection.h"
 #include "SymmetricUpdater.h"
+#include "BlockSymmetric.h"
+#include "SparseCholesky.h"
+#include "SchurComplement.h"
+#include "MatrixFree.h"
+
+template <class A> class SparseFitter;
 
 namespace astrometry {
 
@@ -42,6 +49,9 @@ namespace astrometry {
     const Match* itsMatch;
     const SubMap* map;
   Detection(): itsMatch(nullptr), map(nullptr), isClipped(false), color(astrometry::NODATA) {}
+    // Made and freed by the million, so allocated from a pool
+    static void* operator new(size_t size) {return ObjectPool<Detection>::allocate(size);}
+    static void operator delete(void* p, size_t size) {ObjectPool<Detection>::deallocate(p, size);}
   };
   
   class Match {
@@ -84,9 +94,11 @@ namespace astrometry {
     // Increment chisq, beta, and alpha for this match.
     // Returned integer is the DOF count.  This *does* remap points being fitted.
     // reuseAlpha=true will skip the incrementing of alpha.
+    // The updater is a SymmetricUpdater for a dense alpha or a BlockUpdater.
+    template <class U>
     int accumulateChisq(double& chisq,
 			DVector& beta,
-			SymmetricUpdater& updater,
+			U& updater,
 			bool reuseAlpha=false);
    
     // sigmaClip returns true if clipped, 
@@ -113,17 +125,50 @@ namespace astrometry {
 
   // Class that aligns all coordinates
   class CoordAlign {
+  public:
+    // How fitOnce() solves the normal equations
+    enum Solver {Dense,		// Cholesky of dense alpha
+		 Sparse,	// Sparse Cholesky of block-sparse alpha
+		 Schur,		// Block-sparse alpha, eliminating exposure blocks
+		 ConjugateGradient};	// Never forms alpha
   private:
     list<Match*>& mlist;
     PixelMapCollection& pmc;
     double relativeTolerance;
+    Solver solver;
+    double cgTolerance;		// Relative residual to end conjugate gradients
+    int cgMaxIterations;	// and the most iterations they may take
+    SparseCholesky cholesky;	// Analyses kept between sparse fits
+    SchurComplement schur;
+    // The one that solver chooses for block-sparse alpha
+    BlockSolver& blockSolver() {
+      if (solver==Schur) return schur;
+      return cholesky;
+    }
     set<int> frozenParameters;  // Keep track of degenerate parameters
     map<string, set<int>> frozenMaps; // Which atoms have which params frozen
+    // Accumulate chisq, beta, and (unless reuseAlpha) alpha over the matches
+    template <class U>
+    void accumulate(U& updater, double& chisq, DVector& beta, bool reuseAlpha);
+    // Freeze the parameters flagged as blank in alpha, reporting newly
+    // frozen ones, and return those whose diagonal needs setting.
+    vector<int> freezeBlank(const vector<bool>& blank, DVector& beta);
+    // Print eigenvalues and the parameters of degenerate eigenvectors
+    void reportDegeneracies(DMatrix& alpha);
+    // SparseFitter does the block-sparse and matrix-free fits
+    friend class ::SparseFitter<CoordAlign>;
+    // Maps of block-sparse alpha
+    int nBlockMaps() {return pmc.nFreeMaps();}
+    // Print where parameter j belongs, for error messages
+    void describeParameter(std::ostream& os, int j);
   public:
     CoordAlign(PixelMapCollection& pmc_,
 	       list<Match*>& mlist_): mlist(mlist_),
 				      pmc(pmc_), 
-				      relativeTolerance(0.001)  {}
+				      relativeTolerance(0.001),
+				      solver(Dense),
+				      cgTolerance(1e-6),
+				      cgMaxIterations(1000) {}
 
     void remap();	// Re-map all Detections using current params
     // Fitting routine: returns chisq of previous fit, updates params.
@@ -144,7 +189,14 @@ namespace astrometry {
     void operator()(const DVector& params, double& chisq,
 		    DVector& beta, DMatrix& alpha,
 		    bool reuseAlpha=false);
+    // Same, with block-sparse alpha, which should have nFreeMaps() maps
+    void operator()(const DVector& params, double& chisq,
+		    DVector& beta, BlockSymmetric& alpha,
+		    bool reuseAlpha=false);
     void setRelTolerance(double tol) {relativeTolerance=tol;}
+    void setSolver(Solver s) {solver=s;}
+    void setCGTolerance(double tol) {cgTolerance=tol;}
+    void setCGMaxIterations(int n) {cgMaxIterations=n;}
     // Return count of useful (un-clipped) Matches & Detections.
     // Count either reserved or non-reserved objects, and require minMatches useful
     // Detections for a valid match:
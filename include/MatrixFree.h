@@ -0,0 +1,103 @@
+// Updaters for accumulateChisq() that stand in for the normal matrix alpha
+// without forming it, for solution by conjugate gradients:
+//
+// ProductUpdater adds alpha * x to y as the matches are streamed through
+// it: each rank-one update w v v^T becomes y += w v (v . x).  Memory is
+// only that of x and y, whatever the number of parameters or map pairs.
+//
+// DiagonalUpdater keeps only the diagonal blocks of alpha, one per map,
+// in a BlockSymmetric, e.g. for a block-Jacobi preconditioner.
+//
+// Both can be used by many threads at once.
+
+#ifndef MATRIXFREE_H
+#define MATRIXFREE_H
+
+#include "Std.h"
+#include "LinearAlgebra.h"
+#include "BlockSymmetric.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+class ProductUpdater {
+public:
+  // x must be left unchanged, and y zeroed, before accumulation
+  ProductUpdater(const DVector& x_, DVector& y_, int nLocks_):
+    x(x_), y(y_), nLocks(nLocks_) {
+#ifdef _OPENMP
+    locks.resize(nLocks);
+    for (auto& l : locks) omp_init_lock(&l);
+#endif
+  }
+  ~ProductUpdater() {
+#ifdef _OPENMP
+    for (auto& l : locks) omp_destroy_lock(&l);
+#endif
+  }
+  // y += w * v v^T x for the block of map m starting at parameter i
+  template <class V>
+  void rankOneUpdate(int m, int i, const V& v, double w=1.) {
+    double s = w * dot(v, i);
+    add(m, i, v, s);
+  }
+  // y += w * (v2 v1^T + v1 v2^T) x for the blocks of maps m2, m1
+  template <class V2, class V1>
+  void rankOneUpdate(int m2, int i2, const V2& v2,
+		     int m1, int i1, const V1& v1,
+		     double w=1.) {
+    double s1 = w * dot(v1, i1);
+    double s2 = w * dot(v2, i2);
+    add(m2, i2, v2, s1);
+    add(m1, i1, v1, s2);
+  }
+private:
+  const DVector& x;
+  DVector& y;
+  int nLocks;
+#ifdef _OPENMP
+  vector<omp_lock_t> locks;
+#endif
+  // v . x for the parameters starting at i
+  template <class V>
+  double dot(const V& v, int i) const {
+    double sum = 0.;
+    for (int r=0; r<v.size(); r++) sum += v[r]*x[i+r];
+    return sum;
+  }
+  // y += s * v for the parameters of map m starting at i
+  template <class V>
+  void add(int m, int i, const V& v, double s) {
+#ifdef _OPENMP
+    omp_set_lock(&locks[m % nLocks]);
+#endif
+    for (int r=0; r<v.size(); r++) y[i+r] += s*v[r];
+#ifdef _OPENMP
+    omp_unset_lock(&locks[m % nLocks]);
+#endif
+  }
+  // Hide copying
+  ProductUpdater(const ProductUpdater& rhs) =delete;
+  void operator=(const ProductUpdater& rhs) =delete;
+};
+
+class DiagonalUpdater {
+public:
+  DiagonalUpdater(BlockSymmetric& diag, int nLocks): updater(diag, nLocks) {}
+  template <class V>
+  void rankOneUpdate(int m, int i, const V& v, double w=1.) {
+    updater.rankOneUpdate(m, i, v, w);
+  }
+  // Only updates within one map reach the diagonal blocks
+  template <class V2, class V1>
+  void rankOneUpdate(int m2, int i2, const V2& v2,
+		     int m1, int i1, const V1& v1,
+		     double w=1.) {
+    if (m2==m1) updater.rankOneUpdate(m2, i2, v2, m1, i1, v1, w);
+  }
+private:
+  BlockUpdater updater;
+};
+
+#endif
@@ -0,0 +1,74 @@
+// Pool for objects that are made and freed by the million, like the
+// Detections of the fitting programs.  Objects are carved in order from
+// large slabs instead of each taking a system allocation, and freed ones
+// are kept on a free list for reuse; the slabs are never returned.
+// A class uses the pool through its own operator new and delete:
+//    static void* operator new(size_t size) {return ObjectPool<C>::allocate(size);}
+//    static void operator delete(void* p, size_t size) {ObjectPool<C>::deallocate(p, size);}
+// Safe for use by many threads.
+
+#ifndef OBJECTPOOL_H
+#define OBJECTPOOL_H
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include "Std.h"
+
+template <class T>
+class ObjectPool {
+public:
+  static void* allocate(size_t size) {
+    // Classes derived from T are not pooled
+    if (size != sizeof(T)) return ::operator new(size);
+    return instance().get();
+  }
+  static void deallocate(void* p, size_t size) {
+    if (!p) return;
+    if (size != sizeof(T)) {
+      ::operator delete(p);
+      return;
+    }
+    instance().put(p);
+  }
+private:
+  union Slot {
+    Slot* next;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+  static const size_t SlabSize = 4096;	// Objects per slab
+  std::mutex lock;
+  Slot* freeList;
+  vector<Slot*> slabs;
+
+  ObjectPool(): freeList(nullptr) {}
+  static ObjectPool& instance() {
+    // Never destroyed, so that objects may still be freed during exit
+    static ObjectPool* pool = new ObjectPool;
+    return *pool;
+  }
+  void* get() {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!freeList) {
+      Slot* slab = static_cast<Slot*>(::operator new(SlabSize*sizeof(Slot)));
+      slabs.push_back(slab);
+      // Link the slots so they are handed out in address order
+      for (size_t i=SlabSize; i>0; i--) {
+	slab[i-1].next = freeList;
+	freeList = &slab[i-1];
+      }
+    }
+    Slot* s = freeList;
+    freeList = s->next;
+    return s;
+  }
+  void put(void* p) {
+    std::lock_guard<std::mutex> guard(lock);
+    Slot* s = static_cast<Slot*>(p);
+    s->next = freeList;
+    freeList = s;
+  }
+};
+
+#endif
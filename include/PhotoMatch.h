@@ -10,15 +10,22 @@
 using std::list;
 #include <string>
 #include "Std.h"
+#include "ObjectPool.h"
 #include "LinearAlgebra.h"
 #include "Bounds.h"
 #include "PhotoMapCollection.h"
 #include "SymmetricUpdater.h"
+#include "BlockSymmetric.h"
+#include "SparseCholesky.h"
+#include "SchurComplement.h"
+#include "MatrixFree.h"
 
 #ifdef _OPENMP
 #include <omp.h>
 #endif
 
+template <class A> class SparseFitter;
+
 namespace photometry {
 
   using linalg::SymmetricUpdater;
@@ -40,6 +47,9 @@ namespace photometry {
     const Match* itsMatch;
     const SubMap* map;
     Detection(): itsMatch(nullptr), map(nullptr), isClipped(false) {}
+    // Made and freed by the million, so allocated from a pool
+    static void* operator new(size_t size) {return ObjectPool<Detection>::allocate(size);}
+    static void operator delete(void* p, size_t size) {ObjectPool<Detection>::deallocate(p, size);}
   };
   
   class Match {
@@ -77,9 +87,11 @@ namespace photometry {
     void setReserved(bool b) {isReserved = b;}
 
     // Returned integer is the DOF count
+    // The updater is a SymmetricUpdater for a dense alpha or a BlockUpdater.
+    template <class U>
     int accumulateChisq(double& chisq,
 			DVector& beta,
-			SymmetricUpdater& updater,
+			U& updater,
 			bool reuseAlpha=false);
     // sigmaClip returns true if clipped, and deletes the clipped guy
     // if 2nd arg is true.
@@ -155,9 +167,10 @@ namespace photometry {
     // Recalculate *all* the reference points with current parameters
     void remap();
     // Recalculate the fittable points and increment chisq and fitting vector/matrix
+    template <class U>
     int accumulateChisq(double& chisq,
 			DVector& beta,
-			SymmetricUpdater& updater,
+			U& updater,
 			bool reuseAlpha=false);
     // sigmaClip returns true if clipped one, and only will clip worst one - no recalculation
     bool sigmaClip(double sigThresh);
@@ -193,23 +206,56 @@ namespace photometry {
 
   // Class that fits to make magnitudes agree
   class PhotoAlign {
+  public:
+    // How fitOnce() solves the normal equations
+    enum Solver {Dense,		// Cholesky of dense alpha
+		 Sparse,	// Sparse Cholesky of block-sparse alpha
+		 Schur,		// Block-sparse alpha, eliminating exposure blocks
+		 ConjugateGradient};	// Never forms alpha
   private:
     list<Match*>& mlist;
     PhotoMapCollection& pmc;
     list<PhotoPrior*>& priors;
     double relativeTolerance;
+    Solver solver;
+    double cgTolerance;		// Relative residual to end conjugate gradients
+    int cgMaxIterations;	// and the most iterations they may take
+    SparseCholesky cholesky;	// Analyses kept between sparse fits
+    SchurComplement schur;
+    // The one that solver chooses for block-sparse alpha
+    BlockSolver& blockSolver() {
+      if (solver==Schur) return schur;
+      return cholesky;
+    }
     set<int> frozenParameters;  // Keep track of degenerate parameters
     map<string, set<int>> frozenMaps; // Which atoms have which params frozen
     int nPriorParams;
     int maxMapNumber;
     void countPriorParams();  // Update parameter counts, indices, map numbers for priors
+    // Accumulate chisq, beta, and (unless reuseAlpha) alpha over matches and priors
+    template <class U>
+    void accumulate(U& updater, double& chisq, DVector& beta, bool reuseAlpha);
+    // Freeze the parameters flagged as blank in alpha, reporting newly
+    // frozen ones, and return those whose diagonal needs setting.
+    vector<int> freezeBlank(const vector<bool>& blank, DVector& beta);
+    // Print eigenvalues and the parameters of degenerate eigenvectors
+    void reportDegeneracies(DMatrix& alpha);
+    // SparseFitter does the block-sparse and matrix-free fits
+    friend class ::SparseFitter<PhotoAlign>;
+    // Maps of block-sparse alpha
+    int nBlockMaps() {countPriorParams(); return maxMapNumber;}
+    // Print where parameter j belongs, for error messages
+    void describeParameter(std::ostream& os, int j);
   public:
     PhotoAlign(PhotoMapCollection& pmc_,
 	       list<Match*>& mlist_,
 	       list<PhotoPrior*>& priors_): mlist(mlist_),
 					    pmc(pmc_), 
 					    priors(priors_),
-					    relativeTolerance(0.001)  {countPriorParams();}
+					    relativeTolerance(0.001),
+					    solver(Dense),
+					    cgTolerance(1e-6),
+					    cgMaxIterations(1000) {countPriorParams();}
 
     // Conduct one round of sigma-clipping.  If doReserved=true, 
     // then only clip reserved Matches.  If =false, then
@@ -235,8 +281,17 @@ namespace photometry {
     void operator()(const DVector& params, double& chisq,
 		    DVector& beta, DMatrix& alpha,
 		    bool reuseAlpha=false);
+    // Same, with block-sparse alpha, which should have nMaps() maps
+    void operator()(const DVector& params, double& chisq,
+		    DVector& beta, BlockSymmetric& alpha,
+		    bool reuseAlpha=false);
+    // Number of map numbers used by maps and priors
+    int nMaps() const {return maxMapNumber;}
 
     void setRelTolerance(double tol) {relativeTolerance=tol;}
+    void setSolver(Solver s) {solver=s;}
+    void setCGTolerance(double tol) {cgTolerance=tol;}
+    void setCGMaxIterations(int n) {cgMaxIterations=n;}
     // Return count of useful (un-clipped) Matches & Detections.
     // Count either reserved or non-reserved objects, and require minMatches useful
     // Detections for a valid match:
@@ -0,0 +1,75 @@
+// Solution of BlockSymmetric normal equations by eliminating small,
+// mutually uncoupled parameter blocks - typically the per-exposure maps -
+// through their Schur complement.
+//
+// The analysis picks the blocks to eliminate: in order of increasing degree,
+// a block is eliminated if none of its neighbors has been, and if it does not
+// touch a large part of the graph.  The diagonal block of each eliminated
+// block is then Cholesky-factored on its own, in parallel, and its coupling
+// to its neighbors is folded into a reduced matrix over the remaining
+// ("shared") blocks, e.g. the instrument maps and any exposures that
+// overlap an eliminated one:
+//    S = A_ss - sum_e A_se A_ee^-1 A_es.
+// S is solved with a SparseCholesky, and the eliminated parameters are found
+// by back-substitution.  S keeps the full block numbering, with identity
+// blocks in place of the eliminated ones, so that its analysis can be kept
+// just as for the full matrix.
+
+#ifndef SCHURCOMPLEMENT_H
+#define SCHURCOMPLEMENT_H
+
+#include "Std.h"
+#include "LinearAlgebra.h"
+#include "BlockSymmetric.h"
+#include "SparseCholesky.h"
+
+class SchurComplement: public BlockSolver {
+public:
+  SchurComplement(): nP(0), reduced(0,0), failed(-1) {}
+
+  // Choose the blocks to eliminate for the pattern of alpha, which must
+  // have had completeLayout() called.
+  virtual void analyze(const BlockSymmetric& alpha);
+  // True if alpha has the analyzed layout and no two of the eliminated
+  // blocks are coupled in it.
+  virtual bool covers(const BlockSymmetric& alpha) const;
+
+  // Factor the eliminated blocks of alpha + shift*I and the reduced
+  // matrix.  Returns false if either is not positive definite.
+  virtual bool factorize(const BlockSymmetric& alpha, double shift=0.);
+  virtual int failedParameter() const {return failed;}
+
+  // Replace b with the solution x of alpha * x = b
+  virtual void solve(DVector& b) const;
+
+  int nEliminated() const {return eliminatedBlocks.size();}
+  int nEliminatedParams() const;
+  virtual void report(std::ostream& os) const;
+
+private:
+  // A block coupled to an eliminated block e, holding A_ej (or its transpose)
+  struct Neighbor {
+    int block;
+    const BlockSymmetric::Block* a;
+    bool transposed;	// True if a is stored as A_je
+    double operator()(int r, int c) const {	// A_ej(r,c)
+      return transposed ? (*a)(c,r) : (*a)(r,c);
+    }
+  };
+  int nP;
+  vector<int> start;		// Layout of each block when analyzed
+  vector<int> size;
+  vector<bool> eliminated;
+  vector<int> eliminatedBlocks;
+  // By block number, empty for the shared blocks:
+  vector<vector<Neighbor> > neighbors;	// Neighbors in block order
+  vector<vector<double> > factors;	// Cholesky of A_ee, row-major lower
+  BlockSymmetric reduced;
+  SparseCholesky cholesky;
+  int failed;
+
+  // Find the neighbors of the eliminated blocks in alpha
+  void findNeighbors(const BlockSymmetric& alpha);
+};
+
+#endif
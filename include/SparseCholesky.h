@@ -0,0 +1,79 @@
+// Sparse supernodal Cholesky factorization of a BlockSymmetric matrix.
+//
+// The analysis works on the graph of map blocks: blocks are ordered by
+// minimum degree (with blocks of very high degree, such as the instrument
+// maps that touch most exposures, set aside and ordered last), the
+// elimination tree is postordered, and consecutive blocks with nested
+// structure are merged into supernodes.  Each supernode keeps a dense
+// panel of L: its own columns, with the rows of the diagonal square
+// followed by the rows of the blocks below it that it fills.
+//
+// The analysis depends only on the block pattern, so it can be kept and
+// used for later matrices whose blocks it covers, e.g. on each Newton
+// iteration or after sigma clipping, calling factorize() alone.  The
+// numerical factorization runs the supernodes of each level of the
+// elimination tree in parallel with OpenMP.
+
+#ifndef SPARSECHOLESKY_H
+#define SPARSECHOLESKY_H
+
+#include "Std.h"
+#include "LinearAlgebra.h"
+#include "BlockSymmetric.h"
+
+class SparseCholesky: public BlockSolver {
+public:
+  SparseCholesky(): nP(0), failed(-1) {}
+
+  // Order and find the structure of L for the pattern of alpha, which must
+  // have had completeLayout() called.
+  virtual void analyze(const BlockSymmetric& alpha);
+  // True if analyze() has been done for alpha's layout and every block
+  // stored in alpha falls within the analyzed structure.
+  virtual bool covers(const BlockSymmetric& alpha) const;
+
+  // Factor alpha + shift*I.  Returns false if the matrix is not positive
+  // definite, in which case failedParameter() gives the parameter whose
+  // pivot failed.
+  virtual bool factorize(const BlockSymmetric& alpha, double shift=0.);
+  virtual int failedParameter() const {return failed;}
+
+  // Replace b with the solution x of alpha * x = b
+  virtual void solve(DVector& b) const;
+
+  // Size of the analysis
+  int nSupernodes() const {return snodes.size();}
+  long nonZeros() const;	// elements of L stored
+  virtual void report(std::ostream& os) const;
+
+private:
+  struct Supernode {
+    int firstPos;		// Range of block positions in the order
+    int endPos;
+    int width;			// Number of columns (parameters)
+    int nRows;			// Rows of the panel
+    vector<int> rowBlocks;	// Blocks below the diagonal, by position
+    vector<int> rowPos;		// Their positions
+    vector<int> rowOffset;	// Their first rows in the panel
+    vector<int> rowParams;	// Parameter index of each panel row
+    vector<int> updaters;	// Descendant supernodes with rows in this one
+    int parent;			// -1 for a root
+  };
+  int nP;
+  vector<int> start;		// Layout of each block when analyzed
+  vector<int> size;
+  vector<int> pos;		// Position of each block in the order (-1 if empty)
+  vector<int> snodeOfBlock;
+  vector<int> colOffset;	// Column of each block within its supernode
+  vector<Supernode> snodes;	// In order of elimination
+  vector<vector<int> > levels;	// Supernodes that can be factored together
+  vector<vector<double> > panels;	// Column-major, nRows x width
+  int failed;
+
+  // Panel row of the first row of block b in supernode s, or -1
+  int rowOf(const Supernode& s, int sIndex, int b) const;
+  // Subtract the contributions of descendant d from supernode s
+  void update(int s, int d, vector<double>& scratch, vector<int>& target);
+};
+
+#endif
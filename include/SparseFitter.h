@@ -0,0 +1,378 @@
+// Fitting with block-sparse normal equations, shared by CoordAlign and
+// PhotoAlign, whose fitOnce() hands its work here for every solver but
+// the dense one:
+//
+// fitSparse() takes Newton steps with a fixed alpha factored by the align
+// class's BlockSolver (sparse Cholesky or Schur complement), then damped
+// (Marquardt) steps refactoring alpha + lambda*I with the same analysis.
+//
+// fitMatrixFree() never forms alpha.  Each step is solved by conjugate
+// gradients, with alpha * x streamed over the matches and the factored
+// diagonal blocks of alpha as preconditioner.  A solution cut short at
+// cgMaxIterations is still a descent direction, so it is taken as the step
+// and left to the chisq test like any other.
+//
+// The align class A makes SparseFitter<A> a friend.  Besides its fitting
+// interface (getParams, setParams, nParams, remap, chisqDOF, and operator()
+// with BlockSymmetric alpha) it provides
+//   accumulate(), freezeBlank(), reportDegeneracies(), blockSolver(),
+//   relativeTolerance, cgTolerance and cgMaxIterations,
+//   int nBlockMaps(): the number of maps of its block-sparse alpha, and
+//   void describeParameter(ostream& os, int j): where parameter j belongs.
+
+#ifndef SPARSEFITTER_H
+#define SPARSEFITTER_H
+
+#include "Std.h"
+#include "LinearAlgebra.h"
+#include "BlockSymmetric.h"
+#include "MatrixFree.h"
+#include "Stopwatch.h"
+#include "Marquardt.h"
+
+template <class A>
+class SparseFitter {
+public:
+  explicit SparseFitter(A& align_): align(align_) {}
+  // fitOnce() with block-sparse alpha
+  double fitSparse(bool reportToCerr);
+  // fitOnce() by conjugate gradients, without forming alpha
+  double fitMatrixFree(bool reportToCerr);
+private:
+  A& align;
+  // Scale alpha to unit diagonal, saving the scale factors in ss, and
+  // factor it, reporting degeneracies and exiting if it is not pos-def
+  void factorSparse(BlockSymmetric& alpha, DVector& ss, bool reportToCerr);
+  // Get chisq, beta and the diagonal blocks of alpha at params, returning
+  // the frozen parameters
+  vector<int> accumulateDiagonal(const DVector& params, double& chisq,
+				 DVector& beta, BlockSymmetric& diag);
+  // y = alpha * x at the current parameters, streaming over the matches.
+  // The frozen parameters have rows of the identity.
+  void multiply(const DVector& x, DVector& y, const vector<int>& frozen);
+  // Solve (alpha + lambda*diag(alpha)) x = b by conjugate gradients,
+  // preconditioned by the factored diagonal blocks of alpha (scaled by
+  // ss to unit diagonal, as factorSparse() leaves them).  Returns false if
+  // alpha is found not positive definite.  nIter and residual (relative
+  // to b) are where the iterations stopped, which is short of cgTolerance
+  // if they reached cgMaxIterations.
+  bool solveCG(const DVector& b, const DVector& ss, double lambda,
+	       const vector<int>& frozen, DVector& x,
+	       int& nIter, double& residual);
+  static double dotProduct(const DVector& a, const DVector& b) {
+    double sum = 0.;
+    for (int i=0; i<a.size(); i++) sum += a[i]*b[i];
+    return sum;
+  }
+};
+
+template <class A>
+void
+SparseFitter<A>::factorSparse(BlockSymmetric& alpha, DVector& ss, bool reportToCerr) {
+  // Precondition alpha to unit diagonal
+  int N = alpha.nParams();
+  for (int i=0; i<N; i++) {
+    double d = alpha.diagonal(i);
+    if (d<0.) {
+      cerr << "Negative alpha diagonal " << d
+	   << " at " << i << endl;
+      exit(1);
+    }
+    ss[i] = d > 0. ? 1./sqrt(d) : 1.;
+  }
+  alpha.scale(ss);
+
+  // The ordering and structure found for an earlier alpha serve as long as
+  // no new map pairs have appeared.
+  if (!align.blockSolver().covers(alpha)) {
+    Stopwatch timer;
+    timer.start();
+    align.blockSolver().analyze(alpha);
+    timer.stop();
+    if (reportToCerr) {
+      cerr << "..sparse analysis: ";
+      align.blockSolver().report(cerr);
+      cerr << " in time " << timer << endl;
+    }
+  }
+  if (!align.blockSolver().factorize(alpha)) {
+    int j = align.blockSolver().failedParameter();
+    cerr << "Sparse factorization failed at parameter " << j;
+    align.describeParameter(cerr, j);
+    cerr << endl;
+    // Describe degeneracies as the dense solver does, if alpha is not too big
+    const int MaxDiagnosticParams = 10000;
+    if (N <= MaxDiagnosticParams) {
+      DMatrix dense(N,N);
+      alpha.toDense(dense);
+      align.reportDegeneracies(dense);
+    } else {
+      cerr << "Too many parameters to describe degeneracies" << endl;
+    }
+    exit(1);
+  }
+}
+
+template <class A>
+double
+SparseFitter<A>::fitSparse(bool reportToCerr) {
+  int nMaps = align.nBlockMaps();
+  DVector p = align.getParams();
+  int nP = p.size();
+  DVector beta(nP, 0.);
+  DVector ss(nP, 1.);  // Values to scale parameters by
+  BlockSymmetric alpha(nP, nMaps);
+  double oldChisq = 0.;
+
+  // First will try doing Newton iterations, keeping a fixed Hessian.
+  Stopwatch timer;
+  timer.start();
+  align(p, oldChisq, beta, alpha);
+  timer.stop();
+  if (reportToCerr) cerr << "..fitOnce alpha time " << timer << endl;
+  timer.reset();
+  timer.start();
+  factorSparse(alpha, ss, reportToCerr);
+
+  const int MAX_NEWTON_STEPS = 8;
+  for (int newtonIter = 0; newtonIter < MAX_NEWTON_STEPS; newtonIter++) {
+    beta = ElemProd(beta,ss);
+    align.blockSolver().solve(beta);
+    beta = ElemProd(beta,ss);
+
+    timer.stop();
+    if (reportToCerr) cerr << "..solution time " << timer << endl;
+    timer.reset();
+    timer.start();
+    DVector newP = p + beta;
+    align.setParams(newP);
+    // Get chisq at the new parameters
+    align.remap();
+    int dof;
+    double maxDev;
+    double newChisq = align.chisqDOF(dof, maxDev);
+    timer.stop();
+    cerr << "....Newton iteration #" << newtonIter << " chisq " << newChisq
+	 << " / " << dof
+	 << " in time " << timer << " sec"
+	 << endl;
+    timer.reset();
+    timer.start();
+
+    // Give up on Newton if chisq went up non-trivially
+    if (newChisq > oldChisq * 1.0001) break;
+    else if ((oldChisq - newChisq) < oldChisq * align.relativeTolerance) {
+      // Newton has converged, so we're done.
+      return newChisq;
+    }
+    // Want another Newton iteration, but keep alpha as before
+    p = newP;
+    align(p, oldChisq, beta, alpha, true);
+  }
+
+  // Newton is going backwards or nowhere, so take damped (Marquardt) steps,
+  // refactoring alpha + lambda*I with the same sparse analysis.
+  align.setParams(p);
+  align(p, oldChisq, beta, alpha);
+  factorSparse(alpha, ss, reportToCerr);
+  double lambda = 0.001;
+  const double MaxLambda = 1e10;
+  for (int iter=0; iter<DefaultMaxIterations && lambda < MaxLambda; iter++) {
+    if (!align.blockSolver().factorize(alpha, lambda)) {
+      lambda *= 10.;
+      continue;
+    }
+    DVector step = ElemProd(beta,ss);
+    align.blockSolver().solve(step);
+    step = ElemProd(step,ss);
+    DVector newP = p + step;
+    align.setParams(newP);
+    align.remap();
+    int dof;
+    double maxDev;
+    double newChisq = align.chisqDOF(dof, maxDev);
+    if (reportToCerr)
+      cerr << "....Marquardt iteration #" << iter << " lambda " << lambda
+	   << " chisq " << newChisq << " / " << dof << endl;
+    if (newChisq < oldChisq) {
+      p = newP;
+      if ((oldChisq - newChisq) < oldChisq * align.relativeTolerance)
+	return newChisq;
+      lambda *= 0.1;
+      align(p, oldChisq, beta, alpha);
+      factorSparse(alpha, ss, reportToCerr);
+    } else {
+      lambda *= 10.;
+    }
+  }
+  // No further progress possible
+  align.setParams(p);
+  align.remap();
+  int dof;
+  double maxDev;
+  return align.chisqDOF(dof, maxDev);
+}
+
+template <class A>
+vector<int>
+SparseFitter<A>::accumulateDiagonal(const DVector& p, double& chisq,
+				    DVector& beta, BlockSymmetric& diag) {
+  // (nBlockMaps() first, as it may update the parameter count)
+  int nMaps = align.nBlockMaps();
+  Assert(diag.nMaps()==nMaps);
+  int nP = align.nParams();
+  Assert(p.size()==nP);
+  Assert(beta.size()==nP);
+  align.setParams(p);
+  beta.setZero();
+  diag.setZero();
+
+  const int NumberOfLocks = 2000;
+  DiagonalUpdater updater(diag, NumberOfLocks);
+  align.accumulate(updater, chisq, beta, false);
+
+  // A parameter whose diagonal block row is empty is unconstrained
+  diag.completeLayout();
+  vector<int> frozen = align.freezeBlank(diag.emptyParameters(), beta);
+  for (int i : frozen)
+    diag.setDiagonal(i, 1.);
+  return frozen;
+}
+
+template <class A>
+void
+SparseFitter<A>::multiply(const DVector& x, DVector& y, const vector<int>& frozen) {
+  DVector xFree(x);
+  for (int i : frozen) xFree[i] = 0.;
+  y.setZero();
+  // The pass also makes chisq and beta, which are not needed here
+  double chisq = 0.;
+  DVector beta(x.size(), 0.);
+  const int NumberOfLocks = 2000;
+  ProductUpdater updater(xFree, y, NumberOfLocks);
+  align.accumulate(updater, chisq, beta, false);
+  for (int i : frozen) y[i] = x[i];
+}
+
+template <class A>
+bool
+SparseFitter<A>::solveCG(const DVector& b, const DVector& ss, double lambda,
+			 const vector<int>& frozen, DVector& x,
+			 int& nIter, double& residual) {
+  int nP = b.size();
+  x = DVector(nP, 0.);
+  DVector r(b);
+  DVector q(nP, 0.);
+  // Preconditioned residual
+  DVector z = ElemProd(r,ss);
+  align.blockSolver().solve(z);
+  z = ElemProd(z,ss);
+  DVector d(z);
+  double rz = dotProduct(r,z);
+  double bNorm = sqrt(dotProduct(b,b));
+  double rNorm = bNorm;
+  bool positive = true;
+  for (nIter = 0; nIter<align.cgMaxIterations && rNorm > align.cgTolerance*bNorm; nIter++) {
+    multiply(d, q, frozen);
+    if (lambda > 0.)
+      for (int i=0; i<nP; i++) q[i] += lambda * d[i] / (ss[i]*ss[i]);
+    double dq = dotProduct(d,q);
+    if (!(dq > 0.)) {
+      positive = false;
+      break;
+    }
+    double step = rz / dq;
+    x += step*d;
+    r -= step*q;
+    rNorm = sqrt(dotProduct(r,r));
+    z = ElemProd(r,ss);
+    align.blockSolver().solve(z);
+    z = ElemProd(z,ss);
+    double rzNew = dotProduct(r,z);
+    d = z + (rzNew/rz)*d;
+    rz = rzNew;
+  }
+  residual = bNorm > 0. ? rNorm/bNorm : 0.;
+  return positive;
+}
+
+template <class A>
+double
+SparseFitter<A>::fitMatrixFree(bool reportToCerr) {
+  int nMaps = align.nBlockMaps();
+  DVector p = align.getParams();
+  int nP = p.size();
+  DVector beta(nP, 0.);
+  DVector ss(nP, 1.);  // Values to scale parameters by
+  BlockSymmetric diag(nP, nMaps);
+  vector<int> frozen;
+  double oldChisq = 0.;
+
+  // Alpha is not kept, so each step is made with alpha at the current
+  // parameters: Gauss-Newton steps until one fails to lower chisq, then
+  // damped (Marquardt) steps.
+  double lambda = 0.;
+  const double MaxLambda = 1e10;
+  bool newParams = true;
+  Stopwatch timer;
+  for (int iter=0; iter<DefaultMaxIterations && lambda < MaxLambda; iter++) {
+    timer.reset();
+    timer.start();
+    align.setParams(p);
+    if (newParams) {
+      frozen = accumulateDiagonal(p, oldChisq, beta, diag);
+      factorSparse(diag, ss, reportToCerr);
+      newParams = false;
+    }
+    if (lambda > 0. && !align.blockSolver().factorize(diag, lambda)) {
+      lambda *= 10.;
+      continue;
+    }
+    DVector step;
+    int cgIter;
+    double cgResidual;
+    if (!solveCG(beta, ss, lambda, frozen, step, cgIter, cgResidual)) {
+      // Damping makes alpha + lambda*diag(alpha) positive definite
+      cerr << "WARNING: conjugate gradients found alpha not positive definite"
+	   << " at lambda " << lambda << endl;
+      lambda = lambda > 0. ? lambda*10. : 0.001;
+      continue;
+    }
+    if (cgIter >= align.cgMaxIterations)
+      cerr << "WARNING: conjugate gradients stopped at residual " << cgResidual
+	   << " after " << cgIter << " iterations" << endl;
+    DVector newP = p + step;
+    align.setParams(newP);
+    align.remap();
+    int dof;
+    double maxDev;
+    double newChisq = align.chisqDOF(dof, maxDev);
+    timer.stop();
+    cerr << "....CG iteration #" << iter << " lambda " << lambda
+	 << " chisq " << newChisq << " / " << dof
+	 << " after " << cgIter << " CG steps to residual " << cgResidual
+	 << " in time " << timer << " sec"
+	 << endl;
+    // At the minimum a step leaves chisq unchanged, or raises it by a hair
+    // for an inexact solution, so take that as convergence as the Newton
+    // iterations do.
+    if (newChisq <= oldChisq * 1.0001
+	&& (oldChisq - newChisq) < oldChisq * align.relativeTolerance)
+      return newChisq;
+    if (newChisq < oldChisq) {
+      p = newP;
+      lambda *= 0.1;
+      newParams = true;
+    } else {
+      lambda = lambda > 0. ? lambda*10. : 0.001;
+    }
+  }
+  // No further progress possible
+  align.setParams(p);
+  align.remap();
+  int dof;
+  double maxDev;
+  return align.chisqDOF(dof, maxDev);
+}
+
+#endif
@@ -0,0 +1,71 @@
+// Sparse accumulator for the derivatives of a match's mean with respect to
+// the parameters of the maps its detections use.  Only the parameter
+// blocks of the maps that are touched are held, so the work per match
+// scales with the blocks it touches rather than with the total number of
+// parameters.  An instance is meant to be kept by each thread and cleared
+// for each match, so that its storage is reused.
+// V is the vector class, e.g. DVector.
+
+#ifndef TOUCHEDMAPS_H
+#define TOUCHEDMAPS_H
+
+#include <algorithm>
+#include "Std.h"
+
+template <class V>
+class TouchedMaps {
+public:
+  // Hold nVectors vectors (e.g. one per coordinate) for each map
+  explicit TouchedMaps(int nVectors_=1): nVectors(nVectors_) {}
+  // Forget all maps touched, as at the start of a match
+  void clear() {
+    for (auto& b : blocks) slotOfMap[b.mapNumber] = -1;
+    blocks.clear();
+  }
+  // The slot of a map's parameter block, whose vectors are zeroed when the
+  // map is first touched.
+  int touch(int mapNumber, int startIndex, int nParams) {
+    if (mapNumber >= slotOfMap.size()) slotOfMap.resize(mapNumber+1, -1);
+    int slot = slotOfMap[mapNumber];
+    if (slot >= 0) return slot;
+    slot = blocks.size();
+    slotOfMap[mapNumber] = slot;
+    blocks.push_back(Block(mapNumber, startIndex, nParams));
+    if (vectors.size() < nVectors*blocks.size())
+      vectors.resize(nVectors*blocks.size());
+    for (int k=0; k<nVectors; k++) {
+      V& v = vectors[nVectors*slot + k];
+      if (v.size() != nParams) v.resize(nParams);
+      v.setZero();
+    }
+    return slot;
+  }
+  int size() const {return blocks.size();}
+  int mapNumber(int slot) const {return blocks[slot].mapNumber;}
+  int startIndex(int slot) const {return blocks[slot].startIndex;}
+  int nParams(int slot) const {return blocks[slot].nParams;}
+  V& block(int slot, int k=0) {return vectors[nVectors*slot + k];}
+  // The slots in order of map number
+  const std::vector<int>& byMapNumber() {
+    order.resize(blocks.size());
+    for (int i=0; i<order.size(); i++) order[i] = i;
+    std::sort(order.begin(), order.end(),
+	      [this](int lhs, int rhs)
+	      {return blocks[lhs].mapNumber < blocks[rhs].mapNumber;});
+    return order;
+  }
+private:
+  struct Block {
+    Block(int m, int i, int n): mapNumber(m), startIndex(i), nParams(n) {}
+    int mapNumber;
+    int startIndex;
+    int nParams;
+  };
+  int nVectors;
+  std::vector<int> slotOfMap;	// -1 for maps not touched
+  std::vector<Block> blocks;	// in order of first touch
+  std::vector<V> vectors;	// nVectors for each slot; kept between matches
+  std::vector<int> order;
+};
+
+#endif
@@ -0,0 +1,53 @@
+// Cache of deserialized starting WCS's, shared by the threads reading extensions.
+// Many extensions carry identical WCS specifications (e.g. one per exposure),
+// so each distinct specification is parsed only once and every caller gets
+// its own clone, which it owns and may reproject freely.
+#ifndef WCSCACHE_H
+#define WCSCACHE_H
+
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include "Std.h"
+#include "Wcs.h"
+#include "PixelMapCollection.h"
+
+class WcsCache {
+public:
+  WcsCache() {}
+  ~WcsCache();
+
+  // All of these return a new Wcs owned by the caller, or 0 if the
+  // specification could not be parsed.  Failures are not cached.
+
+  // The first Wcs in a serialized (YAML) PixelMapCollection
+  astrometry::Wcs* serialized(const string& yaml);
+  // A FITS TPV header, as in the WCSIN column of WCSFoF input
+  astrometry::Wcs* tpv(const string& header);
+  // The Wcs of the given name in a serialized PixelMapCollection file
+  astrometry::Wcs* fromFile(const string& pmcFile, const string& wcsName);
+
+  // Number of distinct WCS's parsed so far
+  long size() const;
+
+private:
+  // Hide copying
+  WcsCache(const WcsCache& rhs) =delete;
+  void operator=(const WcsCache& rhs) =delete;
+
+  // Parsed prototypes keyed by the (hashed) content of their specification
+  std::unordered_map<string, astrometry::Wcs*> yamlWcs;
+  std::unordered_map<string, astrometry::Wcs*> tpvWcs;
+  // Prototypes read from files, keyed by (file, wcs name)
+  std::map<std::pair<string,string>, astrometry::Wcs*> fileWcs;
+  // Collections read from files, kept for further lookups
+  std::map<string, astrometry::PixelMapCollection*> filePmcs;
+
+  // Returns the stored prototype if another thread inserted one first
+  typedef std::unordered_map<string, astrometry::Wcs*> ContentMap;
+  astrometry::Wcs* insert(ContentMap& m, const string& key, astrometry::Wcs* w);
+  mutable std::mutex lock;	// Guards all of the maps
+  std::mutex fileLock;		// Serializes reading of PMC files
+};
+
+#endif
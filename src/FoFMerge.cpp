@@ -0,0 +1,287 @@
+// Program to join the outputs of WCSFoF runs on separate shards of the fields
+// into a single catalog.
+
+#include "Std.h"
+#include "FitsTable.h"
+#include "StringStuff.h"
+#include "Bounds.h"
+#include <map>
+#include <set>
+
+#include "FitSubroutines.h"
+
+using namespace std;
+using namespace img;
+using namespace FITS;
+using stringstuff::stripWhite;
+
+string usage=
+  "Join the WCSFoF outputs of separate field shards into one catalog\n"
+  "FoFMerge <outfile> <shardfile> [shardfile...]\n"
+  "      <outfile>: FITS file to hold the merged catalog\n"
+  "      <shardfile>: output of WCSFoF run with the fields or shardIndex/shardCount\n"
+  "          parameters.  All shards must come from the same configuration, and\n"
+  "          each field must have been matched by at most one of them.";
+
+// Quit unless column of two tables has the same values
+template <class T>
+void
+checkColumn(const FTable& lhs, const FTable& rhs, const string& column,
+	    const string& table, const string& file) {
+  vector<T> lv;
+  vector<T> rv;
+  lhs.readCells(lv, column);
+  rhs.readCells(rv, column);
+  if (lv != rv) {
+    cerr << "Column " << column << " of " << table << " table in " << file
+	 << " does not agree with the first shard" << endl;
+    exit(1);
+  }
+}
+
+int
+main(int argc,
+     char *argv[])
+{
+  if (argc < 3) {
+    cerr << usage << endl;
+    exit(1);
+  }
+  string outCatalogName = argv[1];
+  vector<string> shards;
+  for (int i=2; i<argc; i++)
+    shards.push_back(argv[i]);
+
+  try {
+    ////////////////////////////////////////////////
+    // Fields must agree, and each is owned by the shard that matched it
+    ////////////////////////////////////////////////
+    FTable fieldTable = FitsTable(shards[0], FITS::ReadOnly, "Fields").extract();
+    vector<int> owner(fieldTable.nrows(), -1);
+    for (int s=0; s<shards.size(); s++) {
+      FTable ft = FitsTable(shards[s], FITS::ReadOnly, "Fields").extract();
+      if (ft.nrows() != fieldTable.nrows()) {
+	cerr << "Number of fields in " << shards[s] << " differs from the first shard" << endl;
+	exit(1);
+      }
+      checkColumn<string>(fieldTable, ft, "NAME", "Fields", shards[s]);
+      checkColumn<double>(fieldTable, ft, "RA", "Fields", shards[s]);
+      checkColumn<double>(fieldTable, ft, "DEC", "Fields", shards[s]);
+      checkColumn<double>(fieldTable, ft, "RADIUS", "Fields", shards[s]);
+      vector<bool> matched(ft.nrows(), true);
+      try {
+	ft.readCells(matched, "Matched");
+      } catch (FTableError& m) {
+	// An unsharded run matched every field
+      }
+      for (int i=0; i<matched.size(); i++) {
+	if (!matched[i]) continue;
+	if (owner[i] >= 0) {
+	  string name;
+	  ft.readCell(name, "NAME", i);
+	  cerr << "Field " << name << " was matched in both " << shards[owner[i]]
+	       << " and " << shards[s] << endl;
+	  exit(1);
+	}
+	owner[i] = s;
+      }
+    }
+    for (int i=0; i<owner.size(); i++)
+      if (owner[i] < 0) {
+	string name;
+	fieldTable.readCell(name, "NAME", i);
+	cerr << "WARNING: field " << name << " was not matched by any shard" << endl;
+      }
+    try {
+      fieldTable.eraseColumn("Matched");
+    } catch (FTableError& m) {
+      // Nothing to erase
+    }
+    {
+      FitsTable ft(outCatalogName, FITS::ReadWrite + FITS::OverwriteFile, "Fields");
+      ft.copy(fieldTable);
+    }
+
+    ////////////////////////////////////////////////
+    // Exposures must agree
+    ////////////////////////////////////////////////
+    FTable exposureTable = FitsTable(shards[0], FITS::ReadOnly, "Exposures").extract();
+    for (int s=1; s<shards.size(); s++) {
+      FTable ft = FitsTable(shards[s], FITS::ReadOnly, "Exposures").extract();
+      if (ft.nrows() != exposureTable.nrows()) {
+	cerr << "Number of exposures in " << shards[s] << " differs from the first shard" << endl;
+	exit(1);
+      }
+      checkColumn<string>(exposureTable, ft, "Name", "Exposures", shards[s]);
+      checkColumn<int>(exposureTable, ft, "FieldNumber", "Exposures", shards[s]);
+      checkColumn<int>(exposureTable, ft, "InstrumentNumber", "Exposures", shards[s]);
+    }
+    {
+      FitsTable ft(outCatalogName, FITS::ReadWrite + FITS::Create, "Exposures");
+      ft.copy(exposureTable);
+    }
+
+    ////////////////////////////////////////////////
+    // Instruments must agree; device bounds are the union of the shards'
+    ////////////////////////////////////////////////
+    vector<vector<int> > instrumentHDUs(shards.size());
+    vector<vector<int> > catalogHDUs(shards.size());
+    for (int s=0; s<shards.size(); s++)
+      inventoryFitsTables(shards[s], instrumentHDUs[s], catalogHDUs[s]);
+
+    // Instrument tables of the first shard, by number
+    map<int, FTable> instrumentTables;
+    map<int, vector<Bounds<double> > > deviceBounds;
+    for (int s=0; s<shards.size(); s++) {
+      if (instrumentHDUs[s].size() != instrumentHDUs[0].size()) {
+	cerr << "Number of instruments in " << shards[s] << " differs from the first shard" << endl;
+	exit(1);
+      }
+      for (auto hdu : instrumentHDUs[s]) {
+	FTable ft = FitsTable(shards[s], FITS::ReadOnly, hdu).extract();
+	int instrumentNumber;
+	string instrumentName;
+	if (!ft.header()->getValue("Number", instrumentNumber)
+	    || !ft.header()->getValue("Name", instrumentName)) {
+	  cerr << "Could not read name and/or number of instrument at extension "
+	       << hdu << " of " << shards[s] << endl;
+	  exit(1);
+	}
+	if (s==0) {
+	  instrumentTables[instrumentNumber] = ft;
+	  deviceBounds[instrumentNumber].resize(ft.nrows());
+	} else {
+	  string firstName;
+	  if (instrumentTables.count(instrumentNumber)==0
+	      || !instrumentTables[instrumentNumber].header()->getValue("Name", firstName)
+	      || firstName != instrumentName
+	      || instrumentTables[instrumentNumber].nrows() != ft.nrows()) {
+	    cerr << "Instrument " << instrumentNumber << " of " << shards[s]
+		 << " does not agree with the first shard" << endl;
+	    exit(1);
+	  }
+	  checkColumn<string>(instrumentTables[instrumentNumber], ft, "Name",
+			      "Instrument " + instrumentName, shards[s]);
+	}
+	vector<Bounds<double> >& bounds = deviceBounds[instrumentNumber];
+	for (int i=0; i<ft.nrows(); i++) {
+	  double xmin, xmax, ymin, ymax;
+	  ft.readCell(xmin,"XMin",i);
+	  ft.readCell(xmax,"XMax",i);
+	  ft.readCell(ymin,"YMin",i);
+	  ft.readCell(ymax,"YMax",i);
+	  // All zeros means no detections were seen on the device
+	  if (xmin!=0. || xmax!=0. || ymin!=0. || ymax!=0.) {
+	    bounds[i] += Position<double>(xmin, ymin);
+	    bounds[i] += Position<double>(xmax, ymax);
+	  }
+	}
+      }
+    }
+    for (auto& i : instrumentTables) {
+      const vector<Bounds<double> >& bounds = deviceBounds[i.first];
+      int nDevices = bounds.size();
+      vector<double> vxmin(nDevices, 0.);
+      vector<double> vxmax(nDevices, 0.);
+      vector<double> vymin(nDevices, 0.);
+      vector<double> vymax(nDevices, 0.);
+      for (int j=0; j<nDevices; j++) {
+	if (!bounds[j].isDefined()) continue;
+	vxmin[j] = bounds[j].getXMin();
+	vxmax[j] = bounds[j].getXMax();
+	vymin[j] = bounds[j].getYMin();
+	vymax[j] = bounds[j].getYMax();
+      }
+      i.second.writeCells(vxmin, "XMin");
+      i.second.writeCells(vxmax, "XMax");
+      i.second.writeCells(vymin, "YMin");
+      i.second.writeCells(vymax, "YMax");
+
+      FitsTable ft(outCatalogName, FITS::ReadWrite + FITS::Create, -1);
+      ft.setName("Instrument");
+      ft.setVersion(i.first+1);
+      ft.copy(i.second);
+    }
+
+    ////////////////////////////////////////////////
+    // Extensions must agree; each takes its WCSIN from the shard that read it
+    ////////////////////////////////////////////////
+    FTable extensionTable = FitsTable(shards[0], FITS::ReadOnly, "Extensions").extract();
+    vector<int> exposureField;
+    exposureTable.readCells(exposureField, "FieldNumber");
+    for (int s=1; s<shards.size(); s++) {
+      FTable ft = FitsTable(shards[s], FITS::ReadOnly, "Extensions").extract();
+      if (ft.nrows() != extensionTable.nrows()) {
+	cerr << "Number of extensions in " << shards[s] << " differs from the first shard" << endl;
+	exit(1);
+      }
+      checkColumn<string>(extensionTable, ft, "FILENAME", "Extensions", shards[s]);
+      checkColumn<int>(extensionTable, ft, "EXTENSION", "Extensions", shards[s]);
+      checkColumn<int>(extensionTable, ft, "Exposure", "Extensions", shards[s]);
+      checkColumn<int>(extensionTable, ft, "Device", "Extensions", shards[s]);
+      for (long i=0; i<ft.nrows(); i++) {
+	int iExposure;
+	ft.readCell(iExposure, "Exposure", i);
+	if (iExposure < 0 || iExposure >= exposureField.size()) continue;
+	int iField = exposureField[iExposure];
+	if (iField < 0 || iField >= owner.size() || owner[iField]!=s) continue;
+	string wcsin;
+	ft.readCell(wcsin, "WCSIN", i);
+	extensionTable.writeCell(wcsin, "WCSIN", i);
+      }
+    }
+    {
+      FitsTable ft(outCatalogName, FITS::ReadWrite + FITS::Create, "Extensions");
+      ft.copy(extensionTable);
+    }
+
+    ////////////////////////////////////////////////
+    // Match catalogs are copied from the shard owning their field
+    ////////////////////////////////////////////////
+    set<std::pair<int,string> > catalogs;
+    long matchCount = 0;
+    long pointCount = 0;
+    for (int s=0; s<shards.size(); s++) {
+      for (auto hdu : catalogHDUs[s]) {
+	FTable ft = FitsTable(shards[s], FITS::ReadOnly, hdu).extract();
+	int iField;
+	string affinity;
+	if (!ft.header()->getValue("FieldNum", iField)
+	    || !ft.header()->getValue("Affinity", affinity)) {
+	  cerr << "Missing FieldNum or Affinity in extension " << hdu
+	       << " of " << shards[s] << endl;
+	  exit(1);
+	}
+	stripWhite(affinity);
+	if (iField < 0 || iField >= owner.size() || owner[iField]!=s) {
+	  cerr << "MatchCatalog at extension " << hdu << " of " << shards[s]
+	       << " is for a field that this shard did not match" << endl;
+	  exit(1);
+	}
+	if (!catalogs.insert(std::make_pair(iField, affinity)).second) {
+	  cerr << "Duplicate MatchCatalog for field " << iField
+	       << " affinity " << affinity << " in " << shards[s] << endl;
+	  exit(1);
+	}
+	vector<int> sequence;
+	ft.readCells(sequence, "SequenceNumber");
+	for (auto seq : sequence)
+	  if (seq==0) ++matchCount;
+	pointCount += sequence.size();
+
+	FitsTable out(outCatalogName, FITS::ReadWrite + FITS::Create, -1);
+	out.setName("MatchCatalog");
+	out.copy(ft);
+      }
+    }
+
+    cerr << "Merged " << shards.size() << " shards with " << catalogs.size()
+	 << " match catalogs, " << matchCount
+	 << " matches and " << pointCount
+	 << " points." << endl;
+
+  } catch (std::runtime_error &m) {
+    quit(m,1);
+  }
+  exit(0);
+}
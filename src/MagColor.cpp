@@ -19,6 +19,11 @@
 #include "FitsImage.h"
 
 #include "FitSubroutines.h"
+#include "CatalogReader.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using namespace std;
 using namespace stringstuff;
@@ -117,6 +122,8 @@ main(int argc, char *argv[])
   string wcsFiles;
   string photoFiles;
   string skipFile;
+  int catalogThreads;
+  string detectionStore;
   Pset parameters;
   {
     const int def=PsetMember::hasDefault;
@@ -143,6 +150,10 @@ main(int argc, char *argv[])
 			 "files holding WCS maps to override starting WCSs","");
     parameters.addMember("photoFiles",&photoFiles, def,
 			 "files holding single-band photometric solutions for input catalogs","");
+    parameters.addMember("catalogThreads",&catalogThreads, def | low,
+			 "Number of threads reading input catalogs", CATALOG_THREADS, 1);
+    parameters.addMember("detectionStore",&detectionStore, def,
+			 "DetectionStore file to read in place of input catalogs","");
   }
 
   try {
@@ -609,88 +620,137 @@ main(int argc, char *argv[])
     // One catalog for each extension, with object ID's as keys
     vector<map<long, MagPoint> > pointMaps(extensions.size());
 
-    // Now loop over all original catalog bintables, reading the desired rows
-    // and collecting needed information into the Detection structures
-    // Should be safe to multithread this loop as different threads write
-    // only to distinct parts of memory.  Protect the FITS table read though.
-#ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic,60) num_threads(CATALOG_THREADS)
-#endif
-    for (int iext = 0; iext < extensions.size(); iext++) {
-      if (!extensions[iext]) continue; // Skip unused 
-      // Relevant structures for this extension
-      auto& extn = *extensions[iext];
-      auto& expo = *exposures[extn.exposure];
+    // The catalogs' columns may come from a DetectionStore instead
+    DetectionStore* store = detectionStore.empty() ?
+      nullptr : new DetectionStore(detectionStore);
+    if (store) checkDetectionStore(*store, extensionTable);
 
-      string filename;
-      extensionTable.readCell(filename, "FILENAME", iext);
-      /**/if (iext%50==0) cerr << "# Reading object catalog " << iext
-			       << "/" << extensions.size()
-			       << " from " << filename 
-			       << " seeking " << desiredObjects[iext].size()
-			       << " objects" << endl;
-      int hduNumber;
-      extensionTable.readCell(hduNumber, "EXTENSION", iext);
+    // Gather what is needed from each original catalog bintable, so that
+    // the threads below need not read the extension table.
+    struct CatalogInfo {
+      int iext;
       string xKey;
-      extensionTable.readCell(xKey, "XKEY", iext);
       string yKey;
-      extensionTable.readCell(yKey, "YKEY", iext);
       string idKey;
-      extensionTable.readCell(idKey, "IDKEY", iext);
       string magKey;
-      extensionTable.readCell(magKey, "MAGKEY", iext);
       string magErrKey;
-      extensionTable.readCell(magErrKey, "MAGERRKEY", iext);
-      double weight;
-      extensionTable.readCell(weight, "MAGWEIGHT", iext);
-
-      astrometry::Wcs* startWcs = extn.startWcs;
-      photometry::SubMap* photomap = extn.map;
+      int magKeyElement;
+      int magErrKeyElement;
+      bool useRows;
+    };
+    vector<CatalogInfo> infos;
+    vector<CatalogReader::Request> requests;
+    for (int iext = 0; iext < extensions.size(); iext++) {
+      if (!extensions[iext]) continue; // Skip unused
+      // Relevant structures for this extension
+      auto& extn = *extensions[iext];
+      auto& expo = *exposures[extn.exposure];
 
-      if (!startWcs) {
-	cerr << "Failed to find initial Wcs for device " 
+      CatalogInfo info;
+      CatalogReader::Request request;
+      info.iext = iext;
+      extensionTable.readCell(request.filename, "FILENAME", iext);
+      extensionTable.readCell(request.hduNumber, "EXTENSION", iext);
+      extensionTable.readCell(info.xKey, "XKEY", iext);
+      extensionTable.readCell(info.yKey, "YKEY", iext);
+      extensionTable.readCell(info.idKey, "IDKEY", iext);
+      extensionTable.readCell(info.magKey, "MAGKEY", iext);
+      extensionTable.readCell(info.magErrKey, "MAGERRKEY", iext);
+
+      if (!extn.startWcs) {
+	cerr << "Failed to find initial Wcs for device "
 	     << instruments[expo.instrument]->deviceNames.nameOf(extn.device)
 	     << " of exposure " << expo.name
 	     << endl;
 	exit(1);
       }
 
-      bool useRows = stringstuff::nocaseEqual(idKey, "_ROW");
+      info.useRows = stringstuff::nocaseEqual(info.idKey, "_ROW");
       // What we need to read from the FitsTable:
-      vector<string> neededColumns;
-      if (!useRows)
-	neededColumns.push_back(idKey);
-      neededColumns.push_back(xKey);
-      neededColumns.push_back(yKey);
+      if (!info.useRows)
+	request.columns.push_back(info.idKey);
+      request.columns.push_back(info.xKey);
+      request.columns.push_back(info.yKey);
 
       // Be willing to get an element of array-valued bintable cell
       // for mag or magerr.  Syntax would be
       // MAGAPER[4]  to get 4th (0-indexed) element of MAGAPER column
-      int magKeyElement = elementNumber(magKey);
-      int magErrKeyElement = elementNumber(magErrKey);
-      neededColumns.push_back(magKey);
-      neededColumns.push_back(magErrKey);
+      info.magKeyElement = elementNumber(info.magKey);
+      info.magErrKeyElement = elementNumber(info.magErrKey);
+      request.columns.push_back(info.magKey);
+      request.columns.push_back(info.magErrKey);
+
+      if (store) {
+	// The store's table has the same quantities under fixed names
+	info.idKey = "ID";
+	info.xKey = "X";
+	info.yKey = "Y";
+	info.magKey = "MAG";
+	info.magErrKey = "MAGERR";
+	info.magKeyElement = info.magErrKeyElement = -1;
+	info.useRows = false;
+      }
 
-      img::FTable ff;
+      infos.push_back(info);
+      requests.push_back(request);
+    }
+
+    // The reader's threads fetch the catalogs ahead of the threads here,
+    // which collect the needed information into the MagPoints.  This is
+    // safe to multithread as different threads write only to distinct
+    // parts of memory.
+    int consumers = 1;
 #ifdef _OPENMP
-#pragma omp critical(fitsio)
+    consumers = omp_get_max_threads();
 #endif
-      {
-	FITS::FitsTable ft(filename, FITS::ReadOnly, hduNumber);
-	ff = ft.extract(0, -1, neededColumns);
+    CatalogReader reader(store ? vector<CatalogReader::Request>() : requests,
+			 catalogThreads, 2*catalogThreads + consumers);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,1)
+#endif
+    for (int icat = 0; icat < infos.size(); icat++) {
+      const CatalogInfo& info = infos[icat];
+      const string& filename = requests[icat].filename;
+      int hduNumber = requests[icat].hduNumber;
+      int iext = info.iext;
+      auto& extn = *extensions[iext];
+
+      if (icat%50==0) {
+#ifdef _OPENMP
+#pragma omp critical(cerr)
+#endif
+	cerr << "# Reading object catalog " << iext
+	     << "/" << extensions.size()
+	     << " from " << filename
+	     << " seeking " << desiredObjects[iext].size()
+	     << " objects" << endl;
+      }
+
+      astrometry::Wcs* startWcs = extn.startWcs;
+      photometry::SubMap* photomap = extn.map;
+
+      img::FTable ff;
+      try {
+	if (store)
+	  ff = storedDetections(*store, iext);
+	else
+	  ff = reader.take(icat).front();
+      } catch (std::runtime_error& e) {
+	quit(e,1);
       }
       vector<long> id;
-      if (useRows) {
+      if (info.useRows) {
 	id.resize(ff.nrows());
 	for (long i=0; i<id.size(); i++)
 	  id[i] = i;
       } else {
-	ff.readCells(id, idKey);
+	ff.readCells(id, info.idKey);
       }
       Assert(id.size() == ff.nrows());
 
-      bool magColumnIsDouble = isDouble(ff, magKey, magKeyElement);
-      bool magErrColumnIsDouble = isDouble(ff, magErrKey, magErrKeyElement);
+      bool magColumnIsDouble = isDouble(ff, info.magKey, info.magKeyElement);
+      bool magErrColumnIsDouble = isDouble(ff, info.magErrKey, info.magErrKeyElement);
 
       for (long irow = 0; irow < ff.nrows(); irow++) {
 	set<long>::iterator pr = desiredObjects[iext].find(id[irow]);
@@ -701,8 +761,8 @@ main(int argc, char *argv[])
 	// Read the PhotometryArguments for this Detection:
 	MagPoint mp;
 
-	ff.readCell(mp.args.xDevice, xKey, irow);
-	ff.readCell(mp.args.yDevice, yKey, irow);
+	ff.readCell(mp.args.xDevice, info.xKey, irow);
+	ff.readCell(mp.args.yDevice, info.yKey, irow);
 	astrometry::SphericalICRS sky = startWcs->toSky(mp.args.xDevice, mp.args.yDevice);
 	sky.getLonLat(mp.ra, mp.dec);
 	startWcs->toWorld(mp.args.xDevice, mp.args.yDevice,
@@ -711,9 +771,10 @@ main(int argc, char *argv[])
 
 
 	// Get the mag input and its error, adjust for exposure time
-	mp.magIn = getTableDouble(ff, magKey, magKeyElement, magColumnIsDouble,irow)
+	mp.magIn = getTableDouble(ff, info.magKey, info.magKeyElement, magColumnIsDouble,irow)
 	  + extn.magshift;
-	mp.magErr = getTableDouble(ff, magErrKey, magErrKeyElement, magErrColumnIsDouble,irow);
+	mp.magErr = getTableDouble(ff, info.magErrKey, info.magErrKeyElement,
+				   magErrColumnIsDouble,irow);
 	mp.photomap = photomap;
 
 	// If we have any inf or nan magnitudes, do not propagate this point
@@ -731,6 +792,7 @@ main(int argc, char *argv[])
 	exit(1);
       }
     } // end loop over extensions to read
+    if (store) delete store;
 
     // Make output tables
     FitsTable magFitsTable(magOutFile, FITS::OverwriteFile);
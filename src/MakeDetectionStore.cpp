@@ -0,0 +1,284 @@
+// Program that gathers, once, the catalog columns that the fitting programs
+// need for every matched detection of a WCSFoF output into a DetectionStore,
+// which WCSFit, PhotoFit and MagColor can then read in place of the
+// original catalogs.
+#include <algorithm>
+#include "Std.h"
+#include "FitsTable.h"
+#include "StringStuff.h"
+#include "Instrument.h"
+#include "FitSubroutines.h"
+#include "CatalogReader.h"
+#include "DetectionStore.h"
+
+using stringstuff::stripWhite;
+
+const string usage =
+  "MakeDetectionStore: collect the catalog columns of all matched detections\n"
+  "                    into one file for fast reading by the fitting programs\n"
+  " usage: MakeDetectionStore <match file> <store file> [catalog threads]\n"
+  "        <match file> is the FITS file of matches produced by WCSFoF\n"
+  "        <store file> is the detection store to create, to be given as the\n"
+  "            detectionStore parameter of WCSFit, PhotoFit or MagColor\n"
+  "        [catalog threads] is the number of threads reading the catalogs";
+
+// Read a string from the Extensions table, or the default if there is no
+// such column
+string
+keyOf(const img::FTable& extensionTable, string column, long iext,
+      string defaultValue="") {
+  string out;
+  try {
+    extensionTable.readCell(out, column, iext);
+  } catch (img::FTableError& e) {
+    out = defaultValue;
+  }
+  stripWhite(out);
+  return out;
+}
+
+// Values of a column, or element of an array column, at the given rows.
+// Returns false, giving NaN values, if the catalog has no such column.
+bool
+readValues(const img::FTable& ff, string key, const vector<long>& rows,
+	   vector<double>& values) {
+  double nan = std::numeric_limits<double>::quiet_NaN();
+  int element = elementNumber(key);
+  vector<string> columns = ff.listColumns();
+  bool found = false;
+  for (auto& c : columns)
+    if (stringstuff::nocaseEqual(c, key)) found = true;
+  if (key.empty() || !found) {
+    values.insert(values.end(), rows.size(), nan);
+    return false;
+  }
+  bool columnIsDouble = isDouble(ff, key, element);
+  for (auto irow : rows)
+    values.push_back(getTableDouble(ff, key, element, columnIsDouble, irow));
+  return true;
+}
+
+int
+main(int argc,
+     char *argv[]) {
+  try {
+    if (argc<3 || argc>4) {
+      cerr << usage << endl;
+      exit(1);
+    }
+    string inputTables = argv[1];
+    string storeFile = argv[2];
+    int catalogThreads = argc>3 ? atoi(argv[3]) : CATALOG_THREADS;
+    if (catalogThreads < 1) {
+      cerr << usage << endl;
+      exit(1);
+    }
+
+    img::FTable extensionTable;
+    {
+      FITS::FitsTable ft(inputTables, FITS::ReadOnly, "Extensions");
+      extensionTable = ft.extract();
+    }
+    long nExtensions = extensionTable.nrows();
+
+    // Tag extensions are the only ones whose catalogs may lack the columns
+    // named in the Extensions table, as the fits do not read them there.
+    vector<bool> isTag(nExtensions, false);
+    {
+      FITS::FitsTable ft(inputTables, FITS::ReadOnly, "Exposures");
+      vector<int> instrumentNumber;
+      ft.use().readCells(instrumentNumber, "InstrumentNumber");
+      vector<int> exposureColumn;
+      extensionTable.readCells(exposureColumn, "Exposure");
+      for (long iext = 0; iext < nExtensions; iext++)
+	if (exposureColumn[iext] >= 0 && exposureColumn[iext] < int(instrumentNumber.size()))
+	  isTag[iext] = instrumentNumber[exposureColumn[iext]] == TAG_INSTRUMENT;
+    }
+
+    // Collect the objects of each extension that appear in any match
+    vector<Keepers<void> > wanted(nExtensions);
+    {
+      vector<int> instrumentHDUs;
+      vector<int> catalogHDUs;
+      inventoryFitsTables(inputTables, instrumentHDUs, catalogHDUs);
+      for (auto hdu : catalogHDUs) {
+	FITS::FitsTable ft(inputTables, FITS::ReadOnly, hdu);
+	img::FTable ff = ft.use();
+	vector<LONGLONG> extn;
+	vector<LONGLONG> obj;
+	ff.readCells(extn, "Extension");
+	ff.readCells(obj, "Object");
+	for (long i=0; i<extn.size(); i++) {
+	  if (extn[i] < 0 || extn[i] >= nExtensions) {
+	    cerr << "Match catalog in HDU " << hdu
+		 << " refers to nonexistent extension " << extn[i]
+		 << endl;
+	    exit(1);
+	  }
+	  wanted[extn[i]].insert(obj[i], nullptr);
+	}
+      }
+    }
+
+    // Keys to read from each catalog
+    struct CatalogInfo {
+      string idKey;
+      string keys[DetectionStore::NCOLUMNS];
+      bool useRows;
+    };
+    vector<CatalogInfo> infos(nExtensions);
+    vector<CatalogReader::Request> requests;
+    vector<long> requestExtension;
+    for (long iext = 0; iext < nExtensions; iext++) {
+      if (wanted[iext].empty()) continue;
+      wanted[iext].sort();
+      CatalogInfo& info = infos[iext];
+      CatalogReader::Request request;
+      extensionTable.readCell(request.filename, "Filename", iext);
+      extensionTable.readCell(request.hduNumber, "Extension", iext);
+      info.idKey = keyOf(extensionTable, "idKey", iext);
+      // Position keys are needed by every fit; the others may be left out
+      // of the Extensions table by a run that will not use them.
+      extensionTable.readCell(info.keys[DetectionStore::X], "xKey", iext);
+      extensionTable.readCell(info.keys[DetectionStore::Y], "yKey", iext);
+      stripWhite(info.keys[DetectionStore::X]);
+      stripWhite(info.keys[DetectionStore::Y]);
+      info.keys[DetectionStore::ERR] = keyOf(extensionTable, "errKey", iext);
+      info.keys[DetectionStore::MAG] = keyOf(extensionTable, "magKey", iext);
+      info.keys[DetectionStore::MAGERR] = keyOf(extensionTable, "magErrKey", iext);
+      // As in readColors, a default is used without a colorExpression column
+      string colorExpression = keyOf(extensionTable, "colorExpression", iext, "COLOR");
+      info.keys[DetectionStore::COLOR] = colorExpression;
+
+      info.useRows = stringstuff::nocaseEqual(info.idKey, "_ROW");
+      if (info.useRows && wanted[iext].begin()->first < 0) {
+	cerr << "Negative row number " << wanted[iext].begin()->first
+	     << " sought in catalog " << request.filename
+	     << " extension " << request.hduNumber
+	     << endl;
+	exit(1);
+      }
+      if (!info.useRows)
+	request.columns.push_back(info.idKey);
+      for (int c=0; c<DetectionStore::COLOR; c++) {
+	if (info.keys[c].empty()) continue;
+	string key = info.keys[c];
+	elementNumber(key);
+	request.columns.push_back(key);
+      }
+      // Columns that a catalog lacks are skipped by the read, as are those
+      // of a color expression it cannot evaluate; missing columns that
+      // are needed are reported below.
+      request.expressions.push_back(colorExpression.empty() ?
+				    info.keys[DetectionStore::X] : colorExpression);
+      if (info.useRows)
+	wanted[iext].rowRanges(ROW_RANGE_GAP, request.ranges);
+      requests.push_back(request);
+      requestExtension.push_back(iext);
+    }
+
+    // Catalogs are read ahead by the reader's threads but written in order.
+    CatalogReader reader(requests, catalogThreads, 2*catalogThreads);
+    DetectionStore::Writer writer(storeFile);
+    long nextExtension = 0;
+    long totalRows = 0;
+    for (long icat = 0; icat <= requests.size(); icat++) {
+      long iext = icat < requests.size() ? requestExtension[icat] : nExtensions;
+      // Extensions with nothing matched are stored empty
+      for ( ; nextExtension < iext; nextExtension++) {
+	string filename;
+	int hduNumber;
+	extensionTable.readCell(filename, "Filename", nextExtension);
+	extensionTable.readCell(hduNumber, "Extension", nextExtension);
+	vector<double> empty[DetectionStore::NCOLUMNS];
+	writer.add(filename, hduNumber, vector<int64_t>(), empty, false);
+      }
+      if (icat == requests.size()) break;
+
+      const CatalogInfo& info = infos[iext];
+      const CatalogReader::Request& request = requests[icat];
+      vector<img::FTable> pieces = reader.take(icat);
+
+      // Rows wanted from each piece and the IDs they hold
+      vector<std::pair<int64_t, std::pair<int,long> > > found;
+      auto k = wanted[iext].begin();
+      for (int i=0; i<pieces.size(); i++) {
+	if (info.useRows) {
+	  long start = request.ranges[i].first;
+	  for ( ; k!=wanted[iext].end() && k->first < request.ranges[i].second; ++k)
+	    if (k->first - start < pieces[i].nrows())
+	      found.push_back(std::make_pair(k->first, std::make_pair(i, k->first - start)));
+	} else {
+	  vector<long> id;
+	  pieces[i].readCells(id, info.idKey);
+	  wanted[iext].join(id, [&](long irow, void*) {
+	      found.push_back(std::make_pair(id[irow], std::make_pair(i, irow)));
+	    });
+	}
+      }
+      // An object may be in several matches; keep one row for each ID, the
+      // first in the catalog as when the fitting programs read it.
+      std::sort(found.begin(), found.end());
+      found.erase(std::unique(found.begin(), found.end(),
+			      [](const std::pair<int64_t, std::pair<int,long> >& lhs,
+				 const std::pair<int64_t, std::pair<int,long> >& rhs)
+			      {return lhs.first==rhs.first;}),
+		  found.end());
+      long distinct = 0;
+      for (auto w = wanted[iext].begin(); w!=wanted[iext].end(); ++w)
+	if (w==wanted[iext].begin() || w->first != (w-1)->first) ++distinct;
+      if (found.size() < distinct) {
+	cerr << "Did not find all desired objects in catalog " << request.filename
+	     << " extension " << request.hduNumber
+	     << endl;
+	exit(1);
+      }
+
+      // The pieces are ascending row ranges, so taking each piece's rows in
+      // turn keeps the values in the order of the IDs.
+      vector<int64_t> id;
+      vector<double> columns[DetectionStore::NCOLUMNS];
+      bool hasColor = !info.keys[DetectionStore::COLOR].empty();
+      for (auto& f : found) id.push_back(f.first);
+      for (int i=0; i<pieces.size(); i++) {
+	vector<long> rows;
+	for (auto& f : found)
+	  if (f.second.first == i) rows.push_back(f.second.second);
+	if (rows.empty()) continue;
+	for (int c=0; c<DetectionStore::COLOR; c++) {
+	  bool required = c==DetectionStore::X || c==DetectionStore::Y
+	    || (!info.keys[c].empty() && !isTag[iext]);
+	  if (!readValues(pieces[i], info.keys[c], rows, columns[c]) && required) {
+	    cerr << "Column " << info.keys[c]
+		 << " is missing from catalog " << request.filename
+		 << " extension " << request.hduNumber
+		 << endl;
+	    exit(1);
+	  }
+	}
+	// Only the fits' color catalogs need to evaluate their expression,
+	// and the Extensions table does not say which those are, so a failure
+	// is recorded in the store for readColors to report.
+	vector<double> color(pieces[i].nrows(),
+			     std::numeric_limits<double>::quiet_NaN());
+	try {
+	  if (hasColor)
+	    pieces[i].evaluate(color, info.keys[DetectionStore::COLOR]);
+	} catch (std::runtime_error& e) {
+	  // Not a catalog giving colors
+	  hasColor = false;
+	}
+	for (auto irow : rows)
+	  columns[DetectionStore::COLOR].push_back(color[irow]);
+      }
+      writer.add(request.filename, request.hduNumber, id, columns, hasColor);
+      totalRows += id.size();
+      nextExtension = iext + 1;
+    }
+    writer.close();
+    cout << "# Stored " << totalRows << " detections from "
+	 << requests.size() << " catalogs" << endl;
+  } catch (std::runtime_error& m) {
+    quit(m,1);
+  }
+}
@@ -86,12 +86,18 @@ main(int argc, char *argv[])
   bool clipEntireMatch;
   double priorClipThresh;
   double chisqTolerance;
+  string solver;
+  double cgTolerance;
+  int cgMaxIterations;
 
   string inputMaps;
   string fixMaps;
   string priorFiles;
   string useInstruments;
   string skipExposures;
+  int catalogThreads;
+  string detectionStore;
+  string binaryMatches;
 
   string outCatalog;
   string outPhotFile;
@@ -124,6 +130,12 @@ main(int argc, char *argv[])
 			 "the instruments to include in fit",".*");
     parameters.addMember("skipExposures",&skipExposures, def,
 			 "exposures to ignore during fitting","");
+    parameters.addMember("catalogThreads",&catalogThreads, def | low,
+			 "Number of threads reading input catalogs", CATALOG_THREADS, 1);
+    parameters.addMember("detectionStore",&detectionStore, def,
+			 "DetectionStore file to read in place of input catalogs","");
+    parameters.addMember("binaryMatches",&binaryMatches, def,
+			 "Binary copy of the match catalogs written by WCSFoF, if any","");
     parameters.addMemberNoValue("COLORS");
     parameters.addMember("colorExposures",&colorExposures, def,
 			 "exposures holding valid colors for stars","");
@@ -151,6 +163,12 @@ main(int argc, char *argv[])
 			 "seed for reserving randomizer, <=0 to seed with time", 0);
     parameters.addMember("chisqTolerance",&chisqTolerance, def | lowopen,
 			 "Fractional change in chisq for convergence", 0.001, 0.);
+    parameters.addMember("solver",&solver, def,
+			 "Normal-equation solver: dense, sparse, schur or cg", "dense");
+    parameters.addMember("cgTolerance",&cgTolerance, def | lowopen,
+			 "Relative residual ending conjugate-gradient solutions", 1e-6, 0.);
+    parameters.addMember("cgMaxIterations",&cgMaxIterations, def | low,
+			 "Most conjugate-gradient iterations per solution", 1000, 1);
     parameters.addMember("inputMaps",&inputMaps, def,
 			 "list of YAML files specifying maps","");
     parameters.addMember("fixMaps",&fixMaps, def,
@@ -173,6 +191,19 @@ main(int argc, char *argv[])
     processParameters(parameters, usage, 1, argc, argv);
     string inputTables = argv[1];
 
+    // How the normal equations will be solved:
+    PhotoAlign::Solver solverMode = PhotoAlign::Dense;
+    if (stringstuff::nocaseEqual(solver, "sparse")) {
+      solverMode = PhotoAlign::Sparse;
+    } else if (stringstuff::nocaseEqual(solver, "schur")) {
+      solverMode = PhotoAlign::Schur;
+    } else if (stringstuff::nocaseEqual(solver, "cg")) {
+      solverMode = PhotoAlign::ConjugateGradient;
+    } else if (!stringstuff::nocaseEqual(solver, "dense")) {
+      cerr << "Unknown solver " << solver << endl;
+      exit(1);
+    }
+
     /////////////////////////////////////////////////////
     // Parse all the parameters 
     /////////////////////////////////////////////////////
@@ -400,13 +431,13 @@ main(int argc, char *argv[])
     // Start by reading all matched catalogs, creating Detection and Match arrays, and 
     // telling each Extension which objects it should retrieve from its catalog
 
+    set<int> binaryHdus;
     for (int icat = 0; icat < catalogHDUs.size(); icat++) {
       FITS::FitsTable ft(inputTables, FITS::ReadOnly, catalogHDUs[icat]);
-      FTable ff = ft.use();
       {
 	// Only do photometric fitting on the stellar objects:
 	string affinity;
-	if (!ff.getHdrValue("Affinity", affinity)) {
+	if (!ft.header()->getValue("Affinity", affinity)) {
 	  cerr << "Could not find affinity keyword in header of extension " 
 	       << catalogHDUs[icat] 
 	       << endl;
@@ -416,6 +447,12 @@ main(int argc, char *argv[])
 	if (!stringstuff::nocaseEqual(affinity, stellarAffinity))
 	  continue;
       }
+      if (!binaryMatches.empty()) {
+	// Catalogs are read together from the binary copy below
+	binaryHdus.insert(catalogHDUs[icat]);
+	continue;
+      }
+      FTable ff = ft.use();
       string dummy1, dummy2;
       ff.getHdrValue("Field", dummy1);
       ff.getHdrValue("Affinity", dummy2);
@@ -425,17 +462,28 @@ main(int argc, char *argv[])
       
     } // End loop over input matched catalogs
 
+    if (!binaryMatches.empty()) {
+      BinaryMatches binary(binaryMatches);
+      checkBinaryMatches(binary, inputTables, binaryHdus);
+      readMatches<Photo>(binary, binaryHdus, matches, extensions, colorExtensions,
+			 skipSet, minMatches);
+    }
+
     /**/cerr << "Total match count: " << matches.size() << endl;
 
     // Now loop over all original catalog bintables, reading the desired rows
     // and collecting needed information into the Detection structures
-    readObjects<Photo>(extensionTable, exposures, extensions);
+    // (or the DetectionStore made from them).
+    DetectionStore* store = detectionStore.empty() ?
+      nullptr : new DetectionStore(detectionStore);
+    readObjects<Photo>(extensionTable, exposures, extensions, catalogThreads, store);
     
     /**/cerr << "Done reading catalogs for magnitudes." << endl;
 
     // Now loop again over all catalogs being used to supply colors,
     // and insert colors into all the PhotoArguments for Detections they match
-    readColors<Photo>(extensionTable, colorExtensions);
+    readColors<Photo>(extensionTable, colorExtensions, catalogThreads, store);
+    if (store) delete store;
 
     cerr << "Done reading catalogs for colors." << endl;
 
@@ -512,6 +560,9 @@ main(int argc, char *argv[])
 
     // make CoordAlign class
     PhotoAlign ca(mapCollection, matches, priors);
+    ca.setSolver(solverMode);
+    ca.setCGTolerance(cgTolerance);
+    ca.setCGMaxIterations(cgMaxIterations);
 
     int nclip;
     double oldthresh=0.;
@@ -84,11 +84,17 @@ main(int argc, char *argv[])
   bool clipEntireMatch;
   double chisqTolerance;
   bool divideInPlace;
+  string solver;
+  double cgTolerance;
+  int cgMaxIterations;
 
   string inputMaps;
   string fixMaps;
   string useInstruments;
   string skipExposures;
+  int catalogThreads;
+  string detectionStore;
+  string binaryMatches;
 
   string outCatalog;
   string outWcs;
@@ -122,6 +128,12 @@ main(int argc, char *argv[])
 			 "the instruments to include in fit",".*");
     parameters.addMember("skipExposures",&skipExposures, def,
 			 "exposures to ignore during fitting","");
+    parameters.addMember("catalogThreads",&catalogThreads, def | low,
+			 "Number of threads reading input catalogs", CATALOG_THREADS, 1);
+    parameters.addMember("detectionStore",&detectionStore, def,
+			 "DetectionStore file to read in place of input catalogs","");
+    parameters.addMember("binaryMatches",&binaryMatches, def,
+			 "Binary copy of the match catalogs written by WCSFoF, if any","");
     parameters.addMemberNoValue("CLIPPING");
     parameters.addMember("clipThresh",&clipThresh, def | low,
 			 "Clipping threshold (sigma)", 5., 2.);
@@ -138,6 +150,12 @@ main(int argc, char *argv[])
 			 "seed for reserving randomizer, <=0 to seed with time", 0);
     parameters.addMember("chisqTolerance",&chisqTolerance, def | lowopen,
 			 "Fractional change in chisq for convergence", 0.001, 0.);
+    parameters.addMember("solver",&solver, def,
+			 "Normal-equation solver: dense, sparse, schur or cg", "dense");
+    parameters.addMember("cgTolerance",&cgTolerance, def | lowopen,
+			 "Relative residual ending conjugate-gradient solutions", 1e-6, 0.);
+    parameters.addMember("cgMaxIterations",&cgMaxIterations, def | low,
+			 "Most conjugate-gradient iterations per solution", 1000, 1);
     parameters.addMember("inputMaps",&inputMaps, def,
 			 "list of YAML files specifying maps","");
     parameters.addMember("fixMaps",&fixMaps, def,
@@ -172,6 +190,19 @@ main(int argc, char *argv[])
 
     referenceSysError *= ARCSEC/DEGREE;
 
+    // How the normal equations will be solved:
+    CoordAlign::Solver solverMode = CoordAlign::Dense;
+    if (stringstuff::nocaseEqual(solver, "sparse")) {
+      solverMode = CoordAlign::Sparse;
+    } else if (stringstuff::nocaseEqual(solver, "schur")) {
+      solverMode = CoordAlign::Schur;
+    } else if (stringstuff::nocaseEqual(solver, "cg")) {
+      solverMode = CoordAlign::ConjugateGradient;
+    } else if (!stringstuff::nocaseEqual(solver, "dense")) {
+      cerr << "Unknown solver " << solver << endl;
+      exit(1);
+    }
+
     /////////////////////////////////////////////////////
     // Parse all the parameters
     /////////////////////////////////////////////////////
@@ -525,7 +556,13 @@ main(int argc, char *argv[])
     // Start by reading all matched catalogs, creating Detection and Match arrays, and 
     // telling each Extension which objects it should retrieve from its catalog
 
+    set<int> binaryHdus;
     for (int icat = 0; icat < catalogHDUs.size(); icat++) {
+      if (!binaryMatches.empty()) {
+	// Catalogs are read together from the binary copy below
+	binaryHdus.insert(catalogHDUs[icat]);
+	continue;
+      }
       FITS::FitsTable ft(inputTables, FITS::ReadOnly, catalogHDUs[icat]);
       FTable ff = ft.use();
       string dummy1, dummy2;
@@ -537,17 +574,28 @@ main(int argc, char *argv[])
       
     } // End loop over input matched catalogs
 
+    if (!binaryMatches.empty()) {
+      BinaryMatches binary(binaryMatches);
+      checkBinaryMatches(binary, inputTables, binaryHdus);
+      readMatches<Astro>(binary, binaryHdus, matches, extensions, colorExtensions,
+			 skipSet, minMatches);
+    }
+
     /**/cerr << "Total match count: " << matches.size() << endl;
 
     // Now loop over all original catalog bintables, reading the desired rows
     // and collecting needed information into the Detection structures
+    // (or the DetectionStore made from them).
     /**/cerr << "Reading catalogs." << endl;
-    readObjects<Astro>(extensionTable, exposures, extensions);
+    DetectionStore* store = detectionStore.empty() ?
+      nullptr : new DetectionStore(detectionStore);
+    readObjects<Astro>(extensionTable, exposures, extensions, catalogThreads, store);
 
     // Now loop again over all catalogs being used to supply colors,
     // and insert colors into all the Detections they match
     /**/cerr << "Reading colors" << endl;
-    readColors<Astro>(extensionTable, colorExtensions);
+    readColors<Astro>(extensionTable, colorExtensions, catalogThreads, store);
+    if (store) delete store;
 
     /**/cerr << "Purging defective detections and matches" << endl;
 
@@ -590,6 +638,9 @@ main(int argc, char *argv[])
 
     // make CoordAlign class
     CoordAlign ca(mapCollection, matches);
+    ca.setSolver(solverMode);
+    ca.setCGTolerance(cgTolerance);
+    ca.setCGMaxIterations(cgMaxIterations);
 
     int nclip;
     double oldthresh=0.;
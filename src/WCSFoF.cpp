@@ -7,13 +7,25 @@
 #include "NameIndex.h"
 #include "Pset.h"
 #include <map>
+#include <array>
+#include <deque>
+#include <limits>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <iostream>
+#include <iomanip>
 #include "PixelMapCollection.h"
 #include "TPVMap.h"
 #include "TemplateMap.h"
 #include "StringStuff.h"
 
 #include "FitSubroutines.h"
+#include "BinaryMatches.h"
+#include "WcsCache.h"
+#include "FitsLocks.h"
+#include "ExtensionPipeline.h"
 
 using namespace std;
 using namespace img;
@@ -32,21 +44,272 @@ string usage=
 /// will need
 struct Point {
   Point(double x_, double y_, long ext, long obj, long expo):
-    x(2), extensionNumber(ext), objectNumber(obj), exposureNumber(expo) {
+    extensionNumber(ext), objectNumber(obj), exposureNumber(expo) {
     x[0]=x_; x[1]=y_;
   }
-  vector<double> x;
+  std::array<double,2> x;
   long extensionNumber;  // "extension" is an individual input FITS bintable.
   long objectNumber;     // gives the object number of this Point in its input catalog
   long exposureNumber;   // Which exposure the catalog is from.
-  const vector<double> getX() const {return x;}
+  const std::array<double,2>& getX() const {return x;}
 };
 
 
-// *** Here is the typedef that says we'll be collecting & matching Points
-// *** using the Catalog template class in FoF.h.  Change this typedef if
-// *** a better 2d matching structure is desired!
-typedef fof::Catalog<Point,2> PointCat;
+// *** Points are collected and matched by one of the FoF engines in FoF.h.
+// *** PointCat is the interface WCSFoF uses for any of them; the engine is
+// *** chosen at run time by the matchEngine parameter.
+class PointCat {
+public:
+  virtual ~PointCat() {}
+  virtual void add(const Point& point) =0;
+  // Number of matches (groups of 1 or more points) found so far
+  virtual long size() const =0;
+  bool empty() const {return size()==0;}
+  // Append the Points of every match to the list
+  virtual void harvest(list<vector<const Point*> >& matches) const =0;
+  // Remove the matches whose Points all have y below limit, appending them
+  // to the list.  No point may be added below limit + radius afterwards.
+  // Only the engines that can retire matches (tree and grid) do this.
+  virtual void retire(double limit, list<vector<const Point*> >& finished) {
+    cerr << "This matchEngine cannot retire finished matches" << endl;
+    exit(1);
+  }
+  // Points can be queued and then added in a batch by matchQueue(), which
+  // lets distinct catalogs do their matching in parallel threads.
+  void enqueue(const Point& point) {queue.push_back(&point);}
+  long queueSize() const {return queue.size();}
+  void matchQueue() {
+    for (auto p : queue) add(*p);
+    queue.clear();
+  }
+private:
+  vector<const Point*> queue;
+};
+
+// Adapter for any engine class with the fof::Catalog interface
+template <class C>
+class PointCatOf: public PointCat {
+public:
+  template <class... Args>
+  PointCatOf(const vector<double>& lower, const vector<double>& upper, double radius,
+	     Args... args):
+    cat(lower, upper, radius, args...) {}
+  virtual void add(const Point& point) {cat.add(point);}
+  virtual long size() const {return cat.size();}
+  virtual void harvest(list<vector<const Point*> >& matches) const {
+    for (typename C::const_iterator i=cat.begin(); i!=cat.end(); ++i)
+      matches.push_back(vector<const Point*>((*i)->begin(), (*i)->end()));
+  }
+protected:
+  C cat;
+};
+
+// Adapter for the engines that can retire finished matches
+template <class C>
+class RetiringCatOf: public PointCatOf<C> {
+public:
+  RetiringCatOf(const vector<double>& lower, const vector<double>& upper, double radius):
+    PointCatOf<C>(lower, upper, radius) {}
+  virtual void retire(double limit, list<vector<const Point*> >& finished) {
+    this->cat.retireBelow(limit, [&finished](const typename C::MatchType& m) {
+	finished.push_back(vector<const Point*>(m.begin(), m.end()));
+      });
+  }
+};
+
+// Create a PointCat using the named engine.  The tiled engine splits
+// the domain into tilesPerAxis^2 tiles for parallel matching.
+PointCat* 
+newPointCat(const string& engine,
+	    const vector<double>& lower, const vector<double>& upper, double radius,
+	    int tilesPerAxis) {
+  if (stringstuff::nocaseEqual(engine, "tree"))
+    return new RetiringCatOf<fof::Catalog<Point,2> >(lower, upper, radius);
+  else if (stringstuff::nocaseEqual(engine, "grid"))
+    return new RetiringCatOf<fof::GridCatalog<Point,2> >(lower, upper, radius);
+  else if (stringstuff::nocaseEqual(engine, "unionfind"))
+    return new PointCatOf<fof::UnionFindCatalog<Point,2> >(lower, upper, radius);
+  else if (stringstuff::nocaseEqual(engine, "tiled"))
+    return new PointCatOf<fof::TiledCatalog<Point,2> >(lower, upper, radius, tilesPerAxis);
+  cerr << "Unknown matchEngine <" << engine << ">" << endl;
+  exit(1);
+}
+
+// Catalog for matching over large areas of sky, whose Points hold RA and Dec
+// (degrees) rather than coordinates in a field's tangent plane.  The sky is
+// cut into tiles of nearly equal area: bands of declination, each split in RA
+// into as many tiles as keep them about square.  Each tile is matched in its
+// own tangent plane together with copies of the points of neighboring tiles
+// that lie within the matching radius of it, so every linked pair meets in the
+// home tile of either point.  Groups sharing a point are then joined.
+// Distances in a tangent plane exceed the angular ones by up to sec^2 of the
+// angle from the tile center, so tiles are kept to a few degrees (at most
+// 3, for an error below 0.3%).
+// Matching is done when the groups are first requested.
+class SkyTiledCat: public PointCat {
+public:
+  SkyTiledCat(const string& engine_, double radius_, double tileSize, int engineTiles_);
+  virtual void add(const Point& point) {
+    points.push_back(&point);
+    matched = false;
+  }
+  virtual long size() const {
+    match();
+    return groups.size();
+  }
+  virtual void harvest(list<vector<const Point*> >& matches) const {
+    match();
+    matches.insert(matches.end(), groups.begin(), groups.end());
+  }
+private:
+  string engine;
+  double radius;
+  int engineTiles;
+  int nBands;
+  double bandHeight;
+  vector<int> segments;		// Number of tiles in each band
+  vector<long> firstTile;	// Number of the first tile of each band
+  vector<const Point*> points;
+  mutable bool matched;
+  mutable vector<vector<const Point*> > groups;
+  void match() const;
+  // All tiles whose area is within the matching radius of the position
+  void tilesNear(double ra, double dec, vector<long>& tiles) const;
+  void tileCenter(long tile, double& ra, double& dec) const;
+};
+
+SkyTiledCat::SkyTiledCat(const string& engine_, double radius_, double tileSize,
+			 int engineTiles_):
+  engine(engine_), radius(radius_), engineTiles(engineTiles_), matched(true) {
+  nBands = std::max(1, static_cast<int>(ceil(180. / tileSize)));
+  bandHeight = 180. / nBands;
+  long nTiles = 0;
+  for (int k=0; k<nBands; k++) {
+    double decMid = -90. + (k+0.5)*bandHeight;
+    segments.push_back(std::max(1, static_cast<int>(ceil(360.*cos(decMid*DEGREE)/bandHeight))));
+    firstTile.push_back(nTiles);
+    nTiles += segments.back();
+  }
+}
+
+void
+SkyTiledCat::tileCenter(long tile, double& ra, double& dec) const {
+  int k = std::upper_bound(firstTile.begin(), firstTile.end(), tile) - firstTile.begin() - 1;
+  double width = 360. / segments[k];
+  ra = (tile - firstTile[k] + 0.5) * width;
+  if (segments[k]==1)
+    // Polar cap, centered on the pole
+    dec = k==0 ? -90. : 90.;
+  else
+    dec = -90. + (k+0.5)*bandHeight;
+}
+
+void
+SkyTiledCat::tilesNear(double ra, double dec, vector<long>& tiles) const {
+  tiles.clear();
+  int kmin = std::max(0, static_cast<int>(floor((dec - radius + 90.) / bandHeight)));
+  int kmax = std::min(nBands-1, static_cast<int>(floor((dec + radius + 90.) / bandHeight)));
+  // Half-width in RA of the region within the radius of a meridian
+  double sinr = sin(radius*DEGREE);
+  double cosdec = cos(dec*DEGREE);
+  double dra = sinr >= cosdec ? 180. : asin(sinr / cosdec) / DEGREE;
+  for (int k=kmin; k<=kmax; k++) {
+    int n = segments[k];
+    double width = 360. / n;
+    if (2*dra + width >= 360.) {
+      for (int j=0; j<n; j++) tiles.push_back(firstTile[k] + j);
+      continue;
+    }
+    long jmin = static_cast<long>(floor((ra - dra) / width));
+    long jmax = static_cast<long>(floor((ra + dra) / width));
+    for (long j=jmin; j<=jmax; j++)
+      tiles.push_back(firstTile[k] + ((j % n) + n) % n);
+  }
+  std::sort(tiles.begin(), tiles.end());
+  tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
+}
+
+void
+SkyTiledCat::match() const {
+  if (matched) return;
+  long nTiles = firstTile.back() + segments.back();
+
+  // Points to match in each tile, by index into points
+  vector<vector<long> > members(nTiles);
+  vector<long> near;
+  for (long i=0; i<points.size(); i++) {
+    double ra = fmod(points[i]->x[0], 360.);
+    if (ra < 0.) ra += 360.;
+    tilesNear(ra, points[i]->x[1], near);
+    for (auto t : near) members[t].push_back(i);
+  }
+
+  // Match each tile in its own tangent plane
+  vector<vector<vector<long> > > tileGroups(nTiles);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,1)
+#endif
+  for (long t=0; t<nTiles; t++) {
+    if (members[t].size() < 2) continue;
+    double ra0, dec0;
+    tileCenter(t, ra0, dec0);
+    astrometry::Orientation orient(astrometry::SphericalICRS(ra0*DEGREE, dec0*DEGREE));
+    astrometry::Gnomonic projection(orient);
+    vector<Point> local;
+    local.reserve(members[t].size());
+    vector<double> lower(2, 0.);
+    vector<double> upper(2, 0.);
+    for (auto i : members[t]) {
+      const Point& p = *points[i];
+      projection.convertFrom(astrometry::SphericalICRS(p.x[0]*DEGREE, p.x[1]*DEGREE));
+      double x, y;
+      projection.getLonLat(x, y);
+      local.push_back(Point(x/DEGREE, y/DEGREE,
+			    p.extensionNumber, p.objectNumber, p.exposureNumber));
+      for (int d=0; d<2; d++) {
+	lower[d] = std::min(lower[d], local.back().x[d] - radius);
+	upper[d] = std::max(upper[d], local.back().x[d] + radius);
+      }
+    }
+    PointCat* cat = newPointCat(engine, lower, upper, radius, engineTiles);
+    for (auto& p : local) cat->add(p);
+    list<vector<const Point*> > found;
+    cat->harvest(found);
+    for (auto& g : found) {
+      if (g.size() < 2) continue;
+      vector<long> ids;
+      for (auto p : g) ids.push_back(members[t][p - &local[0]]);
+      tileGroups[t].push_back(ids);
+    }
+    delete cat;
+  }
+
+  // Join the groups of all tiles
+  vector<long> parent(points.size());
+  for (long i=0; i<parent.size(); i++) parent[i] = i;
+  auto root = [&parent](long i) {
+    while (parent[i]!=i) i = parent[i] = parent[parent[i]];
+    return i;
+  };
+  for (auto& tg : tileGroups)
+    for (auto& g : tg)
+      for (auto i : g) {
+	long a = root(g.front());
+	long b = root(i);
+	if (a!=b) parent[std::max(a,b)] = std::min(a,b);
+      }
+  groups.clear();
+  vector<long> groupOf(points.size(), -1);
+  for (long i=0; i<points.size(); i++) {
+    long r = root(i);
+    if (groupOf[r] < 0) {
+      groupOf[r] = groups.size();
+      groups.push_back(vector<const Point*>());
+    }
+    groups[groupOf[r]].push_back(points[i]);
+  }
+  matched = true;
+}
 
 struct Field {
   string name;
@@ -54,10 +317,27 @@ struct Field {
   astrometry::SphericalCoords* projection;
   double extent;
   double matchRadius;
+  string matchEngine;
+  int matchTiles;
+  // If positive, points are in RA and Dec and matched in sky tiles of this size
+  double skyTile;
   // Map from affinity name to its catalog of matches:
   typedef map<string, PointCat*> CatMap;
   CatMap catalogs;
-  Field(): projection(0) {}
+  // Store holding the field's Points being matched.  Note that catalogs do not make
+  // copies of the Points, they just hold pointers to them.  So this is a warehouse.
+  // A deque keeps the Points in large contiguous blocks, with no per-Point
+  // allocation, and never moves them as it grows.
+  deque<Point> points;
+  // Matches lying below this y have been written out; no new point may fall below it.
+  double finishedBelow;
+  // Number of the Points in the store whose matches have been written
+  long retiredPoints;
+  // Is this field matched by this run (or left to another shard)?
+  bool selected;
+  Field(): projection(0), skyTile(0.),
+	   finishedBelow(-std::numeric_limits<double>::infinity()),
+	   retiredPoints(0), selected(true) {}
   ~Field() {
     for (CatMap::iterator i=catalogs.begin();
 	 i != catalogs.end();
@@ -66,15 +346,21 @@ struct Field {
     if (projection) delete projection;
   }
   PointCat* catalogFor(const string& affinity) {
-    if (catalogs.find(affinity)==catalogs.end()) {
+    if (catalogs.find(affinity)==catalogs.end() && skyTile > 0.) {
+      catalogs.insert( std::pair<string, PointCat*>(affinity,
+						    new SkyTiledCat(matchEngine,
+								    matchRadius,
+								    skyTile,
+								    matchTiles)));
+    } else if (catalogs.find(affinity)==catalogs.end()) {
       vector<double> lower(2, -extent);
       vector<double> upper(2, extent);
-      // *** This line creates new point catalogs.  Might need to be changed if
-      // *** we decide to use a different catalog structure.
       catalogs.insert( std::pair<string, PointCat*>(affinity,
-						    new PointCat(lower,
-								 upper,
-								 matchRadius)));
+						    newPointCat(matchEngine,
+								lower,
+								upper,
+								matchRadius,
+								matchTiles)));
     }
     return catalogs[affinity];
   }
@@ -84,6 +370,858 @@ private:
   void operator=(const Field& rhs);
 };
 
+// Add all queued points to their catalogs.  Each catalog gets its points in
+// the order they were queued, so results do not depend on the thread count.
+void
+matchQueues(vector<Field*>& fields) {
+  vector<PointCat*> work;
+  for (auto f : fields)
+    for (auto& c : f->catalogs)
+      if (c.second->queueSize() > 0) work.push_back(c.second);
+  // Biggest jobs first to balance the threads
+  std::stable_sort(work.begin(), work.end(),
+		   [](const PointCat* lhs, const PointCat* rhs)
+		   {return lhs->queueSize() > rhs->queueSize();});
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,1)
+#endif
+  for (size_t i=0; i<work.size(); i++)
+    work[i]->matchQueue();
+}
+
+// Order of detections within a match, and of matches in the output:
+// by extension, then object number.  Matching engines return their groups
+// in an order that can depend on memory addresses, so we sort them
+// to make the output reproducible.
+bool
+pointLess(const Point* lhs, const Point* rhs) {
+  if (lhs->extensionNumber != rhs->extensionNumber)
+    return lhs->extensionNumber < rhs->extensionNumber;
+  return lhs->objectNumber < rhs->objectNumber;
+}
+bool
+matchLess(const vector<const Point*>& lhs, const vector<const Point*>& rhs) {
+  return pointLess(lhs.front(), rhs.front());
+}
+
+// Position of cell (x,y) along the Hilbert curve filling an n x n grid,
+// n a power of 2.
+uint64_t
+hilbertIndex(uint32_t n, uint32_t x, uint32_t y) {
+  uint64_t d = 0;
+  for (uint32_t s=n/2; s>0; s/=2) {
+    uint32_t rx = (x & s) ? 1 : 0;
+    uint32_t ry = (y & s) ? 1 : 0;
+    d += uint64_t(s) * s * ((3*rx) ^ ry);
+    // Rotate the quadrant so the curve within it starts and ends correctly
+    if (ry==0) {
+      if (rx==1) {
+	x = n-1-x;
+	y = n-1-y;
+      }
+      std::swap(x,y);
+    }
+  }
+  return d;
+}
+
+// Order matches so that neighbors on the sky, which mostly share their
+// extensions, are neighbors in the output.  The field is cut into square
+// cells of the given size (degrees) and the matches are ordered by the
+// Hilbert-curve position of the cell holding their first detection, then
+// by the extension holding most of their detections, then by their first
+// detection.  Points in the matches must already be in pointLess order.
+void
+orderMatches(list<vector<const Point*> >& matches, const Field& f, double cellSize) {
+  // Sky-tiled fields hold RA and Dec, others tangent-plane coordinates
+  double x0 = f.skyTile > 0. ? 0. : -f.extent;
+  double y0 = f.skyTile > 0. ? -90. : -f.extent;
+  double span = f.skyTile > 0. ? 360. : 2*f.extent;
+  uint32_t n = 1;
+  while (n < (1U<<30) && n*cellSize < span) n *= 2;
+
+  struct Key {
+    uint64_t cell;
+    long extension;
+    list<vector<const Point*> >::iterator match;
+  };
+  vector<Key> keys;
+  keys.reserve(matches.size());
+  map<long,int> counts;
+  for (auto i = matches.begin(); i!=matches.end(); ++i) {
+    const Point* first = i->front();
+    double x = first->x[0];
+    if (f.skyTile > 0.) {
+      // RA may be given in (-180,180], as SkyTiledCat::match allows
+      x = fmod(x, 360.);
+      if (x < 0.) x += 360.;
+    }
+    double cx = std::floor( (x - x0) / cellSize);
+    double cy = std::floor( (first->x[1] - y0) / cellSize);
+    cx = std::max(0., std::min(cx, n-1.));
+    cy = std::max(0., std::min(cy, n-1.));
+    // Dominant extension, the lowest numbered one if tied
+    counts.clear();
+    for (auto p : *i) ++counts[p->extensionNumber];
+    long dominant = first->extensionNumber;
+    int most = 0;
+    for (auto& c : counts)
+      if (c.second > most) {
+	dominant = c.first;
+	most = c.second;
+      }
+    keys.push_back( {hilbertIndex(n, uint32_t(cx), uint32_t(cy)), dominant, i});
+  }
+  std::sort(keys.begin(), keys.end(),
+	    [](const Key& lhs, const Key& rhs) {
+	      if (lhs.cell != rhs.cell) return lhs.cell < rhs.cell;
+	      if (lhs.extension != rhs.extension) return lhs.extension < rhs.extension;
+	      return matchLess(*lhs.match, *rhs.match);
+	    });
+  // Relink the list nodes in the new order
+  list<vector<const Point*> > ordered;
+  for (auto& k : keys)
+    ordered.splice(ordered.end(), matches, k.match);
+  matches.swap(ordered);
+}
+
+// Breaks up the matches that friends-of-friends chaining has grown too big in
+// crowded regions: those with more than maxSize detections, or with a
+// detection farther than maxExtent from the mean position of the match.
+// The detections of such a match are relinked with half the matching
+// radius, and each piece that is still too big is split again, so the
+// pieces are clusters of nearest neighbors.  Unless self-matches are
+// allowed, pieces holding two detections from one exposure are split
+// further as well.  Pieces of one detection are left to the minMatch cut.
+class MatchSplitter {
+public:
+  MatchSplitter(int maxSize_, double maxExtent_, bool allowSelfMatches_):
+    maxSize(maxSize_), maxExtent(maxExtent_), allowSelfMatches(allowSelfMatches_) {}
+  bool active() const {return maxSize > 0 || maxExtent > 0.;}
+  // Replace every match in the list that is too big with its pieces.
+  // Coordinates are in degrees, RA and Dec if sky is true.  Returns the
+  // number of matches that were split; pieces is incremented by their pieces.
+  long split(list<vector<const Point*> >& matches, double radius, bool sky,
+	     long& pieces) const;
+private:
+  int maxSize;
+  double maxExtent;
+  bool allowSelfMatches;
+  // Smallest radius tried is radius / 2^MAX_DEPTH
+  static const int MAX_DEPTH = 10;
+  typedef std::array<double,2> Coords;
+  bool tooBig(const vector<Coords>& xy) const;
+  static bool hasSelfMatch(const vector<const Point*>& m);
+  static void localCoords(const vector<const Point*>& m, bool sky, vector<Coords>& xy);
+  void splitMatch(const vector<const Point*>& m, const vector<Coords>& xy,
+		  double radius, int depth,
+		  list<vector<const Point*> >& out) const;
+};
+
+bool
+MatchSplitter::tooBig(const vector<Coords>& xy) const {
+  if (maxSize > 0 && xy.size() > static_cast<size_t>(maxSize)) return true;
+  if (maxExtent <= 0.) return false;
+  double xMean = 0., yMean = 0.;
+  for (auto& c : xy) {
+    xMean += c[0];
+    yMean += c[1];
+  }
+  xMean /= xy.size();
+  yMean /= xy.size();
+  double extentSq = maxExtent*maxExtent;
+  for (auto& c : xy)
+    if ( (c[0]-xMean)*(c[0]-xMean) + (c[1]-yMean)*(c[1]-yMean) > extentSq)
+      return true;
+  return false;
+}
+
+bool
+MatchSplitter::hasSelfMatch(const vector<const Point*>& m) {
+  set<long> itsExposures;
+  for (auto p : m)
+    if (!itsExposures.insert(p->exposureNumber).second) return true;
+  return false;
+}
+
+// Positions in degrees on a plane.  RA and Dec are projected onto the
+// plane tangent at the first point, which is accurate anywhere on the sky
+// for matches much smaller than a radian.
+void
+MatchSplitter::localCoords(const vector<const Point*>& m, bool sky, vector<Coords>& xy) {
+  xy.resize(m.size());
+  if (!sky) {
+    for (size_t i=0; i<m.size(); i++)
+      xy[i] = m[i]->x;
+    return;
+  }
+  double ra0 = m[0]->x[0]*DEGREE;
+  double dec0 = m[0]->x[1]*DEGREE;
+  double east[3] = {-sin(ra0), cos(ra0), 0.};
+  double north[3] = {-sin(dec0)*cos(ra0), -sin(dec0)*sin(ra0), cos(dec0)};
+  for (size_t i=0; i<m.size(); i++) {
+    double ra = m[i]->x[0]*DEGREE;
+    double dec = m[i]->x[1]*DEGREE;
+    double v[3] = {cos(dec)*cos(ra), cos(dec)*sin(ra), sin(dec)};
+    xy[i][0] = (v[0]*east[0] + v[1]*east[1] + v[2]*east[2]) / DEGREE;
+    xy[i][1] = (v[0]*north[0] + v[1]*north[1] + v[2]*north[2]) / DEGREE;
+  }
+}
+
+void
+MatchSplitter::splitMatch(const vector<const Point*>& m, const vector<Coords>& xy,
+			  double radius, int depth,
+			  list<vector<const Point*> >& out) const {
+  if (depth >= MAX_DEPTH
+      || (!tooBig(xy) && (depth==0 || allowSelfMatches || !hasSelfMatch(m)))) {
+    out.push_back(m);
+    return;
+  }
+  radius *= 0.5;
+  vector<double> lower(2, std::numeric_limits<double>::max());
+  for (auto& c : xy) {
+    lower[0] = std::min(lower[0], c[0]);
+    lower[1] = std::min(lower[1], c[1]);
+  }
+  fof::FriendLinker<2> linker(lower, radius);
+  linker.reserve(xy.size());
+  for (auto& c : xy) linker.add(c);
+  // Gather the pieces, keeping the points' order within each
+  vector<int> slot(m.size(), -1);
+  vector<vector<const Point*> > pieceMatches;
+  vector<vector<Coords> > pieceCoords;
+  for (uint32_t i=0; i<m.size(); i++) {
+    uint32_t root = linker.rootOf(i);
+    if (root==i) {
+      slot[i] = pieceMatches.size();
+      pieceMatches.push_back(vector<const Point*>());
+      pieceCoords.push_back(vector<Coords>());
+    }
+    pieceMatches[slot[root]].push_back(m[i]);
+    pieceCoords[slot[root]].push_back(xy[i]);
+  }
+  for (size_t i=0; i<pieceMatches.size(); i++)
+    splitMatch(pieceMatches[i], pieceCoords[i], radius, depth+1, out);
+}
+
+long
+MatchSplitter::split(list<vector<const Point*> >& matches, double radius, bool sky,
+		     long& pieces) const {
+  long splitCount = 0;
+  vector<Coords> xy;
+  for (auto i = matches.begin(); i!=matches.end(); ) {
+    localCoords(*i, sky, xy);
+    if (!tooBig(xy)) {
+      ++i;
+      continue;
+    }
+    list<vector<const Point*> > out;
+    splitMatch(*i, xy, radius, 0, out);
+    ++splitCount;
+    pieces += out.size();
+    matches.splice(i, out);
+    i = matches.erase(i);
+  }
+  return splitCount;
+}
+
+// Writes matches to the MatchCatalog extension of each (field, affinity)
+// pair, appending rows each time more matches of the pair are finished.
+// The output file is written under fitsLocks, as reader threads may be
+// using other FITS files at the same time.
+class MatchWriter {
+public:
+  MatchWriter(const string& fileName_, int firstHdu,
+	      int minMatches_, bool allowSelfMatches_,
+	      const MatchSplitter& splitter_, double orderCell_,
+	      BinaryMatches::Writer* binary_, FitsLocks& fitsLocks_):
+    matchCount(0), pointCount(0), splitCount(0), pieceCount(0),
+    fileName(fileName_), fitsLocks(fitsLocks_), nextHdu(firstHdu),
+    minMatches(minMatches_), allowSelfMatches(allowSelfMatches_),
+    splitter(splitter_), orderCell(orderCell_), binary(binary_), largest(0) {}
+  void write(const vector<Field*>& fields, int iField, const string& affinity,
+	     list<vector<const Point*> >& pmatches);
+  // Append rows that are already in MatchCatalog form
+  void appendRows(const vector<Field*>& fields, int iField, const string& affinity,
+		  const vector<int>& sequence,
+		  const vector<long>& extn,
+		  const vector<long>& obj);
+  // Print the distribution of the sizes of the matches written
+  void reportSizes(ostream& os) const;
+  long matchCount;	// Matches and points written so far
+  long pointCount;
+  long splitCount;	// Matches split up, and the pieces they gave
+  long pieceCount;
+private:
+  string fileName;
+  FitsLocks& fitsLocks;
+  int nextHdu;
+  int minMatches;
+  bool allowSelfMatches;
+  const MatchSplitter& splitter;
+  // Size of the cells for spatial ordering of matches, 0 to order by first point
+  double orderCell;
+  // Binary copy of the MatchCatalogs, if one is wanted
+  BinaryMatches::Writer* binary;
+  // Number of matches written with 2^i to 2^(i+1)-1 detections
+  vector<long> sizeCounts;
+  long largest;
+  void countSizes(const vector<int>& sequence);
+  // HDU number of the catalog for each field and affinity
+  map<std::pair<int,string>, int> hdus;
+};
+
+void
+MatchWriter::write(const vector<Field*>& fields, int iField, const string& affinity,
+		   list<vector<const Point*> >& pmatches) {
+  if (pmatches.empty()) return;
+  if (splitter.active())
+    splitCount += splitter.split(pmatches, fields[iField]->matchRadius,
+				 fields[iField]->skyTile > 0., pieceCount);
+  for (auto& m : pmatches)
+    std::sort(m.begin(), m.end(), pointLess);
+  if (orderCell > 0.)
+    orderMatches(pmatches, *fields[iField], orderCell);
+  else
+    pmatches.sort(matchLess);
+
+  vector<int> sequence;
+  vector<long> extn;
+  vector<long> obj;
+  long matches=0;
+  // Now loop through matches in this catalog
+  for (list<vector<const Point*> >::const_iterator j=pmatches.begin();
+       j != pmatches.end();
+       ++j) {
+    // Skip any Match that is below minimum match size
+    if (j->size() < minMatches) continue;
+    bool selfMatch = false;
+    if (!allowSelfMatches) {
+      set<long> itsExposures;
+      for (vector<const Point*>::const_iterator k=j->begin();
+	   k != j->end();
+	   ++k) 
+	if ( !itsExposures.insert((*k)->exposureNumber).second) {
+	  selfMatch = true;
+	  break;
+	}
+    }
+    if (selfMatch) continue;
+
+    // Add elements of this match to the output vectors
+    int seq=0;
+    ++matches;
+    for (vector<const Point*>::const_iterator k=j->begin();
+	 k != j->end();
+	 ++k, ++seq) {
+      sequence.push_back(seq);
+      extn.push_back((*k)->extensionNumber);
+      obj.push_back((*k)->objectNumber);
+    }
+  } // end match loop
+  cerr << "...Kept " << matches << " of " << pmatches.size()
+       << " matches with " << sequence.size()
+       << " points for field " << fields[iField]->name
+       << " affinity " << affinity << endl;
+  matchCount += matches;
+  appendRows(fields, iField, affinity, sequence, extn, obj);
+}
+
+void
+MatchWriter::appendRows(const vector<Field*>& fields, int iField, const string& affinity,
+			const vector<int>& sequence,
+			const vector<long>& extn,
+			const vector<long>& obj) {
+  pointCount += sequence.size();
+  countSizes(sequence);
+  auto key = std::make_pair(iField, affinity);
+  bool newCatalog = hdus.count(key)==0;
+  if (newCatalog) hdus[key] = nextHdu++;
+  if (binary) binary->add(hdus[key], sequence, extn, obj);
+  if (!newCatalog && sequence.empty()) return;
+  // Each match starts at sequence number 0
+  long matches = std::count(sequence.begin(), sequence.end(), 0);
+  // The file is opened, written, and closed under both locks
+  std::lock_guard<std::mutex> fileGuard(fitsLocks.lockFor(fileName));
+  std::unique_lock<std::mutex> openGuard = fitsLocks.openClose();
+  if (newCatalog) {
+    // First matches for this catalog, start a new extension
+    FitsTable ft(fileName, FITS::ReadWrite + FITS::Create, -1);
+    ft.setName("MatchCatalog");
+    FTable ff=ft.use();
+    ff.header()->replace("Field", fields[iField]->name, "Field name");
+    ff.header()->replace("FieldNum", iField, "Field number");
+    ff.header()->replace("Affinity", affinity, "Affinity name");
+    ff.header()->replace("Matches", matches, "Number of matches");
+    ff.addColumn(sequence, "SequenceNumber");
+    ff.addColumn(extn, "Extension");
+    ff.addColumn(obj, "Object");
+  } else {
+    // Append to the catalog's rows
+    FitsTable ft(fileName, FITS::ReadWrite, hdus[key]);
+    FTable ff=ft.use();
+    long row = ff.nrows();
+    long oldMatches = 0;
+    ff.header()->getValue("Matches", oldMatches);
+    ff.header()->replace("Matches", oldMatches + matches, "Number of matches");
+    ff.writeCells(sequence, "SequenceNumber", row);
+    ff.writeCells(extn, "Extension", row);
+    ff.writeCells(obj, "Object", row);
+  }
+}
+
+void
+MatchWriter::countSizes(const vector<int>& sequence) {
+  // Each match starts at sequence number 0
+  for (size_t start=0; start<sequence.size(); ) {
+    size_t end = start+1;
+    while (end<sequence.size() && sequence[end]!=0) ++end;
+    long size = end - start;
+    int bin = 0;
+    while ( (2L << bin) <= size) ++bin;
+    if (static_cast<size_t>(bin) >= sizeCounts.size()) sizeCounts.resize(bin+1, 0);
+    ++sizeCounts[bin];
+    largest = std::max(largest, size);
+    start = end;
+  }
+}
+
+void
+MatchWriter::reportSizes(ostream& os) const {
+  os << "Match size distribution:" << endl;
+  for (size_t bin=0; bin<sizeCounts.size(); bin++) {
+    if (sizeCounts[bin]==0) continue;
+    long lo = 1L << bin;
+    long hi = (2L << bin) - 1;
+    os << "  " << std::setw(6) << lo << " - " << std::setw(6) << hi
+       << ": " << sizeCounts[bin] << endl;
+  }
+  os << "Largest match has " << largest << " points" << endl;
+  if (splitCount > 0)
+    os << "Split " << splitCount << " oversize matches into "
+       << pieceCount << " pieces" << endl;
+}
+
+// Spatial index of every point of every match (including those too small
+// to be written to the MatchCatalog), which is saved alongside a .fof so
+// that later extensions can be matched against it without rematching the
+// whole survey.  Each field's plane is cut into square tiles at least as
+// large as the matching radius, and the index rows of each (field, affinity)
+// pair are sorted by tile so a tile's points can be read as a block.
+class MatchIndex {
+public:
+  MatchIndex(double tileSize_, double matchRadius_):
+    tileSize(tileSize_), matchRadius(matchRadius_), nextGroup(0) {}
+  // Take the tiling and group numbering of an existing index file, and load
+  // into the fields' catalogs the old points near the fields' current
+  // points.  Whole groups are loaded so that they can be rematched.  The
+  // reloaded points are recorded as (extension, object) pairs.
+  void load(const string& oldIndex, const vector<Field*>& fields,
+	    set<std::pair<long,long> >& reloaded);
+  // Record the points of groups being written out
+  void add(const vector<Field*>& fields, int iField, const string& affinity,
+	   const list<vector<const Point*> >& groups);
+  // Write the index, including any untouched tiles of the loaded index.
+  void write(const string& fileName, const vector<Field*>& fields) const;
+  double getTileSize() const {return tileSize;}
+  double getMatchRadius() const {return matchRadius;}
+private:
+  struct Row {
+    long tile;
+    double x;
+    double y;
+    long extension;
+    long object;
+    int exposure;
+    long group;
+    long groupSize;
+  };
+  typedef std::pair<int,string> Key;	// (field number, affinity)
+  double tileSize;
+  double matchRadius;
+  long nextGroup;
+  map<Key, vector<Row> > rows;
+  string oldIndex;
+  // Tiles of the old index whose rows have been reloaded
+  map<Key, set<long> > reloadedTiles;
+
+  long tilesPerSide(const Field& f) const {
+    return std::max(1L, static_cast<long>(ceil(2*f.extent / tileSize)));
+  }
+  long tileOf(const Field& f, double x, double y) const {
+    long n = tilesPerSide(f);
+    long ix = std::min(n-1, std::max(0L, static_cast<long>(floor((x+f.extent)/tileSize))));
+    long iy = std::min(n-1, std::max(0L, static_cast<long>(floor((y+f.extent)/tileSize))));
+    return iy*n + ix;
+  }
+  // Add a tile and its 8 neighbors to the set
+  void addNeighbors(const Field& f, long tile, set<long>& tiles) const {
+    long n = tilesPerSide(f);
+    long ix = tile % n;
+    long iy = tile / n;
+    for (long jy = std::max(0L, iy-1); jy <= std::min(n-1, iy+1); jy++)
+      for (long jx = std::max(0L, ix-1); jx <= std::min(n-1, ix+1); jx++)
+	tiles.insert(jy*n + jx);
+  }
+  // Read the (field, affinity) key from the header of an index table
+  static Key keyOf(const FTable& ft);
+};
+
+MatchIndex::Key
+MatchIndex::keyOf(const FTable& ft) {
+  int iField;
+  string affinity;
+  if (!ft.header()->getValue("FieldNum", iField)
+      || !ft.header()->getValue("Affinity", affinity)) {
+    cerr << "Missing FieldNum or Affinity in MatchIndex table" << endl;
+    exit(1);
+  }
+  stripWhite(affinity);
+  return Key(iField, affinity);
+}
+
+void
+MatchIndex::add(const vector<Field*>& fields, int iField, const string& affinity,
+		const list<vector<const Point*> >& groups) {
+  const Field& f = *fields[iField];
+  vector<Row>& v = rows[Key(iField, affinity)];
+  for (auto& g : groups) {
+    for (auto p : g) {
+      Row r;
+      r.tile = tileOf(f, p->x[0], p->x[1]);
+      r.x = p->x[0];
+      r.y = p->x[1];
+      r.extension = p->extensionNumber;
+      r.object = p->objectNumber;
+      r.exposure = p->exposureNumber;
+      r.group = nextGroup;
+      r.groupSize = g.size();
+      v.push_back(r);
+    }
+    ++nextGroup;
+  }
+}
+
+void
+MatchIndex::load(const string& oldIndex_, const vector<Field*>& fields,
+		 set<std::pair<long,long> >& reloaded) {
+  oldIndex = oldIndex_;
+  {
+    FTable info = FitsTable(oldIndex, FITS::ReadOnly, "MatchIndexInfo").extract();
+    double oldRadius;
+    if (!info.header()->getValue("TileSize", tileSize)
+	|| !info.header()->getValue("MatchRadius", oldRadius)
+	|| !info.header()->getValue("NextGroup", nextGroup)) {
+      cerr << "Missing keywords in MatchIndexInfo of " << oldIndex << endl;
+      exit(1);
+    }
+    if (fabs(oldRadius - matchRadius) > 1e-6*matchRadius) {
+      cerr << "matchRadius differs from the one used to build " << oldIndex << endl;
+      exit(1);
+    }
+  }
+
+  // Tiles near the points of each field, found before any old points are added
+  vector<set<long> > fieldTiles(fields.size());
+  for (int iField=0; iField<fields.size(); iField++) {
+    const Field& f = *fields[iField];
+    for (auto& p : f.points)
+      addNeighbors(f, tileOf(f, p.x[0], p.x[1]), fieldTiles[iField]);
+  }
+
+  FITS::FitsFile ff(oldIndex);
+  for (int hdu=1; hdu+1<ff.HDUCount(); hdu++) {
+    FITS::Hdu h(oldIndex, FITS::HDUAny, hdu);
+    if (!stringstuff::nocaseEqual(h.getName(), "MatchIndex")) continue;
+    FitsTable data(oldIndex, FITS::ReadOnly, hdu);
+    Key key = keyOf(data.extract(0,0));
+    if (key.first < 0 || key.first >= fields.size()) {
+      cerr << "Invalid field number " << key.first << " in " << oldIndex << endl;
+      exit(1);
+    }
+    Field& f = *fields[key.first];
+    // Only catalogs receiving new points need their neighbors back
+    if (f.catalogs.count(key.second)==0) continue;
+    PointCat* cat = f.catalogs[key.second];
+
+    // Directory of the tiles, which is the following extension
+    map<long, std::pair<long,long> > directory;
+    {
+      FTable dir = FitsTable(oldIndex, FITS::ReadOnly, hdu+1).extract();
+      vector<long> tile;
+      vector<long> firstRow;
+      vector<long> nRows;
+      dir.readCells(tile, "Tile");
+      dir.readCells(firstRow, "FirstRow");
+      dir.readCells(nRows, "NRows");
+      for (int i=0; i<tile.size(); i++)
+	directory[tile[i]] = std::make_pair(firstRow[i], nRows[i]);
+    }
+
+    // Keep reading tiles until every group that has been touched is complete
+    set<long>& loaded = reloadedTiles[key];
+    map<long,long> groupSize;
+    map<long,long> groupLoaded;
+    map<long, set<long> > groupTiles;
+    set<long> wanted = fieldTiles[key.first];
+    while (!wanted.empty()) {
+      for (auto t : wanted) {
+	if (loaded.count(t) || directory.count(t)==0) continue;
+	loaded.insert(t);
+	FTable ft = data.extract(directory[t].first,
+				 directory[t].first + directory[t].second);
+	vector<double> x;
+	vector<double> y;
+	vector<long> extension;
+	vector<long> object;
+	vector<int> exposure;
+	vector<long> group;
+	vector<long> size;
+	ft.readCells(x, "X");
+	ft.readCells(y, "Y");
+	ft.readCells(extension, "Extension");
+	ft.readCells(object, "Object");
+	ft.readCells(exposure, "Exposure");
+	ft.readCells(group, "Group");
+	ft.readCells(size, "GroupSize");
+	for (long i=0; i<x.size(); i++) {
+	  f.points.push_back(Point(x[i], y[i], extension[i], object[i], exposure[i]));
+	  cat->enqueue(f.points.back());
+	  reloaded.insert(std::make_pair(extension[i], object[i]));
+	  groupSize[group[i]] = size[i];
+	  ++groupLoaded[group[i]];
+	  groupTiles[group[i]].insert(t);
+	}
+      }
+      set<long> next;
+      for (auto& g : groupLoaded)
+	if (g.second < groupSize[g.first])
+	  for (auto t : groupTiles[g.first])
+	    addNeighbors(f, t, next);
+      wanted.clear();
+      for (auto t : next)
+	if (!loaded.count(t) && directory.count(t)) wanted.insert(t);
+    }
+    cerr << "Reloaded " << loaded.size() << " tiles of field " << f.name
+	 << " affinity " << key.second << endl;
+  }
+}
+
+void
+MatchIndex::write(const string& fileName, const vector<Field*>& fields) const {
+  {
+    FitsTable ft(fileName, FITS::ReadWrite + FITS::OverwriteFile, "MatchIndexInfo");
+    FTable ff = ft.use();
+    ff.header()->replace("TileSize", tileSize, "Index tile size (degrees)");
+    ff.header()->replace("MatchRadius", matchRadius, "FoF matching radius (degrees)");
+    ff.header()->replace("NextGroup", nextGroup, "Next unused group number");
+  }
+
+  // Rows of the old index in tiles that were not reloaded are carried over
+  map<Key, vector<Row> > all = rows;
+  if (!oldIndex.empty()) {
+    FITS::FitsFile ff(oldIndex);
+    for (int hdu=1; hdu<ff.HDUCount(); hdu++) {
+      FITS::Hdu h(oldIndex, FITS::HDUAny, hdu);
+      if (!stringstuff::nocaseEqual(h.getName(), "MatchIndex")) continue;
+      FTable ft = FitsTable(oldIndex, FITS::ReadOnly, hdu).extract();
+      Key key = keyOf(ft);
+      auto reloaded = reloadedTiles.find(key);
+      vector<long> tile;
+      vector<double> x;
+      vector<double> y;
+      vector<long> extension;
+      vector<long> object;
+      vector<int> exposure;
+      vector<long> group;
+      vector<long> size;
+      ft.readCells(tile, "Tile");
+      ft.readCells(x, "X");
+      ft.readCells(y, "Y");
+      ft.readCells(extension, "Extension");
+      ft.readCells(object, "Object");
+      ft.readCells(exposure, "Exposure");
+      ft.readCells(group, "Group");
+      ft.readCells(size, "GroupSize");
+      vector<Row>& v = all[key];
+      for (long i=0; i<tile.size(); i++) {
+	if (reloaded != reloadedTiles.end() && reloaded->second.count(tile[i])) continue;
+	Row r = {tile[i], x[i], y[i], extension[i], object[i], exposure[i], group[i], size[i]};
+	v.push_back(r);
+      }
+    }
+  }
+
+  for (auto& i : all) {
+    vector<Row>& v = i.second;
+    std::stable_sort(v.begin(), v.end(),
+		     [](const Row& lhs, const Row& rhs) {return lhs.tile < rhs.tile;});
+    vector<long> tile(v.size());
+    vector<double> x(v.size());
+    vector<double> y(v.size());
+    vector<long> extension(v.size());
+    vector<long> object(v.size());
+    vector<int> exposure(v.size());
+    vector<long> group(v.size());
+    vector<long> size(v.size());
+    vector<long> dirTile;
+    vector<long> dirFirst;
+    vector<long> dirRows;
+    for (long j=0; j<v.size(); j++) {
+      tile[j] = v[j].tile;
+      x[j] = v[j].x;
+      y[j] = v[j].y;
+      extension[j] = v[j].extension;
+      object[j] = v[j].object;
+      exposure[j] = v[j].exposure;
+      group[j] = v[j].group;
+      size[j] = v[j].groupSize;
+      if (dirTile.empty() || dirTile.back()!=tile[j]) {
+	dirTile.push_back(tile[j]);
+	dirFirst.push_back(j);
+	dirRows.push_back(0);
+      }
+      ++dirRows.back();
+    }
+    {
+      FitsTable ft(fileName, FITS::ReadWrite + FITS::Create, -1);
+      ft.setName("MatchIndex");
+      FTable ff = ft.use();
+      ff.header()->replace("Field", fields[i.first.first]->name, "Field name");
+      ff.header()->replace("FieldNum", i.first.first, "Field number");
+      ff.header()->replace("Affinity", i.first.second, "Affinity name");
+      ff.addColumn(tile, "Tile");
+      ff.addColumn(x, "X");
+      ff.addColumn(y, "Y");
+      ff.addColumn(extension, "Extension");
+      ff.addColumn(object, "Object");
+      ff.addColumn(exposure, "Exposure");
+      ff.addColumn(group, "Group");
+      ff.addColumn(size, "GroupSize");
+    }
+    {
+      // Directory of the tiles always follows its index table
+      FitsTable ft(fileName, FITS::ReadWrite + FITS::Create, -1);
+      ft.setName("MatchIndexTiles");
+      FTable ff = ft.use();
+      ff.header()->replace("FieldNum", i.first.first, "Field number");
+      ff.header()->replace("Affinity", i.first.second, "Affinity name");
+      ff.addColumn(dirTile, "Tile");
+      ff.addColumn(dirFirst, "FirstRow");
+      ff.addColumn(dirRows, "NRows");
+    }
+  }
+}
+
+// Write out and free every match of the field that no point with y >= boundary
+// can join, i.e. whose points all lie below boundary - matchRadius.  The
+// catalogs retire these matches from the cells that the boundary has passed
+// and keep the open ones in place.  Once most of the field's stored points
+// belong to finished matches, the points that remain open are moved into a
+// new store and queued for rematching in fresh catalogs; as this takes at
+// least as many finished points as open ones, the cost stays linear in the
+// number of points.  A boundary of +infinity finishes the field.
+// The finished groups are recorded in the index if there is one.
+void
+finishMatches(const vector<Field*>& fields, int iField, double boundary,
+	      MatchWriter& writer, MatchIndex* index) {
+  Field& f = *fields[iField];
+  bool finishing = boundary == std::numeric_limits<double>::infinity();
+  for (auto& c : f.catalogs) {
+    list<vector<const Point*> > finished;
+    if (finishing)
+      c.second->harvest(finished);
+    else
+      c.second->retire(boundary - f.matchRadius, finished);
+    for (auto& m : finished) f.retiredPoints += m.size();
+    if (index) index->add(fields, iField, c.first, finished);
+    writer.write(fields, iField, c.first, finished);
+  }
+  f.finishedBelow = std::max(f.finishedBelow, boundary);
+
+  if (finishing) {
+    // Field is done, release all of its memory
+    for (auto& c : f.catalogs) delete c.second;
+    f.catalogs.clear();
+    deque<Point>().swap(f.points);
+    f.retiredPoints = 0;
+    return;
+  }
+  if (2*f.retiredPoints <= static_cast<long>(f.points.size())) return;
+
+  // Rebuild the field with only its open matches
+  deque<Point> kept;
+  for (auto& c : f.catalogs) {
+    list<vector<const Point*> > open;
+    c.second->harvest(open);
+    vector<const Point*> survivors;
+    for (auto& m : open)
+      survivors.insert(survivors.end(), m.begin(), m.end());
+    delete c.second;
+    c.second = newPointCat(f.matchEngine,
+			   vector<double>(2, -f.extent), vector<double>(2, f.extent),
+			   f.matchRadius, f.matchTiles);
+    // Requeue in (extension, object) order so the rebuilt catalog is deterministic
+    std::sort(survivors.begin(), survivors.end(), pointLess);
+    for (auto p : survivors) {
+      kept.push_back(*p);
+      c.second->enqueue(kept.back());
+    }
+  }
+  // Swapping does not move the Points, so the queued pointers stay valid
+  f.points.swap(kept);
+  f.retiredPoints = 0;
+}
+
+// Copy the MatchCatalogs of an earlier output to the writer, leaving out
+// the matches having any reloaded point, since those are being rematched.
+void
+copyOldMatches(const string& oldCatalog, const vector<Field*>& fields,
+	       const set<std::pair<long,long> >& reloaded,
+	       MatchWriter& writer) {
+  vector<int> instrumentHDUs;
+  vector<int> catalogHDUs;
+  inventoryFitsTables(oldCatalog, instrumentHDUs, catalogHDUs);
+  for (auto hdu : catalogHDUs) {
+    FTable ft = FitsTable(oldCatalog, FITS::ReadOnly, hdu).extract();
+    int iField;
+    string affinity;
+    if (!ft.header()->getValue("FieldNum", iField)
+	|| !ft.header()->getValue("Affinity", affinity)
+	|| iField < 0 || iField >= fields.size()) {
+      cerr << "Invalid FieldNum or Affinity in extension " << hdu
+	   << " of " << oldCatalog << endl;
+      exit(1);
+    }
+    stripWhite(affinity);
+    vector<int> seqIn;
+    vector<long> extnIn;
+    vector<long> objIn;
+    ft.readCells(seqIn, "SequenceNumber");
+    ft.readCells(extnIn, "Extension");
+    ft.readCells(objIn, "Object");
+    vector<int> sequence;
+    vector<long> extn;
+    vector<long> obj;
+    bool keep = false;
+    for (long i=0; i<seqIn.size(); i++) {
+      if (seqIn[i]==0) {
+	// A match is kept or dropped as a whole, by its first point
+	keep = reloaded.count(std::make_pair(extnIn[i], objIn[i]))==0;
+	if (keep) ++writer.matchCount;
+      }
+      if (!keep) continue;
+      sequence.push_back(seqIn[i]);
+      extn.push_back(extnIn[i]);
+      obj.push_back(objIn[i]);
+    }
+    cerr << "...Carried over " << sequence.size() << " of " << seqIn.size()
+	 << " points for field " << fields[iField]->name
+	 << " affinity " << affinity << endl;
+    writer.appendRows(fields, iField, affinity, sequence, extn, obj);
+  }
+}
+
 // Right now a device is just a region of pixel coordinates, plus a name
 struct Device: public Bounds<double> {
   string name;
@@ -132,6 +1270,283 @@ public:
   }
 };
 
+// Everything needed from one input extension, as prepared by a reader thread
+struct ExtensionPoints {
+  long extensionNumber;
+  string filename;
+  int hduNumber;
+  int exposureNumber;
+  int instrumentNumber;
+  int fieldNumber;
+  int deviceNumber;
+  string affinity;
+  // Serialized WCS to put into WCSIN, empty if there is no new one
+  string wcsDump;
+  // Range of pixel coordinates of the objects
+  double xmin, xmax, ymin, ymax;
+  // Projected coordinates, ID, and star flag of each object
+  vector<double> xw;
+  vector<double> yw;
+  vector<long> id;
+  vector<bool> isStar;
+};
+
+// The pipeline of extensions from the reader threads to the main thread,
+// with the locks that the readers share
+class ReaderPipeline: public ExtensionPipeline<ExtensionPoints> {
+public:
+  ReaderPipeline(const vector<long>& order, int maxPending, FitsLocks& fitsLocks_):
+    ExtensionPipeline<ExtensionPoints>(order, maxPending), fitsLocks(fitsLocks_) {}
+  // Guards reads and writes of the extension table
+  std::mutex tableLock;
+  // Locks for the input FITS files
+  FitsLocks& fitsLocks;
+};
+
+// Read the objects of one extension and map them into the field's
+// coordinate system.
+void
+readExtension(long iextn, const FTable& extensionTable,
+	      const vector<Expo*>& exposures,
+	      const vector<Field*>& fields,
+	      ReaderPipeline& pipeline,
+	      WcsCache& wcsCache,
+	      ExtensionPoints& out) {
+  string idKey;
+  string wcsin;
+  string selectionExpression;
+  string starExpression;
+  string xKey;
+  string yKey;
+  {
+    std::lock_guard<std::mutex> lock(pipeline.tableLock);
+    extensionTable.readCell(out.filename, "FILENAME", iextn);
+    extensionTable.readCell(out.hduNumber, "EXTENSION", iextn);
+    extensionTable.readCell(idKey, "IDKEY",iextn);
+    extensionTable.readCell(out.exposureNumber, "Exposure", iextn);
+    extensionTable.readCell(out.deviceNumber, "Device", iextn);
+    extensionTable.readCell(wcsin, "WCSIN", iextn);
+    extensionTable.readCell(selectionExpression, "SELECT", iextn);
+    extensionTable.readCell(xKey, "XKEY", iextn);
+    extensionTable.readCell(yKey, "YKEY", iextn);
+    extensionTable.readCell(starExpression, "STARSELECT", iextn);
+    extensionTable.readCell(out.affinity, "AFFINITY", iextn);
+  }
+  stripWhite(out.filename);
+  out.extensionNumber = iextn;
+
+  // Read only the columns that we will use
+  FTable ft;
+  {
+    std::lock_guard<std::mutex> fileGuard(pipeline.fitsLocks.lockFor(out.filename));
+    FitsTable* fits;
+    {
+      std::unique_lock<std::mutex> openGuard = pipeline.fitsLocks.openClose();
+      fits = new FitsTable(out.filename, FITS::ReadOnly, out.hduNumber);
+    }
+    list<string> keys;
+    keys.push_back(xKey);
+    keys.push_back(yKey);
+    keys.push_back(idKey);
+    list<string> expressions;
+    expressions.push_back(selectionExpression);
+    expressions.push_back(starExpression);
+    vector<string> neededColumns = columnsUsed(fits->extract(0,0).listColumns(),
+					       keys, expressions);
+    ft = fits->extract(0, -1, neededColumns);
+    std::unique_lock<std::mutex> closeGuard = pipeline.fitsLocks.openClose();
+    delete fits;
+  }
+
+  if (stringstuff::nocaseEqual(idKey, "_ROW")) {
+    // Want the input table row number as ID column, so make such a column
+    vector<long> vi(ft.nrows());
+    for (int i=0; i<vi.size(); i++) vi[i] = i;
+    ft.addColumn(vi, "_ROW");
+  }
+
+  // Get instrument and field numbers
+  out.instrumentNumber = exposures[out.exposureNumber]->instrument;
+  out.fieldNumber = exposures[out.exposureNumber]->field;
+  const Field& field = *fields[out.fieldNumber];
+
+  // Now get the WCS for this extension
+  astrometry::Wcs* wcs = 0;
+  list<string> wcssplit = stringstuff::split(wcsin,'@');
+  if (wcssplit.size()==2) {
+    // @ sign signals that we are getting a map from a PMC
+    string wcsName = wcssplit.front();
+    string pmcFile = wcssplit.back();
+    // Replace any white space in wcs name with underscore:
+    wcsName = stringstuff::regexReplace("[[:space:]]+","_",wcsName);
+
+    wcs = wcsCache.fromFile(pmcFile, wcsName);
+    if (!wcs) {
+      cerr << "Could not read WCS <" << wcsName << "> from PixelMapCollection file <"
+	   << pmcFile << ">" << endl;
+      exit(1);
+    }
+  } else if (stringstuff::nocaseEqual(wcsin, "_ICRS")) {
+    // No mapping will be needed.  Do nothing.
+  } else {
+    // Assume that wcsin is a FITS WCS specification
+    wcs = wcsCache.tpv(wcsin);
+    if (!wcs) {
+      cerr << "Failed reading TPV WCS from extension " << iextn << endl;
+      exit(1);
+    }
+  }
+
+  // Now make a new serialized WCS for the table,
+  // and set projection to be the field coordinates
+  if (wcs) {
+    astrometry::PixelMapCollection pmc;
+    pmc.learnWcs(*wcs);
+    ostringstream oss;
+    pmc.writeWcs(oss,wcs->getName());
+    out.wcsDump = oss.str();
+    wcs->reprojectTo(*field.projection);
+  }
+
+  // Now begin reading the input data
+
+  // Filter the input rows and get the columns we want
+  stripWhite(selectionExpression);
+  if (!selectionExpression.empty())
+    ft.filterRows(selectionExpression);
+
+  vector<double> vx;
+  try {
+    ft.readCells(vx, xKey);
+  } catch (FTableError& m) {
+    // Trap for using float column in source file instead of double:
+    vector<float> vf;
+    ft.readCells(vf, xKey);
+    vx.resize(vf.size());
+    for (int i=0; i<vf.size(); i++) vx[i]=vf[i];
+  }
+  vector<double> vy;
+  try {
+    ft.readCells(vy, yKey);
+  } catch (FTableError& m) {
+    // Trap for using float column in source file instead of double:
+    vector<float> vf;
+    ft.readCells(vf, yKey);
+    vy.resize(vf.size());
+    for (int i=0; i<vf.size(); i++) vy[i]=vf[i];
+  }
+  try {
+    ft.readCells(out.id, idKey);
+  } catch (FTableError& m) {
+    // Trap for using int column in source file instead of long:
+    vector<int> vidint;
+    ft.readCells(vidint, idKey);
+    out.id.reserve(vidint.size());
+    out.id.insert(out.id.begin(), vidint.begin(), vidint.end());
+  }
+  out.isStar.assign(ft.nrows(), true);
+  stripWhite(starExpression);
+  if (!starExpression.empty())
+    ft.evaluate(out.isStar, starExpression);
+
+  // Each reader needs its own copy of the projection, which keeps state
+  astrometry::SphericalCoords* projection = wcs ? 0 : field.projection->duplicate();
+
+  // Now loops over objects in the catalog
+  out.xw.resize(vx.size());
+  out.yw.resize(vx.size());
+  for (int iObj = 0; iObj < vx.size(); iObj++) {
+    double xpix = vx[iObj];
+    double ypix = vy[iObj];
+    if (iObj==0) {
+      out.xmin = out.xmax = xpix;
+      out.ymin = out.ymax = ypix;
+    } else {
+      out.xmin = std::min(out.xmin, xpix);
+      out.xmax = std::max(out.xmax, xpix);
+      out.ymin = std::min(out.ymin, ypix);
+      out.ymax = std::max(out.ymax, ypix);
+    }
+	  
+    //  maps coords to field's tangent plane
+    double xw, yw;
+    if (wcs) {
+      wcs->toWorld(xpix, ypix, xw, yw);
+    } else {
+      // Already have RA, Dec, just project them
+      projection->convertFrom(astrometry::SphericalICRS(vx[iObj]*DEGREE, 
+							vy[iObj]*DEGREE ));
+      projection->getLonLat(xw, yw);
+      // Matching program will speak degrees, not radians:
+      xw /= DEGREE;
+      yw /= DEGREE;
+    }
+    out.xw[iObj] = xw;
+    out.yw[iObj] = yw;
+  } // end object loop
+
+  if (wcs) delete wcs;
+  if (projection) delete projection;
+}
+
+// Work of each reader thread: prepare extensions until none are left.
+void
+readerLoop(ReaderPipeline& pipeline,
+	   const FTable& extensionTable,
+	   const vector<Expo*>& exposures,
+	   const vector<Field*>& fields,
+	   WcsCache& wcsCache) {
+  try {
+    for (long iextn = pipeline.next(); iextn >= 0; iextn = pipeline.next()) {
+      ExtensionPoints* ep = new ExtensionPoints;
+      readExtension(iextn, extensionTable, exposures, fields, pipeline, wcsCache, *ep);
+      pipeline.put(iextn, ep);
+    }
+  } catch (std::runtime_error& e) {
+    quit(e,1);
+  }
+}
+
+// Write the Instrument tables, with the device bounds that were found, and
+// the Extensions table to the output file.
+void
+writeInstrumentTables(const string& outCatalogName,
+		      const vector<Instr*>& instruments,
+		      vector<FTable>& instrumentTables,
+		      const FTable& extensionTable) {
+  for (int i=0; i<instruments.size(); i++) {
+    // Instrument tables
+    // Update the device bounds in the table first
+    const Instr& inst = *instruments[i];
+    int nDevices = inst.size();
+    vector<double> vxmin(nDevices);
+    vector<double> vxmax(nDevices);
+    vector<double> vymin(nDevices);
+    vector<double> vymax(nDevices);
+    for (int j=0; j<nDevices; j++) {
+      vxmin[j] = floor(inst[j].getXMin());
+      vxmax[j] = ceil(inst[j].getXMax());
+      vymin[j] = floor(inst[j].getYMin());
+      vymax[j] = ceil(inst[j].getYMax());
+    }
+    instrumentTables[i].writeCells(vxmin, "XMin");
+    instrumentTables[i].writeCells(vxmax, "XMax");
+    instrumentTables[i].writeCells(vymin, "YMin");
+    instrumentTables[i].writeCells(vymax, "YMax");
+
+    FitsTable ft(outCatalogName, FITS::ReadWrite + FITS::Create, -1);
+    ft.setName("Instrument");
+    ft.setVersion(i+1); // might use this later, or put into extension name???
+    ft.copy(instrumentTables[i]);
+  }
+
+  {
+    // Extension table
+    FitsTable ft(outCatalogName, FITS::ReadWrite + FITS::Create, "Extensions");
+    ft.copy(extensionTable);
+  }
+}
+
 int
 main(int argc,
      char *argv[])
@@ -142,6 +1557,22 @@ main(int argc,
   string outCatalogName;
   int minMatches;
   bool allowSelfMatches;
+  string matchEngine;
+  int matchTiles;
+  int readerThreads;
+  double streamRadius;
+  string indexName;
+  string binaryName;
+  double indexTile;
+  string updateFrom;
+  string updateIndex;
+  string fieldSubset;
+  int shardIndex;
+  int shardCount;
+  double skyTile;
+  int maxMatchSize;
+  double maxMatchExtent;
+  double orderCell;
 
   Pset parameters;
   {
@@ -161,6 +1592,42 @@ main(int argc,
 			 "Minimum number of detections for usable match", 2, 2);
     parameters.addMember("selfMatch",&allowSelfMatches, def,
 			 "Retain matches that have 2 elements from same exposure?", false);
+    parameters.addMember("matchEngine",&matchEngine, def,
+			 "FoF engine: tree, grid, unionfind, or tiled", "tree");
+    parameters.addMember("matchTiles",&matchTiles, def | low,
+			 "Tiles per axis of each field for the tiled engine", 8, 1);
+    parameters.addMember("readerThreads",&readerThreads, def | low,
+			 "Number of threads reading input catalogs", 4, 1);
+    parameters.addMember("streamRadius",&streamRadius, def | low,
+			 "Max distance (deg) of detections from their exposure pointing "
+			 "for streaming output, 0 to keep all matches until the end", 0., 0.);
+    parameters.addMember("indexName",&indexName, def,
+			 "filename for spatial index of the matches, none if blank", "");
+    parameters.addMember("binaryName",&binaryName, def,
+			 "filename for binary copy of the match catalogs, none if blank", "");
+    parameters.addMember("indexTile",&indexTile, def | lowopen,
+			 "Tile size of the spatial index (arcsec)", 60., 0.);
+    parameters.addMember("updateFrom",&updateFrom, def,
+			 "Existing output catalog to add new extensions to, none if blank", "");
+    parameters.addMember("updateIndex",&updateIndex, def,
+			 "Spatial index of the updateFrom catalog", "");
+    parameters.addMember("fields",&fieldSubset, def,
+			 "Names of the fields to match, all if blank", "");
+    parameters.addMember("shardIndex",&shardIndex, def | low,
+			 "Which of the shardCount shards of the fields to match", 0, 0);
+    parameters.addMember("shardCount",&shardCount, def | low,
+			 "Number of shards the fields are divided into", 1, 1);
+    parameters.addMember("skyTile",&skyTile, def | low | up,
+			 "Size (deg) of sky tiles for matching in RA/Dec, 0 to match in field planes",
+			 0., 0., 3.);
+    parameters.addMember("maxMatchSize",&maxMatchSize, def | low,
+			 "Split matches having more detections than this, 0 for no limit", 0, 0);
+    parameters.addMember("maxMatchExtent",&maxMatchExtent, def | low,
+			 "Split matches having a detection farther than this from their mean (arcsec),"
+			 " 0 for no limit", 0., 0.);
+    parameters.addMember("orderCell",&orderCell, def | low,
+			 "Cell size (arcsec) for ordering output matches along a Hilbert curve,"
+			 " 0 to order by first detection", 60., 0.);
   }
 
   ////////////////////////////////////////////////
@@ -173,6 +1640,58 @@ main(int argc,
 
   // Convert matching radius to our system units for world coords (degrees)
   matchRadius *= ARCSEC/DEGREE;
+  maxMatchExtent *= ARCSEC/DEGREE;
+  orderCell *= ARCSEC/DEGREE;
+
+  if (!stringstuff::nocaseEqual(matchEngine, "tree")
+      && !stringstuff::nocaseEqual(matchEngine, "grid")
+      && !stringstuff::nocaseEqual(matchEngine, "unionfind")
+      && !stringstuff::nocaseEqual(matchEngine, "tiled")) {
+    cerr << "matchEngine must be tree, grid, unionfind, or tiled, not <"
+	 << matchEngine << ">" << endl;
+    exit(1);
+  }
+  if (streamRadius > 0.
+      && !stringstuff::nocaseEqual(matchEngine, "tree")
+      && !stringstuff::nocaseEqual(matchEngine, "grid")) {
+    cerr << "streamRadius requires matchEngine tree or grid" << endl;
+    exit(1);
+  }
+
+  if (shardIndex >= shardCount) {
+    cerr << "shardIndex must be less than shardCount" << endl;
+    exit(1);
+  }
+  bool sharded = !fieldSubset.empty() || shardCount > 1;
+
+  bool updating = !updateFrom.empty();
+  if (skyTile > 0. && (streamRadius > 0. || updating || !indexName.empty())) {
+    cerr << "skyTile cannot be combined with streamRadius, indexName, or updateFrom" << endl;
+    exit(1);
+  }
+  if (skyTile > 0. && skyTile < matchRadius) {
+    cerr << "skyTile must be larger than matchRadius" << endl;
+    exit(1);
+  }
+  indexTile *= ARCSEC/DEGREE;
+  if (indexTile < matchRadius) {
+    cerr << "indexTile must be at least matchRadius" << endl;
+    exit(1);
+  }
+  if (updating) {
+    if (updateIndex.empty()) {
+      cerr << "updateFrom requires the updateIndex of its catalog" << endl;
+      exit(1);
+    }
+    if (streamRadius > 0.) {
+      cerr << "Cannot use streamRadius when updating a catalog" << endl;
+      exit(1);
+    }
+    if (updateFrom==outCatalogName || updateIndex==indexName) {
+      cerr << "Updated catalog and index must go to new files" << endl;
+      exit(1);
+    }
+  }
 
   try {
     // Teach PixelMapCollection about all types of PixelMaps it might need to deserialize
@@ -202,14 +1721,63 @@ main(int argc,
 
       Field* f = new Field;
       f->name = name;
-      astrometry::Orientation orient(astrometry::SphericalICRS(ra*DEGREE, dec*DEGREE));
-      f->projection = new astrometry::Gnomonic(orient);
+      if (skyTile > 0.) {
+	// Points keep their RA and Dec, and each sky tile has its own projection
+	f->projection = new astrometry::SphericalICRS;
+	f->skyTile = skyTile;
+      } else {
+	astrometry::Orientation orient(astrometry::SphericalICRS(ra*DEGREE, dec*DEGREE));
+	f->projection = new astrometry::Gnomonic(orient);
+      }
       f->extent = extent;
       f->matchRadius = matchRadius;
+      f->matchEngine = matchEngine;
+      f->matchTiles = matchTiles;
       fields.push_back(f);
     } // Done reading fields
     Assert(!fields.empty());
 
+    if (sharded) {
+      // Fields are dealt to shards in turn; a subset further limits them
+      set<string> subset;
+      for (auto name : stringstuff::split(fieldSubset, DefaultListSeperator)) {
+	stripWhite(name);
+	if (!name.empty()) subset.insert(name);
+      }
+      for (auto name : subset) {
+	bool found = false;
+	for (auto f : fields)
+	  if (f->name==name) found = true;
+	if (!found) {
+	  cerr << "Unknown field <" << name << "> in fields parameter" << endl;
+	  exit(1);
+	}
+      }
+      for (int i=0; i<fields.size(); i++)
+	fields[i]->selected = (i % shardCount == shardIndex)
+	  && (subset.empty() || subset.count(fields[i]->name));
+      // Record which fields this shard matched, for FoFMerge
+      vector<bool> matched(fields.size());
+      for (int i=0; i<fields.size(); i++)
+	matched[i] = fields[i]->selected;
+      fieldTable.addColumn(matched, "Matched");
+    }
+
+    if (updating) {
+      // The fields must be those of the catalog being updated
+      FTable oldFields = FitsTable(updateFrom, FITS::ReadOnly, "Fields").extract();
+      bool same = oldFields.nrows()==fields.size();
+      for (int i=0; same && i<fields.size(); i++) {
+	string name;
+	oldFields.readCell(name, "NAME", i);
+	same = name==fields[i]->name;
+      }
+      if (!same) {
+	cerr << "Fields of " << configFile << " differ from those of " << updateFrom << endl;
+	exit(1);
+      }
+    }
+
     /**/cerr << "Read fields" << endl;
 
     // Now read in all the instrument tables
@@ -253,6 +1821,30 @@ main(int argc,
 	exit(1);
       }
 
+    if (updating) {
+      // Start from the device bounds found for the catalog being updated
+      vector<int> oldInstrumentHDUs;
+      vector<int> oldCatalogHDUs;
+      inventoryFitsTables(updateFrom, oldInstrumentHDUs, oldCatalogHDUs);
+      for (auto hdu : oldInstrumentHDUs) {
+	FTable ft = FitsTable(updateFrom, FITS::ReadOnly, hdu).extract();
+	int instrumentNumber;
+	if (!ft.header()->getValue("Number", instrumentNumber)
+	    || instrumentNumber < 0 || instrumentNumber >= instruments.size()) {
+	  cerr << "Invalid instrument number at extension " << hdu
+	       << " of " << updateFrom << endl;
+	  exit(1);
+	}
+	Instr oldInstrument(ft);
+	Instr& inst = *instruments[instrumentNumber];
+	for (int j=0; j<oldInstrument.size() && j<inst.size(); j++)
+	  if (oldInstrument[j].isDefined()) {
+	    inst[j] += Position<double>(oldInstrument[j].getXMin(), oldInstrument[j].getYMin());
+	    inst[j] += Position<double>(oldInstrument[j].getXMax(), oldInstrument[j].getYMax());
+	  }
+      }
+    }
+
 
     // Now get information on exposures
     FTable exposureTable;
@@ -270,11 +1862,13 @@ main(int argc,
     }
     Assert(exposures.size() == exposureTable.nrows());
 	   
-    // And a list holding all Points being matched.  Note that catalogs do not make copies
-    // of the Points, they just hold pointers to them.  So this is a warehouse.
-    // If we wanted to save the memory of the list links we could just let all the Points
-    // be zombies that are destroyed when the program ends.
-    list<Point> allPoints;
+    // Points are queued for their catalogs and matched in batches of this size
+    const long MATCH_QUEUE_POINTS = 10000000;
+    // Smaller batches when streaming, so that finished matches are freed promptly
+    const long STREAM_QUEUE_POINTS = 1000000;
+    bool streaming = streamRadius > 0.;
+    long queuedPoints = 0;
+    long pointsRead = 0;
 
     // Table of information about every catalog file to read:
     FTable extensionTable;
@@ -284,326 +1878,217 @@ main(int argc,
       quit(e,1);
     }
 
-    // If WCS is coming from a serialized PixelMapCollection, I'll keep last-used one around
-    // to avoid re-parsing it all the time:
-    string currentPixelMapCollectionFileName = "";
-    astrometry::PixelMapCollection* inputPmc=0;
-
-    // Loop over input catalogs
-    for (long iextn = 0; iextn < extensionTable.nrows(); iextn++) {
-      string filename;
-      extensionTable.readCell(filename, "FILENAME", iextn);
-      stripWhite(filename);
-      int hduNumber;
-      extensionTable.readCell(hduNumber, "EXTENSION", iextn);
-
-      /**/if (iextn%10==0) cerr << "# Reading object catalog " << iextn
-				<< "/" << extensionTable.nrows()
-			       << " in " << filename 
-			       << " HDU #" << hduNumber
-			       << endl;
-      FTable ft = FitsTable(filename, FITS::ReadOnly, hduNumber).extract();
-
-      string idKey;
-      extensionTable.readCell(idKey, "IDKEY",iextn);
-      
-      if (stringstuff::nocaseEqual(idKey, "_ROW")) {
-	// Want the input table row number as ID column, so make such a column
-	vector<long> vi(ft.nrows());
-	for (int i=0; i<vi.size(); i++) vi[i] = i;
-	ft.addColumn(vi, "_ROW");
+    // When updating, the config's exposures and extensions must begin with
+    // those of the catalog being updated, and only the rest are read.
+    long nOldExtensions = 0;
+    if (updating) {
+      FTable oldExposures = FitsTable(updateFrom, FITS::ReadOnly, "Exposures").extract();
+      bool same = oldExposures.nrows() <= exposureTable.nrows();
+      for (long i=0; same && i<oldExposures.nrows(); i++) {
+	string name;
+	oldExposures.readCell(name, "Name", i);
+	same = name==exposures[i]->name;
       }
-
-      // Get exposure number, instrument, field, and device numbers
-      int exposureNumber;
-      extensionTable.readCell(exposureNumber, "Exposure", iextn);
-      int instrumentNumber = exposures[exposureNumber]->instrument;
-      int fieldNumber = exposures[exposureNumber]->field;
-      int deviceNumber;
-      extensionTable.readCell(deviceNumber, "Device", iextn);
-
-      // Now get the WCS for this extension
-      astrometry::Wcs* wcs = 0;
-      string wcsin;
-      extensionTable.readCell(wcsin, "WCSIN", iextn);
-      list<string> wcssplit = stringstuff::split(wcsin,'@');
-      if (wcssplit.size()==2) {
-	// @ sign signals that we are getting a map from a PMC
-	string wcsName = wcssplit.front();
-	string pmcFile = wcssplit.back();
-	// Replace any white space in wcs name with underscore:
-	wcsName = stringstuff::regexReplace("[[:space:]]+","_",wcsName);
-
-	if (pmcFile!=currentPixelMapCollectionFileName) {
-	  // Need to open this PMC file
-	  // Try opening file as new serialized PMC
-	  ifstream wcsStream(pmcFile.c_str());
-	  if (!wcsStream.is_open()) {
-	    cerr << "Could not open PixelMapCollection file <" << pmcFile 
-		 << ">" << endl;
-	    exit(1);
-	  }
-	  astrometry::PixelMapCollection* tryPMC = new astrometry::PixelMapCollection;
-	  if (tryPMC->read(wcsStream)) {
-	    // Successfully found serialized file:
-	    if (inputPmc) delete inputPmc;
-	    inputPmc = tryPMC;
-	    currentPixelMapCollectionFileName = pmcFile;
-	  } else {
-	    cerr << "Failed deserializing PixelMapCollection file <" << pmcFile 
-		 << ">" << endl;
-	    exit(1);
-	  }
-	} // Done reading the pmcFile
-
-	// Read the wcs from the collection
-	wcs = inputPmc->issueWcs(wcsName)->duplicate();
-      } else if (stringstuff::nocaseEqual(wcsin, "_ICRS")) {
-	// No mapping will be needed.  Do nothing.
-      } else {
-	// Assume that wcsin is a FITS WCS specification
-	Header wcsHead;
-	//	wcsin += "\nEND\n";  //*** hack to fix problem in astropy.io.fits
-	istringstream wcsStream(wcsin);
-	if (!(wcsStream >> wcsHead)) {
-	  cerr << "Error reading WCS/header from WCSIN at extension " << iextn << endl;
-	  exit(1);
-	}
-	wcs = astrometry::readTPV(wcsHead);
-	if (!wcs) {
-	  cerr << "Failed reading TPV WCS from extension " << iextn << endl;
-	  exit(1);
-	}
+      FTable oldExtensions = FitsTable(updateFrom, FITS::ReadOnly, "Extensions").extract();
+      nOldExtensions = oldExtensions.nrows();
+      same = same && nOldExtensions <= extensionTable.nrows();
+      for (long i=0; same && i<nOldExtensions; i++) {
+	string oldFile, newFile;
+	int oldHdu, newHdu;
+	oldExtensions.readCell(oldFile, "FILENAME", i);
+	extensionTable.readCell(newFile, "FILENAME", i);
+	oldExtensions.readCell(oldHdu, "EXTENSION", i);
+	extensionTable.readCell(newHdu, "EXTENSION", i);
+	same = oldFile==newFile && oldHdu==newHdu;
       }
+      if (!same) {
+	cerr << "Exposures and Extensions of " << configFile
+	     << " do not begin with those of " << updateFrom << endl;
+	exit(1);
+      }
+      // Keep the WCS's that were serialized for the old extensions
+      vector<string> wcsin;
+      oldExtensions.readCells(wcsin, "WCSIN");
+      extensionTable.writeCells(wcsin, "WCSIN", 0);
+      cerr << "Adding " << extensionTable.nrows() - nOldExtensions
+	   << " extensions to the " << nOldExtensions << " of " << updateFrom << endl;
+    }
 
-      // Now replace WCSIN in table with a new serialized one, 
-      // and set projection to be the field coordinates
-      if (wcs) {
-	string wcsDump;
-	astrometry::PixelMapCollection pmc;
-	pmc.learnWcs(*wcs);
-	ostringstream oss;
-	pmc.writeWcs(oss,wcs->getName());
-	wcsDump = oss.str();
-	wcs->reprojectTo(*fields[fieldNumber]->projection);
-	extensionTable.writeCell(wcsDump, "WCSIN", iextn);
+    // Order in which extensions are matched.  When streaming, each field's
+    // extensions are swept in increasing y (roughly declination) of their
+    // exposure pointings.  The sweep value of an extension is the lowest y
+    // its detections may have, which is -infinity for reference and tag
+    // exposures since they usually cover the whole field.
+    // Extensions of fields left to other shards are skipped.
+    vector<long> order;
+    vector<double> sweep(extensionTable.nrows(), -std::numeric_limits<double>::infinity());
+    vector<int> extensionField(extensionTable.nrows());
+    for (long i=nOldExtensions; i<extensionTable.nrows(); i++) {
+      int iExposure;
+      extensionTable.readCell(iExposure, "Exposure", i);
+      const Expo& expo = *exposures[iExposure];
+      extensionField[i] = expo.field;
+      if (!fields[expo.field]->selected) continue;
+      order.push_back(i);
+      if (streaming && expo.instrument >= 0) {
+	astrometry::SphericalCoords* projection = fields[expo.field]->projection;
+	projection->convertFrom(expo.pointing);
+	double lon, lat;
+	projection->getLonLat(lon, lat);
+	sweep[i] = lat/DEGREE - streamRadius;
       }
+    }
+    if (streaming)
+      std::stable_sort(order.begin(), order.end(),
+		       [&](long lhs, long rhs) {
+			 if (extensionField[lhs] != extensionField[rhs])
+			   return extensionField[lhs] < extensionField[rhs];
+			 return sweep[lhs] < sweep[rhs];
+		       });
+
+    // Tables that do not change are written first.  When streaming, the
+    // match catalogs follow as their matches are finished, and the
+    // Instrument and Extensions tables come last, as they are only complete
+    // once all extensions are read.  Otherwise these tables are written
+    // before the match catalogs, as they always have been.
+    {
+      // Fields
+      FitsTable ft(outCatalogName, FITS::ReadWrite + FITS::OverwriteFile, "Fields");
+      ft.copy(fieldTable);
+    }
+    {
+      // Exposures
+      FitsTable ft(outCatalogName, FITS::ReadWrite + FITS::Create, "Exposures");
+      ft.copy(exposureTable);
+    }
+    // Primary HDU, Fields, Exposures, and unless streaming the Instrument
+    // and Extensions tables, precede the match catalogs
+    int firstMatchHdu = streaming ? 3 : 3 + instruments.size() + 1;
+    MatchSplitter splitter(maxMatchSize, maxMatchExtent, allowSelfMatches);
+    BinaryMatches::Writer binary(binaryName);
+    // Locks for the FITS files used by the reader threads and the writer
+    FitsLocks fitsLocks;
+    MatchWriter writer(outCatalogName, firstMatchHdu, minMatches, allowSelfMatches, splitter,
+		       orderCell, binaryName.empty() ? 0 : &binary, fitsLocks);
+    // Spatial index of the matches, which is also used to read back the
+    // neighbors of new points when updating
+    MatchIndex index(indexTile, matchRadius);
+    MatchIndex* indexOut = indexName.empty() ? 0 : &index;
 
-      // Now begin reading the input data
+    // Reader threads prepare the extensions' points, and this thread
+    // takes them in order to fill the catalogs.
+    ReaderPipeline pipeline(order, 2*readerThreads, fitsLocks);
+    // One parse of each distinct input WCS, shared by the readers (see WcsCache.h)
+    WcsCache wcsCache;
+    vector<std::thread> readers;
+    for (int i=0; i<readerThreads; i++)
+      readers.push_back(std::thread(readerLoop, std::ref(pipeline),
+				    std::cref(extensionTable),
+				    std::cref(exposures), std::cref(fields),
+				    std::ref(wcsCache)));
 
-      // Filter the input rows and get the columns we want
-      {
-	string selectionExpression;
-	extensionTable.readCell(selectionExpression, "SELECT", iextn);
-	stripWhite(selectionExpression);
-	if (!selectionExpression.empty())
-	  ft.filterRows(selectionExpression);
-      }
-      vector<double> vx;
-      string key;
-      extensionTable.readCell(key, "XKEY", iextn);
-      try {
-	ft.readCells(vx, key);
-      } catch (FTableError& m) {
-	// Trap for using float column in source file instead of double:
-	vector<float> vf;
-	ft.readCells(vf, key);
-	vx.resize(vf.size());
-	for (int i=0; i<vf.size(); i++) vx[i]=vf[i];
-      }
-      vector<double> vy;
-      extensionTable.readCell(key, "YKEY", iextn);
-      try {
-	ft.readCells(vy, key);
-      } catch (FTableError& m) {
-	// Trap for using float column in source file instead of double:
-	vector<float> vf;
-	ft.readCells(vf, key);
-	vy.resize(vf.size());
-	for (int i=0; i<vf.size(); i++) vy[i]=vf[i];
-      }
-      vector<long> vid;
-      extensionTable.readCell(key, "IDKEY", iextn);
-      try {
-	ft.readCells(vid, key);
-      } catch (FTableError& m) {
-	// Trap for using int column in source file instead of long:
-	vector<int> vidint;
-	ft.readCells(vidint, key);
-	vid.reserve(vidint.size());
-	vid.insert(vid.begin(), vidint.begin(), vidint.end());
+    long consumed = 0;
+    for (ExtensionPoints* ep = pipeline.get(); ep; ep = pipeline.get(), ++consumed) {
+      long iextn = ep->extensionNumber;
+      if (consumed%10==0) cerr << "# Read object catalog " << iextn
+			       << " (" << consumed << "/" << order.size()
+			       << ") in " << ep->filename
+			       << " HDU #" << ep->hduNumber
+			       << endl;
+
+      // Replace WCSIN in table with the new serialized one
+      if (!ep->wcsDump.empty()) {
+	std::lock_guard<std::mutex> lock(pipeline.tableLock);
+	extensionTable.writeCell(ep->wcsDump, "WCSIN", iextn);
       }
-      vector<bool> isStar(ft.nrows(), true);
-      {
-	string starExpression;
-	extensionTable.readCell(starExpression, "STARSELECT", iextn);
-	stripWhite(starExpression);
-	if (!starExpression.empty())
-	  ft.evaluate(isStar, starExpression);
+
+      // Expand bounds of device:
+      if (ep->instrumentNumber >=0 && !ep->xw.empty()) {
+	Device& d = (*instruments[ep->instrumentNumber])[ep->deviceNumber];
+	d += Position<double>(ep->xmin, ep->ymin);
+	d += Position<double>(ep->xmax, ep->ymax);
       }
 
       // Select the Catalog(s) to which points from this extension will be added
-      string thisAffinity;
-      extensionTable.readCell(thisAffinity, "AFFINITY", iextn);
-
-      PointCat* starCatalog = fields[fieldNumber]->catalogFor(stellarAffinity);
+      Field* f = fields[ep->fieldNumber];
+      PointCat* starCatalog = f->catalogFor(stellarAffinity);
       PointCat* galaxyCatalog = (stringstuff::nocaseEqual(stellarAffinity,
-							  thisAffinity) ?
+							  ep->affinity) ?
 				 starCatalog : 
-				 fields[fieldNumber]->catalogFor(thisAffinity));
-	
-      // Now loops over objects in the catalog
-      for (int iObj = 0; iObj < vx.size(); iObj++) {
-	double xpix = vx[iObj];
-	double ypix = vy[iObj];
-	// Expand bounds of device:
-	if (instrumentNumber >=0) 
-	  (*instruments[instrumentNumber])[deviceNumber]+=Position<double>(xpix,ypix);
-	  
-	//  maps coords to field's tangent plane
-	double xw, yw;
-	if (wcs) {
-	  Assert(wcs);
-	  wcs->toWorld(xpix, ypix, xw, yw);
-	} else {
-	  // Already have RA, Dec, just project them
-	  fields[fieldNumber]->projection->convertFrom(astrometry::SphericalICRS(vx[iObj]*DEGREE, 
-										 vy[iObj]*DEGREE ));
-	  fields[fieldNumber]->projection->getLonLat(xw, yw);
-	  // Matching program will speak degrees, not radians:
-	  xw /= DEGREE;
-	  yw /= DEGREE;
-	}
-
-	allPoints.push_back(Point(xw, yw, iextn, vid[iObj], exposureNumber));
+				 f->catalogFor(ep->affinity));
 
-	// Now we match!!!!
-	if (isStar[iObj])
-	  starCatalog->add(allPoints.back());
+      for (long iObj = 0; iObj < ep->xw.size(); iObj++) {
+	if (ep->yw[iObj] < f->finishedBelow) {
+	  cerr << "Object " << ep->id[iObj] << " of extension " << iextn
+	       << " lies below matches that have already been written."
+	       << "  Increase streamRadius." << endl;
+	  exit(1);
+	}
+	f->points.push_back(Point(ep->xw[iObj], ep->yw[iObj],
+				  iextn, ep->id[iObj], ep->exposureNumber));
+	// Queue for matching
+	if (ep->isStar[iObj])
+	  starCatalog->enqueue(f->points.back());
 	else
-	  galaxyCatalog->add(allPoints.back());
+	  galaxyCatalog->enqueue(f->points.back());
+	++queuedPoints;
+	++pointsRead;
       } // end object loop
+      int iField = ep->fieldNumber;
+      delete ep;
 
-      if (wcs) delete wcs;
+      if (streaming) {
+	// Lowest y still to come in this field
+	long nextPosition = consumed+1;
+	double boundary = (nextPosition < order.size()
+			   && extensionField[order[nextPosition]]==iField) ?
+	  sweep[order[nextPosition]] : std::numeric_limits<double>::infinity();
+	if (queuedPoints >= STREAM_QUEUE_POINTS
+	    || boundary == std::numeric_limits<double>::infinity()) {
+	  matchQueues(fields);
+	  finishMatches(fields, iField, boundary, writer, indexOut);
+	  // Rematch the points that remain open
+	  matchQueues(fields);
+	  queuedPoints = 0;
+	}
+      } else if (queuedPoints >= MATCH_QUEUE_POINTS) {
+	// Now we match!!!!
+	matchQueues(fields);
+	queuedPoints = 0;
+      }
     } // end input extension loop
 
-    if (inputPmc) delete inputPmc;
+    for (auto& t : readers) t.join();
+    matchQueues(fields);
+    if (!streaming)
+      writeInstrumentTables(outCatalogName, instruments, instrumentTables, extensionTable);
 
-    cerr << "*** Read " << allPoints.size() << " objects" << endl;
+    cerr << "*** Read " << pointsRead << " objects" << endl;
 
-    //  Write all of our tables to output file
-    {
-      // Fields
-      FitsTable ft(outCatalogName, FITS::ReadWrite + FITS::OverwriteFile, "Fields");
-      ft.copy(fieldTable);
-    }
-    {
-      // Exposures
-      FitsTable ft(outCatalogName, FITS::ReadWrite + FITS::Create, "Exposures");
-      ft.copy(exposureTable);
+    if (updating) {
+      // Bring back the old points near the new ones and rematch them, then
+      // carry over the old matches that none of them belonged to.
+      set<std::pair<long,long> > reloaded;
+      index.load(updateIndex, fields, reloaded);
+      matchQueues(fields);
+      copyOldMatches(updateFrom, fields, reloaded, writer);
     }
 
-    for (int i=0; i<instruments.size(); i++) {
-      // Instrument tables
-      // Update the device bounds in the table first
-      const Instr& inst = *instruments[i];
-      int nDevices = inst.size();
-      vector<double> vxmin(nDevices);
-      vector<double> vxmax(nDevices);
-      vector<double> vymin(nDevices);
-      vector<double> vymax(nDevices);
-      for (int j=0; j<nDevices; j++) {
-	vxmin[j] = floor(inst[j].getXMin());
-	vxmax[j] = ceil(inst[j].getXMax());
-	vymin[j] = floor(inst[j].getYMin());
-	vymax[j] = ceil(inst[j].getYMax());
-      }
-      instrumentTables[i].writeCells(vxmin, "XMin");
-      instrumentTables[i].writeCells(vxmax, "XMax");
-      instrumentTables[i].writeCells(vymin, "YMin");
-      instrumentTables[i].writeCells(vymax, "YMax");
+    // Now write all the remaining matches
+    for (int iField=0; iField<fields.size(); iField++)
+      finishMatches(fields, iField, std::numeric_limits<double>::infinity(),
+		    writer, indexOut);
 
-      FitsTable ft(outCatalogName, FITS::ReadWrite + FITS::Create, -1);
-      ft.setName("Instrument");
-      ft.setVersion(i+1); // might use this later, or put into extension name???
-      ft.copy(instrumentTables[i]);
-    }
+    if (streaming)
+      writeInstrumentTables(outCatalogName, instruments, instrumentTables, extensionTable);
 
-    {
-      // Extension table
-      FitsTable ft(outCatalogName, FITS::ReadWrite + FITS::Create, "Extensions");
-      ft.copy(extensionTable);
-    }
-
-    // Now write all the match catalogs
-    long matchCount = 0;
-    long pointCount = 0;
-    //  Loop over fields
-    for (int iField=0; iField<fields.size(); iField++) {
-      //  loop over affinities per field
-      for (Field::CatMap::iterator iAffinity=fields[iField]->catalogs.begin();
-	   iAffinity != fields[iField]->catalogs.end();
-	   ++iAffinity) {
-	const PointCat* pcat= iAffinity->second;
-	cerr << "Catalog for field " << fields[iField]->name
-	     << " affinity " << iAffinity->first
-	     << " with " << pcat->size() << " matches "
-	     << endl;
-	if (pcat->empty()) continue;
-	FitsTable ft(outCatalogName, FITS::ReadWrite + FITS::Create, -1);
-	ft.setName("MatchCatalog");
-	FTable ff=ft.use();
-	ff.header()->replace("Field", fields[iField]->name, "Field name");
-	ff.header()->replace("FieldNum", iField, "Field number");
-	ff.header()->replace("Affinity", iAffinity->first, "Affinity name");
-
-	vector<int> sequence;
-	vector<long> extn;
-	vector<long> obj;
-	long matches=0;
-	// Now loop through matches in this catalog
-	for (PointCat::const_iterator j=pcat->begin();
-	     j != pcat->end();
-	     ++j) {
-	  // Skip any Match that is below minimum match size
-	  if ((*j)->size() < minMatches) continue;
-	  bool selfMatch = false;
-	  if (!allowSelfMatches) {
-	    set<long> itsExposures;
-	    for (list<const Point*>::const_iterator k=(*j)->begin();
-		 k != (*j)->end();
-		 ++k) 
-	      if ( !itsExposures.insert((*k)->exposureNumber).second) {
-		selfMatch = true;
-		break;
-	      }
-	  }
-	  if (selfMatch) continue;
-
-	  // Add elements of this match to the output vectors
-	  int seq=0;
-	  ++matches;
-	  ++matchCount;
-	  for (list<const Point*>::const_iterator k=(*j)->begin();
-	       k != (*j)->end();
-	       ++k, ++seq) {
-	    sequence.push_back(seq);
-	    extn.push_back((*k)->extensionNumber);
-	    obj.push_back((*k)->objectNumber);
-	  }
-	} // end match loop
-	cerr << "...Kept " << matches << " matches with " << sequence.size()
-	     << " points." << endl;
-	pointCount += sequence.size();
-	ff.addColumn(sequence, "SequenceNumber");
-	ff.addColumn(extn, "Extension");
-	ff.addColumn(obj, "Object");
-      } // end Affinity loop
-    } // end Field loop
-    
-    cerr << "Total of " << matchCount
-	 << " matches with " << pointCount
+    if (indexOut) indexOut->write(indexName, fields);
+    if (!binaryName.empty()) binary.close(extensionTable.nrows());
+
+    cerr << "Total of " << writer.matchCount
+	 << " matches with " << writer.pointCount
 	 << " points." << endl;
+    writer.reportSizes(cerr);
 
     // Clean up
     cerr << "Cleaning fields: " << endl;
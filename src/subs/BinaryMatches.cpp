@@ -0,0 +1,200 @@
+// Binary compressed-sparse-row copy of the MatchCatalogs
+#include "BinaryMatches.h"
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+  const char MAGIC[8] = {'G','B','M','A','T','C','H','1'};
+  const int HEADER_ENTRIES = 5;
+}
+
+BinaryMatches::BinaryMatches(const string& filename):
+  file(filename) {
+  const char* base = file.data();
+  size_t length = file.size();
+  if (length < (HEADER_ENTRIES+1)*sizeof(int64_t)
+      || std::memcmp(base, MAGIC, 8) != 0
+      || std::memcmp(base + length - 8, MAGIC, 8) != 0)
+    throw std::runtime_error(filename + " is not a binary match file");
+  const int64_t* header = reinterpret_cast<const int64_t*>(base);
+  nCat = header[1];
+  nMatch = header[2];
+  nMember = header[3];
+  nExt = header[4];
+  if (nCat < 0 || nMatch < 0 || nMember < 0 || nExt < 0
+      || (HEADER_ENTRIES + 2*nCat+1 + nMatch+1 + 2*nMember + nExt+1 + nMember + 1)
+      * sizeof(int64_t) != length)
+    throw std::runtime_error("Wrong size for binary match file " + filename);
+  hdus = header + HEADER_ENTRIES;
+  catStarts = hdus + nCat;
+  matchStarts = catStarts + nCat + 1;
+  mem = reinterpret_cast<const Member*>(matchStarts + nMatch + 1);
+  extStarts = reinterpret_cast<const int64_t*>(mem + nMember);
+  order = extStarts + nExt + 1;
+  if (catStarts[nCat] != nMatch || matchStarts[nMatch] != nMember
+      || extStarts[nExt] != nMember)
+    throw std::runtime_error("Corrupt binary match file " + filename);
+}
+
+BinaryMatches::Writer::Writer(const string& filename_):
+  filename(filename_), bodyName(filename_ + ".members"),
+  bodyMembers(0), closed(false) {}
+
+BinaryMatches::Writer::~Writer() {
+  if (body.is_open()) {
+    body.close();
+    std::remove(bodyName.c_str());
+  }
+}
+
+void
+BinaryMatches::Writer::add(int hdu, const vector<int>& sequence,
+			   const vector<long>& extn, const vector<long>& obj) {
+  if (closed)
+    throw std::runtime_error("Adding to closed binary match file " + filename);
+  Catalog& cat = catalogs[hdu];
+  if (sequence.empty()) return;
+  if (!body.is_open()) {
+    body.open(bodyName.c_str(), std::ios::in | std::ios::out
+	      | std::ios::trunc | std::ios::binary);
+    if (!body)
+      throw std::runtime_error("Could not open temporary file " + bodyName
+			       + " for binary match file");
+  }
+  vector<Member> members(sequence.size());
+  for (size_t i=0; i<sequence.size(); i++) {
+    // Each match starts at sequence number 0
+    if (sequence[i]==0 || cat.matchStart.empty())
+      cat.matchStart.push_back(cat.nMembers + i);
+    members[i].extension = extn[i];
+    members[i].object = obj[i];
+  }
+  body.write(reinterpret_cast<const char*>(members.data()),
+	     members.size()*sizeof(Member));
+  if (!body)
+    throw std::runtime_error("Error writing temporary file " + bodyName);
+  if (!cat.chunks.empty()
+      && cat.chunks.back().first + cat.chunks.back().size == bodyMembers) {
+    cat.chunks.back().size += members.size();
+  } else {
+    Chunk c;
+    c.first = bodyMembers;
+    c.size = members.size();
+    cat.chunks.push_back(c);
+  }
+  cat.nMembers += members.size();
+  bodyMembers += members.size();
+}
+
+void
+BinaryMatches::Writer::close(long nExtensions) {
+  if (closed) return;
+  closed = true;
+  std::ofstream out(filename.c_str(), std::ios::binary);
+  if (!out)
+    throw std::runtime_error("Could not open binary match file " + filename
+			     + " for writing");
+  auto write = [&out](const void* p, size_t bytes) {
+    out.write(static_cast<const char*>(p), bytes);
+  };
+  // Read back the members of the body in the order of the catalogs
+  vector<Member> buffer;
+  auto forEachMember = [&](std::function<void(const Member&)> f) {
+    const int64_t BufferSize = 65536;
+    for (auto& c : catalogs)
+      for (auto& chunk : c.second.chunks)
+	for (int64_t k = 0; k < chunk.size; k += BufferSize) {
+	  int64_t n = std::min(BufferSize, chunk.size - k);
+	  buffer.resize(n);
+	  body.seekg((chunk.first + k)*sizeof(Member));
+	  body.read(reinterpret_cast<char*>(buffer.data()), n*sizeof(Member));
+	  if (!body)
+	    throw std::runtime_error("Error reading temporary file " + bodyName);
+	  for (auto& m : buffer) f(m);
+	}
+  };
+  if (body.is_open()) body.flush();
+
+  int64_t nMatches = 0;
+  int64_t nMembers = 0;
+  for (auto& c : catalogs) {
+    nMatches += c.second.matchStart.size();
+    nMembers += c.second.nMembers;
+  }
+  int64_t header[HEADER_ENTRIES] = {0, static_cast<int64_t>(catalogs.size()),
+				    nMatches, nMembers, nExtensions};
+  std::memcpy(header, MAGIC, 8);
+  write(header, sizeof(header));
+
+  vector<int64_t> v;
+  for (auto& c : catalogs) v.push_back(c.first);
+  write(v.data(), v.size()*sizeof(int64_t));
+  v.clear();
+  int64_t start = 0;
+  for (auto& c : catalogs) {
+    v.push_back(start);
+    start += c.second.matchStart.size();
+  }
+  v.push_back(start);
+  write(v.data(), v.size()*sizeof(int64_t));
+
+  // Member indices of the whole file continue from catalog to catalog
+  start = 0;
+  for (auto& c : catalogs) {
+    v.clear();
+    for (auto s : c.second.matchStart) v.push_back(s + start);
+    write(v.data(), v.size()*sizeof(int64_t));
+    start += c.second.nMembers;
+    // The offsets are no longer needed
+    vector<int64_t>().swap(c.second.matchStart);
+  }
+  write(&start, sizeof(start));
+
+  // Copy the members, counting those of each extension
+  vector<int64_t> extensionStart(nExtensions+1, 0);
+  forEachMember([&](const Member& m) {
+      if (m.extension < 0 || m.extension >= nExtensions)
+	throw std::runtime_error("Extension number out of range writing binary match file "
+				 + filename);
+      ++extensionStart[m.extension+1];
+      write(&m, sizeof(Member));
+    });
+
+  // Members grouped by extension (a counting sort), then ordered by object
+  for (long i=0; i<nExtensions; i++)
+    extensionStart[i+1] += extensionStart[i];
+  vector<int64_t> keeperOrder(nMembers);
+  vector<int64_t> objects(nMembers);
+  {
+    vector<int64_t> next(extensionStart.begin(), extensionStart.end()-1);
+    int64_t j = 0;
+    forEachMember([&](const Member& m) {
+	keeperOrder[next[m.extension]] = j++;
+	objects[next[m.extension]++] = m.object;
+      });
+  }
+  vector<std::pair<int64_t,int64_t> > group;
+  for (long i=0; i<nExtensions; i++) {
+    group.clear();
+    for (int64_t k=extensionStart[i]; k<extensionStart[i+1]; k++)
+      group.push_back(std::make_pair(objects[k], keeperOrder[k]));
+    std::sort(group.begin(), group.end());
+    for (int64_t k=extensionStart[i]; k<extensionStart[i+1]; k++)
+      keeperOrder[k] = group[k-extensionStart[i]].second;
+  }
+  write(extensionStart.data(), extensionStart.size()*sizeof(int64_t));
+  write(keeperOrder.data(), keeperOrder.size()*sizeof(int64_t));
+  write(MAGIC, 8);
+  catalogs.clear();
+  if (body.is_open()) {
+    body.close();
+    std::remove(bodyName.c_str());
+  }
+  out.close();
+  if (!out)
+    throw std::runtime_error("Error writing binary match file " + filename);
+}
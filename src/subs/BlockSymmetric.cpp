@@ -0,0 +1,222 @@
+// Block-sparse symmetric matrix for the normal equations
+#include "BlockSymmetric.h"
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+
+BlockSymmetric::BlockSymmetric(int nParams_, int nMaps_):
+  nP(nParams_), nM(nMaps_), rows(nMaps_) {}
+
+void
+BlockSymmetric::setZero() {
+  rows.resize(nM);
+  blockOfParam.clear();
+  for (auto& r : rows)
+    for (auto& b : r)
+      std::fill(b.second.v.begin(), b.second.v.end(), 0.);
+}
+
+BlockSymmetric::Block&
+BlockSymmetric::blockAt(int rowBlock, int rowStart, int nRows,
+			int colBlock, int colStart, int nCols) {
+  Row& r = rows[rowBlock];
+  auto it = r.find(colBlock);
+  if (it == r.end())
+    it = r.insert(std::make_pair(colBlock,
+				 Block(rowStart, colStart, nRows, nCols))).first;
+  else if (it->second.nRows != nRows || it->second.nCols != nCols
+	   || it->second.rowStart != rowStart || it->second.colStart != colStart) {
+    std::ostringstream oss;
+    oss << "BlockSymmetric: inconsistent parameters for block ("
+	<< rowBlock << "," << colBlock << ")";
+    throw std::runtime_error(oss.str());
+  }
+  return it->second;
+}
+
+const BlockSymmetric::Block*
+BlockSymmetric::find(int rowBlock, int colBlock) const {
+  auto it = rows[rowBlock].find(colBlock);
+  return it==rows[rowBlock].end() ? nullptr : &it->second;
+}
+
+BlockSymmetric::Block*
+BlockSymmetric::find(int rowBlock, int colBlock) {
+  auto it = rows[rowBlock].find(colBlock);
+  return it==rows[rowBlock].end() ? nullptr : &it->second;
+}
+
+void
+BlockSymmetric::completeLayout() {
+  rows.resize(nM);
+  // Parameter ranges of the maps' diagonal blocks, in parameter order
+  vector<std::pair<int,int> > ranges;	// (start, block)
+  for (int b=0; b<nM; b++) {
+    if (!rows[b].empty() && !rows[b].count(b)) {
+      std::ostringstream oss;
+      oss << "BlockSymmetric: block " << b << " has no diagonal block";
+      throw std::runtime_error(oss.str());
+    }
+    if (rows[b].count(b))
+      ranges.push_back(std::make_pair(rows[b][b].rowStart, b));
+  }
+  std::sort(ranges.begin(), ranges.end());
+
+  blockOfParam.assign(nP, -1);
+  int next = 0;	// First parameter not yet assigned
+  auto addGap = [this](int start, int end) {
+    if (end <= start) return;
+    int b = rows.size();
+    rows.push_back(Row());
+    rows[b].insert(std::make_pair(b, Block(start, start, end-start, end-start)));
+    for (int i=start; i<end; i++) blockOfParam[i] = b;
+  };
+  for (auto& r : ranges) {
+    const Block& d = rows[r.second][r.second];
+    if (d.rowStart < next || d.rowStart + d.nRows > nP) {
+      std::ostringstream oss;
+      oss << "BlockSymmetric: block " << r.second
+	  << " overlaps others or runs past the parameters";
+      throw std::runtime_error(oss.str());
+    }
+    addGap(next, d.rowStart);
+    for (int i=d.rowStart; i<d.rowStart+d.nRows; i++) blockOfParam[i] = r.second;
+    next = d.rowStart + d.nRows;
+  }
+  addGap(next, nP);
+}
+
+double
+BlockSymmetric::diagonal(int iParam) const {
+  int b = blockOfParam[iParam];
+  const Block& d = rows[b].at(b);
+  int k = iParam - d.rowStart;
+  return d(k,k);
+}
+
+void
+BlockSymmetric::setDiagonal(int iParam, double value) {
+  int b = blockOfParam[iParam];
+  Block& d = rows[b].at(b);
+  int k = iParam - d.rowStart;
+  d(k,k) = value;
+}
+
+vector<bool>
+BlockSymmetric::emptyParameters() const {
+  vector<bool> used(nP, false);
+  for (auto& r : rows)
+    for (auto& bb : r) {
+      const Block& b = bb.second;
+      for (int i=0; i<b.nRows; i++)
+	for (int j=0; j<b.nCols; j++)
+	  if (b(i,j)!=0.) {
+	    used[b.rowStart+i] = true;
+	    used[b.colStart+j] = true;
+	  }
+    }
+  vector<bool> empty(nP);
+  for (int i=0; i<nP; i++) empty[i] = !used[i];
+  return empty;
+}
+
+void
+BlockSymmetric::scale(const DVector& s) {
+  for (auto& r : rows)
+    for (auto& bb : r) {
+      Block& b = bb.second;
+      for (int i=0; i<b.nRows; i++) {
+	double si = s[b.rowStart+i];
+	for (int j=0; j<b.nCols; j++)
+	  b(i,j) *= si * s[b.colStart+j];
+      }
+    }
+}
+
+void
+BlockSymmetric::multiply(const DVector& x, DVector& y) const {
+  y.setZero();
+  for (int rb=0; rb<rows.size(); rb++)
+    for (auto& bb : rows[rb]) {
+      const Block& b = bb.second;
+      if (bb.first == rb) {
+	// Lower triangle of a diagonal block
+	for (int i=0; i<b.nRows; i++) {
+	  double sum = 0.;
+	  for (int j=0; j<i; j++) {
+	    sum += b(i,j) * x[b.colStart+j];
+	    y[b.colStart+j] += b(i,j) * x[b.rowStart+i];
+	  }
+	  y[b.rowStart+i] += sum + b(i,i) * x[b.rowStart+i];
+	}
+      } else {
+	for (int i=0; i<b.nRows; i++) {
+	  double sum = 0.;
+	  double xi = x[b.rowStart+i];
+	  for (int j=0; j<b.nCols; j++) {
+	    sum += b(i,j) * x[b.colStart+j];
+	    y[b.colStart+j] += b(i,j) * xi;
+	  }
+	  y[b.rowStart+i] += sum;
+	}
+      }
+    }
+}
+
+void
+BlockSymmetric::toDense(DMatrix& m) const {
+  m.setZero();
+  for (int rb=0; rb<rows.size(); rb++)
+    for (auto& bb : rows[rb]) {
+      const Block& b = bb.second;
+      // Only the lower triangle of diagonal blocks is filled
+      bool diag = bb.first==rb;
+      for (int i=0; i<b.nRows; i++)
+	for (int j=0; j<(diag ? i+1 : b.nCols); j++) {
+	  m(b.rowStart+i, b.colStart+j) = b(i,j);
+	  m(b.colStart+j, b.rowStart+i) = b(i,j);
+	}
+    }
+}
+
+BlockUpdater::BlockUpdater(BlockSymmetric& alpha_, int nLocks_):
+  alpha(alpha_), nLocks(nLocks_) {
+#ifdef _OPENMP
+  locks.resize(nLocks);
+  for (auto& l : locks) omp_init_lock(&l);
+#endif
+}
+
+BlockUpdater::~BlockUpdater() {
+#ifdef _OPENMP
+  for (auto& l : locks) omp_destroy_lock(&l);
+#endif
+}
+
+void
+BlockUpdater::blockUpdate(int m2, int i2, int n2,
+			  int m1, int i1, int n1,
+			  const double* c, double w) {
+  if (m2==m1) {
+    lock(m2);
+    BlockSymmetric::Block& b = alpha.blockAt(m2, i2, n2, m2, i2, n2);
+    for (int r=0; r<n2; r++)
+      for (int k=0; k<=r; k++)
+	b(r,k) += w*c[r*n1+k];
+    unlock(m2);
+  } else if (m2 > m1) {
+    lock(m2);
+    BlockSymmetric::Block& b = alpha.blockAt(m2, i2, n2, m1, i1, n1);
+    for (int r=0; r<n2*n1; r++)
+      b.v[r] += w*c[r];
+    unlock(m2);
+  } else {
+    // Store the transpose, in the row of the higher map number
+    lock(m1);
+    BlockSymmetric::Block& b = alpha.blockAt(m1, i1, n1, m2, i2, n2);
+    for (int r=0; r<n1; r++)
+      for (int k=0; k<n2; k++)
+	b(r,k) += w*c[k*n1+r];
+    unlock(m1);
+  }
+}
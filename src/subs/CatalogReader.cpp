@@ -0,0 +1,95 @@
+// Read-ahead service for input catalogs
+#include "CatalogReader.h"
+#include "FitsTable.h"
+#include "FitSubroutines.h"
+
+CatalogReader::CatalogReader(const vector<Request>& requests_, int ioThreads, int readAhead_):
+  requests(requests_), readAhead(std::max(readAhead_, 1)),
+  nextToRead(0), nTaken(0) {
+  ioThreads = std::max(1, std::min(ioThreads, static_cast<int>(requests.size())));
+  for (int i=0; i<ioThreads; i++)
+    threads.push_back(std::thread(&CatalogReader::ioLoop, this));
+}
+
+CatalogReader::~CatalogReader() {
+  {
+    // Stop the threads after the reads they have started
+    std::lock_guard<std::mutex> lock(queueLock);
+    nextToRead = requests.size();
+    changed.notify_all();
+  }
+  for (auto& t : threads) t.join();
+}
+
+void
+CatalogReader::read(const Request& r, vector<img::FTable>& tables) {
+  std::lock_guard<std::mutex> fileGuard(fitsLocks.lockFor(r.filename));
+  FITS::FitsTable* ft;
+  {
+    std::unique_lock<std::mutex> openGuard = fitsLocks.openClose();
+    ft = new FITS::FitsTable(r.filename, FITS::ReadOnly, r.hduNumber);
+  }
+  try {
+    vector<string> columns = r.columns;
+    if (!r.expressions.empty())
+      columns = columnsUsed(ft->extract(0,0).listColumns(),
+			    list<string>(r.columns.begin(), r.columns.end()),
+			    r.expressions);
+    if (r.ranges.empty()) {
+      tables.push_back(ft->extract(0, -1, columns));
+    } else {
+      for (auto& range : r.ranges)
+	tables.push_back(ft->extract(range.first, range.second, columns));
+    }
+  } catch (...) {
+    std::unique_lock<std::mutex> closeGuard = fitsLocks.openClose();
+    delete ft;
+    throw;
+  }
+  std::unique_lock<std::mutex> closeGuard = fitsLocks.openClose();
+  delete ft;
+}
+
+void
+CatalogReader::ioLoop() {
+  while (true) {
+    long i;
+    {
+      std::unique_lock<std::mutex> lock(queueLock);
+      changed.wait(lock, [this]() {return nextToRead < nTaken + readAhead
+				     || nextToRead >= requests.size();});
+      if (nextToRead >= requests.size()) return;
+      i = nextToRead++;
+    }
+    vector<img::FTable> tables;
+    std::exception_ptr error;
+    try {
+      read(requests[i], tables);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    std::lock_guard<std::mutex> lock(queueLock);
+    if (error)
+      failed[i] = error;
+    else
+      ready[i].swap(tables);
+    changed.notify_all();
+  }
+}
+
+vector<img::FTable>
+CatalogReader::take(long i) {
+  std::unique_lock<std::mutex> lock(queueLock);
+  changed.wait(lock, [this,i]() {return ready.count(i)>0 || failed.count(i)>0;});
+  ++nTaken;
+  changed.notify_all();
+  if (failed.count(i)) {
+    std::exception_ptr error = failed[i];
+    failed.erase(i);
+    std::rethrow_exception(error);
+  }
+  vector<img::FTable> tables;
+  tables.swap(ready[i]);
+  ready.erase(i);
+  return tables;
+}
@@ -0,0 +1,120 @@
+// Memory-mapped store of catalog columns for the fitting programs
+#include "DetectionStore.h"
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+  const char MAGIC[8] = {'G','B','D','S','T','O','R','2'};
+  // Entries per extension in the index
+  const int INDEX_ENTRIES = 4;
+}
+
+uint64_t
+DetectionStore::catalogHash(const string& filename, int hduNumber) {
+  // FNV-1a, which is the same on every platform
+  string key = filename + "#" + std::to_string(hduNumber);
+  uint64_t h = 14695981039346656037ULL;
+  for (unsigned char c : key) {
+    h ^= c;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+DetectionStore::DetectionStore(const string& filename):
+  file(filename), nExt(0), indexOffset(0), index(nullptr) {
+  const char* base = file.data();
+  size_t length = file.size();
+  if (length < 4*sizeof(int64_t)
+      || std::memcmp(base, MAGIC, 8) != 0
+      || std::memcmp(base + length - 8, MAGIC, 8) != 0)
+    throw std::runtime_error(filename + " is not a detection store");
+  const int64_t* footer = reinterpret_cast<const int64_t*>(base + length) - 3;
+  nExt = footer[0];
+  indexOffset = footer[1];
+  if (nExt < 0 || indexOffset < 8
+      || indexOffset + nExt*INDEX_ENTRIES*sizeof(int64_t) + 3*sizeof(int64_t) != length)
+    throw std::runtime_error("Corrupt index in detection store " + filename);
+  index = reinterpret_cast<const int64_t*>(base + indexOffset);
+}
+
+DetectionStore::Rows
+DetectionStore::extension(long iext) const {
+  if (iext < 0 || iext >= nExt)
+    throw std::runtime_error("Extension " + std::to_string(iext)
+			     + " is not in detection store " + file.name());
+  Rows r;
+  const int64_t* entry = index + INDEX_ENTRIES*iext;
+  // The block must lie between the magic string and the index
+  if (entry[0] < 8 || entry[1] < 0 || entry[0] > indexOffset
+      || entry[1] > (indexOffset - entry[0]) / int64_t((1+NCOLUMNS)*sizeof(int64_t)))
+    throw std::runtime_error("Corrupt index entry for extension " + std::to_string(iext)
+			     + " in detection store " + file.name());
+  r.n = entry[1];
+  r.hasColor = entry[3] != 0;
+  r.id = reinterpret_cast<const int64_t*>(file.data() + entry[0]);
+  const double* data = reinterpret_cast<const double*>(r.id + r.n);
+  for (int c=0; c<NCOLUMNS; c++)
+    r.column[c] = data + c*r.n;
+  return r;
+}
+
+bool
+DetectionStore::matches(long iext, const string& filename, int hduNumber) const {
+  if (iext < 0 || iext >= nExt) return false;
+  return static_cast<uint64_t>(index[INDEX_ENTRIES*iext+2]) == catalogHash(filename, hduNumber);
+}
+
+DetectionStore::Writer::Writer(const string& filename_):
+  filename(filename_), out(filename_.c_str(), std::ios::binary), closed(false) {
+  if (!out)
+    throw std::runtime_error("Could not open detection store " + filename + " for writing");
+  out.write(MAGIC, 8);
+}
+
+void
+DetectionStore::Writer::add(const string& catalogFile, int hduNumber,
+			    const vector<int64_t>& id,
+			    const vector<double> (&columns)[NCOLUMNS],
+			    bool hasColor) {
+  if (closed)
+    throw std::runtime_error("Adding to closed detection store " + filename);
+  for (size_t i=1; i<id.size(); i++)
+    if (id[i] <= id[i-1])
+      throw std::runtime_error("IDs for detection store " + filename + " are not ascending");
+  for (int c=0; c<NCOLUMNS; c++)
+    if (columns[c].size() != id.size())
+      throw std::runtime_error("Column size mismatch writing detection store " + filename);
+  index.push_back(out.tellp());
+  index.push_back(id.size());
+  index.push_back(static_cast<int64_t>(catalogHash(catalogFile, hduNumber)));
+  index.push_back(hasColor ? 1 : 0);
+  out.write(reinterpret_cast<const char*>(id.data()), id.size()*sizeof(int64_t));
+  for (int c=0; c<NCOLUMNS; c++)
+    out.write(reinterpret_cast<const char*>(columns[c].data()),
+	      columns[c].size()*sizeof(double));
+  if (!out)
+    throw std::runtime_error("Error writing detection store " + filename);
+}
+
+void
+DetectionStore::Writer::close() {
+  if (closed) return;
+  int64_t indexOffset = out.tellp();
+  out.write(reinterpret_cast<const char*>(index.data()), index.size()*sizeof(int64_t));
+  int64_t footer[2] = {static_cast<int64_t>(index.size()/INDEX_ENTRIES), indexOffset};
+  out.write(reinterpret_cast<const char*>(footer), sizeof(footer));
+  out.write(MAGIC, 8);
+  out.close();
+  closed = true;
+  if (!out)
+    throw std::runtime_error("Error writing detection store " + filename);
+}
+
+DetectionStore::Writer::~Writer() {
+  // Destructors must not throw, so errors are only reported by close()
+  try {
+    close();
+  } catch (std::runtime_error& e) {
+  }
+}
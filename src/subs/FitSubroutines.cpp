@@ -3,6 +3,7 @@
 #include "StringStuff.h"
 #include "Bounds.h"
 #include <list>
+#include <cctype>
 #include "Pset.h"
 #include "PhotoTemplate.h"
 #include "PhotoPiecewise.h"
@@ -11,11 +12,17 @@
 #include "PixelMapCollection.h"
 #include "PhotoMapCollection.h"
 #include "FitsTable.h"
+#include "WcsCache.h"
+#include "CatalogReader.h"
 #include "Match.h"
 #include "PhotoMatch.h"
 #include "Random.h"
 #include "Stopwatch.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 // A helper function that strips white space from front/back of a string and replaces
 // internal white space with underscores:
 void
@@ -228,6 +235,117 @@ getTableDouble(img::FTable f, string key, int elementNumber, bool isDouble, long
   return out;
 }
 
+vector<string>
+columnsUsed(const vector<string>& tableColumns,
+	    const list<string>& keys,
+	    const list<string>& expressions) {
+  // Collect upper-cased names of all keys and identifiers in the expressions
+  set<string> names;
+  for (auto key : keys) {
+    elementNumber(key);
+    stripWhite(key);
+    for (auto& c : key) c = std::toupper(c);
+    names.insert(key);
+  }
+  for (auto& expr : expressions) {
+    for (size_t i=0; i<expr.size(); ) {
+      char c = expr[i];
+      if (c=='"' || c=='\'') {
+	// Skip over string literal
+	size_t close = expr.find(c, i+1);
+	i = (close==string::npos) ? expr.size() : close+1;
+      } else if (std::isalpha(c) || c=='_') {
+	size_t start = i;
+	while (i<expr.size() && (std::isalnum(expr[i]) || expr[i]=='_')) ++i;
+	if (start==0 || expr[start-1]!='@') {
+	  string name = expr.substr(start, i-start);
+	  for (auto& ch : name) ch = std::toupper(ch);
+	  names.insert(name);
+	}
+      } else if (std::isdigit(c) || c=='.') {
+	// Skip numbers, including exponents such as 1e-5
+	while (i<expr.size() && (std::isalnum(expr[i]) || expr[i]=='.')) ++i;
+      } else {
+	++i;
+      }
+    }
+  }
+  vector<string> out;
+  for (auto& col : tableColumns) {
+    string ucol = col;
+    for (auto& c : ucol) c = std::toupper(c);
+    if (names.count(ucol)) out.push_back(col);
+  }
+  return out;
+}
+
+img::FTable
+storedDetections(const DetectionStore& store, long iext) {
+  DetectionStore::Rows rows = store.extension(iext);
+  img::FTable out;
+  out.addColumn(vector<long>(rows.id, rows.id+rows.n), "ID");
+  const char* names[DetectionStore::NCOLUMNS] = {"X","Y","ERR","MAG","MAGERR","COLOR"};
+  // Leave out colors the catalog could not give, so that reading them fails
+  // just as evaluating the color expression on the catalog would.
+  for (int c=0; c<DetectionStore::NCOLUMNS; c++)
+    if (c!=DetectionStore::COLOR || rows.hasColor)
+      out.addColumn(vector<double>(rows.column[c], rows.column[c]+rows.n), names[c]);
+  return out;
+}
+
+void
+checkDetectionStore(const DetectionStore& store,
+		    const img::FTable& extensionTable) {
+  if (store.nExtensions() != extensionTable.nrows()) {
+    cerr << "Detection store has " << store.nExtensions()
+	 << " extensions but the Extensions table has " << extensionTable.nrows()
+	 << endl;
+    exit(1);
+  }
+  for (long iext=0; iext<extensionTable.nrows(); iext++) {
+    string filename;
+    int hduNumber;
+    extensionTable.readCell(filename, "Filename", iext);
+    extensionTable.readCell(hduNumber, "Extension", iext);
+    if (!store.matches(iext, filename, hduNumber)) {
+      cerr << "Detection store was not made from catalog " << filename
+	   << " extension " << hduNumber
+	   << " for Extension " << iext
+	   << endl;
+      exit(1);
+    }
+  }
+}
+
+void
+checkBinaryMatches(const BinaryMatches& binary,
+		   const string& inputTables,
+		   const set<int>& catalogHdus) {
+  std::map<int,long> binaryCatalog;
+  for (long icat=0; icat<binary.nCatalogs(); icat++)
+    binaryCatalog[binary.catalogHdu()[icat]] = icat;
+  for (int hdu : catalogHdus) {
+    if (!binaryCatalog.count(hdu)) {
+      cerr << "Binary match file has no catalog for HDU " << hdu << endl;
+      exit(1);
+    }
+    long icat = binaryCatalog[hdu];
+    long nMatches = binary.catalogStart()[icat+1] - binary.catalogStart()[icat];
+    // Only the header and size of the table are needed
+    FITS::FitsTable ft(inputTables, FITS::ReadOnly, hdu);
+    long nRows = ft.use().nrows();
+    long fitsMatches = nMatches;
+    ft.header()->getValue("Matches", fitsMatches); // Only written by newer WCSFoF
+    if (nRows != binary.catalogMembers(icat) || fitsMatches != nMatches) {
+      cerr << "Binary match file has " << nMatches << " matches with "
+	   << binary.catalogMembers(icat) << " members for HDU " << hdu
+	   << " but the match file has " << fitsMatches << " with " << nRows
+	   << endl;
+      exit(1);
+    }
+  }
+}
+
 // This function is used to find degeneracies between exposures and device maps.
 // Start with list of free & fixed devices as initial degen/ok, same for exposures.
 // Will consider as "ok" any device used in an "ok" exposure and vice-versa.
@@ -536,21 +654,44 @@ readExtensions(img::FTable& extensionTable,
 	       double sysError,
 	       double referenceSysError) {
       
-  vector<typename S::Extension*> extensions(extensionTable.nrows(), nullptr);
-  colorExtensions = vector<typename S::ColorExtension*>(extensionTable.nrows(), nullptr);
-  int processed=0;
-
-#ifdef _OPENMP
-  //**#pragma omp parallel for schedule(dynamic,100)
-#endif
-  for (int i=0; i<extensionTable.nrows(); i++) {
-    int iExposure;
-    extensionTable.readCell(iExposure, "Exposure", i);
-
+  int nExtensions = extensionTable.nrows();
+  vector<typename S::Extension*> extensions(nExtensions, nullptr);
+  colorExtensions = vector<typename S::ColorExtension*>(nExtensions, nullptr);
+
+  // Read the table columns here, since FTable access is not thread-safe
+  vector<int> exposureColumn;
+  vector<int> deviceColumn;
+  vector<string> wcsColumn;
+  vector<double> sysErrorValues;
+  extensionTable.readCells(exposureColumn, "Exposure");
+  extensionTable.readCells(deviceColumn, "Device");
+  extensionTable.readCells(wcsColumn, "WCSIn");
+  if (!sysErrorColumn.empty())
+    extensionTable.readCells(sysErrorValues, sysErrorColumn);
+  for (int i=0; i<nExtensions; i++) {
+    int iExposure = exposureColumn[i];
     if (iExposure < 0 || iExposure >= exposures.size()) {
       cerr << "Extension " << i << " has invalid exposure number " << iExposure << endl;
       exit(1);
     }
+  }
+
+  // The dictionary of each extension's map, given to the YAMLCollector
+  // afterwards in extension order so its output matches a serial read.
+  vector<astrometry::YAMLCollector::Dictionary> mapDictionaries(nExtensions);
+  // (Not vector<bool>, whose elements cannot be set from separate threads)
+  vector<char> needsMap(nExtensions, false);
+  vector<char> badWcs(nExtensions, false);
+
+  int processed=0;
+  // One parse of each distinct starting WCS (see WcsCache.h)
+  WcsCache wcsCache;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,100)
+#endif
+  for (int i=0; i<nExtensions; i++) {
+    int iExposure = exposureColumn[i];
 
     // Determine whether this extension might be used to provide colors
     int colorPriority = exposureColorPriorities[iExposure];
@@ -562,19 +703,22 @@ readExtensions(img::FTable& extensionTable,
 	
     if (!exposures[iExposure]) continue;
     
+    int nProcessed;
 #ifdef _OPENMP
 #pragma omp critical(processed)
 #endif
-    ++processed; 
+    nProcessed = ++processed; 
     typename S::Extension* extn = new typename S::Extension;
     extn->exposure = iExposure;
     const Exposure& expo = *exposures[iExposure];
 
     bool isReference = (expo.instrument == REF_INSTRUMENT);
 
-    int iDevice;
-    extensionTable.readCell(iDevice, "Device", i);
-    if (processed%1000==0) {
+    int iDevice = deviceColumn[i];
+    if (nProcessed%1000==0) {
+#ifdef _OPENMP
+#pragma omp critical(cerr)
+#endif
       cerr << "...Extn " << i << "/" << extensions.size() 
 	   << " " << expo.name << endl;
     }
@@ -585,7 +729,7 @@ readExtensions(img::FTable& extensionTable,
 
     // Get systematic error values
     if (!sysErrorColumn.empty()) {
-      extensionTable.readCell(extn->sysError, sysErrorColumn, i);
+      extn->sysError = sysErrorValues[i];
     } else if (isReference) {
       extn->sysError = referenceSysError;
     } else {
@@ -593,22 +737,20 @@ readExtensions(img::FTable& extensionTable,
     }
       
     // Create the starting WCS for the exposure
-    string s;
-    extensionTable.readCell(s, "WCSIn", i);
+    const string& s = wcsColumn[i];
     if (stringstuff::nocaseEqual(s, "_ICRS")) {
       // Create a Wcs that just takes input as RA and Dec in degrees;
       astrometry::IdentityMap identity;
       astrometry::SphericalICRS icrs;
       extn->startWcs = new astrometry::Wcs(&identity, icrs, "ICRS_degrees", DEGREE);
     } else {
-      istringstream iss(s);
-      astrometry::PixelMapCollection pmcTemp;
-      if (!pmcTemp.read(iss)) {
-	cerr << "Could not deserialize starting WCS for extension #" << i << endl;
-	exit(1);
+      extn->startWcs = wcsCache.serialized(s);
+      if (!extn->startWcs) {
+	// Reported after the loop
+	badWcs[i] = true;
+	extensions[i] = extn;
+	continue;
       }
-      string wcsName = pmcTemp.allWcsNames().front();
-      extn->startWcs = pmcTemp.cloneWcs(wcsName);
     }
 
     // destination projection for startWCS is the Exposure projection,
@@ -625,7 +767,7 @@ readExtensions(img::FTable& extensionTable,
       extn->mapName = astrometry::IdentityMap().getName();
     } else {
       // Real instrument, make a map combining its exposure with its Device map:
-      astrometry::YAMLCollector::Dictionary d;
+      astrometry::YAMLCollector::Dictionary& d = mapDictionaries[i];
       d["INSTRUMENT"] = instruments[expo.instrument]->name;
       d["DEVICE"] = instruments[expo.instrument]->deviceNames.nameOf(extn->device);
       d["EXPOSURE"] = expo.name;
@@ -641,16 +783,23 @@ readExtensions(img::FTable& extensionTable,
 	extn->mapName = extn->wcsName + "/base";
       else
 	extn->mapName = extn->wcsName;
-	
-      if (!inputYAML.addMap(extn->mapName,d)) { 
-	cerr << "Input YAML files do not have complete information for map "
-	     << extn->mapName
-	     << endl;
-	exit(1);
-      }
+      needsMap[i] = true;
     }
     extensions[i] = extn;
   }  // End extension loop
+
+  for (int i=0; i<nExtensions; i++) {
+    if (badWcs[i]) {
+      cerr << "Could not deserialize starting WCS for extension #" << i << endl;
+      exit(1);
+    }
+    if (needsMap[i] && !inputYAML.addMap(extensions[i]->mapName, mapDictionaries[i])) { 
+      cerr << "Input YAML files do not have complete information for map "
+	   << extensions[i]->mapName
+	   << endl;
+      exit(1);
+    }
+  }
   return extensions;
 }
 
@@ -924,8 +1073,7 @@ readMatches(img::FTable& table,
 	  auto d = new typename S::Detection;
 	  d->catalogNumber = matchExtns[j];
 	  d->objectNumber = matchObjs[j];
-	  extensions[matchExtns[j]]->keepers.insert(std::pair<long,typename S::Detection*>
-						    (matchObjs[j], d));
+	  extensions[matchExtns[j]]->keepers.insert(matchObjs[j], d);
 	  if (m)
 	    m->add(d);
 	  else
@@ -936,9 +1084,8 @@ readMatches(img::FTable& table,
 	if (matchColorExtension >=0) {
 	  // Tell the color catalog that it needs to look this guy up:
 	  Assert(colorExtensions[matchColorExtension]);
-	  colorExtensions[matchColorExtension]->keepers.insert
-	    (std::pair<long,typename S::Match*>(matchColorObject,
-						matches.back()));
+	  colorExtensions[matchColorExtension]->keepers.insert(matchColorObject,
+							       matches.back());
 	}
       }
       // Clear out previous Match:
@@ -974,6 +1121,98 @@ readMatches(img::FTable& table,
   } // End loop of catalog entries
 }
 
+template <class S>
+void
+readMatches(const BinaryMatches& binary,
+	    const set<int>& useHdus,
+	    list<typename S::Match*>& matches,
+	    vector<typename S::Extension*>& extensions,
+	    vector<typename S::ColorExtension*>& colorExtensions,
+	    const ExtensionObjectSet& skipSet,
+	    int minMatches) {
+  if (binary.nExtensions() != extensions.size()) {
+    cerr << "Binary match file has " << binary.nExtensions()
+	 << " extensions but the Extensions table has " << extensions.size()
+	 << endl;
+    exit(1);
+  }
+  const BinaryMatches::Member* members = binary.members();
+  const int64_t* matchStart = binary.matchStart();
+
+  // The Detection made for each member, if any
+  vector<typename S::Detection*> made(binary.nMembers(), nullptr);
+  // Members of the current match with useful data
+  vector<long> useful;
+
+  for (long icat = 0; icat < binary.nCatalogs(); icat++) {
+    if (!useHdus.count(binary.catalogHdu()[icat])) continue;
+    for (long im = binary.catalogStart()[icat]; im < binary.catalogStart()[icat+1]; im++) {
+      useful.clear();
+      // The highest-priority color information in the match
+      long matchColorExtension = -1;
+      long matchColorObject = 0;
+      int colorPriority = -1;
+      for (long j = matchStart[im]; j < matchStart[im+1]; j++) {
+	long extn = members[j].extension;
+	long obj = members[j].object;
+	if ( skipSet(extn,obj) ) continue;
+	if (extensions[extn])
+	  useful.push_back(j);
+	if (colorExtensions[extn]) {
+	  int newPriority = colorExtensions[extn]->priority;
+	  if (newPriority >= 0 && (colorPriority < 0 || newPriority < colorPriority)) {
+	    colorPriority = newPriority;
+	    matchColorExtension = extn;
+	    matchColorObject = obj;
+	  }
+	}
+      }
+      if (matchColorExtension < 0) {
+	// Without color information, discard detections needing a color
+	useful.erase(std::remove_if(useful.begin(), useful.end(),
+				    [&](long j) {
+				      return extensions[members[j].extension]->needsColor;
+				    }),
+		     useful.end());
+      }
+      if (useful.size() < minMatches) continue;
+
+      typename S::Match* m=nullptr;
+      for (auto j : useful) {
+	auto d = new typename S::Detection;
+	d->catalogNumber = members[j].extension;
+	d->objectNumber = members[j].object;
+	made[j] = d;
+	if (m)
+	  m->add(d);
+	else
+	  m = new typename S::Match(d);
+      }
+      matches.push_back(m);
+      if (matchColorExtension >=0) {
+	Assert(colorExtensions[matchColorExtension]);
+	colorExtensions[matchColorExtension]->keepers.insert(matchColorObject, m);
+      }
+    }
+  }
+
+  // Give each Extension its Detections in object order
+  const int64_t* extensionStart = binary.extensionStart();
+  const int64_t* keeperOrder = binary.keeperOrder();
+  for (long iext = 0; iext < extensions.size(); iext++) {
+    if (!extensions[iext]) continue;
+    auto& keepers = extensions[iext]->keepers;
+    long n = 0;
+    for (long k = extensionStart[iext]; k < extensionStart[iext+1]; k++)
+      if (made[keeperOrder[k]]) ++n;
+    keepers.reserve(keepers.size() + n);
+    for (long k = extensionStart[iext]; k < extensionStart[iext+1]; k++) {
+      long j = keeperOrder[k];
+      if (made[j]) keepers.insert(members[j].object, made[j]);
+    }
+  }
+}
+
 // Subroutine to get what we want from a catalog entry for WCS fitting
 inline
 void
@@ -1132,13 +1371,30 @@ Photo::getOutputP(const Photo::Detection& d,
 template <class S>
 void readObjects(const img::FTable& extensionTable,
 		 const vector<Exposure*>& exposures,
-		 vector<typename S::Extension*>& extensions) {
+		 vector<typename S::Extension*>& extensions,
+		 int catalogThreads,
+		 const DetectionStore* store) {
+
+  if (store) checkDetectionStore(*store, extensionTable);
+
+  // What is needed from each catalog, gathered from the extension table
+  // here so that the threads below do not touch it.
+  struct CatalogInfo {
+    int iext;
+    string xKey;
+    string yKey;
+    string idKey;
+    string magKey;
+    string magErrKey;
+    string errKey;
+    double weight;
+    int magKeyElement;
+    int magErrKeyElement;
+    bool useRows;
+  };
+  vector<CatalogInfo> infos;
+  vector<CatalogReader::Request> requests;
 
-  // Should be safe to multithread this loop as different threads write
-  // only to distinct parts of memory.  Protect the FITS table read though.
-#ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic,60) num_threads(CATALOG_THREADS)
-#endif
   for (int iext = 0; iext < extensions.size(); iext++) {
     if (!extensions[iext]) continue; // Skip unused 
 
@@ -1147,126 +1403,174 @@ void readObjects(const img::FTable& extensionTable,
     Exposure& expo = *exposures[extn.exposure];
     if (extn.keepers.empty()) continue; // or useless
 
-    string filename;
-    extensionTable.readCell(filename, "Filename", iext);
-    /**/if (iext%50==0) cerr << "# Reading object catalog " << iext
-			     << "/" << extensions.size()
-			     << " from " << filename 
-			     << " seeking " << extn.keepers.size()
-			     << " objects" << endl;
-    int hduNumber;
-    string xKey;
-    string yKey;
-    string idKey;
-    string magKey;
-    string magErrKey;
-    double weight;
-    string errKey;
-    extensionTable.readCell(hduNumber, "Extension", iext);
-    extensionTable.readCell(xKey, "xKey", iext);
-    extensionTable.readCell(yKey, "yKey", iext);
-    extensionTable.readCell(idKey, "idKey", iext);
+    CatalogInfo info;
+    CatalogReader::Request request;
+    info.iext = iext;
+    extensionTable.readCell(request.filename, "Filename", iext);
+    extensionTable.readCell(request.hduNumber, "Extension", iext);
+    extensionTable.readCell(info.xKey, "xKey", iext);
+    extensionTable.readCell(info.yKey, "yKey", iext);
+    extensionTable.readCell(info.idKey, "idKey", iext);
 
     if (S::isAstro) {
-      extensionTable.readCell(errKey, "errKey", iext);
-      extensionTable.readCell(weight, "Weight", iext);
+      extensionTable.readCell(info.errKey, "errKey", iext);
+      extensionTable.readCell(info.weight, "Weight", iext);
     } else {
-      extensionTable.readCell(magKey, "magKey", iext);
-      extensionTable.readCell(magErrKey, "magErrKey", iext);
-      extensionTable.readCell(weight, "magWeight", iext);
+      extensionTable.readCell(info.magKey, "magKey", iext);
+      extensionTable.readCell(info.magErrKey, "magErrKey", iext);
+      extensionTable.readCell(info.weight, "magWeight", iext);
     }
-    
-    const typename S::SubMap* sm=extn.map;
-
-    bool isReference = (expo.instrument == REF_INSTRUMENT);
-    bool isTag = (expo.instrument == TAG_INSTRUMENT);
-
-    double sysErrorSq = pow(extn.sysError, 2.);
-    
-    astrometry::Wcs* startWcs = extn.startWcs;
 
-    if (!startWcs) {
+    if (!extn.startWcs) {
       cerr << "Failed to find initial Wcs for exposure " << expo.name
 	   << endl;
       exit(1);
     }
 
-    bool useRows = stringstuff::nocaseEqual(idKey, "_ROW");
+    bool isTag = (expo.instrument == TAG_INSTRUMENT);
+    info.useRows = stringstuff::nocaseEqual(info.idKey, "_ROW");
     // What we need to read from the FitsTable:
-    vector<string> neededColumns;
-    if (!useRows)
-      neededColumns.push_back(idKey);
-    neededColumns.push_back(xKey);
-    neededColumns.push_back(yKey);
+    if (!info.useRows)
+      request.columns.push_back(info.idKey);
+    request.columns.push_back(info.xKey);
+    request.columns.push_back(info.yKey);
       
-    int magKeyElement;
-    int magErrKeyElement;
     if (S::isAstro) {
       if (!isTag)
-	neededColumns.push_back(errKey);
+	request.columns.push_back(info.errKey);
     } else {
       // Be willing to get an element of array-valued bintable cell
       // for mag or magerr.  Syntax would be
       // MAGAPER[4]  to get 4th (0-indexed) element of MAGAPER column
-      magKeyElement = elementNumber(magKey);
-      magErrKeyElement = elementNumber(magErrKey);
-      neededColumns.push_back(magKey);
-      neededColumns.push_back(magErrKey);
+      info.magKeyElement = elementNumber(info.magKey);
+      info.magErrKeyElement = elementNumber(info.magErrKey);
+      request.columns.push_back(info.magKey);
+      request.columns.push_back(info.magErrKey);
     }
-    img::FTable ff;
+
+    if (store) {
+      // The store's table has the same quantities under fixed names
+      info.idKey = "ID";
+      info.xKey = "X";
+      info.yKey = "Y";
+      info.errKey = "ERR";
+      info.magKey = "MAG";
+      info.magErrKey = "MAGERR";
+      info.magKeyElement = info.magErrKeyElement = -1;
+      info.useRows = false;
+    }
+
+    // Catalog rows are read in one table, or in pieces when IDs are row numbers
+    extn.keepers.sort();
+    if (info.useRows && extn.keepers.begin()->first < 0) {
+      cerr << "Negative row number " << extn.keepers.begin()->first
+	   << " sought in catalog " << request.filename
+	   << " extension " << request.hduNumber
+	   << endl;
+      exit(1);
+    }
+    if (info.useRows)
+      extn.keepers.rowRanges(ROW_RANGE_GAP, request.ranges);
+
+    infos.push_back(info);
+    requests.push_back(request);
+  }
+
+  // The reader's threads fetch the catalogs while the threads here fill the
+  // Detections, which may be done in parallel as different threads write
+  // only to distinct parts of memory.
+  int consumers = 1;
 #ifdef _OPENMP
-#pragma omp critical(fitsio)
+  consumers = omp_get_max_threads();
 #endif
-    {
-      FITS::FitsTable ft(filename, FITS::ReadOnly, hduNumber);
-      ff = ft.extract(0, -1, neededColumns);
+  CatalogReader reader(store ? vector<CatalogReader::Request>() : requests,
+		       catalogThreads, 2*catalogThreads + consumers);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,1)
+#endif
+  for (int icat = 0; icat < infos.size(); icat++) {
+    const CatalogInfo& info = infos[icat];
+    const CatalogReader::Request& request = requests[icat];
+    int iext = info.iext;
+    typename S::Extension& extn = *extensions[iext];
+    Exposure& expo = *exposures[extn.exposure];
+
+    if (icat%50==0) {
+#ifdef _OPENMP
+#pragma omp critical(cerr)
+#endif
+      cerr << "# Reading object catalog " << iext
+	   << "/" << extensions.size()
+	   << " from " << request.filename
+	   << " seeking " << extn.keepers.size()
+	   << " objects" << endl;
     }
-    vector<long> id;
-    if (useRows) {
-      id.resize(ff.nrows());
-      for (long i=0; i<id.size(); i++)
-	id[i] = i;
-    } else {
-      ff.readCells(id, idKey);
+
+    vector<img::FTable> pieces;
+    try {
+      if (store)
+	pieces.push_back(storedDetections(*store, iext));
+      else
+	pieces = reader.take(icat);
+    } catch (std::runtime_error& e) {
+      quit(e,1);
     }
-    Assert(id.size() == ff.nrows());
+
+    const typename S::SubMap* sm=extn.map;
+    bool isTag = (expo.instrument == TAG_INSTRUMENT);
+    double sysErrorSq = pow(extn.sysError, 2.);
+    astrometry::Wcs* startWcs = extn.startWcs;
 
     bool magColumnIsDouble;
     bool magErrColumnIsDouble;
     bool errorColumnIsDouble;
     double magshift = extn.magshift;
 
-    if (S::isAstro) {
-      errorColumnIsDouble = isDouble(ff, errKey, -1);
-    } else {
-      magColumnIsDouble = isDouble(ff, magKey, magKeyElement);
-      magErrColumnIsDouble = isDouble(ff, magErrKey, magErrKeyElement);
+    long found = 0;
+    auto k = extn.keepers.begin();
+    for (int i=0; i<pieces.size(); i++) {
+      img::FTable& ff = pieces[i];
+      if (S::isAstro) {
+	errorColumnIsDouble = isDouble(ff, info.errKey, -1);
+      } else {
+	magColumnIsDouble = isDouble(ff, info.magKey, info.magKeyElement);
+	magErrColumnIsDouble = isDouble(ff, info.magErrKey, info.magErrKeyElement);
+      }
+      auto fill = [&](long irow, typename S::Detection* d) {
+	// Have a desired object now.  Fill its Detection structure
+	d->map = sm;
+	S::fillDetection(d, ff, irow,
+			 info.weight,
+			 info.xKey, info.yKey, info.errKey, info.magKey, info.magErrKey,
+			 info.magKeyElement, info.magErrKeyElement,
+			 errorColumnIsDouble, magColumnIsDouble, magErrColumnIsDouble,
+			 magshift,
+			 startWcs, sysErrorSq, isTag);
+      };
+      if (info.useRows) {
+	// The wanted rows of this range, in order
+	long start = request.ranges[i].first;
+	for ( ; k!=extn.keepers.end() && k->first < request.ranges[i].second; ++k) {
+	  if (k->first - start >= ff.nrows()) continue;  // Past end of catalog
+	  fill(k->first - start, k->second);
+	  ++found;
+	}
+      } else {
+	vector<long> id;
+	ff.readCells(id, info.idKey);
+	Assert(id.size() == ff.nrows());
+	found += extn.keepers.join(id, fill);
+      }
     }
 
-    for (long irow = 0; irow < ff.nrows(); irow++) {
-      auto pr = extn.keepers.find(id[irow]);
-      if (pr == extn.keepers.end()) continue; // Not a desired object
-
-      // Have a desired object now.  Fill its Detection structure
-      typename S::Detection* d = pr->second;
-      extn.keepers.erase(pr);
-      d->map = sm;
-
-      S::fillDetection(d, ff, irow,
-		       weight,
-		       xKey, yKey, errKey, magKey, magErrKey,
-		       magKeyElement, magErrKeyElement,
-		       errorColumnIsDouble, magColumnIsDouble, magErrColumnIsDouble,
-		       magshift,
-		       startWcs, sysErrorSq, isTag);
-    } // End loop over catalog objects
-
-    if (!extn.keepers.empty()) {
-      cerr << "Did not find all desired objects in catalog " << filename
-	   << " extension " << hduNumber
+    if (found < extn.keepers.size()) {
+      cerr << "Did not find all desired objects in catalog " << request.filename
+	   << " extension " << request.hduNumber
 	   << endl;
       exit(1);
     }
+    extn.keepers.clear();
   } // end loop over catalogs to read
   
 }
@@ -1276,19 +1580,24 @@ void readObjects(const img::FTable& extensionTable,
 template <class S>
 void
 readColors(img::FTable extensionTable,
-	   vector<typename S::ColorExtension*> colorExtensions) {
+	   vector<typename S::ColorExtension*> colorExtensions,
+	   int catalogThreads,
+	   const DetectionStore* store) {
 
+  if (store) checkDetectionStore(*store, extensionTable);
+
+  // Gather the catalogs to read and their color expressions
+  vector<int> catalogExtension;
+  vector<string> colorExpressions;
+  vector<bool> useRows;
+  vector<CatalogReader::Request> requests;
   for (int iext = 0; iext < colorExtensions.size(); iext++) {
     if (!colorExtensions[iext]) continue; // Skip unused 
     auto& extn = *colorExtensions[iext];
     if (extn.keepers.empty()) continue; // Not using any colors from this catalog
-    string filename;
-    extensionTable.readCell(filename, "Filename", iext);
-    /**/ cerr << "# Reading color catalog " << iext
-	      << "/" << colorExtensions.size()
-	      << " from " << filename << endl;
-    int hduNumber;
-    extensionTable.readCell(hduNumber, "Extension", iext);
+    CatalogReader::Request request;
+    extensionTable.readCell(request.filename, "Filename", iext);
+    extensionTable.readCell(request.hduNumber, "Extension", iext);
     string idKey;
     extensionTable.readCell(idKey, "idKey", iext);
     string colorExpression;
@@ -1300,51 +1609,110 @@ readColors(img::FTable extensionTable,
     }
     stripWhite(colorExpression);
     if (colorExpression.empty()) {
-      cerr << "No colorExpression specified for filename " << filename
-	   << " HDU " << hduNumber
+      cerr << "No colorExpression specified for filename " << request.filename
+	   << " HDU " << request.hduNumber
 	   << endl;
       exit(1);
     }
 
-    // Read the entire catalog for this extension
-    FITS::FitsTable ft(filename, FITS::ReadOnly, hduNumber);
-    img::FTable ff = ft.use();
+    if (store) {
+      // The store holds the color evaluated from the catalog
+      idKey = "ID";
+      colorExpression = "COLOR";
+    }
 
-    bool useRows = stringstuff::nocaseEqual(idKey, "_ROW");
-    vector<long> id;
-    if (useRows) {
-      id.resize(ff.nrows());
-      for (long i=0; i<id.size(); i++)
-	id[i] = i;
-    } else {
-      ff.readCells(id, idKey);
+    // Read only the ID and the columns used by the color expression
+    bool rows = stringstuff::nocaseEqual(idKey, "_ROW");
+    if (!rows)
+      request.columns.push_back(idKey);
+    request.expressions.push_back(colorExpression);
+    extn.keepers.sort();
+    if (rows && extn.keepers.begin()->first < 0) {
+      cerr << "Negative row number " << extn.keepers.begin()->first
+	   << " sought in color catalog " << request.filename
+	   << " extension " << request.hduNumber
+	   << endl;
+      exit(1);
     }
-    Assert(id.size() == ff.nrows());
+    if (rows)
+      extn.keepers.rowRanges(ROW_RANGE_GAP, request.ranges);
+
+    catalogExtension.push_back(iext);
+    colorExpressions.push_back(colorExpression);
+    useRows.push_back(rows);
+    requests.push_back(request);
+  }
 
-    vector<double> color(id.size(), 0.);
-    ff.evaluate(color, colorExpression);
+  // Each color catalog gives colors to distinct Matches, so they can be
+  // filled in parallel.
+  int consumers = 1;
+#ifdef _OPENMP
+  consumers = omp_get_max_threads();
+#endif
+  CatalogReader reader(store ? vector<CatalogReader::Request>() : requests,
+		       catalogThreads, 2*catalogThreads + consumers);
 
-    for (long irow = 0; irow < ff.nrows(); irow++) {
-      auto pr = extn.keepers.find(id[irow]);
-      if (pr == extn.keepers.end()) continue; // Not a desired object
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,1)
+#endif
+  for (int icat = 0; icat < requests.size(); icat++) {
+    int iext = catalogExtension[icat];
+    auto& extn = *colorExtensions[iext];
+    const CatalogReader::Request& request = requests[icat];
+    if (icat%50==0) {
+#ifdef _OPENMP
+#pragma omp critical(cerr)
+#endif
+      cerr << "# Reading color catalog " << iext
+	   << "/" << colorExtensions.size()
+	   << " from " << request.filename << endl;
+    }
 
-      // Have a desired object. Put the color into everything it matches
-      typename S::Match* m = pr->second;
-      extn.keepers.erase(pr);
+    vector<img::FTable> pieces;
+    try {
+      if (store)
+	pieces.push_back(storedDetections(*store, iext));
+      else
+	pieces = reader.take(icat);
+    } catch (std::runtime_error& e) {
+      quit(e,1);
+    }
 
-      for ( auto detptr : *m)
-	S::setColor(detptr,color[irow]);
+    long found = 0;
+    auto k = extn.keepers.begin();
+    for (int i=0; i<pieces.size(); i++) {
+      img::FTable& ff = pieces[i];
+      vector<double> color(ff.nrows(), 0.);
+      ff.evaluate(color, colorExpressions[icat]);
 
-    } // End loop over catalog objects
+      // Have a desired object. Put the color into everything it matches
+      auto fill = [&](long irow, typename S::Match* m) {
+	for ( auto detptr : *m)
+	  S::setColor(detptr,color[irow]);
+      };
+      if (useRows[icat]) {
+	long start = request.ranges[i].first;
+	for ( ; k!=extn.keepers.end() && k->first < request.ranges[i].second; ++k) {
+	  if (k->first - start >= ff.nrows()) continue;  // Past end of catalog
+	  fill(k->first - start, k->second);
+	  ++found;
+	}
+      } else {
+	vector<long> id;
+	ff.readCells(id, request.columns.front());
+	Assert(id.size() == ff.nrows());
+	found += extn.keepers.join(id, fill);
+      }
+    }
 
-    if (!extn.keepers.empty()) {
-      cerr << "Did not find all desired objects in catalog " << filename
-	   << " extension " << hduNumber
-	   << " " << extn.keepers.size() << " left, first ID is "
-	   << extn.keepers.begin()->first
+    if (found < extn.keepers.size()) {
+      cerr << "Did not find all desired objects in catalog " << request.filename
+	   << " extension " << request.hduNumber
+	   << " " << extn.keepers.size() - found << " left"
 	   << endl;
       exit(1);
     }
+    extn.keepers.clear();
   } // end loop over catalogs to read
 }
 
@@ -1889,12 +2257,24 @@ readMatches<AP>(img::FTable& table, \
 		const ExtensionObjectSet& skipSet, \
 		int minMatches); \
 template void \
+readMatches<AP>(const BinaryMatches& binary, \
+		const set<int>& useHdus, \
+		list<AP::Match*>& matches, \
+		vector<AP::Extension*>& extensions, \
+		vector<AP::ColorExtension*>& colorExtensions, \
+		const ExtensionObjectSet& skipSet, \
+		int minMatches); \
+template void \
 readObjects<AP>(const img::FTable& extensionTable, \
 		const vector<Exposure*>& exposures, \
-		vector<AP::Extension*>& extensions);\
+		vector<AP::Extension*>& extensions, \
+		int catalogThreads, \
+		const DetectionStore* store);\
 template void \
 readColors<AP>(img::FTable extensionTable, \
-	       vector<AP::ColorExtension*> colorExtensions);  \
+	       vector<AP::ColorExtension*> colorExtensions, \
+	       int catalogThreads, \
+	       const DetectionStore* store);  \
 template void  \
 purgeNoisyDetections<AP>(double maxError,  \
 			 list<AP::Match*>& matches,  \
@@ -0,0 +1,28 @@
+// Locks for multithreaded FITS access
+#include "FitsLocks.h"
+#include "fitsio.h"
+
+FitsLocks::~FitsLocks() {
+  for (auto& i : fileLocks) delete i.second;
+}
+
+bool
+FitsLocks::concurrentFiles() {
+  return fits_is_reentrant();
+}
+
+std::mutex&
+FitsLocks::lockFor(const string& filename) {
+  if (!concurrentFiles()) return allFilesLock;
+  std::lock_guard<std::mutex> lock(fileMapLock);
+  std::mutex*& m = fileLocks[filename];
+  if (!m) m = new std::mutex;
+  return *m;
+}
+
+std::unique_lock<std::mutex>
+FitsLocks::openClose() {
+  std::unique_lock<std::mutex> lock(allFilesLock, std::defer_lock);
+  if (concurrentFiles()) lock.lock();
+  return lock;
+}
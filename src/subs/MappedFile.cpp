@@ -0,0 +1,34 @@
+// Read-only memory mapping of a file
+#include "MappedFile.h"
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const string& filename_):
+  filename(filename_), base(nullptr), length(0) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("Could not open " + filename);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::runtime_error("Could not stat " + filename);
+  }
+  length = st.st_size;
+  if (length == 0) {
+    // mmap cannot map an empty file
+    close(fd);
+    return;
+  }
+  void* m = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED)
+    throw std::runtime_error("Could not map " + filename);
+  base = static_cast<const char*>(m);
+}
+
+MappedFile::~MappedFile() {
+  if (base) munmap(const_cast<char*>(base), length);
+}
@@ -1,6 +1,7 @@
 // Astrometric matching and fitting classes.
 
 #include "Match.h"
+#include "TouchedMaps.h"
 #include <list>
 using std::list;
 #include <set>
@@ -22,6 +23,7 @@ using std::set;
 
 // #define DEBUG
 #include "Marquardt.h"
+#include "SparseFitter.h"
 
 using namespace astrometry;
 
@@ -131,37 +133,45 @@ Match::remap() {
 // Coordinate-matching routines
 ///////////////////////////////////////////////////////////
 
-// A structure that describes a range of parameters
-struct iRange {
-  iRange(int i=0, int n=0): startIndex(i), nParams(n) {}
-  int startIndex;
-  int nParams;
-}; 
+namespace {
+  // Scratch space of each thread's calls to accumulateChisq, kept between
+  // matches so that nothing is allocated for a match once the thread has
+  // seen a match as large.
+  struct ChisqScratch {
+    ChisqScratch(): touched(2) {}
+    vector<DMatrix> derivs;	// Derivatives of each Detection's world coords
+    // Derivatives of the mean x and y for each map touched
+    TouchedMaps<DVector> touched;
+  };
+  thread_local ChisqScratch scratch;
+}
 
+template <class U>
 int
 Match::accumulateChisq(double& chisq,
 		       DVector& beta,
-		       SymmetricUpdater& updater,
+		       U& updater,
 		       bool reuseAlpha) {
   double xmean, ymean;
   double xW, yW;
-  int nP = beta.size();
 
   // No contributions to fit for <2 detections:
   if (nFit<=1) return 0;
 
   // Update mapping and save derivatives for each detection:
-  vector<DMatrix*> dxyi(elist.size(), 0);
+  ChisqScratch& s = scratch;
+  if (s.derivs.size() < elist.size()) s.derivs.resize(elist.size());
   int ipt=0;
   for (auto i = elist.begin(); i!=elist.end(); ++i, ++ipt) {
     if (!isFit(*i)) continue;
     int npi = (*i)->map->nParams();
     double xw, yw;
     if (npi>0) {
-      dxyi[ipt] = new DMatrix(2,npi);
+      DMatrix& dxy = s.derivs[ipt];
+      if (dxy.rows()!=2 || dxy.cols()!=npi) dxy.resize(2,npi);
       (*i)->map->toWorldDerivs((*i)->xpix, (*i)->ypix,
 			       xw, yw,
-			       *dxyi[ipt],
+			       dxy,
 			       (*i)->color);
     } else {
       (*i)->map->toWorld((*i)->xpix, (*i)->ypix, 
@@ -173,10 +183,10 @@ Match::accumulateChisq(double& chisq,
   }
 
   centroid(xmean,ymean, xW, yW);
-  DVector dxmean(nP, 0.);
-  DVector dymean(nP, 0.);
+  // Derivatives of the mean position, for the maps touched:
+  TouchedMaps<DVector>& touched = s.touched;
+  touched.clear();
 
-  map<int, iRange> mapsTouched;
   ipt = 0;
   for (auto i = elist.begin(); i!=elist.end(); ++i, ++ipt) {
     if (!isFit(*i)) continue;
@@ -184,6 +194,7 @@ Match::accumulateChisq(double& chisq,
     double wyi=(*i)->wty;
     double xi=(*i)->xw;
     double yi=(*i)->yw;
+    const DMatrix& dxy = s.derivs[ipt];
 
     chisq += 
       (xi-xmean)*(xi-xmean)*wxi
@@ -197,20 +208,20 @@ Match::accumulateChisq(double& chisq,
       if (np==0) continue;
       int mapNumber = (*i)->map->mapNumber(iMap);
       // Keep track of parameter ranges we've messed with:
-      mapsTouched[mapNumber] = iRange(ip,np);
+      int slot = touched.touch(mapNumber, ip, np);
 #ifdef USE_TMV
-      tmv::ConstVectorView<double> dx=dxyi[ipt]->row(0,istart,istart+np);
-      tmv::ConstVectorView<double> dy=dxyi[ipt]->row(1,istart,istart+np);
+      tmv::ConstVectorView<double> dx=dxy.row(0,istart,istart+np);
+      tmv::ConstVectorView<double> dy=dxy.row(1,istart,istart+np);
 #elif defined USE_EIGEN
-      DVector dx=dxyi[ipt]->block(0,istart,1,np).transpose();
-      DVector dy=dxyi[ipt]->block(1,istart,1,np).transpose();
+      DVector dx=dxy.block(0,istart,1,np).transpose();
+      DVector dy=dxy.block(1,istart,1,np).transpose();
 #endif
       beta.subVector(ip, ip+np) -= (wxi*(xi-xmean))*dx;
       beta.subVector(ip, ip+np) -= (wyi*(yi-ymean))*dy;
 
       // Derivatives of the mean position:
-      dxmean.subVector(ip, ip+np) += wxi*dx;
-      dymean.subVector(ip, ip+np) += wyi*dy;
+      touched.block(slot,0) += wxi*dx;
+      touched.block(slot,1) += wyi*dy;
 
       if (!reuseAlpha) {
 	// Increment the alpha matrix
@@ -225,11 +236,11 @@ Match::accumulateChisq(double& chisq,
 	  int mapNumber2 = (*i)->map->mapNumber(iMap2);
 	  if (np2==0) continue;
 #ifdef USE_TMV
-	  tmv::ConstVectorView<double> dx2=dxyi[ipt]->row(0,istart2,istart2+np2);
-	  tmv::ConstVectorView<double> dy2=dxyi[ipt]->row(1,istart2,istart2+np2);
+	  tmv::ConstVectorView<double> dx2=dxy.row(0,istart2,istart2+np2);
+	  tmv::ConstVectorView<double> dy2=dxy.row(1,istart2,istart2+np2);
 #elif defined USE_EIGEN
-	  DVector dx2=dxyi[ipt]->block(0,istart2,1,np2).transpose();
-	  DVector dy2=dxyi[ipt]->block(1,istart2,1,np2).transpose();
+	  DVector dx2=dxy.block(0,istart2,1,np2).transpose();
+	  DVector dy2=dxy.block(1,istart2,1,np2).transpose();
 #endif
 	  // Now update below diagonal
 	  updater.rankOneUpdate(mapNumber2, ip2, dx2, 
@@ -241,7 +252,6 @@ Match::accumulateChisq(double& chisq,
       }
       istart+=np;
     } // outer parameter segment loop
-    if (dxyi[ipt]) {delete dxyi[ipt]; dxyi[ipt]=nullptr;}
   } // object loop
 
   if (!reuseAlpha) {
@@ -251,34 +261,28 @@ Match::accumulateChisq(double& chisq,
 	alpha -=  (dymean ^ dymean)/yW;
     */
 
-    // Do updates parameter block by parameter block
-    for (auto m1 = mapsTouched.begin();
-	 m1!=mapsTouched.end();
-	 ++m1) {
-      int map1 = m1->first;
-      int i1 = m1->second.startIndex;
-      int n1 = m1->second.nParams;
-      if (n1<=0) continue;
-      DVector dx1 = dxmean.subVector(i1, i1+n1);
-      DVector dy1 = dymean.subVector(i1, i1+n1);
+    // Do updates parameter block by parameter block, in order of map number
+    const vector<int>& order = touched.byMapNumber();
+    for (int j1=0; j1<order.size(); j1++) {
+      int slot1 = order[j1];
+      int map1 = touched.mapNumber(slot1);
+      int i1 = touched.startIndex(slot1);
+      DVector& dx1 = touched.block(slot1,0);
+      DVector& dy1 = touched.block(slot1,1);
       updater.rankOneUpdate(map1, i1, dx1, -1./xW);
       updater.rankOneUpdate(map1, i1, dy1, -1./yW);
 
       // For cross terms, put the weight into dx1,dy1:
       dx1 *= -1./xW;
       dy1 *= -1./yW;
-      auto m2 = m1;
-      ++m2;
-      for ( ; m2 != mapsTouched.end(); ++m2) {
-	int map2 = m2->first;
-	int i2 = m2->second.startIndex;
-	int n2 = m2->second.nParams;
-	if (n2<=0) continue;
-	DVector dx2 = dxmean.subVector(i2, i2+n2);
-	DVector dy2 = dymean.subVector(i2, i2+n2);
-	updater.rankOneUpdate(map2, i2, dx2,
+      for (int j2=j1+1; j2<order.size(); j2++) {
+	int slot2 = order[j2];
+	int map2 = touched.mapNumber(slot2);
+	int i2 = touched.startIndex(slot2);
+	// The blocks of later maps do not yet hold the weight
+	updater.rankOneUpdate(map2, i2, touched.block(slot2,0),
 			      map1, i1, dx1);
-	updater.rankOneUpdate(map2, i2, dy2,
+	updater.rankOneUpdate(map2, i2, touched.block(slot2,1),
 			      map1, i1, dy1);
       }
     }
@@ -287,6 +291,15 @@ Match::accumulateChisq(double& chisq,
   return 2*(nFit-1);
 }
 
+template
+int Match::accumulateChisq(double&, DVector&, SymmetricUpdater&, bool);
+template
+int Match::accumulateChisq(double&, DVector&, BlockUpdater&, bool);
+template
+int Match::accumulateChisq(double&, DVector&, ProductUpdater&, bool);
+template
+int Match::accumulateChisq(double&, DVector&, DiagonalUpdater&, bool);
+
 bool
 Match::sigmaClip(double sigThresh,
 		 bool deleteDetection) {
@@ -356,23 +369,13 @@ Match::chisq(int& dof, double& maxDeviateSq) const {
   return chi;
 }
 
+template <class U>
 void
-CoordAlign::operator()(const DVector& p, double& chisq,
-		       DVector& beta, DMatrix& alpha,
+CoordAlign::accumulate(U& updater, double& chisq, DVector& beta,
 		       bool reuseAlpha) {
-  int nP = pmc.nParams();
-  Assert(p.size()==nP);
-  Assert(beta.size()==nP);
-  Assert(alpha.rows()==nP);
-  setParams(p);
   double newChisq=0.;
-  beta.setZero();
-  if (!reuseAlpha) alpha.setZero();
   int matchCtr=0;
 
-  const int NumberOfLocks = 2000;
-  SymmetricUpdater updater(alpha, pmc.nFreeMaps(), NumberOfLocks);
-
 #ifdef _OPENMP
   const int chunk=100;
   vector<Match*> vi(mlist.size());
@@ -443,59 +446,116 @@ CoordAlign::operator()(const DVector& p, double& chisq,
   }
 #endif
   chisq = newChisq;
+}
+
+vector<int>
+CoordAlign::freezeBlank(const vector<bool>& blank, DVector& beta) {
+  vector<int> frozen;
+  set<string> newlyFrozenMaps;
+  for (int i = 0; i<blank.size(); i++) {
+    if (blank[i]) {
+      string badAtom = pmc.atomHavingParameter(i);
+      // Is it a newly frozen parameter?
+      if (!frozenMaps.count(badAtom) || !frozenMaps[badAtom].count(i))
+	newlyFrozenMaps.insert(badAtom);
+      // Add to (or make) a list of the frozen parameters in this atom
+      frozenMaps[badAtom].insert(i);
+      frozen.push_back(i);
+      beta[i] = 0.;
+    } else {
+      // Something is weird if a frozen parameter is now constrained
+      if (frozenParameters.count(i)>0) {
+	string badAtom = pmc.atomHavingParameter(i);
+	FormatAndThrow<AstrometryError>() << "Frozen parameter " << i
+					  << " in map " << badAtom
+					  << " became constrained??";
+      }
+    }
+  } // End alpha row loop
+
+  for (auto badAtom : newlyFrozenMaps) {
+    // Print message about freezing parameters
+    int startIndex, nParams;
+    pmc.parameterIndicesOf(badAtom, startIndex, nParams);
+    cerr << "Freezing " << frozenMaps[badAtom].size()
+	 << " of " << nParams
+	 << " parameters in map " << badAtom;
+    if (frozenMaps[badAtom].size() < nParams) {
+      // Give the parameter indices
+      cerr << " (";
+      for (auto i : frozenMaps[badAtom])
+	cerr << i - startIndex << " ";
+      cerr << ")";
+    }
+    cerr << endl;
+  }
+  return frozen;
+}
+
+void
+CoordAlign::operator()(const DVector& p, double& chisq,
+		       DVector& beta, DMatrix& alpha,
+		       bool reuseAlpha) {
+  int nP = pmc.nParams();
+  Assert(p.size()==nP);
+  Assert(beta.size()==nP);
+  Assert(alpha.rows()==nP);
+  setParams(p);
+  beta.setZero();
+  if (!reuseAlpha) alpha.setZero();
+
+  const int NumberOfLocks = 2000;
+  SymmetricUpdater updater(alpha, pmc.nFreeMaps(), NumberOfLocks);
+  accumulate(updater, chisq, beta, reuseAlpha);
 
   if (!reuseAlpha) {
     // Code to spot unconstrained parameters:
-    set<string> newlyFrozenMaps;
+    vector<bool> blank(nP, true);
     for (int i = 0; i<alpha.rows(); i++) {
-      bool blank = true;
       for (int j=0; j<alpha.cols(); j++) 
 	if ( (i>=j && alpha(i,j)!=0.) || (i<j && alpha(j,i)!=0.)) {
 	  // Note that we are checking in lower triangle only
-	  blank = false;
+	  blank[i] = false;
 	  break;
 	}
-      if (blank) {
-	string badAtom = pmc.atomHavingParameter(i);
-	// Is it a newly frozen parameter?
-	if (!frozenMaps.count(badAtom) || !frozenMaps[badAtom].count(i))
-	  newlyFrozenMaps.insert(badAtom);
-	// Add to (or make) a list of the frozen parameters in this atom
-	frozenMaps[badAtom].insert(i);
-	alpha(i,i) = 1.;
-	beta[i] = 0.;
-      } else {
-	// Something is weird if a frozen parameter is now constrained
-	if (frozenParameters.count(i)>0) {
-	  string badAtom = pmc.atomHavingParameter(i);
-	  FormatAndThrow<AstrometryError>() << "Frozen parameter " << i
-					    << " in map " << badAtom
-					    << " became constrained??";
-	}
-      }
-    } // End alpha row loop
-
-    for (auto badAtom : newlyFrozenMaps) {
-      // Print message about freezing parameters
-      int startIndex, nParams;
-      pmc.parameterIndicesOf(badAtom, startIndex, nParams);
-      cerr << "Freezing " << frozenMaps[badAtom].size()
-	   << " of " << nParams
-	   << " parameters in map " << badAtom;
-      if (frozenMaps[badAtom].size() < nParams) {
-	// Give the parameter indices
-	cerr << " (";
-	for (auto i : frozenMaps[badAtom])
-	  cerr << i - startIndex << " ";
-	cerr << ")";
-      }
-      cerr << endl;
     }
+    for (int i : freezeBlank(blank, beta))
+      alpha(i,i) = 1.;
   } // End degenerate parameter check
 }
 
+void
+CoordAlign::operator()(const DVector& p, double& chisq,
+		       DVector& beta, BlockSymmetric& alpha,
+		       bool reuseAlpha) {
+  int nP = pmc.nParams();
+  Assert(p.size()==nP);
+  Assert(beta.size()==nP);
+  Assert(alpha.nParams()==nP);
+  Assert(alpha.nMaps()==pmc.nFreeMaps());
+  setParams(p);
+  beta.setZero();
+  if (!reuseAlpha) alpha.setZero();
+
+  const int NumberOfLocks = 2000;
+  BlockUpdater updater(alpha, NumberOfLocks);
+  accumulate(updater, chisq, beta, reuseAlpha);
+
+  if (!reuseAlpha) {
+    // Spot unconstrained parameters, giving every parameter a block first
+    alpha.completeLayout();
+    for (int i : freezeBlank(alpha.emptyParameters(), beta))
+      alpha.setDiagonal(i, 1.);
+  }
+}
+
 double
 CoordAlign::fitOnce(bool reportToCerr, bool inPlace) {
+  if (solver==ConjugateGradient)
+    return SparseFitter<CoordAlign>(*this).fitMatrixFree(reportToCerr);
+  if (solver!=Dense)
+    return SparseFitter<CoordAlign>(*this).fitSparse(reportToCerr);
+
   DVector p = getParams();
   // First will try doing Newton iterations, keeping a fixed Hessian.
   // If it increases chisq or takes too long to converge, we will 
@@ -572,76 +632,8 @@ CoordAlign::fitOnce(bool reportToCerr, bool inPlace) {
 	cerr << "Cannot describe degeneracies while dividing in place" << endl;
 	exit(1);
       }
-      int N = alpha.cols();
-      set<int> degen;
-      DMatrix U(N,N);
-      DVector S(N);
-
-#ifdef USE_TMV
-      tmv::Eigen(symAlpha, U, S);
-#elif defined USE_EIGEN
-      {
-	Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eig(alpha);
-	U = eig.eigenvectors();
-	S = eig.eigenvalues();
-      }
-#endif
-      // Both packages promise to return eigenvalues in increasing
-      // order, but let's not depend on that.  Report largest/smallest
-      // abs values of eval's, and print them all
-      int imax = S.size()-1; // index of largest, smallest eval
-      double smax=abs(S[imax]);
-      int imin = 0;
-      double smin=abs(S[imin]);
-      for (int i=0; i<U.cols(); i++) {
-	cerr << i << " Eval: " << S[i] << endl;
-	double s= abs(S[i]);
-	if (s>smax) {
-	  smax = s;
-	  imax = i;
-	}
-	if (s<smin) {
-	  smin = s;
-	  imin = i;
-	}
-	if (S[i]<1e-6) degen.insert(i);
-      }
-      cerr << "Largest abs(eval): " << smax << endl;
-      cerr << "Smallest abs(eval): " << smin << endl;
-      degen.insert(imin);
-      // Find biggest contributors to non-positive (or marginal) eigenvectors
-      const int ntop=MIN(N,20);
-      for (int isv : degen) {
-	  cerr << "--->Eigenvector " << isv << " eigenvalue " << S(isv) << endl;
-	  // Find smallest abs coefficient
-	  int imin = 0;
-	  for (int i=0; i<U.rows(); i++)
-	    if (abs(U(i,isv)) < abs(U(imin,isv)))
-	      imin = i;
-	  vector<int> top(ntop,imin);
-	  for (int i=0; i<U.rows(); i++) {
-	    for (int j=0; j<ntop; j++) {
-	      if (abs(U(i,isv)) >= abs(U(top[j],isv))) {
-		// Push smaller entries to right
-		for (int k=ntop-1; k>j; k--)
-		  top[k] = top[k-1];
-		top[j] = i;
-		break;
-	      }
-	    }
-	  }
-	  for (int j : top) {
-	    string badAtom = pmc.atomHavingParameter(j);
-	    int startIndex, nParams;
-	    pmc.parameterIndicesOf(badAtom, startIndex, nParams);
-	    cerr << "Coefficient " << U(j, isv) 
-		 << " at parameter " << j 
-		 << " Map " << badAtom 
-		 << " " << j - startIndex << " of " << nParams
-		 << endl;
-	  }
-	}
-	exit(1);
+      reportDegeneracies(alpha);
+      exit(1);
     }
 
 
@@ -709,6 +701,88 @@ CoordAlign::fitOnce(bool reportToCerr, bool inPlace) {
   return chisq;
 }
 
+void
+CoordAlign::reportDegeneracies(DMatrix& alpha) {
+  int N = alpha.cols();
+  set<int> degen;
+  DMatrix U(N,N);
+  DVector S(N);
+
+#ifdef USE_TMV
+  tmv::Eigen(tmv::SymMatrixViewOf(alpha,tmv::Lower), U, S);
+#elif defined USE_EIGEN
+  {
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eig(alpha);
+    U = eig.eigenvectors();
+    S = eig.eigenvalues();
+  }
+#endif
+  // Both packages promise to return eigenvalues in increasing
+  // order, but let's not depend on that.  Report largest/smallest
+  // abs values of eval's, and print them all
+  int imax = S.size()-1; // index of largest, smallest eval
+  double smax=abs(S[imax]);
+  int imin = 0;
+  double smin=abs(S[imin]);
+  for (int i=0; i<U.cols(); i++) {
+    cerr << i << " Eval: " << S[i] << endl;
+    double s= abs(S[i]);
+    if (s>smax) {
+      smax = s;
+      imax = i;
+    }
+    if (s<smin) {
+      smin = s;
+      imin = i;
+    }
+    if (S[i]<1e-6) degen.insert(i);
+  }
+  cerr << "Largest abs(eval): " << smax << endl;
+  cerr << "Smallest abs(eval): " << smin << endl;
+  degen.insert(imin);
+  // Find biggest contributors to non-positive (or marginal) eigenvectors
+  const int ntop=MIN(N,20);
+  for (int isv : degen) {
+      cerr << "--->Eigenvector " << isv << " eigenvalue " << S(isv) << endl;
+      // Find smallest abs coefficient
+      int imin = 0;
+      for (int i=0; i<U.rows(); i++)
+	if (abs(U(i,isv)) < abs(U(imin,isv)))
+	  imin = i;
+      vector<int> top(ntop,imin);
+      for (int i=0; i<U.rows(); i++) {
+	for (int j=0; j<ntop; j++) {
+	  if (abs(U(i,isv)) >= abs(U(top[j],isv))) {
+	    // Push smaller entries to right
+	    for (int k=ntop-1; k>j; k--)
+	      top[k] = top[k-1];
+	    top[j] = i;
+	    break;
+	  }
+	}
+      }
+      for (int j : top) {
+	string badAtom = pmc.atomHavingParameter(j);
+	int startIndex, nParams;
+	pmc.parameterIndicesOf(badAtom, startIndex, nParams);
+	cerr << "Coefficient " << U(j, isv) 
+	     << " at parameter " << j 
+	     << " Map " << badAtom 
+	     << " " << j - startIndex << " of " << nParams
+	     << endl;
+      }
+  }
+}
+
+void
+CoordAlign::describeParameter(std::ostream& os, int j) {
+  string badAtom = pmc.atomHavingParameter(j);
+  int startIndex, nParams;
+  pmc.parameterIndicesOf(badAtom, startIndex, nParams);
+  os << " Map " << badAtom
+     << " " << j - startIndex << " of " << nParams;
+}
+
 void
 CoordAlign::remap() {
   for (auto i : mlist)
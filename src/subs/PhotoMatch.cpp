@@ -1,6 +1,7 @@
 // Photometric matching and fitting classes.
 
 #include "PhotoMatch.h"
+#include "TouchedMaps.h"
 #include <list>
 using std::list;
 #include <set>
@@ -17,6 +18,7 @@ using std::set;
 
 // #define DEBUG
 #include "Marquardt.h"
+#include "SparseFitter.h"
 
 using namespace photometry;
 
@@ -119,49 +121,56 @@ Match::remap() {
 // Coordinate-matching routines
 ///////////////////////////////////////////////////////////
 
-// A structure that describes a range of parameters
-struct iRange {
-  iRange(int i=0, int n=0): startIndex(i), nParams(n) {}
-  int startIndex;
-  int nParams;
-};
+namespace {
+  // Scratch space of each thread's calls to accumulateChisq, kept between
+  // matches so that nothing is allocated for a match once the thread has
+  // seen a match as large.
+  struct ChisqScratch {
+    vector<DVector> derivs;	// Derivatives of each Detection's magnitude
+    TouchedMaps<DVector> touched;	// Derivatives of the mean, per map touched
+  };
+  thread_local ChisqScratch scratch;
+}
 
+template <class U>
 int
 Match::accumulateChisq(double& chisq,
 		       DVector& beta,
-		       SymmetricUpdater& updater,
+		       U& updater,
 		       bool reuseAlpha) {
   double mean;
   double wt;
-  int nP = beta.size();
 
   // No contributions to fit for <2 detections:
   if (nFit<=1) return 0;
 
   // Update mapping and save derivatives for each detection:
-  vector<DVector*> di(elist.size());
+  ChisqScratch& s = scratch;
+  if (s.derivs.size() < elist.size()) s.derivs.resize(elist.size());
   int ipt=0;
   for (auto i = elist.begin(); i!=elist.end(); ++i, ++ipt) {
     if (!isFit(*i)) continue;
     int npi = (*i)->map->nParams();
     if (npi>0) {
-      di[ipt] = new DVector(npi);
-      (*i)->magOut = (*i)->map->forwardDerivs((*i)->magIn, (*i)->args,
-					      *di[ipt]);
+      DVector& d = s.derivs[ipt];
+      if (d.size()!=npi) d.resize(npi);
+      (*i)->magOut = (*i)->map->forwardDerivs((*i)->magIn, (*i)->args, d);
     } else {
       (*i)->magOut = (*i)->map->forward((*i)->magIn, (*i)->args);
     }
   }
 
   getMean(mean,wt);
-  DVector dmean(nP, 0.);
+  // Derivatives of the mean, for the maps touched:
+  TouchedMaps<DVector>& touched = s.touched;
+  touched.clear();
 
-  map<int, iRange> mapsTouched;
   ipt = 0;
   for (auto i = elist.begin(); i!=elist.end(); ++i, ++ipt) {
     if (!isFit(*i)) continue;
     double wti=(*i)->wt;
     double mi=(*i)->magOut;
+    const DVector& d = s.derivs[ipt];
 
     chisq += (mi-mean)*(mi-mean)*wti;
 
@@ -173,12 +182,12 @@ Match::accumulateChisq(double& chisq,
       if (np==0) continue;
       int mapNumber = (*i)->map->mapNumber(iMap);
       // Keep track of parameter ranges we've messed with:
-      mapsTouched[mapNumber] = iRange(ip,np);
-      DVector dm=di[ipt]->subVector(istart,istart+np);
+      int slot = touched.touch(mapNumber, ip, np);
+      DVector dm=d.subVector(istart,istart+np);
       beta.subVector(ip, ip+np) -= (wti*(mi-mean))*dm;
 
       // Derivatives of the mean position:
-      dmean.subVector(ip, ip+np) += wti*dm;
+      touched.block(slot) += wti*dm;
 
       if (!reuseAlpha) {
 	// Increment the alpha matrix
@@ -193,16 +202,15 @@ Match::accumulateChisq(double& chisq,
 	  int np2=(*i)->map->nSubParams(iMap2);
 	  int mapNumber2 = (*i)->map->mapNumber(iMap2);
 	  if (np2==0) continue;
-	  DVector dm2=di[ipt]->subVector(istart2,istart2+np2);
+	  DVector dm2=d.subVector(istart2,istart2+np2);
 	  // Update below the diagonal:
 	  updater.rankOneUpdate(mapNumber2, ip2, dm2, 
 				mapNumber,  ip,  dm);
 	  istart2+=np2;
 	}
-	istart+=np;
       }
+      istart+=np;
     } // outer parameter segment loop
-    if (di[ipt]) {delete di[ipt]; di[ipt]=nullptr;}
   } // object loop
 
 
@@ -212,28 +220,21 @@ Match::accumulateChisq(double& chisq,
 	alpha -=  (dmean ^ dmean)/wt;
     */
 
-    // Do updates parameter block by parameter block
-    for (auto m1=mapsTouched.begin();
-	 m1 != mapsTouched.end();
-	 ++m1) {
-      int map1 = m1->first;
-      int i1 = m1->second.startIndex;
-      int n1 = m1->second.nParams;
-      if (n1<=0) continue;
-      DVector dm1 = dmean.subVector(i1, i1+n1);
-      // Update astride diagona;:
+    // Do updates parameter block by parameter block, in order of map number
+    const vector<int>& order = touched.byMapNumber();
+    for (int j1=0; j1<order.size(); j1++) {
+      int slot1 = order[j1];
+      int map1 = touched.mapNumber(slot1);
+      int i1 = touched.startIndex(slot1);
+      DVector& dm1 = touched.block(slot1);
+      // Update astride diagonal:
       updater.rankOneUpdate(map1, i1, dm1, -1./wt);
       // Put the weight factor into dm1:
       dm1 *= -1./wt;
-      auto m2 = m1;
-      ++m2;
-      for (; m2 != mapsTouched.end(); ++m2) {
-	int map2 = m2->first;
-	int i2 = m2->second.startIndex;
-	int n2 = m2->second.nParams;
-	if (n2<=0) continue;
-	DVector dm2 = dmean.subVector(i2, i2+n2);
-	updater.rankOneUpdate(map2, i2, dm2,
+      for (int j2=j1+1; j2<order.size(); j2++) {
+	int slot2 = order[j2];
+	updater.rankOneUpdate(touched.mapNumber(slot2), touched.startIndex(slot2),
+			      touched.block(slot2),
 			      map1, i1, dm1);
       }
     }
@@ -241,6 +242,15 @@ Match::accumulateChisq(double& chisq,
   return nFit-1;
 }
 
+template
+int Match::accumulateChisq(double&, DVector&, SymmetricUpdater&, bool);
+template
+int Match::accumulateChisq(double&, DVector&, BlockUpdater&, bool);
+template
+int Match::accumulateChisq(double&, DVector&, ProductUpdater&, bool);
+template
+int Match::accumulateChisq(double&, DVector&, DiagonalUpdater&, bool);
+
 bool
 Match::sigmaClip(double sigThresh,
 		 bool deleteDetection) {
@@ -303,24 +313,13 @@ Match::chisq(int& dof, double& maxDeviateSq) const {
   return chi;
 }
 
+template <class U>
 void
-PhotoAlign::operator()(const DVector& p, double& chisq,
-		       DVector& beta, DMatrix& alpha,
+PhotoAlign::accumulate(U& updater, double& chisq, DVector& beta,
 		       bool reuseAlpha) {
-  countPriorParams();
-  int nP = nParams();
-  Assert(p.size()==nP);
-  Assert(beta.size()==nP);
-  Assert(alpha.rows()==nP);
-  setParams(p);
   double newChisq=0.;
-  beta.setZero();
-  if (!reuseAlpha) alpha.setZero();
   int matchCtr=0;
 
-  const int NumberOfLocks = 2000;
-  SymmetricUpdater updater(alpha, maxMapNumber, NumberOfLocks);
-
 #ifdef _OPENMP
   const int chunk=200;
   vector<Match*> vi(mlist.size());
@@ -365,7 +364,7 @@ PhotoAlign::operator()(const DVector& p, double& chisq,
 #else
   // Without OPENMP, just loop through all matches:
   for (auto i : mlist) {
-    Match* m = *i;
+    Match* m = i;
     if (matchCtr%10000==0) cerr << "# accumulating chisq at match # " 
 				<< matchCtr  //**<< " newChisq " << newChisq
 				<< endl;
@@ -380,93 +379,153 @@ PhotoAlign::operator()(const DVector& p, double& chisq,
   // A single thread will do.
   for (auto i : priors)
     i->accumulateChisq(chisq, beta, updater, reuseAlpha);
+}
+
+vector<int>
+PhotoAlign::freezeBlank(const vector<bool>& blank, DVector& beta) {
+  vector<int> frozen;
+  set<string> newlyFrozenMaps;
+  for (int i = 0; i<blank.size(); i++) {
+    if (blank[i]) {
+      string badAtom="";
+      bool badIsMap; // Is the bad parameter in a map or in a prior?
+      if (i < pmc.nParams()) {
+	badAtom = pmc.atomHavingParameter(i);
+	badIsMap = true;
+      } else {
+	// Look among the priors for this parameter
+	for (auto iprior : priors) {
+	  if ( i >= iprior->startIndex() &&
+	       i < iprior->startIndex() + iprior->nParams()) {
+	    badAtom = iprior->getName();
+	    badIsMap = false;
+	    break;
+	  }
+	}
+      }
+      if (badAtom.empty()) {
+	FormatAndThrow<PhotometryError>() << "Could not locate parent map for "
+					  << " degenerate parameter " << i;
+      }
+      // Add to (or make) a list of the frozen parameters in this atom
+      // Is it a newly frozen parameter?
+      if (!frozenMaps.count(badAtom) || !frozenMaps[badAtom].count(i))
+	newlyFrozenMaps.insert(badAtom);
+      // Add to (or make) a list of the frozen parameters in this atom
+      frozenMaps[badAtom].insert(i);
+      // Caller fudges matrix to freeze parameter:
+      frozen.push_back(i);
+      beta[i] = 0.;
+    } else {
+      // Something is weird if a frozen parameter is now constrained
+      if (frozenParameters.count(i)>0) {
+	if (i < pmc.nParams()) {
+	  string badAtom = pmc.atomHavingParameter(i);
+	  FormatAndThrow<PhotometryError>() << "Frozen parameter " << i
+					    << " in map " << badAtom
+					    << " became constrained??";
+	} else {
+	  FormatAndThrow<PhotometryError>() << "Frozen parameter " << i
+					    << " in prior became constrained??";
+	}
+      }
+    }
+  } // End alpha row loop
+
+  for (auto badAtom : newlyFrozenMaps) {
+    // Print message about freezing parameters
+    int startIndex, nParams;
+    if (pmc.mapExists(badAtom)) {
+      // Message for a map parameter:
+      pmc.parameterIndicesOf(badAtom, startIndex, nParams);
+      cerr << "Freezing " << frozenMaps[badAtom].size()
+	   << " of " << nParams
+	   << " parameters in map " << badAtom;
+      if (frozenMaps[badAtom].size() < nParams) {
+	// Give the parameter indices
+	cerr << " (";
+	for (auto i : frozenMaps[badAtom])
+	  cerr << i - startIndex << " ";
+	cerr << ")";
+      }
+      cerr << endl;
+    } else {
+      // Message for a prior parameter
+      cerr << "Freezing " << frozenMaps[badAtom].size()
+	   << " parameters in map " << badAtom
+	   << endl;  // ??? Could get more specific here.
+    }
+  }
+  return frozen;
+}
+
+void
+PhotoAlign::operator()(const DVector& p, double& chisq,
+		       DVector& beta, DMatrix& alpha,
+		       bool reuseAlpha) {
+  countPriorParams();
+  int nP = nParams();
+  Assert(p.size()==nP);
+  Assert(beta.size()==nP);
+  Assert(alpha.rows()==nP);
+  setParams(p);
+  beta.setZero();
+  if (!reuseAlpha) alpha.setZero();
+
+  const int NumberOfLocks = 2000;
+  SymmetricUpdater updater(alpha, maxMapNumber, NumberOfLocks);
+  accumulate(updater, chisq, beta, reuseAlpha);
 
   if (!reuseAlpha) {
     // Code to spot unconstrained parameters:
-    set<string> newlyFrozenMaps;
+    vector<bool> blank(nP, true);
     for (int i = 0; i<alpha.rows(); i++) {
-      bool blank = true;
       for (int j=0; j<alpha.cols(); j++) 
 	if ( (i>=j && alpha(i,j)!=0.) || (i<j && alpha(j,i)!=0.)) {
 	  // Note that we are checking in lower triangle only
-	  blank = false;
+	  blank[i] = false;
 	  break;
 	}
-      if (blank) {
-	string badAtom="";
-	bool badIsMap; // Is the bad parameter in a map or in a prior?
-	if (i < pmc.nParams()) {
-	  badAtom = pmc.atomHavingParameter(i);
-	  badIsMap = true;
-	} else {
-	  // Look among the priors for this parameter
-	  for (auto iprior : priors) {
-	    if ( i >= iprior->startIndex() &&
-		 i < iprior->startIndex() + iprior->nParams()) {
-	      badAtom = iprior->getName();
-	      badIsMap = false;
-	      break;
-	    }
-	  }
-	}
-	if (badAtom.empty()) {
-	  FormatAndThrow<PhotometryError>() << "Could not locate parent map for "
-					    << " degenerate parameter " << i;
-	}
-	// Add to (or make) a list of the frozen parameters in this atom
-	// Is it a newly frozen parameter?
-	if (!frozenMaps.count(badAtom) || !frozenMaps[badAtom].count(i))
-	  newlyFrozenMaps.insert(badAtom);
-	// Add to (or make) a list of the frozen parameters in this atom
-	frozenMaps[badAtom].insert(i);
-	// Fudge matrix to freeze parameter:
-	alpha(i,i) = 1.;
-	beta[i] = 0.;
-      } else {
-	// Something is weird if a frozen parameter is now constrained
-	if (frozenParameters.count(i)>0) {
-	  if (i < pmc.nParams()) {
-	    string badAtom = pmc.atomHavingParameter(i);
-	    FormatAndThrow<PhotometryError>() << "Frozen parameter " << i
-					      << " in map " << badAtom
-					      << " became constrained??";
-	  } else {
-	    FormatAndThrow<PhotometryError>() << "Frozen parameter " << i
-					      << " in prior became constrained??";
-	  }
-	}
-      }
-    } // End alpha row loop
-
-    for (auto badAtom : newlyFrozenMaps) {
-      // Print message about freezing parameters
-      int startIndex, nParams;
-      if (pmc.mapExists(badAtom)) {
-	// Message for a map parameter:
-	pmc.parameterIndicesOf(badAtom, startIndex, nParams);
-	cerr << "Freezing " << frozenMaps[badAtom].size()
-	     << " of " << nParams
-	     << " parameters in map " << badAtom;
-	if (frozenMaps[badAtom].size() < nParams) {
-	  // Give the parameter indices
-	  cerr << " (";
-	  for (auto i : frozenMaps[badAtom])
-	    cerr << i - startIndex << " ";
-	  cerr << ")";
-	}
-	cerr << endl;
-      } else {
-	// Message for a prior parameter
-	cerr << "Freezing " << frozenMaps[badAtom].size()
-	     << " parameters in map " << badAtom
-	     << endl;  // ??? Could get more specific here.
-      }
     }
+    // Fudge matrix to freeze parameters:
+    for (int i : freezeBlank(blank, beta))
+      alpha(i,i) = 1.;
   } // End degenerate parameter check
 }
 
+void
+PhotoAlign::operator()(const DVector& p, double& chisq,
+		       DVector& beta, BlockSymmetric& alpha,
+		       bool reuseAlpha) {
+  countPriorParams();
+  int nP = nParams();
+  Assert(p.size()==nP);
+  Assert(beta.size()==nP);
+  Assert(alpha.nParams()==nP);
+  Assert(alpha.nMaps()==maxMapNumber);
+  setParams(p);
+  beta.setZero();
+  if (!reuseAlpha) alpha.setZero();
+
+  const int NumberOfLocks = 2000;
+  BlockUpdater updater(alpha, NumberOfLocks);
+  accumulate(updater, chisq, beta, reuseAlpha);
+
+  if (!reuseAlpha) {
+    // Spot unconstrained parameters, giving every parameter a block first
+    alpha.completeLayout();
+    for (int i : freezeBlank(alpha.emptyParameters(), beta))
+      alpha.setDiagonal(i, 1.);
+  }
+}
+
 double
 PhotoAlign::fitOnce(bool reportToCerr, bool inPlace) {
+  if (solver==ConjugateGradient)
+    return SparseFitter<PhotoAlign>(*this).fitMatrixFree(reportToCerr);
+  if (solver!=Dense)
+    return SparseFitter<PhotoAlign>(*this).fitSparse(reportToCerr);
+
   DVector p = getParams();
   // First will try doing Newton iterations, keeping a fixed Hessian.
   // If it increases chisq or takes too long to converge, we will 
@@ -543,82 +602,8 @@ PhotoAlign::fitOnce(bool reportToCerr, bool inPlace) {
 	cerr << "Cannot describe degeneracies while dividing in place" << endl;
 	exit(1);
       }
-      int N = alpha.cols();
-      set<int> degen;
-      DMatrix U(N,N);
-      DVector S(N);
-#ifdef USE_TMV
-      tmv::Eigen(symAlpha, U, S);
-#elif defined USE_EIGEN
-      {
-	Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eig(alpha);
-	U = eig.eigenvectors();
-	S = eig.eigenvalues();
-      }
-#endif
-      // Both packages promise to return eigenvalues in increasing
-      // order, but let's not depend on that.  Report largest/smallest
-      // abs values of eval's, and print them all
-      int imax = S.size()-1; // index of largest, smallest eval
-      double smax=abs(S[imax]);
-      int imin = 0;
-      double smin=abs(S[imin]);
-      for (int i=0; i<U.cols(); i++) {
-	cerr << i << " Eval: " << S[i] << endl;
-	double s= abs(S[i]);
-	if (s>smax) {
-	  smax = s;
-	  imax = i;
-	}
-	if (s<smin) {
-	  smin = s;
-	  imin = i;
-	}
-	if (S[i]<1e-6) degen.insert(i);
-      }
-      cerr << "Largest abs(eval): " << smax << endl;
-      cerr << "Smallest abs(eval): " << smin << endl;
-      degen.insert(imin);
-      // Find biggest contributors to non-positive (or marginal) eigenvectors
-      const int ntop=MIN(N,20);
-      for (int isv : degen) {
-	  cerr << "--->Eigenvector " << isv << " eigenvalue " << S(isv) << endl;
-	  // Find smallest abs coefficient
-	  int imin = 0;
-	  for (int i=0; i<U.rows(); i++)
-	    if (abs(U(i,isv)) < abs(U(imin,isv)))
-	      imin = i;
-	  vector<int> top(ntop,imin);
-	  for (int i=0; i<U.rows(); i++) {
-	    for (int j=0; j<ntop; j++) {
-	      if (abs(U(i,isv)) >= abs(U(top[j],isv))) {
-		// Push smaller entries to right
-		for (int k=ntop-1; k>j; k--)
-		  top[k] = top[k-1];
-		top[j] = i;
-		break;
-	      }
-	    }
-	  }
-	  for (int j : top) {
-	    if (j < pmc.nParams()) {
-	      string badAtom = pmc.atomHavingParameter(j);
-	      int startIndex, nParams;
-	      pmc.parameterIndicesOf(badAtom, startIndex, nParams);
-	      cerr << "Coefficient " << U(j, isv) 
-		   << " at parameter " << j 
-		   << " Map " << badAtom 
-		   << " " << j - startIndex << " of " << nParams
-		   << endl;
-	    } else {
-	      cerr << "Coefficient " << U(j, isv) 
-		   << " at parameter " << j 
-		   << " in priors"
-		   << endl;
-	  }
-	}
-	exit(1);
-      }
+      reportDegeneracies(alpha);
+      exit(1);
     }
 
     // Now attempt Newton iterations to solution, with fixed alpha
@@ -683,6 +668,98 @@ PhotoAlign::fitOnce(bool reportToCerr, bool inPlace) {
   return chisq;
 }
 
+void
+PhotoAlign::reportDegeneracies(DMatrix& alpha) {
+  int N = alpha.cols();
+  set<int> degen;
+  DMatrix U(N,N);
+  DVector S(N);
+#ifdef USE_TMV
+  tmv::Eigen(tmv::SymMatrixViewOf(alpha,tmv::Lower), U, S);
+#elif defined USE_EIGEN
+  {
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eig(alpha);
+    U = eig.eigenvectors();
+    S = eig.eigenvalues();
+  }
+#endif
+  // Both packages promise to return eigenvalues in increasing
+  // order, but let's not depend on that.  Report largest/smallest
+  // abs values of eval's, and print them all
+  int imax = S.size()-1; // index of largest, smallest eval
+  double smax=abs(S[imax]);
+  int imin = 0;
+  double smin=abs(S[imin]);
+  for (int i=0; i<U.cols(); i++) {
+    cerr << i << " Eval: " << S[i] << endl;
+    double s= abs(S[i]);
+    if (s>smax) {
+      smax = s;
+      imax = i;
+    }
+    if (s<smin) {
+      smin = s;
+      imin = i;
+    }
+    if (S[i]<1e-6) degen.insert(i);
+  }
+  cerr << "Largest abs(eval): " << smax << endl;
+  cerr << "Smallest abs(eval): " << smin << endl;
+  degen.insert(imin);
+  // Find biggest contributors to non-positive (or marginal) eigenvectors
+  const int ntop=MIN(N,20);
+  for (int isv : degen) {
+      cerr << "--->Eigenvector " << isv << " eigenvalue " << S(isv) << endl;
+      // Find smallest abs coefficient
+      int imin = 0;
+      for (int i=0; i<U.rows(); i++)
+	if (abs(U(i,isv)) < abs(U(imin,isv)))
+	  imin = i;
+      vector<int> top(ntop,imin);
+      for (int i=0; i<U.rows(); i++) {
+	for (int j=0; j<ntop; j++) {
+	  if (abs(U(i,isv)) >= abs(U(top[j],isv))) {
+	    // Push smaller entries to right
+	    for (int k=ntop-1; k>j; k--)
+	      top[k] = top[k-1];
+	    top[j] = i;
+	    break;
+	  }
+	}
+      }
+      for (int j : top) {
+	if (j < pmc.nParams()) {
+	  string badAtom = pmc.atomHavingParameter(j);
+	  int startIndex, nParams;
+	  pmc.parameterIndicesOf(badAtom, startIndex, nParams);
+	  cerr << "Coefficient " << U(j, isv) 
+	       << " at parameter " << j 
+	       << " Map " << badAtom 
+	       << " " << j - startIndex << " of " << nParams
+	       << endl;
+	} else {
+	  cerr << "Coefficient " << U(j, isv) 
+	       << " at parameter " << j 
+	       << " in priors"
+	       << endl;
+	}
+      }
+  }
+}
+
+void
+PhotoAlign::describeParameter(std::ostream& os, int j) {
+  if (j < pmc.nParams()) {
+    string badAtom = pmc.atomHavingParameter(j);
+    int startIndex, nParams;
+    pmc.parameterIndicesOf(badAtom, startIndex, nParams);
+    os << " Map " << badAtom
+       << " " << j - startIndex << " of " << nParams;
+  } else {
+    os << " in priors";
+  }
+}
+
 void
 PhotoAlign::remap() {
   for (auto i : mlist)
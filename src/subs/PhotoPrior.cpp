@@ -93,10 +93,11 @@ PhotoPrior::remap() {
     i.magOut = i.map->forward(i.magIn, i.args);
 }
   
+template <class U>
 int
 PhotoPrior::accumulateChisq(double& chisq,
 			    DVector& beta,
-			    SymmetricUpdater& updater,
+			    U& updater,
 			    bool reuseAlpha) {
   if (isDegenerate()) return 0; // Can't use this Prior if it's degenerate.
 
@@ -163,8 +164,8 @@ PhotoPrior::accumulateChisq(double& chisq,
 				mapNumber1, ip,  sub1, wt);
 	  istart2+=np2;
 	}
-	istart+=np;
       }
+      istart+=np;
     } // outer parameter segment loop
     
     // Now add derivs wrt prior's parameters to beta and alpha:
@@ -181,6 +182,15 @@ PhotoPrior::accumulateChisq(double& chisq,
   return nFit - nFree;
 }
 
+template
+int PhotoPrior::accumulateChisq(double&, DVector&, SymmetricUpdater&, bool);
+template
+int PhotoPrior::accumulateChisq(double&, DVector&, BlockUpdater&, bool);
+template
+int PhotoPrior::accumulateChisq(double&, DVector&, ProductUpdater&, bool);
+template
+int PhotoPrior::accumulateChisq(double&, DVector&, DiagonalUpdater&, bool);
+
 bool
 PhotoPrior::sigmaClip(double sigThresh) {
   auto worst=points.end();
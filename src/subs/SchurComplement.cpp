@@ -0,0 +1,336 @@
+// Schur-complement solution of block-sparse normal equations
+#include "SchurComplement.h"
+#include <algorithm>
+#include <cmath>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Dense Cholesky of the row-major n x n matrix a, in its lower triangle.
+// Returns the failing pivot, or -1 on success.
+static int
+choleskyInPlace(vector<double>& a, int n) {
+  for (int j=0; j<n; j++) {
+    double* aj = &a[j*n];
+    double d = aj[j];
+    for (int k=0; k<j; k++) d -= aj[k]*aj[k];
+    if (!(d > 0.)) return j;
+    d = std::sqrt(d);
+    aj[j] = d;
+    for (int i=j+1; i<n; i++) {
+      double* ai = &a[i*n];
+      double sum = ai[j];
+      for (int k=0; k<j; k++) sum -= ai[k]*aj[k];
+      ai[j] = sum / d;
+    }
+  }
+  return -1;
+}
+
+// x = (L L^T)^-1 x for the factor from choleskyInPlace
+static void
+choleskySolve(const vector<double>& l, int n, double* x) {
+  for (int i=0; i<n; i++) {
+    double sum = x[i];
+    for (int k=0; k<i; k++) sum -= l[i*n+k]*x[k];
+    x[i] = sum / l[i*n+i];
+  }
+  for (int i=n-1; i>=0; i--) {
+    double sum = x[i];
+    for (int k=i+1; k<n; k++) sum -= l[k*n+i]*x[k];
+    x[i] = sum / l[i*n+i];
+  }
+}
+
+void
+SchurComplement::findNeighbors(const BlockSymmetric& a) {
+  int nB = start.size();
+  neighbors.assign(nB, vector<Neighbor>());
+  for (int rb=0; rb<nB; rb++) {
+    if (size[rb]==0) continue;
+    for (auto& bb : a.row(rb)) {
+      int cb = bb.first;
+      if (cb==rb || size[cb]==0) continue;
+      Neighbor n;
+      n.a = &bb.second;
+      if (eliminated[rb]) {
+	n.block = cb;
+	n.transposed = false;
+	neighbors[rb].push_back(n);
+      }
+      if (eliminated[cb]) {
+	n.block = rb;
+	n.transposed = true;
+	neighbors[cb].push_back(n);
+      }
+    }
+  }
+  for (auto& v : neighbors)
+    std::sort(v.begin(), v.end(),
+	      [](const Neighbor& lhs, const Neighbor& rhs) {return lhs.block < rhs.block;});
+}
+
+void
+SchurComplement::analyze(const BlockSymmetric& a) {
+  nP = a.nParams();
+  int nB = a.nBlocks();
+  start.resize(nB);
+  size.resize(nB);
+  for (int b=0; b<nB; b++) {
+    start[b] = a.blockStart(b);
+    size[b] = a.blockSize(b);
+  }
+
+  // Graph of the blocks
+  vector<vector<int> > adj(nB);
+  for (int rb=0; rb<nB; rb++) {
+    if (size[rb]==0) continue;
+    for (auto& bb : a.row(rb)) {
+      int cb = bb.first;
+      if (cb==rb || size[cb]==0) continue;
+      adj[rb].push_back(cb);
+      adj[cb].push_back(rb);
+    }
+  }
+  int nLive = 0;
+  vector<int> candidates;
+  for (int b=0; b<nB; b++) {
+    std::sort(adj[b].begin(), adj[b].end());
+    adj[b].erase(std::unique(adj[b].begin(), adj[b].end()), adj[b].end());
+    if (size[b]>0) {
+      nLive++;
+      candidates.push_back(b);
+    }
+  }
+
+  // Eliminate low-degree blocks first, never two that are coupled, and
+  // none of the blocks (like the instrument maps) that touch a large part
+  // of the graph, whose elimination would fill in the reduced matrix.
+  const int denseDegree = std::max(16, static_cast<int>(10.*std::sqrt(nLive)));
+  std::stable_sort(candidates.begin(), candidates.end(),
+		   [&adj](int lhs, int rhs) {return adj[lhs].size() < adj[rhs].size();});
+  eliminated.assign(nB, false);
+  eliminatedBlocks.clear();
+  vector<bool> blocked(nB, false);
+  for (int b : candidates) {
+    if (blocked[b] || adj[b].size() > denseDegree) continue;
+    eliminated[b] = true;
+    eliminatedBlocks.push_back(b);
+    for (int u : adj[b]) blocked[u] = true;
+  }
+  std::sort(eliminatedBlocks.begin(), eliminatedBlocks.end());
+  factors.assign(nB, vector<double>());
+
+  // Pattern of the reduced matrix: the shared blocks of alpha, identity
+  // blocks for the eliminated ones, and the fill among the neighbors of
+  // each eliminated block.
+  findNeighbors(a);
+  reduced = BlockSymmetric(nP, nB);
+  for (int rb=0; rb<nB; rb++) {
+    if (size[rb]==0) continue;
+    BlockSymmetric::Row& r = reduced.row(rb);
+    if (eliminated[rb]) {
+      r.insert(std::make_pair(rb, BlockSymmetric::Block(start[rb], start[rb],
+							  size[rb], size[rb])));
+      continue;
+    }
+    for (auto& bb : a.row(rb))
+      if (!eliminated[bb.first])
+	r.insert(std::make_pair(bb.first, BlockSymmetric::Block(bb.second.rowStart,
+								 bb.second.colStart,
+								 bb.second.nRows,
+								 bb.second.nCols)));
+  }
+  for (int e : eliminatedBlocks) {
+    const vector<Neighbor>& nb = neighbors[e];
+    for (int i=0; i<nb.size(); i++)
+      for (int j=0; j<=i; j++) {
+	int bi = nb[i].block;
+	int bj = nb[j].block;
+	reduced.row(bi).insert(std::make_pair(bj, BlockSymmetric::Block(start[bi], start[bj],
+									 size[bi], size[bj])));
+      }
+  }
+  reduced.completeLayout();
+  cholesky.analyze(reduced);
+  failed = -1;
+}
+
+bool
+SchurComplement::covers(const BlockSymmetric& a) const {
+  if (a.nParams()!=nP || a.nBlocks()!=start.size() || nP==0)
+    return false;
+  for (int b=0; b<start.size(); b++)
+    if (a.blockSize(b)!=size[b]
+	|| (size[b]>0 && a.blockStart(b)!=start[b]))
+      return false;
+  for (int rb=0; rb<start.size(); rb++) {
+    if (size[rb]==0) continue;
+    for (auto& bb : a.row(rb)) {
+      int cb = bb.first;
+      if (cb!=rb && size[cb]>0 && eliminated[rb] && eliminated[cb])
+	return false;
+    }
+  }
+  return true;
+}
+
+bool
+SchurComplement::factorize(const BlockSymmetric& a, double shift) {
+  failed = -1;
+  findNeighbors(a);
+  int nB = start.size();
+
+  // Shared blocks of alpha + shift*I, and identity for the eliminated ones
+  reduced.setZero();
+  for (int rb=0; rb<nB; rb++) {
+    if (size[rb]==0) continue;
+    if (eliminated[rb]) {
+      BlockSymmetric::Block& d = reduced.row(rb)[rb];
+      for (int i=0; i<size[rb]; i++) d(i,i) = 1.;
+      continue;
+    }
+    for (auto& bb : a.row(rb))
+      if (!eliminated[bb.first])
+	reduced.row(rb)[bb.first] = bb.second;
+    BlockSymmetric::Block& d = reduced.row(rb)[rb];
+    for (int i=0; i<size[rb]; i++) d(i,i) += shift;
+  }
+
+  // Factor each eliminated block and subtract A_se A_ee^-1 A_es
+  {
+    BlockUpdater updater(reduced, 1024);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,16)
+#endif
+    for (int k=0; k<eliminatedBlocks.size(); k++) {
+      int e = eliminatedBlocks[k];
+      int n = size[e];
+      vector<double>& l = factors[e];
+      l.assign(n*n, 0.);
+      const BlockSymmetric::Block& d = a.row(e).at(e);
+      for (int i=0; i<n; i++) {
+	for (int j=0; j<=i; j++) l[i*n+j] = d(i,j);
+	l[i*n+i] += shift;
+      }
+      int pivot = choleskyInPlace(l, n);
+      if (pivot >= 0) {
+#ifdef _OPENMP
+#pragma omp critical(schurFailure)
+#endif
+	if (failed < 0 || start[e]+pivot < failed) failed = start[e]+pivot;
+	continue;
+      }
+
+      // W_j = A_ee^-1 A_ej, column-major, for each neighbor j
+      const vector<Neighbor>& nb = neighbors[e];
+      vector<vector<double> > w(nb.size());
+      for (int j=0; j<nb.size(); j++) {
+	int nj = size[nb[j].block];
+	w[j].resize(n*nj);
+	for (int c=0; c<nj; c++) {
+	  double* col = &w[j][c*n];
+	  for (int r=0; r<n; r++) col[r] = nb[j](r,c);
+	  choleskySolve(l, n, col);
+	}
+      }
+      // C_ij = A_ie W_j for j <= i
+      vector<double> c;
+      for (int i=0; i<nb.size(); i++) {
+	int bi = nb[i].block;
+	int ni = size[bi];
+	for (int j=0; j<=i; j++) {
+	  int bj = nb[j].block;
+	  int nj = size[bj];
+	  c.assign(ni*nj, 0.);
+	  for (int r=0; r<ni; r++)
+	    for (int q=0; q<nj; q++) {
+	      const double* col = &w[j][q*n];
+	      double sum = 0.;
+	      for (int s=0; s<n; s++) sum += nb[i](s,r) * col[s];
+	      c[r*nj+q] = sum;
+	    }
+	  updater.blockUpdate(bi, start[bi], ni, bj, start[bj], nj, c.data(), -1.);
+	}
+      }
+    }
+  }
+  if (failed >= 0) return false;
+
+  reduced.completeLayout();
+  if (!cholesky.covers(reduced))
+    cholesky.analyze(reduced);
+  if (!cholesky.factorize(reduced)) {
+    failed = cholesky.failedParameter();
+    return false;
+  }
+  return true;
+}
+
+void
+SchurComplement::solve(DVector& b) const {
+  // y_e = A_ee^-1 b_e
+  int nB = start.size();
+  vector<vector<double> > y(nB);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,64)
+#endif
+  for (int k=0; k<eliminatedBlocks.size(); k++) {
+    int e = eliminatedBlocks[k];
+    y[e].resize(size[e]);
+    for (int i=0; i<size[e]; i++) y[e][i] = b[start[e]+i];
+    choleskySolve(factors[e], size[e], y[e].data());
+  }
+
+  // Reduced right-hand side b_s - sum_e A_se y_e, with zeros for the
+  // eliminated parameters, and its solution.
+  DVector r(b);
+  for (int e : eliminatedBlocks) {
+    for (auto& nb : neighbors[e]) {
+      int j = nb.block;
+      for (int q=0; q<size[j]; q++) {
+	double sum = 0.;
+	for (int s=0; s<size[e]; s++) sum += nb(s,q) * y[e][s];
+	r[start[j]+q] -= sum;
+      }
+    }
+    for (int i=0; i<size[e]; i++) r[start[e]+i] = 0.;
+  }
+  cholesky.solve(r);
+  for (int i=0; i<nP; i++) b[i] = r[i];
+
+  // Back-substitute x_e = y_e - A_ee^-1 A_es x_s
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic,64)
+#endif
+  for (int k=0; k<eliminatedBlocks.size(); k++) {
+    int e = eliminatedBlocks[k];
+    int n = size[e];
+    vector<double> t(n, 0.);
+    for (auto& nb : neighbors[e]) {
+      int j = nb.block;
+      for (int s=0; s<n; s++) {
+	double sum = 0.;
+	for (int q=0; q<size[j]; q++) sum += nb(s,q) * r[start[j]+q];
+	t[s] += sum;
+      }
+    }
+    choleskySolve(factors[e], n, t.data());
+    for (int s=0; s<n; s++) b[start[e]+s] = y[e][s] - t[s];
+  }
+}
+
+int
+SchurComplement::nEliminatedParams() const {
+  int n = 0;
+  for (int e : eliminatedBlocks) n += size[e];
+  return n;
+}
+
+void
+SchurComplement::report(std::ostream& os) const {
+  os << "Schur complement eliminating " << nEliminated() << " blocks ("
+     << nEliminatedParams() << " of " << nP << " parameters), reduced by ";
+  cholesky.report(os);
+}
@@ -0,0 +1,448 @@
+// Sparse supernodal Cholesky factorization of block-sparse normal matrices
+#include "SparseCholesky.h"
+#include <algorithm>
+#include <queue>
+#include <functional>
+#include <cmath>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+void
+SparseCholesky::analyze(const BlockSymmetric& alpha) {
+  nP = alpha.nParams();
+  int nB = alpha.nBlocks();
+  start.resize(nB);
+  size.resize(nB);
+  for (int b=0; b<nB; b++) {
+    start[b] = alpha.blockStart(b);
+    size[b] = alpha.blockSize(b);
+  }
+
+  // Graph of the blocks
+  vector<vector<int> > adj(nB);
+  for (int rb=0; rb<nB; rb++) {
+    if (size[rb]==0) continue;
+    for (auto& bb : alpha.row(rb)) {
+      int cb = bb.first;
+      if (cb==rb || size[cb]==0) continue;
+      adj[rb].push_back(cb);
+      adj[cb].push_back(rb);
+    }
+  }
+  int nLive = 0;
+  for (int b=0; b<nB; b++) {
+    std::sort(adj[b].begin(), adj[b].end());
+    adj[b].erase(std::unique(adj[b].begin(), adj[b].end()), adj[b].end());
+    if (size[b]>0) nLive++;
+  }
+
+  // Blocks adjacent to a large part of the graph are left out of the
+  // minimum-degree ordering and eliminated last.
+  const int denseDegree = std::max(16, static_cast<int>(10.*std::sqrt(nLive)));
+  vector<bool> dense(nB, false);
+  vector<int> denseBlocks;
+  for (int b=0; b<nB; b++)
+    if (size[b]>0 && adj[b].size() > denseDegree) {
+      dense[b] = true;
+      denseBlocks.push_back(b);
+    }
+
+  // Minimum degree, counting parameters, on the graph of the other blocks
+  vector<int> order;
+  {
+    vector<vector<int> > g(nB);
+    vector<long> degree(nB, 0);
+    typedef std::pair<long,int> Entry;
+    std::priority_queue<Entry, vector<Entry>, std::greater<Entry> > queue;
+    for (int b=0; b<nB; b++) {
+      if (size[b]==0 || dense[b]) continue;
+      for (int u : adj[b])
+	if (!dense[u]) {
+	  g[b].push_back(u);
+	  degree[b] += size[u];
+	}
+      queue.push(Entry(degree[b], b));
+    }
+    vector<bool> done(nB, false);
+    vector<int> merged;
+    while (!queue.empty()) {
+      Entry e = queue.top();
+      queue.pop();
+      int v = e.second;
+      if (done[v] || e.first != degree[v]) continue;
+      done[v] = true;
+      order.push_back(v);
+      // The neighbors of v become a clique
+      vector<int> nbrs;
+      nbrs.swap(g[v]);
+      for (int u : nbrs) {
+	merged.clear();
+	std::set_union(g[u].begin(), g[u].end(), nbrs.begin(), nbrs.end(),
+		       std::back_inserter(merged));
+	g[u].clear();
+	degree[u] = 0;
+	for (int w : merged)
+	  if (w!=u && w!=v) {
+	    g[u].push_back(w);
+	    degree[u] += size[w];
+	  }
+	queue.push(Entry(degree[u], u));
+      }
+    }
+  }
+  std::sort(denseBlocks.begin(), denseBlocks.end(),
+	    [&adj](int lhs, int rhs) {return adj[lhs].size() < adj[rhs].size();});
+  order.insert(order.end(), denseBlocks.begin(), denseBlocks.end());
+  int n = order.size();
+  pos.assign(nB, -1);
+  for (int k=0; k<n; k++) pos[order[k]] = k;
+
+  // Block structure of L and the elimination tree
+  vector<vector<int> > lStruct(n);
+  vector<int> parent(n, -1);
+  {
+    vector<vector<int> > children(n);
+    for (int k=0; k<n; k++) {
+      vector<int>& s = lStruct[k];
+      for (int u : adj[order[k]])
+	if (pos[u] > k) s.push_back(pos[u]);
+      for (int c : children[k])
+	for (int x : lStruct[c])
+	  if (x > k) s.push_back(x);
+      std::sort(s.begin(), s.end());
+      s.erase(std::unique(s.begin(), s.end()), s.end());
+      if (!s.empty()) {
+	parent[k] = s.front();
+	children[parent[k]].push_back(k);
+      }
+    }
+
+    // Postorder the tree, which keeps the fill but makes subtrees contiguous
+    vector<int> post;
+    post.reserve(n);
+    vector<std::pair<int,int> > stack;	// (node, next child)
+    for (int root=0; root<n; root++) {
+      if (parent[root] >= 0) continue;
+      stack.push_back(std::make_pair(root, 0));
+      while (!stack.empty()) {
+	auto& top = stack.back();
+	if (top.second < children[top.first].size()) {
+	  int c = children[top.first][top.second++];
+	  stack.push_back(std::make_pair(c, 0));
+	} else {
+	  post.push_back(top.first);
+	  stack.pop_back();
+	}
+      }
+    }
+    vector<int> newPos(n);
+    for (int k=0; k<n; k++) newPos[post[k]] = k;
+    vector<vector<int> > newStruct(n);
+    vector<int> newParent(n, -1);
+    for (int k=0; k<n; k++) {
+      vector<int>& s = newStruct[newPos[k]];
+      for (int x : lStruct[k]) s.push_back(newPos[x]);
+      std::sort(s.begin(), s.end());
+      if (parent[k]>=0) newParent[newPos[k]] = newPos[parent[k]];
+    }
+    lStruct.swap(newStruct);
+    parent.swap(newParent);
+    vector<int> newOrder(n);
+    for (int k=0; k<n; k++) newOrder[newPos[k]] = order[k];
+    order.swap(newOrder);
+    for (int k=0; k<n; k++) pos[order[k]] = k;
+  }
+
+  // Merge chains of blocks with nested structure into supernodes
+  vector<int> nChildren(n, 0);
+  for (int k=0; k<n; k++)
+    if (parent[k]>=0) nChildren[parent[k]]++;
+  snodes.clear();
+  vector<int> snodeOfPos(n);
+  for (int k=0; k<n; k++) {
+    bool extend = k>0 && parent[k-1]==k && nChildren[k]==1
+      && lStruct[k-1].size() == lStruct[k].size()+1;
+    if (!extend) {
+      snodes.push_back(Supernode());
+      snodes.back().firstPos = k;
+    }
+    snodes.back().endPos = k+1;
+    snodeOfPos[k] = snodes.size()-1;
+  }
+
+  snodeOfBlock.assign(nB, -1);
+  colOffset.assign(nB, -1);
+  for (int s=0; s<snodes.size(); s++) {
+    Supernode& S = snodes[s];
+    S.width = 0;
+    S.rowParams.clear();
+    for (int k=S.firstPos; k<S.endPos; k++) {
+      int b = order[k];
+      snodeOfBlock[b] = s;
+      colOffset[b] = S.width;
+      S.width += size[b];
+      for (int i=0; i<size[b]; i++) S.rowParams.push_back(start[b]+i);
+    }
+    S.nRows = S.width;
+    S.rowBlocks.clear();
+    S.rowPos = lStruct[S.endPos-1];
+    S.rowOffset.clear();
+    for (int x : S.rowPos) {
+      int b = order[x];
+      S.rowBlocks.push_back(b);
+      S.rowOffset.push_back(S.nRows);
+      S.nRows += size[b];
+      for (int i=0; i<size[b]; i++) S.rowParams.push_back(start[b]+i);
+    }
+    S.parent = S.rowPos.empty() ? -1 : snodeOfPos[S.rowPos.front()];
+    S.updaters.clear();
+  }
+  for (int d=0; d<snodes.size(); d++) {
+    int last = -1;
+    for (int x : snodes[d].rowPos) {
+      int s = snodeOfPos[x];
+      if (s != last) snodes[s].updaters.push_back(d);
+      last = s;
+    }
+  }
+
+  // Supernodes with no ancestor relation can be factored at once
+  vector<int> level(snodes.size(), 0);
+  levels.clear();
+  for (int s=0; s<snodes.size(); s++) {
+    if (level[s] >= levels.size()) levels.resize(level[s]+1);
+    levels[level[s]].push_back(s);
+    int p = snodes[s].parent;
+    if (p>=0) level[p] = std::max(level[p], level[s]+1);
+  }
+  panels.assign(snodes.size(), vector<double>());
+  failed = -1;
+}
+
+bool
+SparseCholesky::covers(const BlockSymmetric& alpha) const {
+  if (alpha.nParams()!=nP || alpha.nBlocks()!=start.size() || nP==0)
+    return false;
+  for (int b=0; b<start.size(); b++)
+    if (alpha.blockSize(b)!=size[b]
+	|| (size[b]>0 && alpha.blockStart(b)!=start[b]))
+      return false;
+  for (int rb=0; rb<start.size(); rb++) {
+    if (size[rb]==0) continue;
+    for (auto& bb : alpha.row(rb)) {
+      int cb = bb.first;
+      if (cb==rb || size[cb]==0) continue;
+      int r = pos[rb] > pos[cb] ? rb : cb;
+      int c = pos[rb] > pos[cb] ? cb : rb;
+      int s = snodeOfBlock[c];
+      if (snodeOfBlock[r]!=s && rowOf(snodes[s], s, r) < 0)
+	return false;
+    }
+  }
+  return true;
+}
+
+int
+SparseCholesky::rowOf(const Supernode& S, int sIndex, int b) const {
+  if (snodeOfBlock[b]==sIndex) return colOffset[b];
+  auto it = std::lower_bound(S.rowPos.begin(), S.rowPos.end(), pos[b]);
+  if (it==S.rowPos.end() || *it!=pos[b]) return -1;
+  return S.rowOffset[it - S.rowPos.begin()];
+}
+
+void
+SparseCholesky::update(int s, int d, vector<double>& scratch, vector<int>& target) {
+  const Supernode& S = snodes[s];
+  const Supernode& D = snodes[d];
+  // Rows of d in the columns of s, then those below them
+  int j0 = std::lower_bound(D.rowPos.begin(), D.rowPos.end(), S.firstPos)
+    - D.rowPos.begin();
+  int j1 = std::lower_bound(D.rowPos.begin(), D.rowPos.end(), S.endPos)
+    - D.rowPos.begin();
+  int r0 = D.rowOffset[j0];
+  int m = D.nRows - r0;
+  int nJ = (j1 < D.rowPos.size() ? D.rowOffset[j1] : D.nRows) - r0;
+
+  target.resize(m);
+  for (int j=j0; j<D.rowBlocks.size(); j++) {
+    int b = D.rowBlocks[j];
+    int base = rowOf(S, s, b);
+    for (int k=0; k<size[b]; k++)
+      target[D.rowOffset[j] - r0 + k] = base + k;
+  }
+
+  // Lower trapezoid of L_d(rows, t) * L_d(columns of s, t)^T
+  scratch.assign(static_cast<size_t>(m)*nJ, 0.);
+  const double* ld = panels[d].data();
+  for (int t=0; t<D.width; t++) {
+    const double* col = ld + static_cast<size_t>(t)*D.nRows + r0;
+    for (int c=0; c<nJ; c++) {
+      double v = col[c];
+      if (v==0.) continue;
+      double* out = &scratch[static_cast<size_t>(c)*m];
+      for (int r=c; r<m; r++)
+	out[r] += col[r]*v;
+    }
+  }
+  double* ls = panels[s].data();
+  for (int c=0; c<nJ; c++) {
+    double* out = ls + static_cast<size_t>(target[c])*S.nRows;
+    const double* in = &scratch[static_cast<size_t>(c)*m];
+    for (int r=c; r<m; r++)
+      out[target[r]] -= in[r];
+  }
+}
+
+bool
+SparseCholesky::factorize(const BlockSymmetric& alpha, double shift) {
+  failed = -1;
+  // Blocks of alpha going into each supernode's panel
+  vector<vector<std::pair<int,int> > > assigned(snodes.size());
+  for (int rb=0; rb<start.size(); rb++) {
+    if (size[rb]==0) continue;
+    for (auto& bb : alpha.row(rb)) {
+      int cb = bb.first;
+      if (size[cb]==0) continue;
+      int c = pos[rb] >= pos[cb] ? cb : rb;
+      assigned[snodeOfBlock[c]].push_back(std::make_pair(rb,cb));
+    }
+  }
+
+  for (auto& lev : levels) {
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+      vector<double> scratch;
+      vector<int> target;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+      for (int i=0; i<lev.size(); i++) {
+	int s = lev[i];
+	const Supernode& S = snodes[s];
+	vector<double>& panel = panels[s];
+	panel.assign(static_cast<size_t>(S.nRows)*S.width, 0.);
+	auto P = [&panel, &S](int r, int c) -> double& {
+	  return panel[static_cast<size_t>(c)*S.nRows + r];
+	};
+
+	// Assemble alpha
+	for (auto& rc : assigned[s]) {
+	  int rb = rc.first;
+	  int cb = rc.second;
+	  const BlockSymmetric::Block& B = alpha.row(rb).at(cb);
+	  if (rb==cb) {
+	    int off = colOffset[rb];
+	    for (int r=0; r<size[rb]; r++)
+	      for (int c=0; c<=r; c++)
+		P(off+r, off+c) += B(r,c);
+	  } else if (pos[rb] > pos[cb]) {
+	    int row0 = rowOf(S, s, rb);
+	    int col0 = colOffset[cb];
+	    for (int r=0; r<size[rb]; r++)
+	      for (int c=0; c<size[cb]; c++)
+		P(row0+r, col0+c) += B(r,c);
+	  } else {
+	    // Stored block is the transpose of the one needed here
+	    int row0 = rowOf(S, s, cb);
+	    int col0 = colOffset[rb];
+	    for (int r=0; r<size[cb]; r++)
+	      for (int c=0; c<size[rb]; c++)
+		P(row0+r, col0+c) += B(c,r);
+	  }
+	}
+	if (shift!=0.)
+	  for (int j=0; j<S.width; j++) P(j,j) += shift;
+
+	for (int d : S.updaters)
+	  update(s, d, scratch, target);
+
+	// Dense Cholesky of the panel
+	for (int j=0; j<S.width; j++) {
+	  double* cj = &P(0,j);
+	  for (int k=0; k<j; k++) {
+	    double ljk = P(j,k);
+	    if (ljk==0.) continue;
+	    const double* ck = &P(0,k);
+	    for (int r=j; r<S.nRows; r++)
+	      cj[r] -= ck[r]*ljk;
+	  }
+	  double dj = cj[j];
+	  if (!(dj > 0.)) {
+#ifdef _OPENMP
+#pragma omp critical(cholesky)
+#endif
+	    if (failed<0 || S.rowParams[j] < failed) failed = S.rowParams[j];
+	    break;
+	  }
+	  dj = std::sqrt(dj);
+	  for (int r=j; r<S.nRows; r++)
+	    cj[r] /= dj;
+	}
+      }
+    }
+    if (failed>=0) return false;
+  }
+  return true;
+}
+
+void
+SparseCholesky::solve(DVector& b) const {
+  vector<double> x;
+  // Forward substitution with L
+  for (int s=0; s<snodes.size(); s++) {
+    const Supernode& S = snodes[s];
+    const double* P = panels[s].data();
+    x.resize(S.width);
+    for (int j=0; j<S.width; j++) {
+      double sum = b[S.rowParams[j]];
+      for (int k=0; k<j; k++)
+	sum -= P[static_cast<size_t>(k)*S.nRows + j] * x[k];
+      x[j] = sum / P[static_cast<size_t>(j)*S.nRows + j];
+      b[S.rowParams[j]] = x[j];
+    }
+    for (int j=0; j<S.width; j++) {
+      const double* col = P + static_cast<size_t>(j)*S.nRows;
+      for (int r=S.width; r<S.nRows; r++)
+	b[S.rowParams[r]] -= col[r] * x[j];
+    }
+  }
+  // Back substitution with L^T
+  for (int s=snodes.size()-1; s>=0; s--) {
+    const Supernode& S = snodes[s];
+    const double* P = panels[s].data();
+    x.resize(S.width);
+    for (int j=0; j<S.width; j++) {
+      const double* col = P + static_cast<size_t>(j)*S.nRows;
+      double sum = b[S.rowParams[j]];
+      for (int r=S.width; r<S.nRows; r++)
+	sum -= col[r] * b[S.rowParams[r]];
+      x[j] = sum;
+    }
+    for (int j=S.width-1; j>=0; j--) {
+      const double* col = P + static_cast<size_t>(j)*S.nRows;
+      double sum = x[j];
+      for (int r=j+1; r<S.width; r++)
+	sum -= col[r] * x[r];
+      x[j] = sum / col[j];
+      b[S.rowParams[j]] = x[j];
+    }
+  }
+}
+
+void
+SparseCholesky::report(std::ostream& os) const {
+  os << "sparse Cholesky with " << nSupernodes() << " supernodes, "
+     << nonZeros() << " nonzeros";
+}
+
+long
+SparseCholesky::nonZeros() const {
+  long n = 0;
+  for (auto& S : snodes)
+    n += static_cast<long>(S.nRows)*S.width - static_cast<long>(S.width)*(S.width-1)/2;
+  return n;
+}
@@ -0,0 +1,109 @@
+// Thread-safe cache of deserialized WCS's.
+#include "WcsCache.h"
+#include <sstream>
+#include <fstream>
+#include "Header.h"
+#include "TPVMap.h"
+
+using namespace astrometry;
+
+WcsCache::~WcsCache() {
+  for (auto& i : yamlWcs) delete i.second;
+  for (auto& i : tpvWcs) delete i.second;
+  for (auto& i : fileWcs) delete i.second;
+  for (auto& i : filePmcs) delete i.second;
+}
+
+long
+WcsCache::size() const {
+  std::lock_guard<std::mutex> guard(lock);
+  return yamlWcs.size() + tpvWcs.size() + fileWcs.size();
+}
+
+Wcs*
+WcsCache::insert(ContentMap& m, const string& key, Wcs* w) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto result = m.insert(std::make_pair(key, w));
+  if (!result.second) delete w;	// Lost a race to parse the same content
+  return result.first->second;
+}
+
+Wcs*
+WcsCache::serialized(const string& yaml) {
+  Wcs* proto = 0;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto i = yamlWcs.find(yaml);
+    if (i!=yamlWcs.end()) proto = i->second;
+  }
+  if (!proto) {
+    // Parse outside the lock so that distinct WCS's are read in parallel
+    istringstream iss(yaml);
+    PixelMapCollection pmcTemp;
+    if (!pmcTemp.read(iss)) return 0;
+    auto names = pmcTemp.allWcsNames();
+    if (names.empty()) return 0;
+    proto = insert(yamlWcs, yaml, pmcTemp.cloneWcs(names.front()));
+  }
+  return proto->duplicate();
+}
+
+Wcs*
+WcsCache::tpv(const string& header) {
+  Wcs* proto = 0;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto i = tpvWcs.find(header);
+    if (i!=tpvWcs.end()) proto = i->second;
+  }
+  if (!proto) {
+    img::Header wcsHead;
+    istringstream wcsStream(header);
+    if (!(wcsStream >> wcsHead)) return 0;
+    Wcs* w = readTPV(wcsHead);
+    if (!w) return 0;
+    proto = insert(tpvWcs, header, w);
+  }
+  return proto->duplicate();
+}
+
+Wcs*
+WcsCache::fromFile(const string& pmcFile, const string& wcsName) {
+  auto key = std::make_pair(pmcFile, wcsName);
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto i = fileWcs.find(key);
+    if (i!=fileWcs.end()) return i->second->duplicate();
+  }
+
+  // Only one thread reads files, so that a large PMC is not parsed
+  // several times by threads that all missed it at once.
+  std::lock_guard<std::mutex> fileGuard(fileLock);
+  PixelMapCollection* pmc = 0;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto i = fileWcs.find(key);
+    if (i!=fileWcs.end()) return i->second->duplicate();
+    auto j = filePmcs.find(pmcFile);
+    if (j!=filePmcs.end()) pmc = j->second;
+  }
+  if (!pmc) {
+    ifstream wcsStream(pmcFile.c_str());
+    if (!wcsStream.is_open()) return 0;
+    pmc = new PixelMapCollection;
+    if (!pmc->read(wcsStream)) {
+      delete pmc;
+      return 0;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    filePmcs[pmcFile] = pmc;
+  }
+  // Collections are only touched while fileLock is held
+  if (!pmc->wcsExists(wcsName)) return 0;
+  Wcs* proto = pmc->cloneWcs(wcsName);
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    fileWcs[key] = proto;
+  }
+  return proto->duplicate();
+}
@@ -0,0 +1,167 @@
+// Benchmark the FoF matching engines of FoF.h on a dense simulated field,
+// and check that they find identical groups.
+// benchFoF [nPoints] [density per matchRadius^2] [nExposures]
+#include <vector>
+#include <array>
+#include <list>
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+#include "FoF.h"
+#include "Stopwatch.h"
+
+using namespace std;
+
+struct Point {
+  Point(double x_, double y_, long idx): index(idx) {
+    x[0]=x_; x[1]=y_;
+  }
+  std::array<double,2> x;
+  long index;
+  const std::array<double,2>& getX() const {return x;}
+};
+
+// Put matches into a canonical form for comparison:  each group sorted by
+// point index, and groups sorted by their first member.
+template <class C>
+vector<vector<long> >
+canonical(const C& cat) {
+  vector<vector<long> > out;
+  for (typename C::const_iterator i=cat.begin(); i!=cat.end(); ++i) {
+    vector<long> g;
+    for (auto p : **i) g.push_back(p->index);
+    std::sort(g.begin(), g.end());
+    out.push_back(g);
+  }
+  std::sort(out.begin(), out.end());
+  return out;
+}
+
+// Add the points in batches in order of y, retiring before each batch the
+// matches that it cannot reach, as WCSFoF does when streaming, and return
+// the canonical form of all of the matches.
+template <class C>
+vector<vector<long> >
+streamed(C& cat, const vector<Point>& points, int nBatches) {
+  vector<Point> sorted(points);
+  std::sort(sorted.begin(), sorted.end(),
+	    [](const Point& lhs, const Point& rhs) {return lhs.x[1] < rhs.x[1];});
+  vector<vector<long> > out;
+  auto keep = [&out](const typename C::MatchType& m) {
+    vector<long> g;
+    for (auto p : m) g.push_back(p->index);
+    std::sort(g.begin(), g.end());
+    out.push_back(g);
+  };
+  size_t batch = sorted.size() / nBatches + 1;
+  for (size_t start=0; start<sorted.size(); start+=batch) {
+    cat.retireBelow(sorted[start].x[1] - cat.getRadius(), keep);
+    for (size_t i=start; i<sorted.size() && i<start+batch; i++) cat.add(sorted[i]);
+  }
+  vector<vector<long> > rest = canonical(cat);
+  out.insert(out.end(), rest.begin(), rest.end());
+  std::sort(out.begin(), out.end());
+  return out;
+}
+
+template <class C>
+double
+timeEngine(C& cat, const vector<Point>& points) {
+  Stopwatch timer;
+  timer.start();
+  for (auto& p : points) cat.add(p);
+  timer.stop();
+  return timer;
+}
+
+int
+main(int argc,
+     char *argv[])
+{
+  long nPoints = argc>1 ? atol(argv[1]) : 1000000;
+  double density = argc>2 ? atof(argv[2]) : 0.5;
+  int nExposures = argc>3 ? atoi(argv[3]) : 10;
+
+  try {
+    // Points are "true" sources observed nExposures times with a small scatter.
+    const double radius = 1.;
+    const double scatter = 0.2*radius;
+    long nSources = nPoints / nExposures;
+    double extent = sqrt(nSources / density) * radius / 2.;
+    srand48(12345);
+    vector<double> sx(nSources), sy(nSources);
+    for (long i=0; i<nSources; i++) {
+      sx[i] = (2*drand48()-1.)*extent;
+      sy[i] = (2*drand48()-1.)*extent;
+    }
+    vector<Point> points;
+    points.reserve(nSources*nExposures);
+    for (int e=0; e<nExposures; e++)
+      for (long i=0; i<nSources; i++)
+	points.push_back(Point(sx[i] + scatter*(drand48()-0.5),
+			       sy[i] + scatter*(drand48()-0.5),
+			       points.size()));
+
+    cout << "Matching " << points.size() << " points over +-" << extent
+	 << " with radius " << radius << endl;
+
+    // Tree Cells only index points inside the domain, so leave a margin
+    vector<double> lower(2,-extent-radius);
+    vector<double> upper(2,extent+radius);
+    fof::Catalog<Point,2> tree(lower, upper, radius);
+    fof::GridCatalog<Point,2> grid(lower, upper, radius);
+    fof::UnionFindCatalog<Point,2> uf(lower, upper, radius);
+    fof::TiledCatalog<Point,2> tiled(lower, upper, radius);
+
+    double tTree = timeEngine(tree, points);
+    cout << "tree: " << tree.size() << " matches in " << tTree << " s" << endl;
+    double tGrid = timeEngine(grid, points);
+    cout << "grid: " << grid.size() << " matches in " << tGrid << " s"
+	 << " using " << grid.nCells() << " cells" << endl;
+    double tUF = timeEngine(uf, points);
+    cout << "unionfind: " << uf.size() << " matches in " << tUF << " s" << endl;
+    // Tiled matching happens when the catalog is first read
+    Stopwatch timer;
+    timer.start();
+    timeEngine(tiled, points);
+    long nTiled = tiled.size();
+    timer.stop();
+    double tTiled = timer;
+    cout << "tiled: " << nTiled << " matches in " << tTiled << " s" << endl;
+    cout << "Speedup: grid " << tTree / tGrid
+	 << " unionfind " << tTree / tUF
+	 << " tiled " << tTree / tTiled << endl;
+
+    vector<vector<long> > treeMatches = canonical(tree);
+    if (treeMatches != canonical(grid)) {
+      cout << "ERROR: grid engine produced different matches" << endl;
+      exit(1);
+    }
+    if (treeMatches != canonical(uf)) {
+      cout << "ERROR: unionfind engine produced different matches" << endl;
+      exit(1);
+    }
+    if (treeMatches != canonical(tiled)) {
+      cout << "ERROR: tiled engine produced different matches" << endl;
+      exit(1);
+    }
+    cout << "Matches are identical" << endl;
+
+    fof::Catalog<Point,2> treeStream(lower, upper, radius);
+    if (treeMatches != streamed(treeStream, points, 20)) {
+      cout << "ERROR: tree engine produced different matches when streaming" << endl;
+      exit(1);
+    }
+    fof::GridCatalog<Point,2> gridStream(lower, upper, radius);
+    if (treeMatches != streamed(gridStream, points, 20)) {
+      cout << "ERROR: grid engine produced different matches when streaming" << endl;
+      exit(1);
+    }
+    cout << "Streamed matches are identical" << endl;
+  } catch (std::runtime_error& e) {
+    cerr << e.what() << endl;
+    exit(1);
+  }
+  exit(0);
+}
@@ -0,0 +1,79 @@
+// Write a binary match file from MatchCatalog rows given out of HDU order,
+// with one catalog's rows split in two, and check that it reads back in the
+// layout that BinaryMatches describes.
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include "BinaryMatches.h"
+
+using namespace std;
+
+bool
+check(bool condition, const string& what) {
+  if (!condition) cout << "ERROR: " << what << endl;
+  return condition;
+}
+
+int
+main(int argc,
+     char *argv[])
+{
+  const string filename = "testBinaryMatches.tmp";
+  bool ok = true;
+  {
+    BinaryMatches::Writer writer(filename);
+    // HDU 5 gets matches of 3 and 2 members, then HDU 3 one of 2, HDU 4
+    // none, and HDU 5 another of 2.
+    writer.add(5, {0,1,2,0,1}, {0,1,2,1,0}, {10,11,12,13,14});
+    writer.add(3, {0,1}, {2,2}, {7,3});
+    writer.add(4, {}, {}, {});
+    writer.add(5, {0,1}, {1,2}, {5,6});
+    writer.close(3);
+  }
+  FILE* body = fopen((filename + ".members").c_str(), "r");
+  if (body) fclose(body);
+  ok = check(!body, "temporary member file was not removed") && ok;
+
+  try {
+    BinaryMatches binary(filename);
+    ok = check(binary.nCatalogs()==3 && binary.nMatches()==4
+	       && binary.nMembers()==9 && binary.nExtensions()==3,
+	       "wrong counts") && ok;
+    // Catalogs in HDU order, each with its own members
+    const int64_t hdus[] = {3, 4, 5};
+    const long members[] = {2, 0, 7};
+    for (int i=0; i<3; i++) {
+      ok = check(binary.catalogHdu()[i]==hdus[i], "wrong catalog HDU order") && ok;
+      ok = check(binary.catalogMembers(i)==members[i], "wrong catalog members") && ok;
+    }
+    const int64_t starts[] = {0, 2, 5, 7, 9};
+    for (int i=0; i<5; i++)
+      ok = check(binary.matchStart()[i]==starts[i], "wrong match starts") && ok;
+    // Members of HDU 5 in the order added
+    const int64_t objects[] = {7, 3, 10, 11, 12, 13, 14, 5, 6};
+    for (int i=0; i<9; i++)
+      ok = check(binary.members()[i].object==objects[i], "wrong member order") && ok;
+
+    // Each extension's members in order of object number
+    const int64_t* extensionStart = binary.extensionStart();
+    const int64_t* keeperOrder = binary.keeperOrder();
+    ok = check(extensionStart[3]==9, "wrong extension starts") && ok;
+    for (int e=0; e<3; e++) {
+      long previous = -1;
+      for (int64_t k=extensionStart[e]; k<extensionStart[e+1]; k++) {
+	const BinaryMatches::Member& m = binary.members()[keeperOrder[k]];
+	ok = check(m.extension==e && m.object > previous, "wrong keeper order") && ok;
+	previous = m.object;
+      }
+    }
+    ok = check(extensionStart[3]-extensionStart[2]==4, "wrong extension 2 members") && ok;
+  } catch (std::runtime_error& e) {
+    cout << "ERROR: " << e.what() << endl;
+    ok = false;
+  }
+  std::remove(filename.c_str());
+
+  if (!ok) exit(1);
+  cout << "Binary matches read back correctly" << endl;
+  exit(0);
+}
@@ -0,0 +1,90 @@
+// Write a detection store and check that it reads back, including an
+// extension without color, and that an index entry pointing outside the
+// file is refused.
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include "DetectionStore.h"
+
+using namespace std;
+
+bool
+check(bool condition, const string& what) {
+  if (!condition) cout << "ERROR: " << what << endl;
+  return condition;
+}
+
+int
+main(int argc,
+     char *argv[])
+{
+  const string filename = "testDetectionStore.tmp";
+  bool ok = true;
+  {
+    DetectionStore::Writer writer(filename);
+    vector<int64_t> id = {3, 5, 9};
+    vector<double> columns[DetectionStore::NCOLUMNS];
+    for (int c=0; c<DetectionStore::NCOLUMNS; c++)
+      columns[c] = {1.*c, 2.*c, 3.*c};
+    writer.add("a.fits", 1, id, columns, true);
+    vector<double> empty[DetectionStore::NCOLUMNS];
+    writer.add("b.fits", 2, vector<int64_t>(), empty, false);
+    writer.close();
+  }
+
+  try {
+    DetectionStore store(filename);
+    ok = check(store.nExtensions()==2, "wrong extension count") && ok;
+    DetectionStore::Rows rows = store.extension(0);
+    ok = check(rows.n==3 && rows.hasColor, "wrong extension 0") && ok;
+    for (int i=0; i<3; i++) {
+      ok = check(rows.id[i]==(i==0 ? 3 : i==1 ? 5 : 9), "wrong IDs") && ok;
+      for (int c=0; c<DetectionStore::NCOLUMNS; c++)
+	ok = check(rows.column[c][i]==(i+1.)*c, "wrong column values") && ok;
+    }
+    rows = store.extension(1);
+    ok = check(rows.n==0 && !rows.hasColor, "wrong extension 1") && ok;
+    ok = check(store.matches(0, "a.fits", 1) && store.matches(1, "b.fits", 2)
+	       && !store.matches(0, "a.fits", 2), "wrong catalog hashes") && ok;
+    bool refused = false;
+    try {
+      store.extension(2);
+    } catch (std::runtime_error& e) {
+      refused = true;
+    }
+    ok = check(refused, "extension past the end was accepted") && ok;
+  } catch (std::runtime_error& e) {
+    cout << "ERROR: " << e.what() << endl;
+    ok = false;
+  }
+
+  // Point the first index entry past the index
+  {
+    std::fstream f(filename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+    int64_t indexOffset;
+    f.seekg(-16, std::ios::end);
+    f.read(reinterpret_cast<char*>(&indexOffset), sizeof(indexOffset));
+    int64_t badOffset = indexOffset + 8;
+    f.seekp(indexOffset);
+    f.write(reinterpret_cast<const char*>(&badOffset), sizeof(badOffset));
+  }
+  try {
+    DetectionStore store(filename);
+    bool refused = false;
+    try {
+      store.extension(0);
+    } catch (std::runtime_error& e) {
+      refused = true;
+    }
+    ok = check(refused, "corrupt index entry was accepted") && ok;
+  } catch (std::runtime_error& e) {
+    cout << "ERROR: " << e.what() << endl;
+    ok = false;
+  }
+  std::remove(filename.c_str());
+
+  if (!ok) exit(1);
+  cout << "Detection store reads back correctly" << endl;
+  exit(0);
+}
@@ -0,0 +1,100 @@
+// Check that ExtensionPipeline delivers the items of any order of
+// extension numbers, in that order, with several reader threads.
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <iostream>
+#include <cstdlib>
+#include "ExtensionPipeline.h"
+
+using namespace std;
+
+struct Item {
+  long extensionNumber;
+};
+
+// Run the pipeline over order with nReaders threads, and return true if the
+// consumer got every extension in order.
+bool
+runPipeline(const vector<long>& order, int nReaders, int maxPending) {
+  ExtensionPipeline<Item> pipeline(order, maxPending);
+  vector<std::thread> readers;
+  for (int i=0; i<nReaders; i++)
+    readers.push_back(std::thread([&pipeline]() {
+	  for (long n = pipeline.next(); n >= 0; n = pipeline.next()) {
+	    // Finish out of order
+	    std::this_thread::sleep_for(std::chrono::microseconds((n*7919) % 200));
+	    Item* item = new Item;
+	    item->extensionNumber = n;
+	    pipeline.put(n, item);
+	  }
+	}));
+  bool ok = true;
+  size_t consumed = 0;
+  for (Item* item = pipeline.get(); item; item = pipeline.get(), ++consumed) {
+    if (consumed >= order.size() || item->extensionNumber != order[consumed]) {
+      cout << "ERROR: got extension " << item->extensionNumber
+	   << " at position " << consumed << endl;
+      ok = false;
+    }
+    delete item;
+  }
+  for (auto& t : readers) t.join();
+  if (consumed != order.size()) {
+    cout << "ERROR: consumed " << consumed << " of " << order.size()
+	 << " extensions" << endl;
+    ok = false;
+  }
+  return ok;
+}
+
+int
+main(int argc,
+     char *argv[])
+{
+  const long nExtensions = 500;
+  bool ok = true;
+
+  // All extensions, in table order
+  vector<long> all;
+  for (long i=0; i<nExtensions; i++) all.push_back(i);
+  ok = runPipeline(all, 4, 8) && ok;
+
+  // One shard of fields: the extensions of every third field, in the
+  // order of their fields, as when sharding by field
+  const int nFields = 7;
+  vector<long> shard;
+  for (int f=1; f<nFields; f+=3)
+    for (long i=0; i<nExtensions; i++)
+      if (i % nFields == f) shard.push_back(i);
+  ok = runPipeline(shard, 4, 8) && ok;
+  ok = runPipeline(shard, 1, 1) && ok;
+
+  // The extensions added when updating a catalog that already has
+  // nOld of them
+  const long nOld = 320;
+  vector<long> added;
+  for (long i=nOld; i<nExtensions; i++) added.push_back(i);
+  ok = runPipeline(added, 4, 8) && ok;
+  ok = runPipeline(added, 3, 2) && ok;
+
+  // Extensions not in the order are refused
+  {
+    ExtensionPipeline<Item> pipeline(shard, 8);
+    Item item;
+    bool refused = false;
+    try {
+      pipeline.put(0, &item);
+    } catch (std::runtime_error& e) {
+      refused = true;
+    }
+    if (!refused) {
+      cout << "ERROR: extension outside of the order was accepted" << endl;
+      ok = false;
+    }
+  }
+
+  if (!ok) exit(1);
+  cout << "Pipeline orders are correct" << endl;
+  exit(0);
+}
@@ -0,0 +1,335 @@
+// Check the solvers of block-sparse normal equations against a dense
+// solution: SparseCholesky and SchurComplement, unshifted and shifted, their
+// failure on a matrix that is not positive definite, and the sparse and
+// conjugate-gradient fits of SparseFitter on a linear least-squares problem,
+// including one whose conjugate-gradient solutions are cut short.
+#include <vector>
+#include <iostream>
+#include <cstdlib>
+#include <cmath>
+#include "Std.h"
+#include "LinearAlgebra.h"
+#include "BlockSymmetric.h"
+#include "SparseCholesky.h"
+#include "SchurComplement.h"
+#include "SparseFitter.h"
+
+using namespace std;
+
+double
+uniform() {
+  return rand() / (RAND_MAX + 1.) - 0.5;
+}
+
+// Least-squares problem linear in the parameters of nMaps maps, laid out
+// as the fits have them: a few "instrument" maps seen by every
+// measurement, and "exposure" maps that each see only their own.
+// Measurement k has residual t_k - sum over its maps m of v_km . p_m.
+class LinearAlign {
+public:
+  struct Term {
+    int map;
+    DVector v;
+  };
+  struct Measurement {
+    vector<Term> terms;
+    double target;
+    double weight;
+  };
+
+  LinearAlign(int nInstruments, int nExposures, int perExposure):
+    relativeTolerance(1e-10), cgTolerance(1e-12), cgMaxIterations(1000),
+    nRemaps(0), nAlphas(0) {
+    int nMaps = nInstruments + nExposures;
+    int next = 0;
+    for (int m=0; m<nMaps; m++) {
+      start.push_back(next);
+      size.push_back(m < nInstruments ? 4 : 1 + rand() % 3);
+      next += size.back();
+    }
+    params = DVector(next, 0.);
+    for (int e=nInstruments; e<nMaps; e++)
+      for (int k=0; k<perExposure; k++) {
+	Measurement meas;
+	meas.target = uniform();
+	meas.weight = 1. + uniform();
+	addTerm(meas, e);
+	addTerm(meas, rand() % nInstruments);
+	measurements.push_back(meas);
+      }
+  }
+
+  // Fitting interface used by SparseFitter
+  double relativeTolerance;
+  double cgTolerance;
+  int cgMaxIterations;
+  int nParams() const {return params.size();}
+  DVector getParams() const {return params;}
+  void setParams(const DVector& p) {params = p;}
+  void remap() {nRemaps++;}
+  int nBlockMaps() {return start.size();}
+  BlockSolver& blockSolver() {return cholesky;}
+  double chisqDOF(int& dof, double& maxDev) const {
+    double chisq = 0.;
+    maxDev = 0.;
+    for (auto& meas : measurements) {
+      double r = residual(meas);
+      chisq += meas.weight * r * r;
+      maxDev = std::max(maxDev, std::abs(r));
+    }
+    dof = measurements.size() - nParams();
+    return chisq;
+  }
+  template <class U>
+  void accumulate(U& updater, double& chisq, DVector& beta, bool reuseAlpha) {
+    chisq = 0.;
+    for (auto& meas : measurements) {
+      double r = residual(meas);
+      chisq += meas.weight * r * r;
+      for (int i=0; i<meas.terms.size(); i++) {
+	const Term& ti = meas.terms[i];
+	for (int j=0; j<ti.v.size(); j++)
+	  beta[start[ti.map]+j] += meas.weight * r * ti.v[j];
+	if (reuseAlpha) continue;
+	updater.rankOneUpdate(ti.map, start[ti.map], ti.v, meas.weight);
+	for (int k=0; k<i; k++) {
+	  const Term& tk = meas.terms[k];
+	  updater.rankOneUpdate(ti.map, start[ti.map], ti.v,
+				tk.map, start[tk.map], tk.v, meas.weight);
+	}
+      }
+    }
+  }
+  void operator()(const DVector& p, double& chisq, DVector& beta,
+		  BlockSymmetric& alpha, bool reuseAlpha=false) {
+    nAlphas++;
+    setParams(p);
+    beta.setZero();
+    if (!reuseAlpha) alpha.setZero();
+    BlockUpdater updater(alpha, 16);
+    accumulate(updater, chisq, beta, reuseAlpha);
+    if (!reuseAlpha) alpha.completeLayout();
+  }
+  vector<int> freezeBlank(const vector<bool>& blank, DVector& beta) {
+    vector<int> frozen;
+    for (int i=0; i<blank.size(); i++)
+      if (blank[i]) {
+	frozen.push_back(i);
+	beta[i] = 0.;
+      }
+    return frozen;
+  }
+  void reportDegeneracies(DMatrix& alpha) {}
+  void describeParameter(std::ostream& os, int j) {}
+
+  // Each step of a fit remaps once
+  int nRemaps;
+  // Times the full alpha was made
+  int nAlphas;
+
+private:
+  vector<int> start;
+  vector<int> size;
+  vector<Measurement> measurements;
+  DVector params;
+  SparseCholesky cholesky;
+
+  void addTerm(Measurement& meas, int m) {
+    Term t;
+    t.map = m;
+    t.v = DVector(size[m], 0.);
+    for (int j=0; j<size[m]; j++) t.v[j] = uniform();
+    meas.terms.push_back(t);
+  }
+  double residual(const Measurement& meas) const {
+    double r = meas.target;
+    for (auto& t : meas.terms)
+      for (int j=0; j<t.v.size(); j++)
+	r -= t.v[j] * params[start[t.map]+j];
+    return r;
+  }
+};
+
+// Solve (a + shift*I) x = b by dense Cholesky, returning false if the matrix
+// is not positive definite
+bool
+denseSolve(const BlockSymmetric& a, double shift, const DVector& b, DVector& x) {
+  int n = a.nParams();
+  DMatrix m(n,n);
+  a.toDense(m);
+  vector<double> l(n*n, 0.);
+  for (int i=0; i<n; i++) {
+    for (int j=0; j<=i; j++) {
+      double sum = m(i,j) + (i==j ? shift : 0.);
+      for (int k=0; k<j; k++) sum -= l[i*n+k]*l[j*n+k];
+      if (i==j) {
+	if (!(sum > 0.)) return false;
+	l[i*n+i] = sqrt(sum);
+      } else {
+	l[i*n+j] = sum / l[j*n+j];
+      }
+    }
+  }
+  x = b;
+  for (int i=0; i<n; i++) {
+    for (int k=0; k<i; k++) x[i] -= l[i*n+k]*x[k];
+    x[i] /= l[i*n+i];
+  }
+  for (int i=n-1; i>=0; i--) {
+    for (int k=i+1; k<n; k++) x[i] -= l[k*n+i]*x[k];
+    x[i] /= l[i*n+i];
+  }
+  return true;
+}
+
+// Largest difference between x and y, relative to the largest element of y
+double
+difference(const DVector& x, const DVector& y) {
+  double diff = 0.;
+  double norm = 0.;
+  for (int i=0; i<y.size(); i++) {
+    diff = std::max(diff, std::abs(x[i]-y[i]));
+    norm = std::max(norm, std::abs(y[i]));
+  }
+  return norm > 0. ? diff / norm : diff;
+}
+
+// Check solver against the dense solution of (alpha + shift*I) x = b
+bool
+checkSolver(BlockSolver& solver, const string& name,
+	    const BlockSymmetric& alpha, double shift, const DVector& b) {
+  const double Tolerance = 1e-8;
+  DVector expected;
+  denseSolve(alpha, shift, b, expected);
+  if (!solver.covers(alpha)) solver.analyze(alpha);
+  if (!solver.factorize(alpha, shift)) {
+    cout << "ERROR: " << name << " failed to factor with shift " << shift
+	 << " at parameter " << solver.failedParameter() << endl;
+    return false;
+  }
+  DVector x(b);
+  solver.solve(x);
+  double diff = difference(x, expected);
+  if (diff > Tolerance) {
+    cout << "ERROR: " << name << " solution with shift " << shift
+	 << " differs from dense by " << diff << endl;
+    return false;
+  }
+  return true;
+}
+
+// Check that solver refuses alpha, which is not positive definite
+bool
+checkFailure(BlockSolver& solver, const string& name, const BlockSymmetric& alpha) {
+  solver.analyze(alpha);
+  if (solver.factorize(alpha)) {
+    cout << "ERROR: " << name << " factored a matrix that is not positive definite"
+	 << endl;
+    return false;
+  }
+  int j = solver.failedParameter();
+  if (j < 0 || j >= alpha.nParams()) {
+    cout << "ERROR: " << name << " failed at parameter " << j << endl;
+    return false;
+  }
+  return true;
+}
+
+int
+main(int argc,
+     char *argv[])
+{
+  srand(1234);
+  bool ok = true;
+
+  LinearAlign problem(3, 200, 8);
+  int nP = problem.nParams();
+  DVector p = problem.getParams();
+  DVector beta(nP, 0.);
+  BlockSymmetric alpha(nP, problem.nBlockMaps());
+  double chisq;
+  problem(p, chisq, beta, alpha);
+
+  // Direct solvers, unshifted and with the shifts of damped steps
+  {
+    SparseCholesky cholesky;
+    SchurComplement schur;
+    for (double shift : {0., 0.001, 10.}) {
+      ok = checkSolver(cholesky, "SparseCholesky", alpha, shift, beta) && ok;
+      ok = checkSolver(schur, "SchurComplement", alpha, shift, beta) && ok;
+    }
+    if (schur.nEliminated()==0) {
+      cout << "ERROR: SchurComplement eliminated no blocks" << endl;
+      ok = false;
+    }
+  }
+
+  // A negative diagonal element makes alpha not positive definite
+  {
+    BlockSymmetric bad(alpha);
+    int j = nP / 2;
+    bad.setDiagonal(j, -bad.diagonal(j));
+    SparseCholesky cholesky;
+    SchurComplement schur;
+    ok = checkFailure(cholesky, "SparseCholesky", bad) && ok;
+    ok = checkFailure(schur, "SchurComplement", bad) && ok;
+  }
+
+  // The fits reach the least-squares solution in one step, as it is linear
+  DVector expected;
+  denseSolve(alpha, 0., beta, expected);
+  {
+    LinearAlign fit(problem);
+    SparseFitter<LinearAlign>(fit).fitSparse(false);
+    double diff = difference(fit.getParams(), expected);
+    if (diff > 1e-8) {
+      cout << "ERROR: sparse fit differs from dense by " << diff << endl;
+      ok = false;
+    }
+  }
+  {
+    LinearAlign fit(problem);
+    SparseFitter<LinearAlign>(fit).fitMatrixFree(false);
+    double diff = difference(fit.getParams(), expected);
+    if (diff > 1e-6) {
+      cout << "ERROR: conjugate-gradient fit differs from dense by " << diff << endl;
+      ok = false;
+    }
+    // One step to the solution and one to find chisq unchanged
+    if (fit.nRemaps > 3) {
+      cout << "ERROR: conjugate-gradient fit took " << fit.nRemaps
+	   << " steps to converge" << endl;
+      ok = false;
+    }
+  }
+
+  {
+    // Solutions cut short still lead to the minimum, without alpha
+    LinearAlign fit(problem);
+    fit.relativeTolerance = 1e-6;
+    fit.cgMaxIterations = 2;
+    fit.nAlphas = 0;
+    double chisqMin;
+    {
+      LinearAlign best(problem);
+      best.setParams(expected);
+      int dof;
+      double maxDev;
+      chisqMin = best.chisqDOF(dof, maxDev);
+    }
+    double chisq = SparseFitter<LinearAlign>(fit).fitMatrixFree(false);
+    if (chisq > chisqMin * 1.00001) {
+      cout << "ERROR: conjugate-gradient fit cut short ended at chisq " << chisq
+	   << " above minimum " << chisqMin << endl;
+      ok = false;
+    }
+    if (fit.nAlphas > 0) {
+      cout << "ERROR: conjugate-gradient fit made the full alpha" << endl;
+      ok = false;
+    }
+  }
+
+  if (!ok) exit(1);
+  cout << "Solvers agree with dense solutions" << endl;
+  exit(0);
+}